@@ -0,0 +1,1397 @@
+/**************************************************************
+ * *  Filename: bench.c
+ * *  Purpose - Benchmark driver for smallsh. It measures the
+ * *  command launch, parse, reap, pid map, glob and substitution paths,
+ * *  shell startup with an rc file, calling a function, loops, the
+ * *  command server, output capture, tracing, "|&" fan-out, the
+ * *  result cache and "on", and writes one JSON object per line so
+ * *  results can be compared between builds.
+ * *
+ * *  Usage: smallsh_bench [-n iterations] [-m rss_mb] [-s shell]
+ * *
+ * ***************************************************************/
+
+// Build the shell's code in, without its main()
+#define SMALLSH_NO_MAIN
+#include "smallsh.c"
+
+#define BENCH_DEFAULT_ITERATIONS 2000
+#define BENCH_DEFAULT_RSS_MB 256
+#define BENCH_REAP_JOBS 1000
+#define BENCH_PID_MAP_JOBS 1000000
+#define BENCH_PID_MAP_LIVE 64
+#define BENCH_GLOB_FILES 100000
+#define BENCH_GLOB_PASSES 5
+#define BENCH_CAPTURE_MB 1024
+#define BENCH_RC_LINES 2000
+#define BENCH_FAN_OUT_MB 64
+#define BENCH_CACHE_MB 256
+#define BENCH_ON_HOSTS 32
+#define BENCH_ON_LATENCY "0.02"
+#define BENCH_FUNCTION_BODY "test -n \"$1\" && echo \"$1\" | tr a-z A-Z > /dev/null; X=$2; cat < /dev/null 2> /dev/null || true"
+
+// Function declarations
+long long NowNanoseconds();
+int CompareLongLong(const void *left, const void *right);
+void PrintPercentiles(const char *engine, long long *samples, int count, int rssMb);
+void BenchScript(const char *shellPath, const char *name, const char *line, int count);
+void BenchSpawn(int engine, int iterations, int rssMb);
+void BenchParse(int argCount, int iterations, int expand);
+void BenchReap(int jobCount);
+void BenchPidMap(int jobCount, int liveCount);
+void BenchGlob(int fileCount, int passes);
+void BenchServer(const char *shellPath, const char *events, int count);
+int RunServerRequest(int serverFd, const char *line);
+void BenchCapture(int megabytes, int isSplice);
+void BenchSubstitution(const char *kind, const char *line, int count);
+void BenchStartup(const char *shellPath, const char *kind, int rcLines, int count);
+void BenchFunction(const char *body, int count, int isCached);
+void BenchLoop(const char *shellPath, const char *body, int count, int isLoop);
+void BenchTrace(const char *line, int count, int isTracing);
+void BenchFanOut(const char *shellPath, int megabytes, int workers, const char *mode);
+void BenchCache(int megabytes, int count);
+void BenchOn(const char *shellPath, int hostCount, int maxJobs);
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command line options
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Runs every benchmark and writes the results to stdout.
+ * *
+ * ***************************************************************/
+int main(int argc, char **argv)
+{
+	int iterations = BENCH_DEFAULT_ITERATIONS;
+	int rssMb = BENCH_DEFAULT_RSS_MB;
+	const char *shellPath = "./smallsh";
+	int argCounts[] = { 1, 8, 64, 512, 4096 };
+	int i;
+
+	for (i = 1; i < argc - 1; i += 2)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+		{
+			iterations = atoi(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-m") == 0)
+		{
+			rssMb = atoi(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-s") == 0)
+		{
+			shellPath = argv[i + 1];
+		}
+	}
+
+	InitShell(0);
+
+	// Whole shell runs, including startup and reading the script
+	BenchScript(shellPath, "builtin", "true", iterations);
+	BenchScript(shellPath, "external", "/bin/true", iterations / 4);
+
+	// The launch engines, with and without a large shell
+	BenchSpawn(SPAWN_ENGINE_POSIX, iterations / 4, 0);
+	BenchSpawn(SPAWN_ENGINE_FORK, iterations / 4, 0);
+	BenchSpawn(SPAWN_ENGINE_POSIX, iterations / 4, rssMb);
+	BenchSpawn(SPAWN_ENGINE_FORK, iterations / 4, rssMb);
+
+	for (i = 0; i < (int)(sizeof(argCounts) / sizeof(argCounts[0])); i++)
+	{
+		BenchParse(argCounts[i], iterations * 10, 0);
+	}
+	for (i = 0; i < (int)(sizeof(argCounts) / sizeof(argCounts[0])); i++)
+	{
+		BenchParse(argCounts[i], iterations * 10, 1);
+	}
+
+	BenchReap(BENCH_REAP_JOBS);
+	BenchPidMap(BENCH_PID_MAP_JOBS, BENCH_PID_MAP_LIVE);
+	BenchGlob(BENCH_GLOB_FILES, BENCH_GLOB_PASSES);
+	BenchSubstitution("builtin", "echo $(pwd)", iterations * 10);
+	BenchSubstitution("external", "echo $(/bin/pwd)", iterations / 4);
+	BenchStartup(shellPath, "norc", BENCH_RC_LINES, iterations / 4);
+	BenchStartup(shellPath, "parse", BENCH_RC_LINES, iterations / 4);
+	BenchStartup(shellPath, "snapshot", BENCH_RC_LINES, iterations / 4);
+	BenchFunction(BENCH_FUNCTION_BODY, iterations * 10, 0);
+	BenchFunction(BENCH_FUNCTION_BODY, iterations * 10, 1);
+	BenchLoop(shellPath, "X=1", iterations * 50, 0);
+	BenchLoop(shellPath, "X=1", iterations * 50, 1);
+	BenchServer(shellPath, "uring", iterations / 4);
+	BenchServer(shellPath, "epoll", iterations / 4);
+	BenchCapture(BENCH_CAPTURE_MB, 0);
+	BenchCapture(BENCH_CAPTURE_MB, 1);
+	BenchTrace("true > /dev/null", iterations * 50, 0);
+	BenchTrace("true > /dev/null", iterations * 50, 1);
+	BenchFanOut(shellPath, BENCH_FAN_OUT_MB, 0, "");
+	BenchFanOut(shellPath, BENCH_FAN_OUT_MB, (int)sysconf(_SC_NPROCESSORS_ONLN), "");
+	BenchFanOut(shellPath, BENCH_FAN_OUT_MB, (int)sysconf(_SC_NPROCESSORS_ONLN), "u");
+	BenchCache(BENCH_CACHE_MB, iterations);
+	BenchOn(shellPath, BENCH_ON_HOSTS, 1);
+	BenchOn(shellPath, BENCH_ON_HOSTS, BENCH_ON_HOSTS);
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the CLOCK_MONOTONIC time in nanoseconds.
+ * *
+ * * Purpose:
+ * *	Reads the clock for the measurements.
+ * *
+ * ***************************************************************/
+long long NowNanoseconds()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((long long)now.tv_sec * 1000000000LL) + now.tv_nsec;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  left, right - the samples to compare
+ * *
+ * * Exit:
+ * *  Returns <0, 0 or >0 for qsort.
+ * *
+ * * Purpose:
+ * *	Orders latency samples.
+ * *
+ * ***************************************************************/
+int CompareLongLong(const void *left, const void *right)
+{
+	long long a = *(const long long *)left;
+	long long b = *(const long long *)right;
+
+	return (a > b) - (a < b);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  shellPath - the smallsh binary to run
+ * *  name - the name of the result
+ * *  line - the command line to repeat
+ * *  count - how many times to repeat it
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Runs a script of the same command line through the shell and
+ * *	reports commands per second.
+ * *
+ * ***************************************************************/
+void BenchScript(const char *shellPath, const char *name, const char *line, int count)
+{
+	char scriptPath[] = "/tmp/smallsh_benchXXXXXX";
+	int scriptFd = mkstemp(scriptPath);
+	FILE *script;
+	int i;
+
+	if (scriptFd < 0)
+	{
+		return;
+	}
+
+	script = fdopen(scriptFd, "w");
+	for (i = 0; i < count; i++)
+	{
+		fprintf(script, "%s\n", line);
+	}
+	fclose(script);
+
+	// Keep the reaper from taking the child, as the shell does for
+	//  foreground commands
+	sigset_t childMask;
+	sigset_t oldMask;
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	char *shellArgs[] = { (char *)shellPath, scriptPath, NULL };
+	long long start = NowNanoseconds();
+	pid_t shellPid = SpawnCommand(shellArgs, NULL, 1, -1);
+	if (shellPid > 0)
+	{
+		waitpid(shellPid, NULL, 0);
+	}
+	long long elapsed = NowNanoseconds() - start;
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	unlink(scriptPath);
+
+	if (shellPid < 0)
+	{
+		printf("{\"bench\":\"commands\",\"kind\":\"%s\",\"error\":\"cannot run %s\"}\n",
+			name, shellPath);
+		return;
+	}
+
+	printf("{\"bench\":\"commands\",\"kind\":\"%s\",\"count\":%d,\"commands_per_sec\":%.0f}\n",
+		name, count, count / (elapsed / 1e9));
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  engine - the launch engine to use
+ * *  iterations - the number of launches to time
+ * *  rssMb - megabytes of memory to touch first, to act like a large
+ * *          shell
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times launching and waiting on /bin/true and reports the
+ * *	latency percentiles.
+ * *
+ * ***************************************************************/
+void BenchSpawn(int engine, int iterations, int rssMb)
+{
+	long long *samples = malloc(iterations * sizeof(long long));
+	char *ballast = NULL;
+	char *trueArgs[] = { "/bin/true", NULL };
+	sigset_t childMask;
+	sigset_t oldMask;
+	int i;
+
+	if (samples == NULL)
+	{
+		return;
+	}
+
+	if (rssMb > 0)
+	{
+		ballast = malloc((size_t)rssMb << 20);
+		if (ballast != NULL)
+		{
+			memset(ballast, 1, (size_t)rssMb << 20);
+		}
+	}
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	spawnEngine = engine;
+	for (i = 0; i < iterations; i++)
+	{
+		long long start = NowNanoseconds();
+		pid_t childPid = SpawnCommand(trueArgs, NULL, 1, -1);
+		if (childPid > 0)
+		{
+			waitpid(childPid, NULL, 0);
+		}
+		samples[i] = NowNanoseconds() - start;
+	}
+	spawnEngine = SPAWN_ENGINE_POSIX;
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	PrintPercentiles((engine == SPAWN_ENGINE_FORK) ? "fork" : "posix_spawn", samples, iterations,
+		(ballast != NULL) ? rssMb : 0);
+
+	free(ballast);
+	free(samples);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  engine - the name of the launch engine
+ * *  samples - the latency samples, in nanoseconds
+ * *  count - the number of samples
+ * *  rssMb - the extra memory the shell held
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes the p50, p90, p99 and max latency of the samples.
+ * *
+ * ***************************************************************/
+void PrintPercentiles(const char *engine, long long *samples, int count, int rssMb)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	qsort(samples, count, sizeof(long long), CompareLongLong);
+	printf("{\"bench\":\"spawn\",\"engine\":\"%s\",\"rss_mb\":%d,\"count\":%d,"
+		"\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		engine, rssMb, count, samples[count / 2] / 1e3, samples[(count * 9) / 10] / 1e3,
+		samples[(count * 99) / 100] / 1e3, samples[count - 1] / 1e3);
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argCount - the number of arguments on the line
+ * *  iterations - the number of parses to time
+ * *  expand - 1 to use "$HOME" in every argument and expand it too
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times ParseCommandLine on a line with the given number of
+ * *	arguments and a redirect, resetting the arena between lines the
+ * *	way the shell loop does. With expand set, ExpandPipeline runs on
+ * *	each parsed line as well.
+ * *
+ * ***************************************************************/
+void BenchParse(int argCount, int iterations, int expand)
+{
+	size_t lineSize = (argCount * 16) + 32;
+	char *line = malloc(lineSize);
+	char *work = malloc(lineSize);
+	struct Pipeline pipeline;
+	struct Arena arena;
+	size_t used;
+	int i;
+
+	if ((line == NULL) || (work == NULL))
+	{
+		return;
+	}
+	memset(&arena, 0, sizeof(arena));
+
+	used = snprintf(line, lineSize, "cmd");
+	for (i = 1; i < argCount; i++)
+	{
+		used += snprintf(line + used, lineSize - used, (expand) ? " $HOME/a%d" : " a%d", i);
+	}
+	snprintf(line + used, lineSize - used, " > out");
+	size_t lineLength = strlen(line) + 1;
+
+	long long start = NowNanoseconds();
+	for (i = 0; i < iterations; i++)
+	{
+		// The parser cuts the line up, so each run gets a fresh copy
+		memcpy(work, line, lineLength);
+		ArenaReset(&arena);
+		ParseCommandLine(work, &pipeline, &arena);
+		if (expand)
+		{
+			ExpandPipeline(&pipeline);
+		}
+	}
+	long long elapsed = NowNanoseconds() - start;
+
+	printf("{\"bench\":\"%s\",\"args\":%d,\"count\":%d,\"ns_per_line\":%.1f}\n",
+		(expand) ? "expand" : "parse", argCount, iterations, (double)elapsed / iterations);
+	fflush(stdout);
+
+	free(work);
+	free(line);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  jobCount - the number of background jobs to start
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Starts a batch of background jobs and times how long it takes
+ * *	for the SIGCHLD reaper to collect all of them.
+ * *
+ * ***************************************************************/
+void BenchReap(int jobCount)
+{
+	char *trueArgs[] = { "/bin/true", NULL };
+	int *jobIndexes = malloc(jobCount * sizeof(int));
+	int started = 0;
+	int collected = 0;
+	sigset_t childMask;
+	sigset_t oldMask;
+	int i;
+
+	if (jobIndexes == NULL)
+	{
+		return;
+	}
+	if (jobCount > MAX_JOBS)
+	{
+		jobCount = MAX_JOBS;
+	}
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	long long start = NowNanoseconds();
+	for (i = 0; i < jobCount; i++)
+	{
+		pid_t childPid = SpawnCommand(trueArgs, NULL, 0, -1);
+		if (childPid < 0)
+		{
+			continue;
+		}
+		jobIndexes[started] = AddJob(&childPid, 1, -1, "/bin/true");
+		if (jobIndexes[started] >= 0)
+		{
+			jobs[jobIndexes[started]].isQuiet = 1;
+			started++;
+		}
+	}
+	long long launched = NowNanoseconds();
+
+	// Let the handler run and collect what it reports
+	while (collected < started)
+	{
+		sigsuspend(&oldMask);
+		ReportCompletions();
+		for (i = 0; i < started; i++)
+		{
+			if ((jobIndexes[i] >= 0) && (jobs[jobIndexes[i]].isDone))
+			{
+				RemoveJob(jobIndexes[i]);
+				jobIndexes[i] = -1;
+				collected++;
+			}
+		}
+	}
+	long long elapsed = NowNanoseconds() - start;
+
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	printf("{\"bench\":\"reap\",\"jobs\":%d,\"launch_ms\":%.1f,\"total_ms\":%.1f,"
+		"\"jobs_per_sec\":%.0f}\n", started, (launched - start) / 1e6, elapsed / 1e6,
+		started / (elapsed / 1e9));
+	fflush(stdout);
+
+	free(jobIndexes);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  jobCount - the number of pids to add and remove
+ * *  liveCount - how many are in the map at once
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Adds and removes pids in the pid to job map the way a long
+ * *	session does, without starting any processes. Each pid is
+ * *	removed liveCount pids after it was added. The time for each
+ * *	must not grow as jobs come and go.
+ * *
+ * ***************************************************************/
+void BenchPidMap(int jobCount, int liveCount)
+{
+	pid_t base = 100000;
+	int i;
+
+	long long start = NowNanoseconds();
+	for (i = 0; i < jobCount + liveCount; i++)
+	{
+		if (i < jobCount)
+		{
+			struct PidSlot *slot = FindPidSlot(base + i, 1);
+			slot->pid = base + i;
+			slot->job = i & (MAX_JOBS - 1);
+		}
+		if (i >= liveCount)
+		{
+			RemovePidSlot(FindPidSlot(base + i - liveCount, 0));
+		}
+	}
+	long long elapsed = NowNanoseconds() - start;
+
+	printf("{\"bench\":\"pidmap\",\"jobs\":%d,\"live\":%d,\"ns_per_job\":%.1f}\n", jobCount, liveCount,
+		(double)elapsed / jobCount);
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fileCount - the number of files in the directory
+ * *  passes - the number of times to expand the pattern
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Expands "*.log" in a large directory a few times. The first
+ * *	pass reads the directory; the later ones should only check
+ * *	its mtime and match the cached listing.
+ * *
+ * ***************************************************************/
+void BenchGlob(int fileCount, int passes)
+{
+	char directory[] = "/tmp/smallsh_bench_XXXXXX";
+	char path[sizeof(directory) + 32];
+	char line[sizeof(directory) + 32];
+	struct Pipeline pipeline;
+	struct Arena arena;
+	long long firstNs = 0;
+	long long cachedNs = 0;
+	int matches = 0;
+	int i;
+
+	if (mkdtemp(directory) == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < fileCount; i++)
+	{
+		snprintf(path, sizeof(path), "%s/f%06d.%s", directory, i, (i % 2 == 0) ? "log" : "txt");
+		int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+	}
+
+	// Let the directory's mtime age, so the listing can be trusted
+	sleep(2);
+
+	memset(&arena, 0, sizeof(arena));
+	for (i = 0; i < passes; i++)
+	{
+		snprintf(line, sizeof(line), "echo %s/*.log", directory);
+		ArenaReset(&arena);
+		long long start = NowNanoseconds();
+		ParseCommandLine(line, &pipeline, &arena);
+		ExpandPipeline(&pipeline);
+		long long elapsed = NowNanoseconds() - start;
+		if (i == 0)
+		{
+			firstNs = elapsed;
+		}
+		else
+		{
+			cachedNs += elapsed;
+		}
+		matches = pipeline.commands[0].argc - 1;
+	}
+
+	printf("{\"bench\":\"glob\",\"files\":%d,\"matches\":%d,\"first_ms\":%.2f,\"cached_ms\":%.2f}\n",
+		fileCount, matches, firstNs / 1e6, (passes > 1) ? (cachedNs / 1e6) / (passes - 1) : 0.0);
+	fflush(stdout);
+
+	for (i = 0; i < fileCount; i++)
+	{
+		snprintf(path, sizeof(path), "%s/f%06d.%s", directory, i, (i % 2 == 0) ? "log" : "txt");
+		unlink(path);
+	}
+	rmdir(directory);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  shellPath - the smallsh binary to run
+ * *  events - the server's event loop, "uring" or "epoll"
+ * *  count - the number of commands of each kind
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Starts a command server and times round trips through it,
+ * *	next to starting "smallsh -c" for each command the way an
+ * *	orchestrator would without it.
+ * *
+ * ***************************************************************/
+void BenchServer(const char *shellPath, const char *events, int count)
+{
+	char socketPath[] = "/tmp/smallsh_bench_sockXXXXXX";
+	const char *kinds[] = { "builtin", "external", "startup" };
+	const char *lines[] = { "true", "/bin/true", "true" };
+	struct sockaddr_un address;
+	long long *samples = malloc(count * sizeof(long long));
+	sigset_t childMask;
+	sigset_t oldMask;
+	int kind;
+	int i;
+
+	int tempFd = mkstemp(socketPath);
+	if ((samples == NULL) || (tempFd < 0))
+	{
+		free(samples);
+		return;
+	}
+	close(tempFd);
+	unlink(socketPath);
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	char *serverArgs[] = { (char *)shellPath, "--events", (char *)events, "--server", socketPath, NULL };
+	pid_t serverPid = SpawnCommand(serverArgs, NULL, 1, -1);
+
+	// Wait for the server to listen
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+	int serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	for (i = 0; (serverPid > 0) && (i < 200); i++)
+	{
+		if (connect(serverFd, (struct sockaddr *)&address, sizeof(address)) == 0)
+		{
+			break;
+		}
+		usleep(10000);
+	}
+	if ((serverPid < 0) || (i == 200))
+	{
+		printf("{\"bench\":\"server\",\"events\":\"%s\",\"error\":\"cannot start %s --server\"}\n", events,
+			shellPath);
+		if (serverPid > 0)
+		{
+			kill(serverPid, SIGTERM);
+			waitpid(serverPid, NULL, 0);
+		}
+		sigprocmask(SIG_SETMASK, &oldMask, NULL);
+		close(serverFd);
+		free(samples);
+		return;
+	}
+
+	for (kind = 0; kind < 3; kind++)
+	{
+		char *startupArgs[] = { (char *)shellPath, "-c", (char *)lines[kind], NULL };
+		long long start = NowNanoseconds();
+		for (i = 0; i < count; i++)
+		{
+			long long before = NowNanoseconds();
+			if (kind < 2)
+			{
+				RunServerRequest(serverFd, lines[kind]);
+			}
+			else
+			{
+				pid_t shellPid = SpawnCommand(startupArgs, NULL, 1, -1);
+				if (shellPid > 0)
+				{
+					waitpid(shellPid, NULL, 0);
+				}
+			}
+			samples[i] = NowNanoseconds() - before;
+		}
+		long long elapsed = NowNanoseconds() - start;
+
+		qsort(samples, count, sizeof(long long), CompareLongLong);
+		printf("{\"bench\":\"server\",\"events\":\"%s\",\"kind\":\"%s\",\"count\":%d,\"p50_us\":%.1f,"
+			"\"p99_us\":%.1f,\"commands_per_sec\":%.0f}\n", events, kinds[kind], count, samples[count / 2] / 1e3,
+			samples[(count * 99) / 100] / 1e3, count / (elapsed / 1e9));
+		fflush(stdout);
+	}
+
+	close(serverFd);
+	kill(serverPid, SIGTERM);
+	waitpid(serverPid, NULL, 0);
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	unlink(socketPath);
+	free(samples);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  serverFd - a connection to a command server
+ * *  line - the command line to run
+ * *
+ * * Exit:
+ * *  Returns the command's exit status.
+ * *  Returns -1, if the connection failed.
+ * *
+ * * Purpose:
+ * *	Sends one run frame and reads frames until its status comes.
+ * *
+ * ***************************************************************/
+int RunServerRequest(int serverFd, const char *line)
+{
+	unsigned char header[FRAME_HEADER_SIZE];
+	char payload[4096];
+	size_t length = strlen(line);
+
+	header[0] = FRAME_RUN;
+	WriteFrameNumber(header + 1, 1);
+	WriteFrameNumber(header + 5, (unsigned int)length);
+	if ((WriteAll(serverFd, (const char *)header, sizeof(header)) < 0) || (WriteAll(serverFd, line, length) < 0))
+	{
+		return -1;
+	}
+
+	while (ReadAll(serverFd, (char *)header, sizeof(header)) == 0)
+	{
+		unsigned int frameLength = ReadFrameNumber(header + 5);
+		while (frameLength > 0)
+		{
+			size_t chunk = (frameLength < sizeof(payload)) ? frameLength : sizeof(payload);
+			if (ReadAll(serverFd, payload, chunk) < 0)
+			{
+				return -1;
+			}
+			frameLength -= chunk;
+		}
+		if (header[0] == FRAME_STATUS)
+		{
+			return (int)ReadFrameNumber((const unsigned char *)payload);
+		}
+	}
+
+	return -1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  megabytes - how much output to capture
+ * *  isSplice - 1 to capture with RunCapture, 0 to read and write
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Captures a child's output to a log and to /dev/null the way
+ * *	"--log" does, next to a plain read and write loop. The child
+ * *	vmsplices one buffer over and over, so the time is the
+ * *	capture's and not the writer's.
+ * *
+ * ***************************************************************/
+void BenchCapture(int megabytes, int isSplice)
+{
+	char logPath[] = "/tmp/smallsh_bench_log_XXXXXX";
+	int outputPipe[2];
+	int nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	int logFd = mkstemp(logPath);
+
+	if ((nullFd < 0) || (logFd < 0) || (pipe2(outputPipe, O_CLOEXEC) < 0))
+	{
+		return;
+	}
+	unlink(logPath);
+	fcntl(outputPipe[1], F_SETPIPE_SZ, CAPTURE_CHUNK);
+
+	long long start = NowNanoseconds();
+	pid_t writerPid = fork();
+	if (writerPid == 0)
+	{
+		static char chunk[1 << 20];
+		int i;
+
+		close(outputPipe[0]);
+		memset(chunk, 'x', sizeof(chunk));
+		for (i = 0; i < megabytes; i++)
+		{
+			struct iovec vector = { chunk, sizeof(chunk) };
+			while (vector.iov_len > 0)
+			{
+				ssize_t moved = vmsplice(outputPipe[1], &vector, 1, 0);
+				if (moved <= 0)
+				{
+					_exit(1);
+				}
+				vector.iov_base = (char *)vector.iov_base + moved;
+				vector.iov_len -= moved;
+			}
+		}
+		_exit(0);
+	}
+	close(outputPipe[1]);
+
+	if (isSplice)
+	{
+		captureLogFd = logFd;
+		RunCapture(outputPipe[0], nullFd);
+		captureLogFd = -1;
+	}
+	else
+	{
+		static char buffer[SERVER_READ_SIZE];
+		ssize_t bytesRead;
+		while ((bytesRead = read(outputPipe[0], buffer, sizeof(buffer))) > 0)
+		{
+			WriteAll(logFd, buffer, bytesRead);
+			WriteAll(nullFd, buffer, bytesRead);
+		}
+	}
+	waitpid(writerPid, NULL, 0);
+	long long elapsed = NowNanoseconds() - start;
+
+	struct stat info;
+	fstat(logFd, &info);
+	printf("{\"bench\":\"capture\",\"mode\":\"%s\",\"mb\":%d,\"logged_mb\":%lld,\"gb_per_s\":%.2f}\n",
+		isSplice ? "splice" : "copy", megabytes, (long long)info.st_size >> 20,
+		(megabytes / 1024.0) / (elapsed / 1e9));
+	fflush(stdout);
+
+	close(outputPipe[0]);
+	close(nullFd);
+	close(logFd);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  kind - the name of the series
+ * *  line - a command line with a "$(...)" in it
+ * *  count - how many times to expand it
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times parsing and expanding a line with a command
+ * *	substitution. A builtin inside runs in the shell; anything
+ * *	else is started and its output read from a pipe.
+ * *
+ * ***************************************************************/
+void BenchSubstitution(const char *kind, const char *line, int count)
+{
+	char copy[64];
+	struct Pipeline pipeline;
+	struct Arena arena;
+	long long totalNs = 0;
+	int i;
+
+	memset(&arena, 0, sizeof(arena));
+	for (i = 0; i < count; i++)
+	{
+		strncpy(copy, line, sizeof(copy) - 1);
+		copy[sizeof(copy) - 1] = '\0';
+		ArenaReset(&arena);
+		long long start = NowNanoseconds();
+		ParseCommandLine(copy, &pipeline, &arena);
+		ExpandPipeline(&pipeline);
+		totalNs += NowNanoseconds() - start;
+	}
+
+	printf("{\"bench\":\"substitution\",\"kind\":\"%s\",\"count\":%d,\"avg_us\":%.2f}\n",
+		kind, count, (totalNs / 1e3) / count);
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  shellPath - the smallsh binary to run
+ * *  kind - "norc" to skip the rc file, "parse" to run it each
+ * *         time, or "snapshot" to load its snapshot
+ * *  rcLines - how many variables the rc file sets
+ * *  count - how many shells to start
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times starting "smallsh -c true" with a large rc file. A
+ * *	"true" at the end of the rc file keeps it from being cached,
+ * *	which is what "parse" times.
+ * *
+ * ***************************************************************/
+void BenchStartup(const char *shellPath, const char *kind, int rcLines, int count)
+{
+	char rcFile[] = "/tmp/smallsh_benchXXXXXX";
+	char snapshotPath[sizeof(rcFile) + sizeof(RC_SNAPSHOT_SUFFIX)];
+	int rcFd = mkstemp(rcFile);
+	FILE *rc;
+	int i;
+
+	if (rcFd < 0)
+	{
+		return;
+	}
+
+	rc = fdopen(rcFd, "w");
+	for (i = 0; i < rcLines; i++)
+	{
+		fprintf(rc, "BENCH_VARIABLE_%d=\"value of variable %d\"\n", i, i);
+		if ((i % 4) == 0)
+		{
+			fprintf(rc, "export BENCH_VARIABLE_%d\n", i);
+		}
+	}
+	fprintf(rc, "hash ls cat sh\n");
+	if (strcmp(kind, "parse") == 0)
+	{
+		fprintf(rc, "true\n");
+	}
+	fclose(rc);
+	snprintf(snapshotPath, sizeof(snapshotPath), "%s%s", rcFile, RC_SNAPSHOT_SUFFIX);
+
+	SetVariable("SMALLSHRC", 9, rcFile, 1);
+	RefreshEnvironment();
+
+	sigset_t childMask;
+	sigset_t oldMask;
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	char *normalArgs[] = { (char *)shellPath, "-c", "true", NULL };
+	char *norcArgs[] = { (char *)shellPath, "--norc", "-c", "true", NULL };
+	char **shellArgs = (strcmp(kind, "norc") == 0) ? norcArgs : normalArgs;
+
+	// The first shell writes the snapshot the others load
+	pid_t shellPid = SpawnCommand(shellArgs, NULL, 1, -1);
+	if (shellPid > 0)
+	{
+		waitpid(shellPid, NULL, 0);
+	}
+
+	long long start = NowNanoseconds();
+	for (i = 0; (shellPid > 0) && (i < count); i++)
+	{
+		shellPid = SpawnCommand(shellArgs, NULL, 1, -1);
+		if (shellPid > 0)
+		{
+			waitpid(shellPid, NULL, 0);
+		}
+	}
+	long long elapsed = NowNanoseconds() - start;
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	UnsetVariable("SMALLSHRC");
+	RefreshEnvironment();
+	unlink(rcFile);
+	unlink(snapshotPath);
+
+	if (shellPid < 0)
+	{
+		printf("{\"bench\":\"startup\",\"kind\":\"%s\",\"error\":\"cannot run %s\"}\n",
+			kind, shellPath);
+		return;
+	}
+
+	printf("{\"bench\":\"startup\",\"kind\":\"%s\",\"rc_lines\":%d,\"count\":%d,\"avg_us\":%.1f}\n",
+		kind, rcLines, count, (elapsed / 1e3) / count);
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  body - the commands of a function
+ * *  count - how many times to get them ready to run
+ * *  isCached - 1 to copy the list parsed when it was defined,
+ * *             0 to parse the text again each time
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times what a function call does before its body runs, against
+ * *	what running the same commands written out on a line does.
+ * *
+ * ***************************************************************/
+void BenchFunction(const char *body, int count, int isCached)
+{
+	char copy[256];
+	struct CommandList list;
+	struct Arena arena;
+	long long totalNs = 0;
+	int i;
+
+	memset(&arena, 0, sizeof(arena));
+	struct Definition *function = NewDefinition("f", 1, body);
+	if ((function == NULL) || (ParseDefinition(function, 0) < 0))
+	{
+		printf("{\"bench\":\"function\",\"error\":\"cannot parse the body\"}\n");
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		ArenaReset(&arena);
+		long long start = NowNanoseconds();
+		if (isCached)
+		{
+			CopyCommandList(&function->list, &list, &arena);
+		}
+		else
+		{
+			strncpy(copy, body, sizeof(copy) - 1);
+			copy[sizeof(copy) - 1] = '\0';
+			ParseCommandList(copy, &list, &arena);
+		}
+		totalNs += NowNanoseconds() - start;
+	}
+
+	printf("{\"bench\":\"function\",\"kind\":\"%s\",\"count\":%d,\"avg_us\":%.3f}\n",
+		(isCached) ? "cached" : "parse", count, (totalNs / 1e3) / count);
+	fflush(stdout);
+	FreeDefinition(function);
+	ArenaFree(&arena);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  shellPath - the smallsh binary to run
+ * *  body - the command to repeat
+ * *  count - how many times to run it
+ * *  isLoop - 1 to write one for loop, 0 to write count lines
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times the same work fed to the shell as one line per pass and
+ * *	as a for loop over count words, which is read and parsed once.
+ * *
+ * ***************************************************************/
+void BenchLoop(const char *shellPath, const char *body, int count, int isLoop)
+{
+	char scriptPath[] = "/tmp/smallsh_benchXXXXXX";
+	int scriptFd = mkstemp(scriptPath);
+	FILE *script;
+	int i;
+
+	if (scriptFd < 0)
+	{
+		return;
+	}
+
+	script = fdopen(scriptFd, "w");
+	if (isLoop)
+	{
+		fprintf(script, "for i in");
+		for (i = 0; i < count; i++)
+		{
+			fprintf(script, " %d", i);
+		}
+		fprintf(script, "; do %s; done\n", body);
+	}
+	else
+	{
+		for (i = 0; i < count; i++)
+		{
+			fprintf(script, "%s\n", body);
+		}
+	}
+	fclose(script);
+
+	sigset_t childMask;
+	sigset_t oldMask;
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	char *shellArgs[] = { (char *)shellPath, "--norc", scriptPath, NULL };
+	long long start = NowNanoseconds();
+	pid_t shellPid = SpawnCommand(shellArgs, NULL, 1, -1);
+	if (shellPid > 0)
+	{
+		waitpid(shellPid, NULL, 0);
+	}
+	long long elapsed = NowNanoseconds() - start;
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	unlink(scriptPath);
+
+	if (shellPid < 0)
+	{
+		printf("{\"bench\":\"loop\",\"kind\":\"%s\",\"error\":\"cannot run %s\"}\n",
+			(isLoop) ? "loop" : "lines", shellPath);
+		return;
+	}
+
+	printf("{\"bench\":\"loop\",\"kind\":\"%s\",\"count\":%d,\"avg_us\":%.3f}\n",
+		(isLoop) ? "loop" : "lines", count, (elapsed / 1e3) / count);
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - a command line of builtins to run in the shell
+ * *  count - how many times to parse and run it
+ * *  isTracing - 1 to trace into a file, 0 with tracing off
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times the parse and run of a line with no child, where the
+ * *	trace points are the largest part of the work, with tracing off
+ * *	and on.
+ * *
+ * ***************************************************************/
+void BenchTrace(const char *line, int count, int isTracing)
+{
+	char tracePath[] = "/tmp/smallsh_bench_traceXXXXXX";
+	char copy[256];
+	struct CommandList list;
+	struct Arena arena;
+	long long totalNs = 0;
+	int i;
+
+	if (isTracing)
+	{
+		int traceFd = mkstemp(tracePath);
+		if ((traceFd < 0) || (OpenTrace(tracePath) < 0))
+		{
+			printf("{\"bench\":\"trace\",\"error\":\"cannot make the trace file\"}\n");
+			return;
+		}
+		close(traceFd);
+	}
+
+	memset(&arena, 0, sizeof(arena));
+	for (i = 0; i < count; i++)
+	{
+		ArenaReset(&arena);
+		strncpy(copy, line, sizeof(copy) - 1);
+		copy[sizeof(copy) - 1] = '\0';
+		long long start = NowNanoseconds();
+		long long traceStart = TRACE_START();
+		if (ParseCommandList(copy, &list, &arena) == 0)
+		{
+			TRACE(TRACE_PARSE, traceStart, list.count, 0, "");
+			ExecuteCommandList(&list);
+		}
+		totalNs += NowNanoseconds() - start;
+	}
+
+	printf("{\"bench\":\"trace\",\"kind\":\"%s\",\"count\":%d,\"avg_us\":%.3f}\n",
+		(isTracing) ? "on" : "off", count, (totalNs / 1e3) / count);
+	fflush(stdout);
+	ArenaFree(&arena);
+
+	if (isTracing)
+	{
+		munmap(traceHeader, sizeof(struct TraceHeader) + (TRACE_RING_EVENTS * sizeof(struct TraceRecord)));
+		traceHeader = NULL;
+		traceRecords = NULL;
+		unlink(tracePath);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  shellPath - the smallsh binary to run
+ * *  megabytes - how much text to filter
+ * *  workers - the "|&" count, or 0 for a plain pipe
+ * *  mode - "" for ordered or "u" for unordered
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times a CPU bound filter, gzip, over a file of lines through a
+ * *	plain pipe and fanned out over the cores.
+ * *
+ * ***************************************************************/
+void BenchFanOut(const char *shellPath, int megabytes, int workers, const char *mode)
+{
+	char inputPath[] = "/tmp/smallsh_bench_fanXXXXXX";
+	char line[256];
+	int i;
+
+	int inputFd = mkstemp(inputPath);
+	FILE *input = (inputFd < 0) ? NULL : fdopen(inputFd, "w");
+	if (input == NULL)
+	{
+		return;
+	}
+	for (i = 0; ftell(input) < (long)megabytes << 20; i++)
+	{
+		fprintf(input, "%d line of text for the filter to work on %x\n", i, i * 2654435761u);
+	}
+	fclose(input);
+
+	if (workers > 0)
+	{
+		snprintf(line, sizeof(line), "cat %s |& %d%s gzip -1 > /dev/null", inputPath, workers, mode);
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "cat %s | gzip -1 > /dev/null", inputPath);
+	}
+
+	sigset_t childMask;
+	sigset_t oldMask;
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	char *shellArgs[] = { (char *)shellPath, "--norc", "-c", line, NULL };
+	long long start = NowNanoseconds();
+	pid_t shellPid = SpawnCommand(shellArgs, NULL, 1, -1);
+	if (shellPid > 0)
+	{
+		waitpid(shellPid, NULL, 0);
+	}
+	long long elapsed = NowNanoseconds() - start;
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	unlink(inputPath);
+
+	if (shellPid < 0)
+	{
+		printf("{\"bench\":\"fanout\",\"error\":\"cannot run %s\"}\n", shellPath);
+		return;
+	}
+
+	printf("{\"bench\":\"fanout\",\"workers\":%d,\"mode\":\"%s\",\"mb\":%d,\"mb_per_sec\":%.1f}\n",
+		workers, (workers == 0) ? "pipe" : (mode[0] == 'u') ? "unordered" : "ordered", megabytes,
+		megabytes / (elapsed / 1e9));
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  megabytes - how big the file to checksum is
+ * *  count - how many cache hits to time
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times "cache sha256sum file" on a miss, which runs sha256sum,
+ * *	and on a hit, which sends the stored output back.
+ * *
+ * ***************************************************************/
+void BenchCache(int megabytes, int count)
+{
+	char directory[] = "/tmp/smallsh_bench_cacheXXXXXX";
+	char inputPath[] = "/tmp/smallsh_bench_cache_inXXXXXX";
+	char block[65536];
+	char path[PATH_MAX];
+	long long hitNs = 0;
+	int i;
+
+	int inputFd = mkstemp(inputPath);
+	if ((inputFd < 0) || (mkdtemp(directory) == NULL))
+	{
+		printf("{\"bench\":\"cache\",\"error\":\"cannot make the cache files\"}\n");
+		return;
+	}
+	memset(block, 'x', sizeof(block));
+	for (i = 0; i < megabytes * 16; i++)
+	{
+		WriteAll(inputFd, block, sizeof(block));
+	}
+	close(inputFd);
+	setenv("SMALLSH_CACHE", directory, 1);
+
+	// Output goes to /dev/null so only the cache is timed, and so does
+	//  input, as a command reading a pipe is not cached
+	fflush(stdout);
+	int savedIn = dup(0);
+	int savedOut = dup(1);
+	int nullFd = open("/dev/null", O_RDWR);
+	dup2(nullFd, 0);
+	dup2(nullFd, 1);
+	close(nullFd);
+
+	char *cacheArgs[] = { "cache", "sha256sum", inputPath, NULL };
+	long long start = NowNanoseconds();
+	BuiltinCache(3, cacheArgs);
+	long long missNs = NowNanoseconds() - start;
+	for (i = 0; i < count; i++)
+	{
+		start = NowNanoseconds();
+		BuiltinCache(3, cacheArgs);
+		hitNs += NowNanoseconds() - start;
+	}
+
+	fflush(stdout);
+	dup2(savedIn, 0);
+	dup2(savedOut, 1);
+	close(savedIn);
+	close(savedOut);
+	unsetenv("SMALLSH_CACHE");
+	unlink(inputPath);
+	DIR *entries = opendir(directory);
+	struct dirent *entry;
+	while ((entries != NULL) && ((entry = readdir(entries)) != NULL))
+	{
+		if (entry->d_name[0] != '.')
+		{
+			snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+			unlink(path);
+		}
+	}
+	if (entries != NULL)
+	{
+		closedir(entries);
+	}
+	rmdir(directory);
+
+	printf("{\"bench\":\"cache\",\"mb\":%d,\"miss_us\":%.3f,\"hit_us\":%.3f}\n",
+		megabytes, missNs / 1e3, (hitNs / 1e3) / count);
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  shellPath - the smallsh binary to run
+ * *  hostCount - how many hosts to run on
+ * *  maxJobs - the "on -j" count
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Times "on" over a command server standing in for each host,
+ * *	with a command that waits a round trip's worth of time, one
+ * *	host at a time and all at once.
+ * *
+ * ***************************************************************/
+void BenchOn(const char *shellPath, int hostCount, int maxJobs)
+{
+	char socketPath[] = "/tmp/smallsh_bench_onXXXXXX";
+	char line[PATH_MAX * 4];
+	size_t length;
+	sigset_t childMask;
+	sigset_t oldMask;
+	int i;
+
+	int tempFd = mkstemp(socketPath);
+	if (tempFd < 0)
+	{
+		return;
+	}
+	close(tempFd);
+	unlink(socketPath);
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	char *serverArgs[] = { (char *)shellPath, "--norc", "--server", socketPath, NULL };
+	pid_t serverPid = SpawnCommand(serverArgs, NULL, 1, -1);
+	for (i = 0; (serverPid > 0) && (i < 200) && (access(socketPath, F_OK) < 0); i++)
+	{
+		usleep(10000);
+	}
+
+	length = snprintf(line, sizeof(line), "on -j %d ", maxJobs);
+	for (i = 0; (i < hostCount) && (length + strlen(socketPath) + 32 < sizeof(line)); i++)
+	{
+		length += sprintf(line + length, (i > 0) ? ",%s" : "%s", socketPath);
+	}
+	sprintf(line + length, " sleep " BENCH_ON_LATENCY);
+
+	char *shellArgs[] = { (char *)shellPath, "--norc", "-c", line, NULL };
+	long long start = NowNanoseconds();
+	pid_t shellPid = (serverPid > 0) ? SpawnCommand(shellArgs, NULL, 1, -1) : -1;
+	if (shellPid > 0)
+	{
+		waitpid(shellPid, NULL, 0);
+	}
+	long long elapsed = NowNanoseconds() - start;
+
+	if (serverPid > 0)
+	{
+		kill(serverPid, SIGTERM);
+		waitpid(serverPid, NULL, 0);
+	}
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	unlink(socketPath);
+
+	if (shellPid < 0)
+	{
+		printf("{\"bench\":\"on\",\"error\":\"cannot run %s\"}\n", shellPath);
+		return;
+	}
+
+	printf("{\"bench\":\"on\",\"hosts\":%d,\"jobs\":%d,\"latency_s\":%s,\"elapsed_ms\":%.1f}\n",
+		hostCount, maxJobs, BENCH_ON_LATENCY, elapsed / 1e6);
+	fflush(stdout);
+}
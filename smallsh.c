@@ -14,590 +14,15342 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <termios.h>
+#include <spawn.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
-#define MAX_ARGS 513 // This is 513 because we support 512 arguments plus 1 command
-#define MAX_COMMAND_LENGTH 2048 
 #define MAX_ERR_MSG_LENGTH 80 
+#define MAX_REDIRECTS 32 // for one command
+#define ARENA_BLOCK_SIZE 16384
+#define INPUT_BLOCK_SIZE 65536
+
+// Background job tracking. The sizes are powers of two.
+#define MAX_JOBS 1024
+#define MAX_JOB_COMMAND 128
+#define PID_SLOT_COUNT 8192
+#define REAP_RING_SIZE 1024
+#define SELF_PIPE_MIN_FD 10 // above what redirects usually name
+
+// The history file, and how many bytes can be added after the prefix
+//  index before it is rebuilt
+#define HISTORY_FILE_NAME ".smallsh_history"
+#define HISTORY_TAIL_LIMIT 65536
+
+// The startup file, and the snapshot of the tables it set up that is
+//  kept next to it
+#define RC_FILE_NAME ".smallshrc"
+#define RC_SNAPSHOT_SUFFIX ".snapshot"
+#define RC_SNAPSHOT_MAGIC "smallshS"
+#define RC_SNAPSHOT_VERSION 3
+
+// The result cache of "cache command", under $XDG_CACHE_HOME or
+//  ~/.cache unless $SMALLSH_CACHE names it
+#define CACHE_DIRECTORY_NAME "smallsh"
+#define CACHE_MAGIC "smallshC"
+#define CACHE_VERSION 1
+
+// "on hosts command". ssh master connections are kept in the cache
+//  directory for ON_CONTROL_PERSIST seconds after their last command.
+#define ON_DEFAULT_JOBS 64
+#define ON_LINE_SIZE 65536
+#define ON_CONTROL_PERSIST "600"
+
+// The variable table
+#define VARIABLE_HASH_BUCKETS 256
+
+// The alias and function tables, and how deep function calls can go
+#define DEFINITION_HASH_BUCKETS 64
+#define MAX_FUNCTION_DEPTH 256
+#define MAX_ALIAS_DEPTH 16
+
+// How many loops can be running inside each other, counting the ones
+//  in the functions they call
+#define MAX_LOOP_DEPTH 1024
+
+// Expansion modes, and the characters that mean a word needs one
+#define EXPAND_WORD 0
+#define EXPAND_HEREDOC 1
+#define EXPAND_QUOTES 2
+#define EXPAND_PATTERN 3
+#define EXPAND_SPECIAL "$'\"\\*?["
+
+// The command path cache
+#define PATH_HASH_BUCKETS 256
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+// The directory listing cache behind file name patterns
+#define DIRECTORY_CACHE_LISTINGS 64
+#define DIRECTORY_CACHE_BYTES (64 << 20)
+#define DIRECTORY_READ_SIZE 65536
+
+// Command server mode. Every frame is a type byte, then the request id
+//  and the payload length as four byte numbers in network byte order.
+#define SERVER_MAX_CLIENTS 256
+#define SERVER_MAX_REQUESTS 1024
+#define SERVER_MAX_LINE 65536
+#define SERVER_READ_SIZE 65536
+#define SERVER_OUTPUT_LIMIT (1 << 20) // unsent output before a client's requests pause
+#define SERVER_EPOLL_EVENTS 64
+#define FRAME_HEADER_SIZE 9
+#define FRAME_RUN 'R'    // client to server: a command line to run
+#define FRAME_STDOUT 'O' // server to client: some of the command's stdout
+#define FRAME_STDERR 'E' // server to client: some of its stderr
+#define FRAME_STATUS 'S' // server to client: the exit status, last of all
+
+// The event loop of the server and of the interactive shell. An
+//  io_uring is used if the kernel has one, with one-shot polls armed
+//  again before each wait so they are level triggered like epoll.
+//  Otherwise it is an epoll set.
+#define EVENTS_EPOLL 0
+#define EVENTS_URING 1
+#define EVENT_RING_ENTRIES 1024
+#define EVENT_DATA_IGNORE 0xffffffffffffffffULL // a cancel, whose completion means nothing
+#define EVENT_DATA_CHILD 0xfffffffffffffffeULL  // the child wait
+#ifndef IORING_OP_WAITID
+#define IORING_OP_WAITID 50 // Linux 6.7, newer than some headers
+#endif
+
+// What an event in server mode is for
+#define SERVER_TAG_LISTEN 0
+#define SERVER_TAG_REAPER 1
+#define SERVER_TAG_CLIENT 2
+#define SERVER_TAG_OUTPUT 3
+
+// What an event in the interactive shell's loop is for
+#define SHELL_TAG_INPUT 0
+#define SHELL_TAG_CHILD 1
+#define SHELL_TAG_CAPTURE 2
+#define SHELL_EVENTS 16
+
+// Output capture for "--log". The last stage writes to a pipe whose
+//  data is teed into the log and spliced on, a chunk at a time.
+#define CAPTURE_CHUNK (1 << 20)
+
+// Execution tracing for "--trace file" or SMALLSH_TRACE. Events go
+//  into a ring of fixed records in a shared file mapping, so forked
+//  copies of the shell write to it too and smallsh_trace can read it
+//  after a crash. A trace point costs one branch when tracing is off.
+#define TRACE_MAGIC "SMSHTRC1"
+#define TRACE_VERSION 1
+#define TRACE_RING_EVENTS 65536 // a power of two; 4 MB of records
+#define TRACE_READ 1     // a command line read
+#define TRACE_PARSE 2    // a line broken into its pipelines
+#define TRACE_BUILTIN 3  // a builtin run in the shell
+#define TRACE_PATH 4     // a command looked up on PATH
+#define TRACE_SPAWN 5    // posix_spawn, which includes the exec
+#define TRACE_FORK 6     // a fork for a command, builtin or list
+#define TRACE_EXEC 7     // the exec in a forked child
+#define TRACE_REDIRECT 8 // a redirect's file opened
+#define TRACE_WAIT 9     // the shell waiting on a foreground job
+#define TRACE_EXIT 10    // a child's status collected from the kernel
+#define TRACE_REAP 11    // the shell taking that status off the reap ring
+#define TRACE_KIND_COUNT 12
+
+#define TRACE_START() ((traceRecords != NULL) ? TraceNow() : 0)
+#define TRACE(kind, start, value, detail, text) \
+	do \
+	{ \
+		if (traceRecords != NULL) \
+		{ \
+			TraceEvent((kind), (start), (value), (detail), (text)); \
+		} \
+	} while (0)
+
+// "cmd |& N filter" runs N copies of the filter on blocks of whole
+//  lines. "N" keeps the output in input order and "Nu" passes lines on
+//  as the workers write them.
+#define MAX_FAN_OUT 1024
+#define FAN_OUT_BLOCK (1 << 20)
+#define FAN_OUT_READ (1 << 16)
+
+// Launch engines for external commands
+#define SPAWN_ENGINE_POSIX 0
+#define SPAWN_ENGINE_FORK 1
+
+extern char **environ;
+
+static int spawnEngine = SPAWN_ENGINE_POSIX;
+static posix_spawnattr_t foreGroundAttr;
+static posix_spawnattr_t backGroundAttr;
+
+// 1 if the shell owns a terminal and gives it to each foreground job
+static int shellIsInteractive = 0;
+
+// Redirect kinds. Each one applies to a descriptor of the command,
+//  stdin or stdout unless a number comes before the symbol.
+#define REDIRECT_INPUT 0      // N<file
+#define REDIRECT_OUTPUT 1     // N>file
+#define REDIRECT_APPEND 2     // N>>file
+#define REDIRECT_DUP 3        // N>&M or N<&M, and N>&- closes N
+#define REDIRECT_HERESTRING 4 // N<<<word
+#define REDIRECT_HEREDOC 5    // N<<word, with the body on the lines after
+
+// One redirect of a command, in the order it was written
+struct Redirect
+{
+	int kind;
+	int fd;       // the descriptor the command sees
+	char *target; // the file, descriptor number, word or here-doc body
+	int isQuoted; // a here-doc whose delimiter was quoted is not expanded
+};
+
+// One stage of a pipeline. argv is a slice of the pipeline's
+//  argument pool and redirects is a slice of its redirect pool.
+struct Command
+{
+	char **argv;
+	int argc;
+	struct Redirect *redirects;
+	int redirectCount;
+	int fanOut;      // the workers "|& N" runs it as, or 0
+	int isUnordered; // "|& Nu", whose lines need not keep their order
+};
+
+// A single parsed command line. Every pointer points into the
+//  user's input buffer or the line's arena, except the here-doc
+//  bodies. The pools are sized to the line when it is parsed.
+struct Pipeline
+{
+	char **argPool;
+	int poolUsed;
+	int poolSize;
+	struct Redirect *redirectPool;
+	int redirectsUsed;
+	int hereDocCount;
+	struct Command *commands;
+	pid_t *pids; // the pid of each stage, once it is started
+	int pidCount; // the stages, then the output capture if there is one
+	int captureFd; // or the pipe the shell copies the output from, or -1
+	int count;
+	int stageLimit;
+	int isBackground;
+	int isExpanded;
+	int isSubstitution; // its stages stay in the shell's process group
+	struct Compound *compound; // runs instead of the one empty stage
+	struct Arena *arena; // the line's arena, for anything built later
+};
+
+// A compound command. It is read as one part of a command list, over
+//  any list operators in its body.
+#define COMPOUND_FUNCTION 0 // "name() { body; }" defines a function
+#define COMPOUND_FOR 1      // "for name in words; do body; done"
+#define COMPOUND_WHILE 2    // "while list; do body; done"
+#define COMPOUND_UNTIL 3    // "until list; do body; done"
+
+// How a command list joins a pipeline to the one after it
+#define LIST_SEQUENCE 0   // ";", or the end of the line
+#define LIST_AND 1        // "&&": the next runs if this one succeeded
+#define LIST_OR 2         // "||": the next runs if this one failed
+#define LIST_BACKGROUND 3 // "&": this one runs in the background
+
+// A command line: pipelines joined by ";", "&", "&&" and "||". They
+//  run left to right, and "&&" and "||" bind equally, as in sh.
+struct CommandList
+{
+	struct Pipeline *pipelines;
+	char *operators; // how each pipeline is joined to the next
+	int count;
+};
+
+// A loop is parsed once, with the line it is on. Running it copies
+//  these lists, as expanding a pipeline changes it.
+struct Compound
+{
+	int kind;
+	char *name;                   // the function, or the for loop's variable
+	char *body;                   // a function's text, parsed when it is defined
+	struct CommandList words;     // a for loop's words, as one pipeline
+	struct CommandList condition; // a while or until loop's test
+	struct CommandList list;      // a loop's body
+};
+
+// A bump allocator for everything one command line needs. The blocks
+//  are kept from line to line, so a reset costs nothing and a line
+//  only mallocs when it is bigger than any line before it.
+struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct Arena
+{
+	struct ArenaBlock *first;
+	struct ArenaBlock *current;
+	struct ArenaBlock *last;
+};
+
+// A change to a child's descriptors: dup2(source, target), or close
+//  target when source is -1. They are applied in order, so a later
+//  one can copy what an earlier one set up, as in "> out 2>&1".
+struct FdAction
+{
+	int source;
+	int target;
+};
+
+// Everything one child's descriptors need. The opened descriptors are
+//  the shell's close-on-exec copies, closed once the child is started.
+struct FdPlan
+{
+	struct FdAction actions[MAX_REDIRECTS + 2];
+	int actionCount;
+	int opened[MAX_REDIRECTS];
+	int openedCount;
+};
+
+// A command the shell runs itself instead of starting a process
+typedef int (*BuiltinFunc)(int argc, char **argv);
+
+struct Builtin
+{
+	const char *name;
+	BuiltinFunc func;
+	int next; // next builtin with the same first character, or -1
+};
+
+// Where command lines come from. Interactive input is read a line at a
+//  time after a prompt. Script input is mapped or read in large blocks
+//  and split into lines in place.
+struct InputReader
+{
+	int isInteractive;
+	int fd;
+	char *buffer;
+	size_t length;   // bytes of input in the buffer
+	size_t position; // start of the next line
+	size_t capacity;
+	int isMapped;
+	int atEnd;       // no more input to read into the buffer
+};
+
+// A background job. Every process in the job maps back to it through
+//  the pid slots, so a reaped child is matched to its job in O(1).
+struct Job
+{
+	int inUse;
+	pid_t pid;       // the pid reported for the job, its last stage
+	pid_t pgid;
+	int liveCount;   // processes in the job that have not been reaped
+	int status;      // wait status of the reported pid
+	int isQuiet;     // finished quietly and left for its owner to remove
+	int isDone;
+	int isStopped;
+	int number;      // the job number fg, bg and wait take as %n
+	int hasModes;    // modes holds its terminal modes from when it stopped
+	struct termios modes;
+	struct timespec startTime;
+	struct timespec endTime;  // run time, once the job is done
+	struct rusage usage; // summed over every process in the job
+	char *cgroup;    // its cgroup v2 directory under "limit", or NULL
+	int captureFd;   // the pipe the shell copies its "--log" output from, or -1
+	char command[MAX_JOB_COMMAND];
+};
+
+// A limit the limit builtin sets for background jobs. The ones with a
+//  file are written to each job's cgroup v2 directory; the others are
+//  rlimits each child sets before it execs.
+struct JobLimit
+{
+	const char *name;
+	const char *file;  // the cgroup file, or NULL for an rlimit
+	int resource;      // the rlimit
+	int isSize;        // the value can end in K, M or G
+	long long value;   // -1 when it is not set
+};
+
+// An entry in the open addressed pid to job map. A pid of 0 is an
+//  empty slot. Removing an entry shifts the rest of its probe chain
+//  back, so the map leaves no tombstones for lookups to step over.
+struct PidSlot
+{
+	pid_t pid;
+	int job;
+};
+
+// A child the SIGCHLD handler reaped, waiting to be reported
+struct ReapRecord
+{
+	pid_t pid;
+	int status;
+	struct rusage usage;
+};
+
+static struct Job jobs[MAX_JOBS];
+static int freeJobs[MAX_JOBS];
+static int freeJobCount = 0;
+static struct PidSlot pidSlots[PID_SLOT_COUNT];
+
+// Single producer, single consumer ring. Only the handler moves the
+//  head and only the shell loop moves the tail.
+static struct ReapRecord reapRing[REAP_RING_SIZE];
+static unsigned int reapHead = 0;
+static unsigned int reapTail = 0;
+
+// The handler writes a byte here so a waiting shell wakes up
+static int selfPipe[2] = { -1, -1 };
+
+// A command name and where it was found on PATH
+struct PathEntry
+{
+	char *name;
+	char *path;
+	int hits;
+	struct PathEntry *next;
+};
+
+// One copy of a "|& N" filter. A free slot has a pid of -1 and one
+//  whose output is waiting on the blocks before it has a pid of 0.
+struct FanOutWorker
+{
+	pid_t pid;
+	int inFd;  // where its block is written, or -1
+	int outFd; // where its output is read, or -1
+	char *block;
+	size_t blockLength;
+	size_t blockSent;
+	char *output; // what it wrote that is not passed on yet
+	size_t outputLength;
+	size_t outputSize;
+	unsigned long sequence; // the block it has, in ordered mode
+	int isClosed;           // it stopped reading
+};
+
+// The start of a cache entry. The key it was made for follows, and
+//  then the command's output.
+struct CacheHeader
+{
+	char magic[8];
+	unsigned int version;
+	int status;
+	unsigned long long keyLength;
+	unsigned long long outputLength;
+};
+
+// One of a host's output streams under "on", with the start of a line
+//  that has not ended yet
+struct OnHostStream
+{
+	const char *host;
+	int outFd;
+	size_t length;
+	char pending[ON_LINE_SIZE];
+};
+
+static struct PathEntry *pathBuckets[PATH_HASH_BUCKETS];
+static char *hashedPath = NULL; // the PATH the cache was filled from
+
+// The record getdents64 fills in. glibc has no declaration for it.
+struct LinuxDirent64
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// One name in a directory listing, and its d_type
+struct DirectoryEntry
+{
+	const char *name;
+	unsigned char type;
+};
+
+// The names in one directory, sorted. It is found by device and inode
+//  and trusted while the directory's mtime stays the same.
+struct DirectoryListing
+{
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	int isRacy;       // read too soon after a change to trust the mtime
+	int pinCount;     // matches still walking the entries
+	char *buffer;     // the getdents64 records the names point into
+	struct DirectoryEntry *entries;
+	size_t count;
+	size_t bytes;
+	struct DirectoryListing *next;
+};
+
+static struct DirectoryListing *directoryCache = NULL; // most recent first
+static size_t directoryCacheCount = 0;
+static size_t directoryCacheBytes = 0;
+
+// The pattern matches for one command, and the path being matched
+struct GlobState
+{
+	char path[PATH_MAX];
+	char **matches;
+	size_t matchCount;
+	size_t matchCapacity;
+	int isOutOfMemory;
+	struct Arena *arena;
+};
+
+// The resources one command used, for "time" and "status -v"
+struct CommandTiming
+{
+	struct timespec wallTime;
+	struct rusage usage;
+};
+
+// A shell variable. The entry is the whole "NAME=value" string, so an
+//  exported variable goes into the envp as it is.
+struct Variable
+{
+	char *entry;
+	size_t nameLength;
+	int isExported;
+	struct Variable *next;
+};
+
+static struct Variable *variableBuckets[VARIABLE_HASH_BUCKETS];
+
+// The envp every child gets. It is only rebuilt after an exported
+//  variable changes; until then the strings it had are kept alive.
+static char **shellEnvironment = NULL;
+static int environmentDirty = 1;
+static char **retiredEntries = NULL;
+static size_t retiredCount = 0;
+static size_t retiredCapacity = 0;
+
+// For "$$" and "$!"
+static pid_t shellPid = 0;
+static pid_t lastBackgroundPid = 0;
+
+// The output of a "$(...)" on the line being expanded. The measuring
+//  pass runs the command and the writing pass finds its output here
+//  by where the "$(" is in the word.
+struct Substitution
+{
+	const char *text;
+	char *output;
+	size_t length;
+	struct Substitution *next;
+};
+
+static struct Substitution *substitutions = NULL;
+static struct Arena *substitutionArena = NULL;
+static int substitutionStatus = 0; // the status of the last one, for "x=$(cmd)"
+static int substitutionCapture = -1; // what an inline builtin prints
+static char *substitutionBuffer = NULL; // what a command writes, before it is copied to the arena
+static size_t substitutionCapacity = 0;
+
+// An alias or a function. Its text is parsed the first time it is
+//  needed and the parsed list is kept, so each later use only copies
+//  the list and runs it, without lexing the text again.
+struct Definition
+{
+	char *name;
+	char *text;   // the alias value or the function body, as written
+	int isParsed;
+	struct CommandList list;
+	struct Arena arena; // the parsed list and the copy of text it points into
+	struct Definition *next;
+};
+
+struct DefinitionTable
+{
+	struct Definition *buckets[DEFINITION_HASH_BUCKETS];
+	int count;
+};
+
+static struct DefinitionTable aliasTable;
+static struct DefinitionTable functionTable;
+static struct Definition *retiredDefinitions = NULL; // replaced, but a line may still point into them
+static int isAliasExpansionOff = 0; // while an alias value is parsed
+
+// The function calls being run. Each depth has an arena for the copies
+//  of the body it runs, reused by every call at that depth.
+static int functionDepth = 0;
+static int isReturning = 0; // "return" ran, so the rest of the body is skipped
+static struct Arena callArenas[MAX_FUNCTION_DEPTH];
+static char **positionalArgs = NULL; // "$1" and on
+static int positionalCount = 0;
+static const char *positionalJoined = ""; // "$@" and "$*" inside a word
+static size_t positionalJoinedLength = 0;
+
+// The loops being run. Each depth has an arena for the expanded words
+//  of a for loop and one for the copy of the body, which is reset
+//  every time around. A function call starts with no loop to break.
+struct LoopFrame
+{
+	struct Arena words;
+	struct Arena body;
+};
+
+static struct LoopFrame loopFrames[MAX_LOOP_DEPTH];
+static int loopNesting = 0;     // every loop running, to pick the frame
+static int loopDepth = 0;       // the ones "break" can end
+static int loopJumps = 0;       // loops "break" or "continue" still has to leave
+static int isContinuing = 0;    // the last one left goes around again
+static int foregroundSignal = 0; // the signal that ended the last foreground job
+
+// The command history. The file is only ever appended to, so an
+//  offset into it names an entry for good.
+struct History
+{
+	int fd;
+	char *map;
+	size_t mapLength;
+	size_t *index;        // the latest copy of each entry, sorted by text
+	size_t indexCount;
+	size_t indexedLength; // the part of the file the index covers
+	size_t entryCount;    // entries in the part of the file counted
+	size_t countedLength;
+};
+
+static struct History history = { -1, NULL, 0, NULL, 0, 0, 0, 0 };
+
+// The start of an rc snapshot. The rc file it was made from and the
+//  variables it read from the environment are its key. After it come
+//  the strings: the PATH the cache was filled from, then each variable
+//  the rc file read as it was in the environment, "NAME=value" or just
+//  "NAME" if it was not set, then each variable it read or changed as
+//  it left it, the export flag and "NAME=value" or "-NAME" if unset,
+//  then each cached command as its name and path, then each alias and
+//  each function as its name and its text. Definitions are parsed
+//  when first used.
+struct RcSnapshotHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int dependencyCount;
+	unsigned long long rcDevice;
+	unsigned long long rcInode;
+	long long rcSize;
+	long long rcSeconds;
+	long long rcNanoseconds;
+	unsigned long long length; // of the whole file, to catch one cut short
+	unsigned int variableCount;
+	unsigned int pathCount;
+	unsigned int hasHashedPath;
+	unsigned int aliasCount;
+	unsigned int functionCount;
+	unsigned int reserved;
+};
+
+static const char *rcPath = NULL;    // NULL with --norc
+static int isLoadingRc = 0;
+static int isRcCacheable = 0;        // the rc has only done what a snapshot holds
+static char *snapshotMap = NULL;     // strings in the loaded snapshot are not freed
+static size_t snapshotLength = 0;
+static char **startupEnvironment = NULL; // environ before the variable table replaced it
+
+// A variable the rc file looked at or changed while it ran, chained
+//  by index in the buckets of its name's hash
+struct RcVariable
+{
+	char *name;
+	int isRead;
+	int next;
+};
+
+static struct RcVariable *rcVariables = NULL;
+static size_t rcVariableCount = 0;
+static size_t rcVariableCapacity = 0;
+static int rcVariableBuckets[VARIABLE_HASH_BUCKETS];
+
+// An entry being sorted into the prefix index, with its first eight
+//  bytes packed so they compare as one number
+struct HistoryKey
+{
+	unsigned long long key;
+	size_t offset;
+};
+
+// 1 while "&" is ignored. SIGTSTP sent to the shell toggles it.
+static volatile sig_atomic_t foreGroundOnly = 0;
+
+// The prompt the shell waits at, or 0, so the SIGTSTP handler and the
+//  job reports can show it again after their messages
+#define PROMPT_COMMAND 1 // ": "
+#define PROMPT_HEREDOC 2 // "> "
+static volatile sig_atomic_t atPrompt = 0;
+
+// The shell's terminal modes, put back when a job stops
+static struct termios shellModes;
+
+// The job fg and bg use when they are not given one
+static int currentJob = -1;
+
+// Background job limits. cpu is a percent of one CPU and io a weight
+//  from 1 to 10000.
+static struct JobLimit jobLimits[] =
+{
+	{ "cpu", "cpu.max", 0, 0, -1 },
+	{ "memory", "memory.max", 0, 1, -1 },
+	{ "io", "io.weight", 0, 0, -1 },
+	{ "time", NULL, RLIMIT_CPU, 0, -1 },
+	{ "as", NULL, RLIMIT_AS, 1, -1 },
+	{ "nofile", NULL, RLIMIT_NOFILE, 0, -1 },
+	{ "nproc", NULL, RLIMIT_NPROC, 0, -1 },
+	{ "core", NULL, RLIMIT_CORE, 1, -1 },
+	{ "fsize", NULL, RLIMIT_FSIZE, 1, -1 },
+};
+static int jobLimitCount = 0;          // how many are set
+static char *jobCgroupRoot = NULL;     // the cgroup the job cgroups go in
+static int jobCgroupState = 0;         // 1 once it is made, -1 if it cannot be
+static int isLaunchLimited = 0;        // the children being started get the limits
+static const char *launchCgroup = NULL; // and join this cgroup, if it is not NULL
+
+// A connection to the command server
+struct ServerClient
+{
+	int fd;           // -1 for a free slot
+	char *input;      // frames not handled yet
+	size_t inputLength;
+	size_t inputCapacity;
+	char *output;     // frames not sent yet
+	size_t outputLength;
+	size_t outputSent;
+	size_t outputCapacity;
+	int isWaitingToWrite;
+	int isPaused;     // its requests' output is not read until it catches up
+	int isInputDone;  // it has shut down its side
+	int requestCount;
+};
+
+// A command line the server is running for a client
+struct ServerRequest
+{
+	int inUse;
+	int client;       // -1 once the client has gone
+	unsigned int id;
+	int fds[2];       // the read ends of its stdout and stderr, -1 at the end
+	int jobIndex;     // -1 once the job is done
+	int exitStatus;
+};
+
+// A descriptor the io_uring backend polls, by fd. The generation
+//  changes whenever the poll is replaced, so a completion for an old
+//  one is told apart and dropped.
+struct EventWatch
+{
+	unsigned int events;
+	unsigned int generation;
+	unsigned long long data;
+	char inUse;
+	char isArmed;
+	char isQueued; // in the queue to be armed before the next wait
+};
+
+// One event taken off the loop: what happened and the data it was
+//  watched with
+struct EventRecord
+{
+	unsigned int events;
+	unsigned long long data;
+};
+
+struct EventLoop
+{
+	int backend;
+	int fd; // the ring or the epoll set, or -1 when there is no loop
+
+	// The io_uring's rings, mapped from the kernel
+	unsigned int *sqHead;
+	unsigned int *sqTail;
+	unsigned int *sqArray;
+	unsigned int sqMask;
+	unsigned int sqEntries;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int toSubmit;
+
+	struct EventWatch *watches;
+	int watchCapacity;
+	int *armQueue;
+	int armCount;
+
+	// Child exits come from IORING_OP_WAITID where the kernel has it,
+	//  with SIGCHLD held, or else from the reaper's self-pipe
+	int hasChildWait;
+	int isWatchingChildren;
+	int isChildArmed;
+	int isChildless; // the last wait found no children; a new job arms it again
+	unsigned long long childData;
+	siginfo_t childInfo;
+};
+
+static struct ServerClient serverClients[SERVER_MAX_CLIENTS];
+static struct ServerRequest serverRequests[SERVER_MAX_REQUESTS];
+static struct Arena serverArena;
+static struct EventLoop serverEvents = { EVENTS_EPOLL, -1 };
+static struct EventLoop shellEvents = { EVENTS_EPOLL, -1 }; // the interactive shell's
+static int eventBackend = EVENTS_URING; // "--events epoll" asks for the fallback
+static int serverCapture[2] = { -1, -1 }; // what the shell prints for a request
+
+// The log "--log file" copies command output into, or -1, and the pipe
+//  the server tees a request's stdout into on its way there
+static int captureLogFd = -1;
+static int serverLogTee[2] = { -1, -1 };
+static int shellLogTee[2] = { -1, -1 }; // the same, for the interactive shell
+
+// The start of a trace file: which ring it is and the next record
+//  to write, which every writer takes with one atomic add
+struct TraceHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int capacity;
+	unsigned long long head;
+	char reserved[40];
+};
+
+// One trace event, a cache line long. A span has the time it took and
+//  an instant a duration of 0. The sequence is written last, so a
+//  record that is half written or was written over is told apart.
+struct TraceRecord
+{
+	unsigned long long sequence; // the record's index plus one
+	long long start;             // CLOCK_MONOTONIC nanoseconds
+	long long duration;
+	long long value;
+	int pid;
+	unsigned short kind;
+	unsigned short reserved;
+	int detail;
+	char text[20];
+};
+
+static struct TraceHeader *traceHeader = NULL;
+static struct TraceRecord *traceRecords = NULL; // NULL when tracing is off
+
+// What the last foreground command left behind for "status"
+static int statusNumber = 0;
+static char errMsg[MAX_ERR_MSG_LENGTH] = "";
+static struct CommandTiming lastTiming;
+static int hasLastTiming = 0;
 
 // Function declarations
-void RunShellLoop();
+void SetScriptArgs(int count, char **args);
+void InitShell(int isInteractive);
+void RunShellLoop(struct InputReader *reader);
 void RemoveNewLineAndAddNullTerm(char *stringValue);
-int RunForeGroundCommand(char *userCommand, char *errMsg);
-void ParseUserInputToArgs(char *userCommand, char **returnArr);
-void InitializeArgsArray(char **argv);
-int ContainsString(char *stringToSearch, char *stringToSearchFor);
-void GetFileName(char *userCommand, char *returnValue);
-int RunBackGroundCommand(char *userCommand);
+int OpenInputReader(struct InputReader *reader, int fd);
+void OpenStringReader(struct InputReader *reader, const char *commands);
+char *ReadCommandLine(struct InputReader *reader);
+char *ReadHereDocLine(struct InputReader *reader);
+void WaitForInput();
+char *ReadBufferedLine(struct InputReader *reader);
+int ReadHereDocs(struct InputReader *reader, struct Pipeline *pipeline);
+int FillInputBuffer(struct InputReader *reader);
+void ExecutePipeline(struct Pipeline *pipeline);
+void ExecuteCommandList(struct CommandList *list);
+pid_t ForkCommandList(struct CommandList *list, pid_t pgid);
+int RunForeGroundCommand(struct Pipeline *pipeline, char *errMsg, struct rusage *usage);
+void AddUsage(struct rusage *total, const struct rusage *add);
+void SubtractUsage(struct rusage *total, const struct rusage *before);
+void ElapsedSince(const struct timespec *start, struct timespec *elapsed);
+void PrintTiming(FILE *out, const struct CommandTiming *timing);
+int ParseCommandLine(char *userCommand, struct Pipeline *pipeline, struct Arena *arena);
+int ParseCommandList(char *line, struct CommandList *list, struct Arena *arena);
+char *NextListOperator(char *line, int *kind, int *length);
+int ParseCompound(char *segment, struct Pipeline *pipeline, struct Arena *arena, char **end);
+struct Compound *NewCompound(struct Pipeline *pipeline, struct Arena *arena, int kind);
+int IsKeyword(const char *text, const char *keyword);
+int ParseLoop(char *text, struct Pipeline *pipeline, struct Arena *arena, char **end);
+char *FindCompoundEnd(char *text, int *depth);
+int CompoundDepth(char *line);
+char *ReadCompoundLines(struct InputReader *reader, char *line, struct Arena *arena);
+int ExpandAliases(struct Pipeline *pipeline);
+int SpliceAlias(struct Pipeline *pipeline, int stage, struct Pipeline *body);
+struct Definition *FindDefinition(struct DefinitionTable *table, const char *name);
+struct Definition *NewDefinition(const char *name, size_t nameLength, const char *text);
+void AddDefinition(struct DefinitionTable *table, struct Definition *definition);
+int RemoveDefinition(struct DefinitionTable *table, const char *name);
+int ParseDefinition(struct Definition *definition, int isAlias);
+void FreeDefinition(struct Definition *definition);
+void FreeRetiredDefinitions();
+void PrintAlias(const struct Definition *alias);
+int CallFunction(int argc, char **argv);
+int RunCompound(struct Compound *compound);
+int RunLoop(struct Compound *loop);
+int LaunchBackgroundLoop(struct Pipeline *pipeline);
+int CopyCommandList(const struct CommandList *source, struct CommandList *copy, struct Arena *arena);
+int BuiltinAlias(int argc, char **argv);
+int BuiltinUnalias(int argc, char **argv);
+int BuiltinReturn(int argc, char **argv);
+int BuiltinBreak(int argc, char **argv);
+int BuiltinContinue(int argc, char **argv);
+int LeaveLoops(const char *name, int argc, char **argv, int isContinue);
+int IsSpreadWord(const char *word);
+void *ArenaAlloc(struct Arena *arena, size_t size);
+void ArenaReset(struct Arena *arena);
+void ArenaFree(struct Arena *arena);
+char *ArenaCopy(struct Arena *arena, const char *text);
+int SaveWord(struct Pipeline *pipeline, struct Redirect **pendingRedirect, char *word);
+int EndStage(struct Pipeline *pipeline);
+int ParseFanOut(char **current, struct Command *stage);
+struct Redirect *AddRedirect(struct Pipeline *pipeline, int kind, int fd);
+int IsDescriptorWord(const char *word);
+char *FindClosingQuote(char *quote);
+char *FindClosingParen(char *dollar);
+int RunBackGroundCommand(struct Pipeline *pipeline);
+pid_t LaunchPipeline(struct Pipeline *pipeline, int isForeGround, pid_t *pids);
+int OpenRedirects(struct Command *command, struct FdPlan *plan);
+int OpenHereDoc(const char *body, const char *tail);
+int HasRedirect(struct Command *command, int fd);
+void AddFdAction(struct FdPlan *plan, int source, int target);
+void CloseFdPlan(struct FdPlan *plan);
+int ApplyFdPlan(const struct FdPlan *plan);
+void GiveTerminalTo(pid_t pgid);
+void InitSpawnEngine();
+void InitBuiltins();
+struct Builtin *FindBuiltin(const char *name);
+int RunBuiltinInShell(struct Builtin *builtin, struct Command *command);
+pid_t ForkBuiltin(struct Builtin *builtin, struct Command *command, const struct FdPlan *plan,
+	int isForeGround, pid_t pgid);
+pid_t ForkFanOut(struct Command *command, const struct FdPlan *plan, int isForeGround, pid_t pgid);
+int RunFanOut(struct Command *command, int isForeGround, pid_t pgid);
+int StartFanOutWorker(struct Command *command, struct FanOutWorker *worker, int isForeGround, pid_t pgid);
+int EmitFanOutOutput(struct FanOutWorker *worker, int isAll);
+int BuiltinExit(int argc, char **argv);
+int BuiltinCd(int argc, char **argv);
+int BuiltinStatus(int argc, char **argv);
+int BuiltinEcho(int argc, char **argv);
+int BuiltinPwd(int argc, char **argv);
+int BuiltinTrue(int argc, char **argv);
+int BuiltinFalse(int argc, char **argv);
+int BuiltinTest(int argc, char **argv);
+int BuiltinPrintf(int argc, char **argv);
+int BuiltinParallel(int argc, char **argv);
+int ParseJobCount(const char *name, int argc, char **argv, int *next, long *maxJobs);
+char **BuildParallelArgs(char **templateArgs, int templateCount, const char *arg);
+void FreeParallelArgs(char **argv);
+int BuiltinOn(int argc, char **argv);
+pid_t ForkOnHost(const char *host, int argc, char **argv, const sigset_t *mask);
+int RunOnHost(const char *host, int argc, char **argv);
+ssize_t CopyHostLines(struct OnHostStream *stream, int fd);
+int EvaluateTest(int argc, char **argv);
+int EvaluateTestPrimary(int argc, char **argv);
+void PrintEscapedChar(char **format);
+pid_t SpawnCommand(char **argv, const struct FdPlan *plan, int isForeGround, pid_t pgid);
+pid_t ForkCommand(const char *path, char **argv, const struct FdPlan *plan, int isForeGround,
+	pid_t pgid);
+const char *LookupCommandPath(const char *name, int *fromCache);
+struct PathEntry *FindPathEntry(const char *name, unsigned int *bucket);
+char *SearchPath(const char *name);
+void ForgetCommandPath(const char *name);
+void ClearPathCache();
+unsigned int HashString(const char *value);
+unsigned int HashBytes(const char *value, size_t length);
+unsigned long long HashBytes64(const char *value, size_t length);
+void ExecuteAssignments(struct Pipeline *pipeline, int assignments);
+int ExpandPipeline(struct Pipeline *pipeline);
+int ExpandModeFor(const struct Redirect *redirect);
+size_t ExpandText(const char *text, int mode, char *out);
+size_t CopyExpanded(char *out, size_t length, const char *text, size_t count, int escape);
+int IsGlobWord(const char *word);
+int GlobCommand(struct Pipeline *pipeline, struct Command *command, const char *isPattern);
+void GlobPath(struct GlobState *state, size_t pathLength, const char *pattern);
+int IsGlobPattern(const char *component);
+void UnescapePattern(char *pattern);
+int AddGlobMatch(struct GlobState *state, const char *name);
+struct DirectoryListing *GetDirectoryListing(const char *path);
+struct DirectoryListing *ReadDirectoryListing(int directoryFd, const struct stat *info);
+int CompareDirectoryEntries(const void *left, const void *right);
+void FreeDirectoryListing(struct DirectoryListing *listing);
+size_t LookupExpansion(const char *text, const char **value, size_t *valueLength);
+size_t LookupSubstitution(const char *text, const char **value, size_t *valueLength);
+const char *LookupPositional(int index);
+int RunSubstitution(struct Substitution *substitution, size_t length);
+int CaptureBuiltin(struct Builtin *builtin, struct Command *command, struct Substitution *substitution);
+int CaptureCommand(struct CommandList *list, struct Substitution *substitution);
+void InitVariables();
+struct Variable *FindVariable(const char *name, size_t nameLength);
+struct Variable *FindVariableEntry(const char *name, size_t nameLength);
+int SetVariable(const char *name, size_t nameLength, const char *value, int export);
+void UnsetVariable(const char *name);
+void FreeLater(char *entry);
+void RefreshEnvironment();
+size_t AssignmentNameLength(const char *word);
+size_t VariableNameLength(const char *text);
+int BuiltinExport(int argc, char **argv);
+int BuiltinUnset(int argc, char **argv);
+int BuiltinHash(int argc, char **argv);
+int BuiltinHistory(int argc, char **argv);
+int CompareOffsetsDescending(const void *left, const void *right);
+void OpenHistory();
+void AddHistory(const char *line);
+int MapHistory();
+const char *FindRcFile();
+void NoteRcVariable(const char *name, size_t nameLength, int isRead);
+const char *FindStartupEntry(const char *name, size_t nameLength);
+int LoadRcSnapshot(const char *path);
+void RunRcFile(const char *path);
+int IsSnapshotCommand(struct Pipeline *pipeline, int assignments);
+void SaveRcSnapshot(const char *path, const struct stat *rcInfo);
+void FreeShellString(char *text);
+void CloseInputReader(struct InputReader *reader);
+int CompareHistoryKeys(const void *left, const void *right);
+void BuildHistoryIndex();
+int HistoryEntriesMatch(size_t left, size_t right);
+size_t CountHistoryLines(size_t start, size_t end);
+int CompareHistoryPrefix(size_t offset, const char *prefix, size_t prefixLength);
+long FindHistoryEntry(const char *prefix, size_t prefixLength, size_t *first, size_t *last);
+char *ExpandHistory(char *line, struct Arena *arena);
 static void sigchld_handler (int sig);
+static void sigtstp_handler (int sig);
+int WaitForJob(int jobIndex);
+void WaitForChild(const sigset_t *waitMask);
+void ContinueJob(struct Job *job);
+int FindJob(const char *spec, const char *builtinName);
+int FindCurrentJob();
+int NextJobNumber();
+void PrintJob(int jobIndex, const char *state);
+int ForeGroundStatus(int status, char *errMsg);
+void TakeTerminalBack(struct Job *job);
+int IsNumber(const char *text);
+int BuiltinJobs(int argc, char **argv);
+int BuiltinFg(int argc, char **argv);
+int BuiltinBg(int argc, char **argv);
+int BuiltinWait(int argc, char **argv);
+void InitJobTable();
+void ReapChildren();
+void ReportCompletions();
+int AddJob(pid_t *pids, int count, pid_t pgid, const char *command);
+void ResetJobTableInChild();
+void MoveSelfPipe(int fd);
+void RemoveJob(int jobIndex);
+int BuiltinLimit(int argc, char **argv);
+int BuiltinCache(int argc, char **argv);
+int RunCachedCommand(int argc, char **argv, int outFd, int *isComplete);
+char *MakeCacheKey(int argc, char **argv, size_t *length);
+int FindCacheDirectory(char *path, size_t size);
+int ReplayCacheEntry(int entryFd, const char *key, size_t keyLength);
+void SendCacheOutput(int fd, off_t offset, size_t length);
+char *MakeJobCgroup();
+int OpenJobCgroupRoot();
+void RemoveJobCgroupRoot();
+int WriteCgroupFile(const char *directory, const char *file, const char *text);
+void ApplyJobLimits();
+void PrintJobUsage(int jobIndex);
+long long ParseLimitValue(const char *text, int isSize);
+struct PidSlot *FindPidSlot(pid_t pid, int forInsert);
+unsigned int PidSlotHome(pid_t pid);
+void RemovePidSlot(struct PidSlot *slot);
+void DescribePipeline(struct Pipeline *pipeline, char *description, size_t size);
+int RunServer(const char *socketPath);
+void WatchServerFd(int fd, int operation, unsigned int events, int tag, int index);
+int InitEventLoop(struct EventLoop *loop, int backend);
+int SetupEventRing(struct EventLoop *loop);
+void WatchEvent(struct EventLoop *loop, int fd, int operation, unsigned int events, unsigned long long data);
+void WatchChildren(struct EventLoop *loop, unsigned long long data, int holdSignal);
+struct io_uring_sqe *NextEventSqe(struct EventLoop *loop);
+int WaitEvents(struct EventLoop *loop, struct EventRecord *records, int max);
+int WaitShellEvents(const sigset_t *waitMask);
+void AcceptClients(int listenFd);
+void ReadClient(int clientIndex);
+void StartRequest(int clientIndex, unsigned int id, const char *line, size_t length);
+int IsInlineBuiltin(struct Builtin *builtin);
+void ForwardOutput(int requestIndex, int stream);
+void SendOutput(int requestIndex, int stream, size_t length);
+void CollectRequests();
+void FinishRequest(int requestIndex);
+void QueueStatus(int clientIndex, unsigned int id, int exitStatus);
+void QueueFrame(int clientIndex, char type, unsigned int id, const char *payload, size_t length);
+char *ReserveOutput(int clientIndex, size_t length);
+void FlushClient(int clientIndex);
+void UpdateClientEvents(int clientIndex);
+void CloseIdleClient(int clientIndex);
+void PauseRequests(int clientIndex, int pause);
+void CloseClient(int clientIndex);
+int RunClient(const char *socketPath, int argc, char **argv);
+ssize_t QuoteWords(int argc, char **argv, char *line, size_t size);
+unsigned int ReadFrameNumber(const unsigned char *bytes);
+void WriteFrameNumber(unsigned char *bytes, unsigned int value);
+int WriteAll(int fd, const char *data, size_t length);
+int OpenCaptureLog(const char *path);
+int OpenTrace(const char *path);
+long long TraceNow();
+void TraceEvent(int kind, long long start, long long value, int detail, const char *text);
+pid_t ForkCapture(int source, pid_t pgid);
+void RunCapture(int source, int destination);
+int CopyCapture(int fd);
+ssize_t TeeToLog(int source, int *teeFds, size_t length, unsigned int flags);
+int SpliceAll(int source, int destination, size_t length);
+ssize_t MoveChunk(int source, int destination, size_t length);
+int ReadAll(int fd, char *data, size_t length);
+
+// The built in commands. InitBuiltins chains them by first character
+//  so a lookup only compares names that could match.
+static struct Builtin builtins[] =
+{
+	{ "exit", BuiltinExit, -1 },
+	{ "cd", BuiltinCd, -1 },
+	{ "status", BuiltinStatus, -1 },
+	{ "echo", BuiltinEcho, -1 },
+	{ "pwd", BuiltinPwd, -1 },
+	{ "true", BuiltinTrue, -1 },
+	{ "false", BuiltinFalse, -1 },
+	{ "test", BuiltinTest, -1 },
+	{ "[", BuiltinTest, -1 },
+	{ "printf", BuiltinPrintf, -1 },
+	{ "parallel", BuiltinParallel, -1 },
+	{ "on", BuiltinOn, -1 },
+	{ "hash", BuiltinHash, -1 },
+	{ "history", BuiltinHistory, -1 },
+	{ "export", BuiltinExport, -1 },
+	{ "unset", BuiltinUnset, -1 },
+	{ "jobs", BuiltinJobs, -1 },
+	{ "fg", BuiltinFg, -1 },
+	{ "bg", BuiltinBg, -1 },
+	{ "wait", BuiltinWait, -1 },
+	{ "limit", BuiltinLimit, -1 },
+	{ "alias", BuiltinAlias, -1 },
+	{ "unalias", BuiltinUnalias, -1 },
+	{ "return", BuiltinReturn, -1 },
+	{ "break", BuiltinBreak, -1 },
+	{ "continue", BuiltinContinue, -1 },
+	{ "cache", BuiltinCache, -1 },
+};
+
+// What FindBuiltin gives for a function, so a call runs wherever a
+//  builtin can: in the shell, in a pipeline or in the background
+static struct Builtin functionBuiltin = { "function", CallFunction, -1 };
+
+static int builtinIndex[256];
+
+#ifndef SMALLSH_NO_MAIN
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command line. "-c commands" runs the given
+ * *               commands and a file name runs that script.
+ * *               "--server socket" serves commands on a UNIX
+ * *               socket and "--client socket command..." runs one
+ * *               command on such a server. Otherwise commands are
+ * *               read from stdin. Any of these can come after
+ * *               "--log file", which copies command output to the
+ * *               file as well, "--norc", which skips the rc file,
+ * *               "--events uring|epoll", which picks the
+ * *               event loop of the server and of a shell at a
+ * *               terminal, and "--trace file", which records a
+ * *               trace of what the shell does there.
+ * *               SMALLSH_TRACE=file traces to file.PID instead.
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	This is the entry point into the program.
+ * *
+ * ***************************************************************/
+int main(int argc, char **argv)
+{
+	struct InputReader reader;
+	int useRc = 1;
+	const char *tracePath = NULL;
+	char traceName[PATH_MAX];
+
+	while (argc > 1)
+	{
+		if ((argc > 2) && (strcmp(argv[1], "--log") == 0))
+		{
+			if (OpenCaptureLog(argv[2]) < 0)
+			{
+				fprintf(stderr, "smallsh: %s: %s\n", argv[2], strerror(errno));
+				return 1;
+			}
+			argv[2] = argv[0];
+			argc -= 2;
+			argv += 2;
+		}
+		else if ((argc > 2) && (strcmp(argv[1], "--events") == 0))
+		{
+			if ((strcmp(argv[2], "uring") != 0) && (strcmp(argv[2], "epoll") != 0))
+			{
+				fprintf(stderr, "smallsh: --events: use uring or epoll\n");
+				return 2;
+			}
+			eventBackend = (strcmp(argv[2], "epoll") == 0) ? EVENTS_EPOLL : EVENTS_URING;
+			argv[2] = argv[0];
+			argc -= 2;
+			argv += 2;
+		}
+		else if ((argc > 2) && (strcmp(argv[1], "--trace") == 0))
+		{
+			tracePath = argv[2];
+			argv[2] = argv[0];
+			argc -= 2;
+			argv += 2;
+		}
+		else if (strcmp(argv[1], "--norc") == 0)
+		{
+			useRc = 0;
+			argv[1] = argv[0];
+			argc--;
+			argv++;
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (useRc)
+	{
+		rcPath = FindRcFile();
+	}
+
+	// Each shell traced through the environment gets a file of its own
+	if ((tracePath == NULL) && (getenv("SMALLSH_TRACE") != NULL) && (getenv("SMALLSH_TRACE")[0] != '\0'))
+	{
+		snprintf(traceName, sizeof(traceName), "%s.%d", getenv("SMALLSH_TRACE"), (int)getpid());
+		tracePath = traceName;
+	}
+	if ((tracePath != NULL) && (OpenTrace(tracePath) < 0))
+	{
+		fprintf(stderr, "smallsh: %s: %s\n", tracePath, strerror(errno));
+		return 1;
+	}
+
+	if ((argc > 2) && (strcmp(argv[1], "--server") == 0))
+	{
+		InitShell(0);
+		return RunServer(argv[2]);
+	}
+	if ((argc > 3) && (strcmp(argv[1], "--client") == 0))
+	{
+		return RunClient(argv[2], argc - 3, argv + 3);
+	}
+
+	// Figure out where the commands come from
+	if ((argc > 2) && (strcmp(argv[1], "-c") == 0))
+	{
+		OpenStringReader(&reader, argv[2]);
+		SetScriptArgs(argc - 3, argv + 3);
+	}
+	else if (argc > 1)
+	{
+		int scriptFd = open(argv[1], O_RDONLY);
+		if ((scriptFd < 0) || (OpenInputReader(&reader, scriptFd) < 0))
+		{
+			fprintf(stderr, "smallsh: %s: %s\n", argv[1], strerror(errno));
+			return 127;
+		}
+		SetScriptArgs(argc - 2, argv + 2);
+	}
+	else if (OpenInputReader(&reader, 0) < 0)
+	{
+		fprintf(stderr, "smallsh: cannot read stdin: %s\n", strerror(errno));
+		return 1;
+	}
+
+	InitShell(reader.isInteractive);
+
+	// Run the small shell loop
+	RunShellLoop(&reader);
+
+	return statusNumber;
+}
+#endif
+
+/**************************************************************
+ * * Entry:
+ * *  count - how many words follow the script
+ * *  args - the words
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Makes the words after a script, or after "-c command", its
+ * *	"$1" and on.
+ * *
+ * ***************************************************************/
+void SetScriptArgs(int count, char **args)
+{
+	size_t length = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		length += strlen(args[i]) + 1;
+	}
+	char *joined = malloc(length + 1);
+	if (joined == NULL)
+	{
+		return;
+	}
+	length = 0;
+	for (i = 0; i < count; i++)
+	{
+		length += sprintf(joined + length, (i > 0) ? " %s" : "%s", args[i]);
+	}
+	joined[length] = '\0';
+
+	positionalArgs = args;
+	positionalCount = count;
+	positionalJoined = joined;
+	positionalJoinedLength = length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  isInteractive - 1 if the commands come from a terminal
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Sets up the signal handlers, the job table, the launch engine
+ * *	and the builtins, then runs the rc file. SIGTSTP toggles
+ * *	foreground-only mode.
+ * *
+ * ***************************************************************/
+void InitShell(int isInteractive)
+{
+	// Set up a signal handler to deal with signals from child processes
+	InitJobTable();
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = sigchld_handler;
+	act.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &act, NULL);
+	act.sa_flags = 0;
+
+	// The shell itself ignores SIGINT; foreground children get the
+	//  default action back when they are launched.
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &act, NULL);
+
+	// Each foreground job gets the terminal while it runs. The shell
+	//  ignores SIGTTOU so it can take the terminal back afterwards.
+	if ((isInteractive) && (tcgetpgrp(0) == getpgrp()))
+	{
+		shellIsInteractive = 1;
+		sigaction(SIGTTOU, &act, NULL);
+		tcgetattr(0, &shellModes);
+	}
+
+	// A ^Z only reaches the shell when no job has the terminal, so at
+	//  the prompt it toggles foreground-only mode instead of stopping
+	//  the shell. Foreground jobs get it and stop.
+	act.sa_handler = sigtstp_handler;
+	act.sa_flags = SA_RESTART;
+	sigaction(SIGTSTP, &act, NULL);
+
+	// At a terminal the shell waits for what is typed, for its
+	//  children and for the output it logs on one event loop. Without
+	//  one, the read and each wait block on their own.
+	if ((shellIsInteractive) && (InitEventLoop(&shellEvents, eventBackend) == 0))
+	{
+		WatchChildren(&shellEvents, (unsigned long long)SHELL_TAG_CHILD << 32, 0);
+		if ((captureLogFd >= 0) && (pipe2(shellLogTee, O_CLOEXEC | O_NONBLOCK) == 0))
+		{
+			fcntl(shellLogTee[1], F_SETPIPE_SZ, CAPTURE_CHUNK);
+		}
+	}
+
+	shellPid = getpid();
+
+	// A snapshot of what the rc file set up stands in for running
+	//  it, if the rc and the variables it read are the same as then.
+	//  It only holds what the rc changed, so the table starts from
+	//  the environment either way.
+	startupEnvironment = environ;
+	InitVariables();
+	int isSnapshotLoaded = (rcPath != NULL) && (LoadRcSnapshot(rcPath) == 0);
+	InitSpawnEngine();
+	InitBuiltins();
+	if ((rcPath != NULL) && (!isSnapshotLoaded))
+	{
+		RunRcFile(rcPath);
+	}
+
+	// Only commands typed at a terminal go into the history
+	if (isInteractive)
+	{
+		OpenHistory();
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - where the command lines come from
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Runs the shell loop until the input ends
+ * *
+ * ***************************************************************/
+void RunShellLoop(struct InputReader *reader)
+{
+	char *userInput;
+	struct CommandList list;
+	struct Arena arena;
+	int i;
+
+	memset(&arena, 0, sizeof(arena));
+
+	while (1)
+	{
+		// Report the background jobs that finished since the last line
+		ReportCompletions();
+		FreeRetiredDefinitions();
+		ArenaReset(&arena);
+
+		// Get user input. Stop at the end of the input.
+		long long traceStart = TRACE_START();
+		userInput = ReadCommandLine(reader);
+		if (userInput == NULL)
+		{
+			fflush(stdout);
+			return;
+		}
+		TRACE(TRACE_READ, traceStart, strlen(userInput), 0, userInput);
+
+		// Restart loop if user entered nothing
+		if (strcmp(userInput, "") == 0)
+		{
+			continue;
+		}
+
+		// Replace "!!" and "!prefix", then record what will really run
+		if (reader->isInteractive)
+		{
+			userInput = ExpandHistory(userInput, &arena);
+			if (userInput == NULL)
+			{
+				continue;
+			}
+			AddHistory(userInput);
+		}
+
+		// Restart the loop if the user entered a comment
+		if (userInput[0] == '#')
+		{
+			continue;
+		}
+
+		// A function body can go on over the lines after this one
+		if (CompoundDepth(userInput) > 0)
+		{
+			userInput = ReadCompoundLines(reader, userInput, &arena);
+			if (userInput == NULL)
+			{
+				continue;
+			}
+		}
+
+		// A here-doc's body is on the lines after this one, and reading
+		//  them can reuse the buffer this line is in, so parse a copy
+		if (strstr(userInput, "<<") != NULL)
+		{
+			size_t lineSize = strlen(userInput) + 1;
+			char *lineCopy = ArenaAlloc(&arena, lineSize);
+			if (lineCopy == NULL)
+			{
+				continue;
+			}
+			memcpy(lineCopy, userInput, lineSize);
+			userInput = lineCopy;
+		}
+
+		// Break the line into its pipelines. The here-doc bodies follow
+		//  the line in the order their pipelines were written. As in
+		//  sh, a syntax error sets the status to 2, and a shell that is
+		//  not at a terminal stops there and exits with it. An rc file
+		//  with one is not snapshotted, so the error shows each time.
+		traceStart = TRACE_START();
+		if (ParseCommandList(userInput, &list, &arena) < 0)
+		{
+			statusNumber = 2;
+			isRcCacheable = 0;
+			if (!reader->isInteractive)
+			{
+				fflush(stdout);
+				return;
+			}
+			continue;
+		}
+		TRACE(TRACE_PARSE, traceStart, list.count, 0, "");
+		for (i = 0; i < list.count; i++)
+		{
+			if ((list.pipelines[i].hereDocCount > 0) && (ReadHereDocs(reader, &list.pipelines[i]) < 0))
+			{
+				break;
+			}
+		}
+		if (i == list.count)
+		{
+			ExecuteCommandList(&list);
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - where the command lines come from
+ * *  line - a line with a compound command that is not closed
+ * *  arena - where the joined lines go
+ * *
+ * * Exit:
+ * *  Returns the line with the lines after it joined on by new
+ * *  lines, up to the one that closes it.
+ * *  Returns NULL, if the input ends first.
+ * *
+ * * Purpose:
+ * *	Reads the rest of a function or a loop written over several
+ * *	lines, the way here-doc bodies are read. Comment lines in it
+ * *	are dropped.
+ * *
+ * ***************************************************************/
+char *ReadCompoundLines(struct InputReader *reader, char *line, struct Arena *arena)
+{
+	size_t length = strlen(line);
+	char *joined = ArenaCopy(arena, line);
+	char *next;
+
+	while ((joined != NULL) && (CompoundDepth(joined) > 0))
+	{
+		next = ReadHereDocLine(reader);
+		if (next == NULL)
+		{
+			printf("smallsh: syntax error: unexpected end of file\n");
+			return NULL;
+		}
+		if (next[strspn(next, " \t")] == '#')
+		{
+			continue;
+		}
+
+		size_t nextLength = strlen(next);
+		char *bigger = ArenaAlloc(arena, length + nextLength + 2);
+		if (bigger != NULL)
+		{
+			memcpy(bigger, joined, length);
+			bigger[length] = '\n';
+			memcpy(bigger + length + 1, next, nextLength + 1);
+			length += nextLength + 1;
+		}
+		joined = bigger;
+	}
+	if (joined == NULL)
+	{
+		printf("smallsh: out of memory\n");
+	}
+
+	return joined;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  list - the parsed command line
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Runs the pipelines of a command line in order. After "&&" a
+ * *	pipeline only runs if the status is 0, and after "||" only if
+ * *	it is not; one that is skipped is not expanded or started and
+ * *	leaves the status as it was, so "a && b || c" runs c when
+ * *	either a or b fails. A "return" in a function, or a "break" or
+ * *	"continue" in a loop, skips the rest.
+ * *
+ * ***************************************************************/
+void ExecuteCommandList(struct CommandList *list)
+{
+	int i;
+
+	for (i = 0; (i < list->count) && (!isReturning) && (loopJumps == 0); i++)
+	{
+		int joiner = (i > 0) ? list->operators[i - 1] : LIST_SEQUENCE;
+
+		if (((joiner == LIST_AND) && (statusNumber != 0)) || ((joiner == LIST_OR) && (statusNumber == 0)))
+		{
+			continue;
+		}
+		ExecutePipeline(&list->pipelines[i]);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  list - a parsed command line
+ * *  pgid - the process group to join, 0 to lead a new one, or
+ * *         -1 to stay in the shell's group
+ * *
+ * * Exit:
+ * *  Returns the pid of the child, which exits with the list's
+ * *  status.
+ * *  Returns -1, if it could not be started.
+ * *
+ * * Purpose:
+ * *	Runs a command list in a forked copy of the shell, the way sh
+ * *	runs a subshell, when its output is wanted somewhere else as a
+ * *	whole. Builtins like cd only change the copy. While a limited
+ * *	job is being started the copy takes the limits itself, and
+ * *	what it runs inherits them.
+ * *
+ * ***************************************************************/
+pid_t ForkCommandList(struct CommandList *list, pid_t pgid)
+{
+	pid_t listPid;
+	struct sigaction act;
+	sigset_t emptyMask;
+
+	long long traceStart = TRACE_START();
+	fflush(stdout);
+	listPid = fork();
+	if (listPid != 0)
+	{
+		TRACE(TRACE_FORK, traceStart, listPid, 0, "list");
+	}
+
+	if (listPid == 0)
+	{
+		if (pgid >= 0)
+		{
+			setpgid(0, pgid);
+		}
+
+		// The copy has no terminal to hand out and serves no clients
+		ResetJobTableInChild();
+		ApplyJobLimits();
+		isLaunchLimited = 0;
+		launchCgroup = NULL;
+		shellIsInteractive = 0;
+		serverEvents.fd = -1;
+
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGINT, &act, NULL);
+		sigaction(SIGTSTP, &act, NULL);
+		sigaction(SIGTTOU, &act, NULL);
+		sigemptyset(&emptyMask);
+		sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+		ExecuteCommandList(list);
+		fflush(stdout);
+		_exit(statusNumber);
+	}
+
+	return listPid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  compound - a parsed compound command
+ * *
+ * * Exit:
+ * *  Returns its status.
+ * *
+ * * Purpose:
+ * *	Runs a compound command. A function definition parses the body
+ * *	now, so a syntax error in it is reported where it is defined,
+ * *	and replaces any function of the same name.
+ * *
+ * ***************************************************************/
+int RunCompound(struct Compound *compound)
+{
+	if (compound->kind != COMPOUND_FUNCTION)
+	{
+		return RunLoop(compound);
+	}
+
+	struct Definition *function = NewDefinition(compound->name, strlen(compound->name), compound->body);
+
+	if (function == NULL)
+	{
+		printf("smallsh: out of memory\n");
+		return 1;
+	}
+	if (ParseDefinition(function, 0) < 0)
+	{
+		FreeDefinition(function);
+		return 2;
+	}
+	AddDefinition(&functionTable, function);
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - a parsed for, while or until loop
+ * *
+ * * Exit:
+ * *  Returns the status of the last command the body ran, or 0 if
+ * *  it never ran.
+ * *
+ * * Purpose:
+ * *	Runs a loop in the shell. A for loop's words are expanded once,
+ * *	with globs and "$@", and each one is put in the variable in
+ * *	turn. Every time around, the parsed test and body are copied
+ * *	into this depth's arena, which is reset first, and run, so a
+ * *	loop of any length reads and parses nothing and its memory
+ * *	stays the size of one pass. A foreground command ended by
+ * *	SIGINT ends the loop too.
+ * *
+ * ***************************************************************/
+int RunLoop(struct Compound *loop)
+{
+	struct CommandList copy;
+	char **words = NULL;
+	int wordCount = 0;
+	int status = 0;
+	int i;
+
+	// What the loop does can depend on the files and the commands it
+	//  runs, so no snapshot holds it
+	if (isLoadingRc)
+	{
+		isRcCacheable = 0;
+	}
+	if (loopNesting == MAX_LOOP_DEPTH)
+	{
+		printf("smallsh: maximum loop nesting level exceeded (%d)\n", MAX_LOOP_DEPTH);
+		return 1;
+	}
+
+	struct LoopFrame *frame = &loopFrames[loopNesting];
+	if (loop->kind == COMPOUND_FOR)
+	{
+		ArenaReset(&frame->words);
+		if (CopyCommandList(&loop->words, &copy, &frame->words) < 0)
+		{
+			printf("smallsh: out of memory\n");
+			return 1;
+		}
+		if (copy.count > 0)
+		{
+			substitutionStatus = 0;
+			if (ExpandPipeline(&copy.pipelines[0]) < 0)
+			{
+				return 1;
+			}
+			words = copy.pipelines[0].commands[0].argv;
+			wordCount = copy.pipelines[0].commands[0].argc;
+		}
+	}
+
+	loopNesting++;
+	loopDepth++;
+	for (i = 0; (loop->kind != COMPOUND_FOR) || (i < wordCount); i++)
+	{
+		int isFailed = 0;
+		int isDone = 0;
+
+		ArenaReset(&frame->body);
+		foregroundSignal = 0;
+		if (loop->kind == COMPOUND_FOR)
+		{
+			isFailed = (SetVariable(loop->name, strlen(loop->name), words[i], 0) < 0);
+		}
+		else
+		{
+			isFailed = (CopyCommandList(&loop->condition, &copy, &frame->body) < 0);
+			if (!isFailed)
+			{
+				ExecuteCommandList(&copy);
+				isDone = ((statusNumber == 0) != (loop->kind == COMPOUND_WHILE));
+			}
+		}
+		if ((!isFailed) && (!isDone) && (!isReturning) && (loopJumps == 0) && (foregroundSignal != SIGINT))
+		{
+			isFailed = (CopyCommandList(&loop->list, &copy, &frame->body) < 0);
+			if (!isFailed)
+			{
+				ExecuteCommandList(&copy);
+				status = statusNumber;
+			}
+		}
+		if (isFailed)
+		{
+			printf("smallsh: out of memory\n");
+			status = 1;
+			break;
+		}
+
+		// "break n" and "continue n" end the loops inside this one
+		//  first; the last one that continue leaves goes around again
+		if (loopJumps > 0)
+		{
+			loopJumps--;
+			if ((loopJumps > 0) || (!isContinuing))
+			{
+				break;
+			}
+			isContinuing = 0;
+			continue;
+		}
+		if ((isDone) || (isReturning) || (foregroundSignal == SIGINT))
+		{
+			break;
+		}
+	}
+	loopDepth--;
+	loopNesting--;
+
+	return status;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - a loop followed by "&"
+ * *
+ * * Exit:
+ * *  Returns 0, if it was started.
+ * *  Returns 1, if it could not be.
+ * *
+ * * Purpose:
+ * *	Starts a loop as a background job: a copy of the shell in its
+ * *	own process group runs it, and is reported like any other job
+ * *	when it is done.
+ * *
+ * ***************************************************************/
+int LaunchBackgroundLoop(struct Pipeline *pipeline)
+{
+	static const char *loopWords[] = { "function", "for", "while", "until" };
+	struct CommandList list;
+	char description[MAX_JOB_COMMAND];
+
+	list.pipelines = pipeline;
+	list.operators = "";
+	list.count = 1;
+
+	// The limits are taken by the copy, like the stages of any other
+	//  background job, so its cgroup counts the whole loop
+	char *cgroup = NULL;
+	if (jobLimitCount > 0)
+	{
+		cgroup = MakeJobCgroup();
+		isLaunchLimited = 1;
+		launchCgroup = cgroup;
+	}
+	pipeline->isBackground = 0;
+	RefreshEnvironment();
+	pid_t listPid = ForkCommandList(&list, 0);
+	pipeline->isBackground = 1;
+	isLaunchLimited = 0;
+	launchCgroup = NULL;
+	if (listPid < 0)
+	{
+		printf("smallsh: cannot start the loop: %s\n", strerror(errno));
+		if (cgroup != NULL)
+		{
+			rmdir(cgroup);
+			free(cgroup);
+		}
+		return 1;
+	}
+	setpgid(listPid, listPid);
+
+	snprintf(description, sizeof(description), "%s loop", loopWords[pipeline->compound->kind]);
+	int jobIndex = AddJob(&listPid, 1, listPid, description);
+	if (jobIndex < 0)
+	{
+		printf("smallsh: job table is full, pid %d is not tracked\n", (int)listPid);
+		free(cgroup);
+	}
+	else
+	{
+		jobs[jobIndex].cgroup = cgroup;
+		jobs[jobIndex].number = NextJobNumber();
+		currentJob = jobIndex;
+	}
+
+	printf("background pid is %d\n", (int)listPid);
+	lastBackgroundPid = listPid;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the function's name and its arguments
+ * *
+ * * Exit:
+ * *  Returns the status of the last command the body ran.
+ * *
+ * * Purpose:
+ * *	Runs a function. The parsed body is copied into the arena for
+ * *	this depth, since expanding a pipeline changes it, and the
+ * *	arguments become "$1" and on until it returns. A loop the call
+ * *	is in cannot be ended by a "break" in the body.
+ * *
+ * ***************************************************************/
+int CallFunction(int argc, char **argv)
+{
+	struct Definition *function = FindDefinition(&functionTable, argv[0]);
+	char **savedArgs = positionalArgs;
+	int savedCount = positionalCount;
+	const char *savedJoined = positionalJoined;
+	size_t savedJoinedLength = positionalJoinedLength;
+	int savedLoopDepth = loopDepth;
+	struct CommandList body;
+	size_t length = 0;
+	int i;
+
+	// It can have been unset since the pipeline was started
+	if (function == NULL)
+	{
+		printf("%s: no such file or directory\n", argv[0]);
+		return 127;
+	}
+	if ((!function->isParsed) && (ParseDefinition(function, 0) < 0))
+	{
+		return 2;
+	}
+	if (functionDepth == MAX_FUNCTION_DEPTH)
+	{
+		printf("smallsh: %s: maximum function nesting level exceeded (%d)\n", argv[0], MAX_FUNCTION_DEPTH);
+		return 1;
+	}
+
+	struct Arena *arena = &callArenas[functionDepth];
+	ArenaReset(arena);
+	for (i = 1; i < argc; i++)
+	{
+		length += strlen(argv[i]) + 1;
+	}
+	char *joined = ArenaAlloc(arena, length + 1);
+	if ((joined == NULL) || (CopyCommandList(&function->list, &body, arena) < 0))
+	{
+		printf("smallsh: out of memory\n");
+		return 1;
+	}
+	length = 0;
+	for (i = 1; i < argc; i++)
+	{
+		length += sprintf(joined + length, (i > 1) ? " %s" : "%s", argv[i]);
+	}
+	joined[length] = '\0';
+
+	positionalArgs = argv + 1;
+	positionalCount = argc - 1;
+	positionalJoined = joined;
+	positionalJoinedLength = length;
+	functionDepth++;
+	loopDepth = 0;
+
+	statusNumber = 0;
+	ExecuteCommandList(&body);
+
+	functionDepth--;
+	loopDepth = savedLoopDepth;
+	isReturning = 0;
+	positionalArgs = savedArgs;
+	positionalCount = savedCount;
+	positionalJoined = savedJoined;
+	positionalJoinedLength = savedJoinedLength;
+
+	return statusNumber;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  source - a parsed command list
+ * *  copy - the return variable for the copy
+ * *  arena - where the copy is allocated
+ * *
+ * * Exit:
+ * *  Returns 0, if it was copied.
+ * *  Returns -1, if there was no memory.
+ * *
+ * * Purpose:
+ * *	Copies the arrays of a parsed list that running it changes:
+ * *	the pipelines, their stages, argv and redirects. The words are
+ * *	shared, as expansion writes new ones instead of changing them.
+ * *
+ * ***************************************************************/
+int CopyCommandList(const struct CommandList *source, struct CommandList *copy, struct Arena *arena)
+{
+	int i;
+	int j;
+
+	copy->count = source->count;
+	copy->operators = source->operators;
+	copy->pipelines = ArenaAlloc(arena, (source->count + 1) * sizeof(struct Pipeline));
+	if (copy->pipelines == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < source->count; i++)
+	{
+		const struct Pipeline *from = &source->pipelines[i];
+		struct Pipeline *to = &copy->pipelines[i];
+
+		*to = *from;
+		to->arena = arena;
+		to->isExpanded = 0;
+		to->commands = ArenaAlloc(arena, from->count * sizeof(struct Command));
+		to->pids = ArenaAlloc(arena, (from->count + 1) * sizeof(pid_t));
+		if ((to->commands == NULL) || (to->pids == NULL))
+		{
+			return -1;
+		}
+
+		for (j = 0; j < from->count; j++)
+		{
+			const struct Command *fromCommand = &from->commands[j];
+			struct Command *toCommand = &to->commands[j];
+
+			toCommand->argc = fromCommand->argc;
+			toCommand->redirectCount = fromCommand->redirectCount;
+			toCommand->fanOut = fromCommand->fanOut;
+			toCommand->isUnordered = fromCommand->isUnordered;
+			toCommand->argv = ArenaAlloc(arena, (fromCommand->argc + 1) * sizeof(char *));
+			toCommand->redirects = ArenaAlloc(arena, (fromCommand->redirectCount + 1) * sizeof(struct Redirect));
+			if ((toCommand->argv == NULL) || (toCommand->redirects == NULL))
+			{
+				return -1;
+			}
+			memcpy(toCommand->argv, fromCommand->argv, fromCommand->argc * sizeof(char *));
+			toCommand->argv[fromCommand->argc] = NULL;
+			memcpy(toCommand->redirects, fromCommand->redirects, fromCommand->redirectCount * sizeof(struct Redirect));
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  table - the aliases or the functions
+ * *  name - the name to look up
+ * *
+ * * Exit:
+ * *  Returns the definition.
+ * *  Returns NULL, if there is none.
+ * *
+ * * Purpose:
+ * *	Looks a name up in a definition table.
+ * *
+ * ***************************************************************/
+struct Definition *FindDefinition(struct DefinitionTable *table, const char *name)
+{
+	struct Definition *definition;
+
+	if (table->count == 0)
+	{
+		return NULL;
+	}
+	for (definition = table->buckets[HashString(name) % DEFINITION_HASH_BUCKETS]; definition != NULL;
+		definition = definition->next)
+	{
+		if (strcmp(definition->name, name) == 0)
+		{
+			return definition;
+		}
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the name, not null terminated
+ * *  nameLength - the length of name
+ * *  text - the alias value or the function body
+ * *
+ * * Exit:
+ * *  Returns the new definition, not yet in a table.
+ * *  Returns NULL, if there was no memory.
+ * *
+ * * Purpose:
+ * *	Makes an alias or a function, with copies of its name and text.
+ * *
+ * ***************************************************************/
+struct Definition *NewDefinition(const char *name, size_t nameLength, const char *text)
+{
+	struct Definition *definition = calloc(1, sizeof(struct Definition));
+
+	if (definition == NULL)
+	{
+		return NULL;
+	}
+	definition->name = strndup(name, nameLength);
+	definition->text = strdup(text);
+	if ((definition->name == NULL) || (definition->text == NULL))
+	{
+		FreeDefinition(definition);
+		return NULL;
+	}
+
+	return definition;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  table - the aliases or the functions
+ * *  definition - the definition to add
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Puts a definition in a table, in place of any of the same name.
+ * *
+ * ***************************************************************/
+void AddDefinition(struct DefinitionTable *table, struct Definition *definition)
+{
+	unsigned int bucket = HashString(definition->name) % DEFINITION_HASH_BUCKETS;
+
+	RemoveDefinition(table, definition->name);
+	definition->next = table->buckets[bucket];
+	table->buckets[bucket] = definition;
+	table->count++;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  table - the aliases or the functions
+ * *  name - the definition to remove
+ * *
+ * * Exit:
+ * *  Returns 0, if it was removed.
+ * *  Returns -1, if there is none.
+ * *
+ * * Purpose:
+ * *	Takes a definition out of a table. It is only freed at the next
+ * *	prompt, as the body of a function that is running, or a line
+ * *	being run, can still be using it.
+ * *
+ * ***************************************************************/
+int RemoveDefinition(struct DefinitionTable *table, const char *name)
+{
+	struct Definition **link = &table->buckets[HashString(name) % DEFINITION_HASH_BUCKETS];
+
+	while (*link != NULL)
+	{
+		struct Definition *definition = *link;
+		if (strcmp(definition->name, name) == 0)
+		{
+			*link = definition->next;
+			table->count--;
+			definition->next = retiredDefinitions;
+			retiredDefinitions = definition;
+			return 0;
+		}
+		link = &definition->next;
+	}
+
+	return -1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  definition - an alias or a function
+ * *  isAlias - 1 if it is an alias
+ * *
+ * * Exit:
+ * *  Returns 0, if it was parsed.
+ * *  Returns -1, if it has a syntax error.
+ * *
+ * * Purpose:
+ * *	Parses the text of a definition into its own arena, once. An
+ * *	alias has to be one pipeline, which is spliced into each line
+ * *	that uses it; a command list needs a function. Aliases are not
+ * *	replaced in an alias value until it is used.
+ * *
+ * ***************************************************************/
+int ParseDefinition(struct Definition *definition, int isAlias)
+{
+	int savedAliasesOff = isAliasExpansionOff;
+	const char *problem = NULL;
+	int result;
+	int i;
+
+	char *copy = ArenaCopy(&definition->arena, definition->text);
+	if (copy == NULL)
+	{
+		printf("smallsh: out of memory\n");
+		return -1;
+	}
+	isAliasExpansionOff = isAlias;
+	result = ParseCommandList(copy, &definition->list, &definition->arena);
+	isAliasExpansionOff = savedAliasesOff;
+
+	for (i = 0; (result == 0) && (i < definition->list.count); i++)
+	{
+		if (definition->list.pipelines[i].hereDocCount > 0)
+		{
+			problem = "here-documents are not supported in definitions";
+		}
+	}
+	if ((result == 0) && (isAlias) && ((definition->list.count != 1) ||
+		(definition->list.pipelines[0].isBackground) || (definition->list.pipelines[0].compound != NULL)))
+	{
+		problem = (definition->list.count == 0) ? "the value is empty" :
+			"an alias can only be one pipeline; use a function for more";
+	}
+	if (problem != NULL)
+	{
+		printf("smallsh: %s%s: %s\n", (isAlias) ? "alias: " : "", definition->name, problem);
+		result = -1;
+	}
+
+	if (result < 0)
+	{
+		ArenaFree(&definition->arena);
+		return -1;
+	}
+	definition->isParsed = 1;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  definition - a definition that is in no table
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees a definition and its parsed list.
+ * *
+ * ***************************************************************/
+void FreeDefinition(struct Definition *definition)
+{
+	ArenaFree(&definition->arena);
+	FreeShellString(definition->name);
+	FreeShellString(definition->text);
+	free(definition);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees the definitions that were replaced or removed, once no
+ * *	function is running and no line is left that could use them.
+ * *
+ * ***************************************************************/
+void FreeRetiredDefinitions()
+{
+	if (functionDepth > 0)
+	{
+		return;
+	}
+	while (retiredDefinitions != NULL)
+	{
+		struct Definition *definition = retiredDefinitions;
+		retiredDefinitions = definition->next;
+		FreeDefinition(definition);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed command line
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Expands and runs one parsed command line and updates the
+ * *	status. A leading "time" reports the resources the command used
+ * *	on stderr.
+ * *
+ * ***************************************************************/
+void ExecutePipeline(struct Pipeline *pipeline)
+{
+	struct Command *first = &pipeline->commands[0];
+	struct CommandTiming timing;
+	struct rusage selfBefore;
+	struct timespec startTime;
+	int timeCommand = 0;
+	int assignments = 0;
+
+	// A loop in the background runs in a copy of the shell
+	if (pipeline->compound != NULL)
+	{
+		if ((pipeline->isBackground) && (!foreGroundOnly) && (pipeline->compound->kind != COMPOUND_FUNCTION))
+		{
+			statusNumber = LaunchBackgroundLoop(pipeline);
+		}
+		else
+		{
+			statusNumber = RunCompound(pipeline->compound);
+		}
+		return;
+	}
+
+	// Expand the words only now, so "$?" is the status of the command
+	//  before this one
+	if (!pipeline->isExpanded)
+	{
+		pipeline->isExpanded = 1;
+		substitutionStatus = 0;
+		if (ExpandPipeline(pipeline) < 0)
+		{
+			statusNumber = 1;
+			return;
+		}
+	}
+
+	// A command that expanded to nothing does nothing
+	if (first->argc == 0)
+	{
+		statusNumber = 0;
+		return;
+	}
+
+	while ((assignments < first->argc) && (AssignmentNameLength(first->argv[assignments]) > 0))
+	{
+		assignments++;
+	}
+	if ((isLoadingRc) && (!IsSnapshotCommand(pipeline, assignments)))
+	{
+		isRcCacheable = 0;
+	}
+	if (assignments > 0)
+	{
+		ExecuteAssignments(pipeline, assignments);
+		return;
+	}
+	RefreshEnvironment();
+
+	// "time" is a prefix on the whole command line
+	if (strcmp(first->argv[0], "time") == 0)
+	{
+		timeCommand = 1;
+		first->argv++;
+		first->argc--;
+		if (first->argc == 0)
+		{
+			if (pipeline->count > 1)
+			{
+				printf("smallsh: syntax error near unexpected token `|'\n");
+				return;
+			}
+			memset(&timing, 0, sizeof(timing));
+			PrintTiming(stderr, &timing);
+			return;
+		}
+	}
+
+	// Run built in commands in the shell itself. In a pipeline or in
+	//  the background they get a child process like anything else.
+	struct Builtin *builtin = NULL;
+	if ((pipeline->count == 1) && ((!pipeline->isBackground) || (foreGroundOnly)))
+	{
+		builtin = FindBuiltin(first->argv[0]);
+	}
+
+	// Every command except status and return clears the previous
+	//  status
+	if ((builtin == NULL) || ((builtin->func != BuiltinStatus) && (builtin->func != BuiltinReturn)))
+	{
+		strncpy(errMsg, "", MAX_ERR_MSG_LENGTH);
+		statusNumber = 0;
+	}
+
+	// Check if we are doing a background process
+	if ((pipeline->isBackground) && (foreGroundOnly))
+	{
+		pipeline->isBackground = 0;
+	}
+	if (pipeline->isBackground)
+	{
+		RunBackGroundCommand(pipeline);
+		return;
+	}
+
+	memset(&timing, 0, sizeof(timing));
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	if (builtin != NULL)
+	{
+		// A builtin's resources are the shell's own, over its run
+		getrusage(RUSAGE_SELF, &selfBefore);
+		statusNumber = RunBuiltinInShell(builtin, first);
+		getrusage(RUSAGE_SELF, &timing.usage);
+		SubtractUsage(&timing.usage, &selfBefore);
+	}
+	else
+	{
+		// Run the foreground command	
+		statusNumber = RunForeGroundCommand(pipeline, errMsg, &timing.usage);
+	}
+
+	ElapsedSince(&startTime, &timing.wallTime);
+
+	if (timeCommand)
+	{
+		PrintTiming(stderr, &timing);
+	}
+
+	// status -v describes the command before it, not itself
+	if ((builtin == NULL) || (builtin->func != BuiltinStatus))
+	{
+		lastTiming = timing;
+		hasLastTiming = 1;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed and expanded command line
+ * *  assignments - how many NAME=value words start the first stage
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Handles the assignments at the start of a command line. On
+ * *	their own they set shell variables. Before a command they are
+ * *	exported for that command only, and put back once it has
+ * *	started, or finished if it runs in the foreground.
+ * *
+ * ***************************************************************/
+void ExecuteAssignments(struct Pipeline *pipeline, int assignments)
+{
+	struct Command *first = &pipeline->commands[0];
+	int i;
+
+	if ((assignments == first->argc) && (pipeline->count == 1))
+	{
+		for (i = 0; i < assignments; i++)
+		{
+			size_t nameLength = AssignmentNameLength(first->argv[i]);
+			SetVariable(first->argv[i], nameLength, first->argv[i] + nameLength + 1, 0);
+		}
+		RefreshEnvironment();
+		strncpy(errMsg, "", MAX_ERR_MSG_LENGTH);
+		statusNumber = substitutionStatus;
+		return;
+	}
+
+	// Remember what each variable was so it can be put back
+	char **oldValues = ArenaAlloc(pipeline->arena, assignments * sizeof(char *));
+	int *oldExported = ArenaAlloc(pipeline->arena, assignments * sizeof(int));
+	if ((oldValues == NULL) || (oldExported == NULL))
+	{
+		printf("smallsh: out of memory\n");
+		return;
+	}
+	for (i = 0; i < assignments; i++)
+	{
+		size_t nameLength = AssignmentNameLength(first->argv[i]);
+		struct Variable *variable = FindVariable(first->argv[i], nameLength);
+		oldValues[i] = NULL;
+		oldExported[i] = 0;
+		if (variable != NULL)
+		{
+			const char *value = variable->entry + nameLength + 1;
+			oldValues[i] = ArenaAlloc(pipeline->arena, strlen(value) + 1);
+			if (oldValues[i] != NULL)
+			{
+				strcpy(oldValues[i], value);
+			}
+			oldExported[i] = variable->isExported;
+		}
+		SetVariable(first->argv[i], nameLength, first->argv[i] + nameLength + 1, 1);
+	}
+
+	char **words = first->argv;
+	first->argv += assignments;
+	first->argc -= assignments;
+	ExecutePipeline(pipeline);
+
+	// Put the variables back, the last assignment first
+	for (i = assignments - 1; i >= 0; i--)
+	{
+		char *name = words[i];
+		size_t nameLength = AssignmentNameLength(name);
+		if (oldValues[i] == NULL)
+		{
+			name[nameLength] = '\0';
+			UnsetVariable(name);
+			name[nameLength] = '=';
+		}
+		else
+		{
+			struct Variable *variable;
+			SetVariable(name, nameLength, oldValues[i], 0);
+			variable = FindVariable(name, nameLength);
+			variable->isExported = oldExported[i];
+		}
+	}
+	environmentDirty = 1;
+	RefreshEnvironment();
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed command line
+ * *
+ * * Exit:
+ * *  Returns 0, if every word was expanded.
+ * *  Returns -1, on a bad substitution.
+ * *
+ * * Purpose:
+ * *	Expands "$$", "$?", "$!", "$VAR", "${VAR}" and "$(command)"
+ * *	and removes the quotes in every argument, redirect target and
+ * *	here-doc body. The first pass only measures, so all the
+ * *	expanded words are written into one allocation from the line's
+ * *	arena in a second pass. Words with nothing to expand keep
+ * *	pointing into the line. An unquoted word that expands to
+ * *	nothing is dropped, as it is in sh. The result of an expansion
+ * *	is not split into words, except that a word that is just "$@"
+ * *	becomes one word per positional parameter.
+ * *
+ * ***************************************************************/
+int ExpandPipeline(struct Pipeline *pipeline)
+{
+	size_t total = 0;
+	size_t length;
+	char *buffer;
+	int spreads = 0;
+	int i;
+	int j;
+	int k;
+
+	substitutions = NULL;
+	substitutionArena = pipeline->arena;
+
+	// Measure everything that needs expanding
+	for (i = 0; i < pipeline->count; i++)
+	{
+		struct Command *command = &pipeline->commands[i];
+		for (j = 0; j < command->argc; j++)
+		{
+			if (IsSpreadWord(command->argv[j]))
+			{
+				spreads++;
+			}
+			else if (strpbrk(command->argv[j], EXPAND_SPECIAL) != NULL)
+			{
+				int mode = (IsGlobWord(command->argv[j])) ? EXPAND_PATTERN : EXPAND_WORD;
+				length = ExpandText(command->argv[j], mode, NULL);
+				if (length == (size_t)-1)
+				{
+					return -1;
+				}
+				total += length + 1;
+			}
+		}
+		for (j = 0; j < command->redirectCount; j++)
+		{
+			struct Redirect *redirect = &command->redirects[j];
+			int mode = ExpandModeFor(redirect);
+			if ((mode >= 0) && (strpbrk(redirect->target, EXPAND_SPECIAL) != NULL))
+			{
+				length = ExpandText(redirect->target, mode, NULL);
+				if (length == (size_t)-1)
+				{
+					return -1;
+				}
+				total += length + 1;
+			}
+		}
+	}
+
+	if ((total == 0) && (spreads == 0))
+	{
+		return 0;
+	}
+	buffer = ArenaAlloc(pipeline->arena, total + 1);
+	if (buffer == NULL)
+	{
+		printf("smallsh: out of memory\n");
+		return -1;
+	}
+
+	// Write each expanded word and point the command at it
+	for (i = 0; i < pipeline->count; i++)
+	{
+		struct Command *command = &pipeline->commands[i];
+		char **argv = command->argv;
+		int capacity = command->argc;
+		char *isPattern = NULL;
+		int kept = 0;
+
+		// A "$@" can add words, so those commands get a new array
+		if (spreads > 0)
+		{
+			int spreadCount = 0;
+			for (j = 0; j < command->argc; j++)
+			{
+				spreadCount += IsSpreadWord(command->argv[j]);
+			}
+			if (spreadCount > 0)
+			{
+				capacity += spreadCount * positionalCount;
+				argv = ArenaAlloc(pipeline->arena, (capacity + 1) * sizeof(char *));
+				if (argv == NULL)
+				{
+					printf("smallsh: out of memory\n");
+					return -1;
+				}
+			}
+		}
+
+		for (j = 0; j < command->argc; j++)
+		{
+			char *word = command->argv[j];
+			if ((spreads > 0) && (IsSpreadWord(word)))
+			{
+				for (k = 0; k < positionalCount; k++)
+				{
+					argv[kept] = positionalArgs[k];
+					kept++;
+				}
+				continue;
+			}
+			if (strpbrk(word, EXPAND_SPECIAL) != NULL)
+			{
+				int mode = EXPAND_WORD;
+				if (IsGlobWord(word))
+				{
+					mode = EXPAND_PATTERN;
+					if ((isPattern == NULL) && ((isPattern = ArenaAlloc(pipeline->arena, capacity)) != NULL))
+					{
+						memset(isPattern, 0, capacity);
+					}
+					if (isPattern != NULL)
+					{
+						isPattern[kept] = 1;
+					}
+				}
+				length = ExpandText(word, mode, buffer);
+				buffer[length] = '\0';
+
+				// Quotes make an empty word on purpose; keep those
+				if ((length == 0) && (strpbrk(word, "'\"") == NULL))
+				{
+					buffer++;
+					continue;
+				}
+				word = buffer;
+				buffer += length + 1;
+			}
+			argv[kept] = word;
+			kept++;
+		}
+		argv[kept] = NULL;
+		command->argv = argv;
+		command->argc = kept;
+		if ((isPattern != NULL) && (GlobCommand(pipeline, command, isPattern) < 0))
+		{
+			return -1;
+		}
+
+		for (j = 0; j < command->redirectCount; j++)
+		{
+			struct Redirect *redirect = &command->redirects[j];
+			int mode = ExpandModeFor(redirect);
+			if ((mode >= 0) && (strpbrk(redirect->target, EXPAND_SPECIAL) != NULL))
+			{
+				length = ExpandText(redirect->target, mode, buffer);
+				buffer[length] = '\0';
+				redirect->target = buffer;
+				buffer += length + 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  word - an argument as it was parsed
+ * *
+ * * Exit:
+ * *  Returns 1, if it is just $@ or "$@".
+ * *  Returns 0, if not.
+ * *
+ * * Purpose:
+ * *	Finds the words that expand to one word per positional
+ * *	parameter instead of to a single word.
+ * *
+ * ***************************************************************/
+int IsSpreadWord(const char *word)
+{
+	return (strcmp(word, "$@") == 0) || (strcmp(word, "\"$@\"") == 0);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  redirect - a parsed redirect
+ * *
+ * * Exit:
+ * *  Returns the expansion mode for its target.
+ * *  Returns -1, if the target is not expanded.
+ * *
+ * * Purpose:
+ * *	Picks how a redirect's target is expanded. A here-doc body is
+ * *	expanded unless its delimiter was quoted, and descriptor numbers
+ * *	are never expanded.
+ * *
+ * ***************************************************************/
+int ExpandModeFor(const struct Redirect *redirect)
+{
+	if (redirect->kind == REDIRECT_DUP)
+	{
+		return -1;
+	}
+	if (redirect->kind == REDIRECT_HEREDOC)
+	{
+		return (redirect->isQuoted) ? -1 : EXPAND_HEREDOC;
+	}
+
+	return EXPAND_WORD;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - the text to expand
+ * *  mode - EXPAND_WORD for a word, EXPAND_PATTERN for a word that
+ * *         is matched against file names, EXPAND_HEREDOC for a
+ * *         here-doc body, where quotes are plain text, or
+ * *         EXPAND_QUOTES to only remove quotes
+ * *  out - where to write the result, or NULL to only measure it
+ * *
+ * * Exit:
+ * *  Returns the length of the expanded text.
+ * *  Returns (size_t)-1, on a bad substitution.
+ * *
+ * * Purpose:
+ * *	Expands one word. Single quotes keep everything in them as it
+ * *	is, double quotes keep all but "$" and a backslash before
+ * *	"$", "\"", "\\" or "`", and outside quotes a backslash keeps the
+ * *	next character as it is. For a pattern, the quoted pattern
+ * *	characters get a backslash, so they only match themselves.
+ * *
+ * ***************************************************************/
+size_t ExpandText(const char *text, int mode, char *out)
+{
+	size_t length = 0;
+	int inDouble = 0;
+	int isWord = (mode == EXPAND_WORD) || (mode == EXPAND_PATTERN);
+	int isPattern = (mode == EXPAND_PATTERN);
+	const char *current = text;
+
+	while (*current != '\0')
+	{
+		char c = *current;
+
+		if ((c == '\'') && (!inDouble) && (mode != EXPAND_HEREDOC))
+		{
+			const char *close = strchr(current + 1, '\'');
+			length = CopyExpanded(out, length, current + 1, close - (current + 1), isPattern);
+			current = close + 1;
+			continue;
+		}
+		if ((c == '"') && (mode != EXPAND_HEREDOC))
+		{
+			inDouble = !inDouble;
+			current++;
+			continue;
+		}
+		if ((c == '\\') && (current[1] != '\0'))
+		{
+			// In double quotes and here-docs only a few characters can
+			//  be escaped; before anything else the backslash stays
+			if (((!inDouble) && (isWord)) || (strchr("$\"\\`", current[1]) != NULL))
+			{
+				if ((mode == EXPAND_HEREDOC) && (current[1] == '"'))
+				{
+					c = '\\';
+				}
+				else
+				{
+					current++;
+					c = *current;
+				}
+			}
+			length = CopyExpanded(out, length, &c, 1, isPattern);
+			current++;
+			continue;
+		}
+		if ((c == '$') && (mode != EXPAND_QUOTES))
+		{
+			const char *value;
+			size_t valueLength;
+			size_t used = LookupExpansion(current, &value, &valueLength);
+			if (used == (size_t)-1)
+			{
+				printf("smallsh: %s: bad substitution\n", text);
+				return (size_t)-1;
+			}
+			if (used > 0)
+			{
+				length = CopyExpanded(out, length, value, valueLength, isPattern && inDouble);
+				current += used;
+				continue;
+			}
+		}
+
+		length = CopyExpanded(out, length, &c, 1, isPattern && inDouble);
+		current++;
+	}
+
+	return length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  out - where the expansion is written, or NULL to only measure
+ * *  length - how much has been written so far
+ * *  text - the text to add
+ * *  count - how long it is
+ * *  escape - 1 to put a backslash before each pattern character
+ * *
+ * * Exit:
+ * *  Returns the new length.
+ * *
+ * * Purpose:
+ * *	Adds a piece of text to an expansion.
+ * *
+ * ***************************************************************/
+size_t CopyExpanded(char *out, size_t length, const char *text, size_t count, int escape)
+{
+	size_t i;
+
+	if (!escape)
+	{
+		if (out != NULL)
+		{
+			memcpy(out + length, text, count);
+		}
+		return length + count;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (strchr("*?[]\\", text[i]) != NULL)
+		{
+			if (out != NULL)
+			{
+				out[length] = '\\';
+			}
+			length++;
+		}
+		if (out != NULL)
+		{
+			out[length] = text[i];
+		}
+		length++;
+	}
+
+	return length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - text starting with "$"
+ * *  value - the return variable for the value
+ * *  valueLength - the return variable for its length
+ * *
+ * * Exit:
+ * *  Returns how many characters of text the reference used.
+ * *  Returns 0, if the "$" does not start a reference.
+ * *  Returns (size_t)-1, if "${" is not closed or holds no name.
+ * *
+ * * Purpose:
+ * *	Finds the value of one "$" reference. Unset variables are
+ * *	empty. The numbers are written to a small static buffer that
+ * *	holds them until the next call. A "$(" runs the command the
+ * *	first time it is looked up.
+ * *
+ * ***************************************************************/
+size_t LookupExpansion(const char *text, const char **value, size_t *valueLength)
+{
+	static char number[24];
+	size_t nameLength;
+	size_t used;
+	const char *name;
+
+	switch (text[1])
+	{
+		case '$':
+			// No snapshot of the rc file can hold a pid
+			isRcCacheable = 0;
+			*valueLength = snprintf(number, sizeof(number), "%d", (int)shellPid);
+			*value = number;
+			return 2;
+		case '?':
+			*valueLength = snprintf(number, sizeof(number), "%d", statusNumber);
+			*value = number;
+			return 2;
+		case '!':
+			isRcCacheable = 0;
+			*valueLength = (lastBackgroundPid > 0) ?
+				(size_t)snprintf(number, sizeof(number), "%d", (int)lastBackgroundPid) : 0;
+			*value = number;
+			return 2;
+		case '(':
+			return LookupSubstitution(text, value, valueLength);
+		case '#':
+			*valueLength = snprintf(number, sizeof(number), "%d", positionalCount);
+			*value = number;
+			return 2;
+		case '@':
+		case '*':
+			*value = positionalJoined;
+			*valueLength = positionalJoinedLength;
+			return 2;
+		case '{':
+			if (isdigit((unsigned char)text[2]))
+			{
+				used = 2 + strspn(text + 2, "0123456789");
+				if (text[used] != '}')
+				{
+					return (size_t)-1;
+				}
+				*value = LookupPositional(atoi(text + 2));
+				*valueLength = strlen(*value);
+				return used + 1;
+			}
+			name = text + 2;
+			nameLength = VariableNameLength(name);
+			if ((nameLength == 0) || (name[nameLength] != '}'))
+			{
+				return (size_t)-1;
+			}
+			used = nameLength + 3;
+			break;
+		default:
+			if ((text[1] >= '1') && (text[1] <= '9'))
+			{
+				*value = LookupPositional(text[1] - '0');
+				*valueLength = strlen(*value);
+				return 2;
+			}
+			name = text + 1;
+			nameLength = VariableNameLength(name);
+			if (nameLength == 0)
+			{
+				return 0;
+			}
+			used = nameLength + 1;
+			break;
+	}
+
+	struct Variable *variable = FindVariable(name, nameLength);
+	if (variable == NULL)
+	{
+		*value = "";
+		*valueLength = 0;
+	}
+	else
+	{
+		*value = variable->entry + nameLength + 1;
+		*valueLength = strlen(*value);
+	}
+
+	return used;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  index - the number of a positional parameter, from 1
+ * *
+ * * Exit:
+ * *  Returns its value, or "" if there are not that many.
+ * *
+ * * Purpose:
+ * *	Finds "$1" and on: the arguments of the function that is
+ * *	running, or of the script.
+ * *
+ * ***************************************************************/
+const char *LookupPositional(int index)
+{
+	return ((index >= 1) && (index <= positionalCount)) ? positionalArgs[index - 1] : "";
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - text starting with "$("
+ * *  value - the return variable for the command's output
+ * *  valueLength - the return variable for its length
+ * *
+ * * Exit:
+ * *  Returns how many characters of text the substitution used.
+ * *  Returns 0, if it is not being expanded for a line.
+ * *
+ * * Purpose:
+ * *	Finds the output of a "$(...)", running the command if this
+ * *	is the first time the line's expansion has come to it.
+ * *
+ * ***************************************************************/
+size_t LookupSubstitution(const char *text, const char **value, size_t *valueLength)
+{
+	struct Substitution *substitution;
+	const char *close = FindClosingParen((char *)text);
+
+	if ((close == NULL) || (substitutionArena == NULL))
+	{
+		return 0;
+	}
+
+	for (substitution = substitutions; substitution != NULL; substitution = substitution->next)
+	{
+		if (substitution->text == text)
+		{
+			break;
+		}
+	}
+	if (substitution == NULL)
+	{
+		substitution = ArenaAlloc(substitutionArena, sizeof(struct Substitution));
+		if (substitution == NULL)
+		{
+			return (size_t)-1;
+		}
+		substitution->text = text;
+		RunSubstitution(substitution, close - (text + 2));
+		substitution->next = substitutions;
+		substitutions = substitution;
+	}
+
+	*value = substitution->output;
+	*valueLength = substitution->length;
+
+	return (close + 1) - text;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  substitution - a "$(...)" to run, whose text is set
+ * *  length - how long the command between the parentheses is
+ * *
+ * * Exit:
+ * *  Returns the status of the command.
+ * *
+ * * Purpose:
+ * *	Runs the command in a "$(...)" and keeps its output, without
+ * *	the newlines at the end, in the line's arena. A builtin that
+ * *	only prints runs in the shell with its output captured, so
+ * *	"$(pwd)" costs no fork. Anything else runs like a foreground
+ * *	command with its stdout on a pipe.
+ * *
+ * ***************************************************************/
+int RunSubstitution(struct Substitution *substitution, size_t length)
+{
+	struct Substitution *savedList = substitutions;
+	struct Arena *arena = substitutionArena;
+	struct CommandList inner;
+	char *line = ArenaAlloc(arena, length + 1);
+	int status = 0;
+
+	// What a command prints can change from run to run, so an rc
+	//  file that uses it is not kept in a snapshot
+	isRcCacheable = 0;
+	substitution->output = "";
+	substitution->length = 0;
+	if (line == NULL)
+	{
+		return 1;
+	}
+	memcpy(line, substitution->text + 2, length);
+	line[length] = '\0';
+
+	// The inner line is expanded on its own, so save where the outer
+	//  one keeps its substitutions
+	struct Pipeline *first;
+	int i;
+
+	if (ParseCommandList(line, &inner, arena) < 0)
+	{
+		status = 2;
+		inner.count = 0;
+	}
+	for (i = 0; i < inner.count; i++)
+	{
+		if (inner.pipelines[i].hereDocCount > 0)
+		{
+			printf("smallsh: here-documents are not supported in command substitution\n");
+			status = 2;
+			inner.count = 0;
+		}
+	}
+
+	// A list or a loop runs in a copy of the shell, which expands
+	//  each part as it gets to it
+	first = inner.pipelines;
+	if ((inner.count > 1) || ((inner.count == 1) && (first->compound != NULL)))
+	{
+		status = CaptureCommand(&inner, substitution);
+	}
+	else if ((inner.count == 1) && (ExpandPipeline(first) < 0))
+	{
+		status = 1;
+	}
+	else if ((inner.count == 1) && (first->commands[0].argc > 0))
+	{
+		struct Builtin *builtin = FindBuiltin(first->commands[0].argv[0]);
+		if ((first->count == 1) && (!first->isBackground) && (IsInlineBuiltin(builtin)))
+		{
+			status = CaptureBuiltin(builtin, &first->commands[0], substitution);
+		}
+		else
+		{
+			status = CaptureCommand(&inner, substitution);
+		}
+	}
+	substitutions = savedList;
+	substitutionArena = arena;
+
+	// Newlines at the end are dropped, as they are in sh
+	while ((substitution->length > 0) && (substitution->output[substitution->length - 1] == '\n'))
+	{
+		substitution->length--;
+	}
+
+	substitutionStatus = status;
+	return status;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  builtin - a builtin IsInlineBuiltin allows
+ * *  command - the command to run
+ * *  substitution - where its output goes
+ * *
+ * * Exit:
+ * *  Returns the status of the builtin.
+ * *
+ * * Purpose:
+ * *	Runs a builtin in the shell with stdout on a memory file and
+ * *	copies what it printed into the line's arena. Each capture
+ * *	starts at the end of the file and cuts it back afterwards.
+ * *
+ * ***************************************************************/
+int CaptureBuiltin(struct Builtin *builtin, struct Command *command, struct Substitution *substitution)
+{
+	if (substitutionCapture < 0)
+	{
+		substitutionCapture = memfd_create("smallsh-substitution", MFD_CLOEXEC);
+		if (substitutionCapture < 0)
+		{
+			substitutionCapture = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		}
+		if (substitutionCapture < 0)
+		{
+			printf("smallsh: cannot make a capture file: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	fflush(stdout);
+	int savedFd = fcntl(1, F_DUPFD_CLOEXEC, 10);
+	off_t start = lseek(substitutionCapture, 0, SEEK_END);
+	if ((savedFd < 0) || (start < 0) || (dup2(substitutionCapture, 1) < 0))
+	{
+		if (savedFd >= 0)
+		{
+			close(savedFd);
+		}
+		return 1;
+	}
+
+	int status = RunBuiltinInShell(builtin, command);
+	fflush(stdout);
+	dup2(savedFd, 1);
+	close(savedFd);
+
+	off_t end = lseek(substitutionCapture, 0, SEEK_CUR);
+	size_t length = (end > start) ? (size_t)(end - start) : 0;
+	char *output = (length > 0) ? ArenaAlloc(substitutionArena, length) : NULL;
+	if ((output != NULL) && (pread(substitutionCapture, output, length, start) == (ssize_t)length))
+	{
+		substitution->output = output;
+		substitution->length = length;
+	}
+	ftruncate(substitutionCapture, start);
+	lseek(substitutionCapture, start, SEEK_SET);
+
+	return status;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  list - the parsed command line in the "$(...)". A single
+ * *         pipeline has been expanded.
+ * *  substitution - where its output goes
+ * *
+ * * Exit:
+ * *  Returns the status of the last stage.
+ * *
+ * * Purpose:
+ * *	Runs a command with stdout on a pipe, reads the pipe to the
+ * *	end and waits for every stage. A list of pipelines, or a
+ * *	loop, runs in a copy of the shell. The processes stay in the
+ * *	shell's process group: ^Z belongs to the shell while it
+ * *	expands a line, so a process that is stopped is continued.
+ * *
+ * ***************************************************************/
+int CaptureCommand(struct CommandList *list, struct Substitution *substitution)
+{
+	struct Pipeline *pipeline = &list->pipelines[0];
+	int outputPipe[2];
+	sigset_t childMask;
+	sigset_t oldMask;
+	int status = 0;
+	size_t length = 0;
+	pid_t *pids = pipeline->pids;
+	int pidCount;
+	int lastStage;
+	pid_t listPid;
+	int i;
+
+	if (pipe2(outputPipe, O_CLOEXEC) < 0)
+	{
+		printf("smallsh: cannot make the output pipe: %s\n", strerror(errno));
+		return 1;
+	}
+
+	fflush(stdout);
+	int savedFd = fcntl(1, F_DUPFD_CLOEXEC, 10);
+	dup2(outputPipe[1], 1);
+	close(outputPipe[1]);
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	RefreshEnvironment();
+	if ((list->count > 1) || (pipeline->compound != NULL))
+	{
+		listPid = ForkCommandList(list, -1);
+		pids = &listPid;
+		pidCount = 1;
+		lastStage = 0;
+	}
+	else
+	{
+		pipeline->isSubstitution = 1;
+		LaunchPipeline(pipeline, 1, pids);
+		pidCount = pipeline->pidCount;
+		lastStage = pipeline->count - 1;
+	}
+	fflush(stdout);
+	dup2(savedFd, 1);
+	close(savedFd);
+
+	while (1)
+	{
+		if (length == substitutionCapacity)
+		{
+			size_t capacity = (substitutionCapacity == 0) ? 4096 : substitutionCapacity * 2;
+			char *bigger = realloc(substitutionBuffer, capacity);
+			if (bigger == NULL)
+			{
+				break;
+			}
+			substitutionBuffer = bigger;
+			substitutionCapacity = capacity;
+		}
+		ssize_t bytesRead = read(outputPipe[0], substitutionBuffer + length, substitutionCapacity - length);
+		if ((bytesRead < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+		if (bytesRead <= 0)
+		{
+			break;
+		}
+		length += bytesRead;
+	}
+	close(outputPipe[0]);
+
+	for (i = 0; i < pidCount; i++)
+	{
+		int stageStatus = 0;
+		if (pids[i] <= 0)
+		{
+			continue;
+		}
+		while (1)
+		{
+			if (waitpid(pids[i], &stageStatus, WUNTRACED) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				break;
+			}
+			if (!WIFSTOPPED(stageStatus))
+			{
+				break;
+			}
+			kill(pids[i], SIGCONT);
+		}
+		if (i == lastStage)
+		{
+			status = (WIFSIGNALED(stageStatus)) ? 128 + WTERMSIG(stageStatus) : WEXITSTATUS(stageStatus);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	if (pids[lastStage] < 0)
+	{
+		status = 127;
+	}
+
+	char *output = (length > 0) ? ArenaAlloc(substitutionArena, length) : NULL;
+	if (output != NULL)
+	{
+		memcpy(output, substitutionBuffer, length);
+		substitution->output = output;
+		substitution->length = length;
+	}
+
+	return status;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  word - a word as it was typed
+ * *
+ * * Exit:
+ * *  Returns 1, if the word has a "*", "?" or "[" outside quotes.
+ * *  Returns 0, otherwise.
+ * *
+ * * Purpose:
+ * *	Decides if a word is a pattern to match against file names.
+ * *
+ * ***************************************************************/
+int IsGlobWord(const char *word)
+{
+	const char *current = word;
+
+	while (*current != '\0')
+	{
+		if (*current == '\'')
+		{
+			current = strchr(current + 1, '\'');
+		}
+		else if (*current == '"')
+		{
+			current = FindClosingQuote((char *)current);
+		}
+		else if ((*current == '$') && (current[1] == '('))
+		{
+			current = FindClosingParen((char *)current);
+		}
+		else if (*current == '\\')
+		{
+			current++;
+		}
+		else if (strchr("*?[", *current) != NULL)
+		{
+			return 1;
+		}
+		if ((current == NULL) || (*current == '\0'))
+		{
+			break;
+		}
+		current++;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the line the command belongs to
+ * *  command - a command whose words have been expanded
+ * *  isPattern - 1 for each word that is a pattern
+ * *
+ * * Exit:
+ * *  Returns 0, if the patterns were matched.
+ * *  Returns -1, if out of memory.
+ * *
+ * * Purpose:
+ * *	Replaces each pattern with the names it matches, in sorted
+ * *	order. A pattern that matches nothing stays as it was typed,
+ * *	as it does in sh.
+ * *
+ * ***************************************************************/
+int GlobCommand(struct Pipeline *pipeline, struct Command *command, const char *isPattern)
+{
+	struct GlobState state;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	state.arena = pipeline->arena;
+
+	for (i = 0; i < command->argc; i++)
+	{
+		size_t before = state.matchCount;
+		if (isPattern[i])
+		{
+			GlobPath(&state, 0, command->argv[i]);
+			if (state.matchCount > before)
+			{
+				continue;
+			}
+			UnescapePattern(command->argv[i]);
+		}
+		if (AddGlobMatch(&state, command->argv[i]) < 0)
+		{
+			state.isOutOfMemory = 1;
+		}
+	}
+
+	char **argv = ArenaAlloc(pipeline->arena, (state.matchCount + 1) * sizeof(char *));
+	if ((argv == NULL) || (state.isOutOfMemory))
+	{
+		free(state.matches);
+		printf("smallsh: out of memory expanding file names\n");
+		return -1;
+	}
+	if (state.matchCount > 0)
+	{
+		memcpy(argv, state.matches, state.matchCount * sizeof(char *));
+	}
+	argv[state.matchCount] = NULL;
+	command->argv = argv;
+	command->argc = state.matchCount;
+
+	free(state.matches);
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  state - the matches so far and the path being built
+ * *  pathLength - how much of state->path is already matched
+ * *  pattern - the rest of the pattern
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Matches a pattern one path component at a time. A component
+ * *	with no pattern characters is used as it is. Any other one is
+ * *	matched against the cached listing of the directory so far,
+ * *	and each match that can lead on is followed.
+ * *
+ * ***************************************************************/
+void GlobPath(struct GlobState *state, size_t pathLength, const char *pattern)
+{
+	char component[NAME_MAX + 1];
+	const char *end;
+	size_t componentLength;
+	size_t i;
+
+	while (*pattern == '/')
+	{
+		if (pathLength + 1 >= sizeof(state->path))
+		{
+			return;
+		}
+		state->path[pathLength] = '/';
+		pathLength++;
+		pattern++;
+	}
+	state->path[pathLength] = '\0';
+
+	// A pattern that ends in "/" only matches directories
+	if (*pattern == '\0')
+	{
+		struct stat info;
+		if ((stat(state->path, &info) == 0) && (S_ISDIR(info.st_mode)))
+		{
+			AddGlobMatch(state, state->path);
+		}
+		return;
+	}
+
+	end = strchr(pattern, '/');
+	if (end == NULL)
+	{
+		end = pattern + strlen(pattern);
+	}
+	componentLength = end - pattern;
+	if ((componentLength > NAME_MAX) || (pathLength + componentLength + 1 >= sizeof(state->path)))
+	{
+		return;
+	}
+	memcpy(component, pattern, componentLength);
+	component[componentLength] = '\0';
+
+	if (!IsGlobPattern(component))
+	{
+		UnescapePattern(component);
+		strcpy(state->path + pathLength, component);
+		if (*end != '\0')
+		{
+			GlobPath(state, pathLength + strlen(component), end);
+		}
+		else
+		{
+			struct stat info;
+			if (lstat(state->path, &info) == 0)
+			{
+				AddGlobMatch(state, state->path);
+			}
+		}
+		return;
+	}
+
+	struct DirectoryListing *listing = GetDirectoryListing((pathLength > 0) ? state->path : ".");
+	if (listing == NULL)
+	{
+		return;
+	}
+
+	// The names are sorted, so a literal start to the pattern narrows
+	//  the search to one run of them
+	size_t prefixLength = strcspn(component, "*?[\\");
+	size_t first = 0;
+	size_t last = listing->count;
+	while (first < last)
+	{
+		size_t middle = first + ((last - first) / 2);
+		if (strncmp(listing->entries[middle].name, component, prefixLength) < 0)
+		{
+			first = middle + 1;
+		}
+		else
+		{
+			last = middle;
+		}
+	}
+
+	// "prefix*suffix" is the common case and needs no fnmatch
+	const char *suffix = NULL;
+	size_t suffixLength = 0;
+	if ((component[prefixLength] == '*') && (strpbrk(component + prefixLength + 1, "*?[\\") == NULL))
+	{
+		suffix = component + prefixLength + 1;
+		suffixLength = strlen(suffix);
+	}
+
+	listing->pinCount++;
+	for (i = first; i < listing->count; i++)
+	{
+		const struct DirectoryEntry *entry = &listing->entries[i];
+		if (strncmp(entry->name, component, prefixLength) != 0)
+		{
+			break;
+		}
+
+		size_t nameLength = strlen(entry->name);
+		if ((strcmp(entry->name, ".") == 0) || (strcmp(entry->name, "..") == 0))
+		{
+			continue;
+		}
+		if (suffix != NULL)
+		{
+			if (((prefixLength == 0) && (entry->name[0] == '.')) || (nameLength < prefixLength + suffixLength) ||
+				(memcmp(entry->name + nameLength - suffixLength, suffix, suffixLength) != 0))
+			{
+				continue;
+			}
+		}
+		else if (fnmatch(component, entry->name, FNM_PERIOD) != 0)
+		{
+			continue;
+		}
+
+		if (pathLength + nameLength + 1 >= sizeof(state->path))
+		{
+			continue;
+		}
+		memcpy(state->path + pathLength, entry->name, nameLength + 1);
+
+		if (*end == '\0')
+		{
+			AddGlobMatch(state, state->path);
+		}
+		else if ((entry->type == DT_DIR) || (entry->type == DT_LNK) || (entry->type == DT_UNKNOWN))
+		{
+			// The rest of the pattern only matches inside directories;
+			//  opening this one finds out if it is one
+			GlobPath(state, pathLength + nameLength, end);
+		}
+	}
+	listing->pinCount--;
+	state->path[pathLength] = '\0';
+}
+
+/**************************************************************
+ * * Entry:
+ * *  component - one path component of a pattern
+ * *
+ * * Exit:
+ * *  Returns 1, if it has an unescaped "*", "?" or "[".
+ * *  Returns 0, otherwise.
+ * *
+ * * Purpose:
+ * *	Tells a component that has to be matched from a plain name.
+ * *
+ * ***************************************************************/
+int IsGlobPattern(const char *component)
+{
+	const char *current;
+
+	for (current = component; *current != '\0'; current++)
+	{
+		if ((*current == '\\') && (current[1] != '\0'))
+		{
+			current++;
+		}
+		else if (strchr("*?[", *current) != NULL)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pattern - a pattern, changed in place
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Removes the backslashes that escape characters in a pattern,
+ * *	leaving the name it stands for.
+ * *
+ * ***************************************************************/
+void UnescapePattern(char *pattern)
+{
+	char *read = pattern;
+	char *write = pattern;
+
+	while (*read != '\0')
+	{
+		if ((*read == '\\') && (read[1] != '\0'))
+		{
+			read++;
+		}
+		*write = *read;
+		write++;
+		read++;
+	}
+	*write = '\0';
+}
+
+/**************************************************************
+ * * Entry:
+ * *  state - the matches so far
+ * *  name - the name to add
+ * *
+ * * Exit:
+ * *  Returns 0, if it was added.
+ * *  Returns -1, if out of memory.
+ * *
+ * * Purpose:
+ * *	Copies a match into the line's arena and adds it to the list.
+ * *
+ * ***************************************************************/
+int AddGlobMatch(struct GlobState *state, const char *name)
+{
+	if (state->matchCount == state->matchCapacity)
+	{
+		size_t capacity = (state->matchCapacity == 0) ? 64 : state->matchCapacity * 2;
+		char **bigger = realloc(state->matches, capacity * sizeof(char *));
+		if (bigger == NULL)
+		{
+			state->isOutOfMemory = 1;
+			return -1;
+		}
+		state->matches = bigger;
+		state->matchCapacity = capacity;
+	}
+
+	size_t length = strlen(name) + 1;
+	char *copy = ArenaAlloc(state->arena, length);
+	if (copy == NULL)
+	{
+		state->isOutOfMemory = 1;
+		return -1;
+	}
+	memcpy(copy, name, length);
+	state->matches[state->matchCount] = copy;
+	state->matchCount++;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - a directory
+ * *
+ * * Exit:
+ * *  Returns the directory's sorted listing.
+ * *  Returns NULL, if it cannot be read.
+ * *
+ * * Purpose:
+ * *	Finds a directory in the listing cache by its device and inode.
+ * *	The listing is used only if the directory's mtime has not
+ * *	changed since it was read; otherwise, or the first time, the
+ * *	directory is read again with getdents64. The cache keeps the
+ * *	most recently used listings first.
+ * *
+ * ***************************************************************/
+struct DirectoryListing *GetDirectoryListing(const char *path)
+{
+	struct DirectoryListing *listing;
+	struct DirectoryListing **link;
+	struct stat info;
+
+	int directoryFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (directoryFd < 0)
+	{
+		return NULL;
+	}
+	if (fstat(directoryFd, &info) < 0)
+	{
+		close(directoryFd);
+		return NULL;
+	}
+
+	for (link = &directoryCache; *link != NULL; link = &(*link)->next)
+	{
+		listing = *link;
+		if ((listing->device == info.st_dev) && (listing->inode == info.st_ino))
+		{
+			break;
+		}
+	}
+
+	listing = *link;
+	if (listing != NULL)
+	{
+		*link = listing->next;
+		if ((!listing->isRacy) && (listing->modified.tv_sec == info.st_mtim.tv_sec) &&
+			(listing->modified.tv_nsec == info.st_mtim.tv_nsec))
+		{
+			close(directoryFd);
+			listing->next = directoryCache;
+			directoryCache = listing;
+			return listing;
+		}
+
+		// It changed. A listing in use further up the match keeps its
+		//  memory until the cache drops it.
+		if (listing->pinCount > 0)
+		{
+			listing->device = 0;
+			listing->inode = 0;
+			listing->next = directoryCache;
+			directoryCache = listing;
+		}
+		else
+		{
+			FreeDirectoryListing(listing);
+		}
+	}
+
+	listing = ReadDirectoryListing(directoryFd, &info);
+	close(directoryFd);
+	if (listing == NULL)
+	{
+		return NULL;
+	}
+	listing->next = directoryCache;
+	directoryCache = listing;
+	directoryCacheCount++;
+	directoryCacheBytes += listing->bytes;
+
+	// Drop the least recently used listings past the limits
+	while ((directoryCacheCount > DIRECTORY_CACHE_LISTINGS) || (directoryCacheBytes > DIRECTORY_CACHE_BYTES))
+	{
+		struct DirectoryListing **victim = NULL;
+		for (link = &directoryCache->next; *link != NULL; link = &(*link)->next)
+		{
+			if ((*link)->pinCount == 0)
+			{
+				victim = link;
+			}
+		}
+		if (victim == NULL)
+		{
+			break;
+		}
+		struct DirectoryListing *dropped = *victim;
+		*victim = dropped->next;
+		FreeDirectoryListing(dropped);
+	}
+
+	return listing;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  directoryFd - an open directory
+ * *  info - its fstat, taken before reading
+ * *
+ * * Exit:
+ * *  Returns a new listing of the directory, sorted by name.
+ * *  Returns NULL, on a read error or if out of memory.
+ * *
+ * * Purpose:
+ * *	Reads a whole directory with getdents64 into one buffer and
+ * *	sorts pointers to the names. The mtime was taken before the
+ * *	read, so a change during it shows up the next time. A listing
+ * *	read within a second or so of the last change is marked racy
+ * *	and not trusted again, because the mtime may not move for a
+ * *	change made inside the same clock tick.
+ * *
+ * ***************************************************************/
+struct DirectoryListing *ReadDirectoryListing(int directoryFd, const struct stat *info)
+{
+	size_t capacity = DIRECTORY_READ_SIZE;
+	size_t used = 0;
+	size_t count = 0;
+	size_t offset;
+	struct timespec now;
+	long bytesRead;
+
+	struct DirectoryListing *listing = calloc(1, sizeof(*listing));
+	char *buffer = malloc(capacity);
+	if ((listing == NULL) || (buffer == NULL))
+	{
+		free(listing);
+		free(buffer);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		if (capacity - used < DIRECTORY_READ_SIZE / 2)
+		{
+			char *bigger = realloc(buffer, capacity * 2);
+			if (bigger == NULL)
+			{
+				bytesRead = -1;
+				break;
+			}
+			buffer = bigger;
+			capacity *= 2;
+		}
+		bytesRead = syscall(SYS_getdents64, directoryFd, buffer + used, capacity - used);
+		if (bytesRead <= 0)
+		{
+			break;
+		}
+		used += bytesRead;
+	}
+	if (bytesRead < 0)
+	{
+		free(buffer);
+		free(listing);
+		return NULL;
+	}
+
+	for (offset = 0; offset < used; offset += ((struct LinuxDirent64 *)(buffer + offset))->d_reclen)
+	{
+		count++;
+	}
+	listing->entries = malloc((count + 1) * sizeof(struct DirectoryEntry));
+	if (listing->entries == NULL)
+	{
+		free(buffer);
+		free(listing);
+		return NULL;
+	}
+	count = 0;
+	for (offset = 0; offset < used; offset += ((struct LinuxDirent64 *)(buffer + offset))->d_reclen)
+	{
+		struct LinuxDirent64 *record = (struct LinuxDirent64 *)(buffer + offset);
+		listing->entries[count].name = record->d_name;
+		listing->entries[count].type = record->d_type;
+		count++;
+	}
+	qsort(listing->entries, count, sizeof(struct DirectoryEntry), CompareDirectoryEntries);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	listing->device = info->st_dev;
+	listing->inode = info->st_ino;
+	listing->modified = info->st_mtim;
+	listing->isRacy = (now.tv_sec - info->st_mtim.tv_sec < 2);
+	listing->buffer = buffer;
+	listing->count = count;
+	listing->bytes = capacity + ((count + 1) * sizeof(struct DirectoryEntry));
+
+	return listing;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  left, right - the directory entries to compare
+ * *
+ * * Exit:
+ * *  Returns <0, 0 or >0 as strcmp does for their names.
+ * *
+ * * Purpose:
+ * *	Orders a listing by name for qsort.
+ * *
+ * ***************************************************************/
+int CompareDirectoryEntries(const void *left, const void *right)
+{
+	return strcmp(((const struct DirectoryEntry *)left)->name, ((const struct DirectoryEntry *)right)->name);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  listing - a listing that has been taken out of the cache
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees a listing and takes it off the cache totals.
+ * *
+ * ***************************************************************/
+void FreeDirectoryListing(struct DirectoryListing *listing)
+{
+	directoryCacheCount--;
+	directoryCacheBytes -= listing->bytes;
+	free(listing->entries);
+	free(listing->buffer);
+	free(listing);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - the reader to set up
+ * *  fd - the descriptor the commands are read from
+ * *
+ * * Exit:
+ * *  Returns 0, if the reader is ready.
+ * *  Returns -1, if the input could not be set up.
+ * *
+ * * Purpose:
+ * *	Sets up a reader for a terminal or a script. A terminal is
+ * *	read a line at a time after a prompt. A regular file is mapped
+ * *	whole; anything else is read in large blocks.
+ * *
+ * ***************************************************************/
+int OpenInputReader(struct InputReader *reader, int fd)
+{
+	struct stat fileInfo;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = fd;
+
+	// getline sizes the buffer to the longest line typed
+	if (isatty(fd))
+	{
+		reader->isInteractive = 1;
+		return 0;
+	}
+
+	// Map a script file in one go. The mapping is private, so cutting
+	//  lines up in place does not change the file.
+	if ((fstat(fd, &fileInfo) == 0) && (S_ISREG(fileInfo.st_mode)) && (fileInfo.st_size > 0))
+	{
+		void *mapping = mmap(NULL, fileInfo.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+
+		// The last line gets its terminator in the zeroed tail of the
+		//  last page. If the file fills that page exactly and does not
+		//  end in a new line there is no room, so read it instead.
+		if ((mapping != MAP_FAILED) && ((fileInfo.st_size % sysconf(_SC_PAGESIZE)) == 0) &&
+			(((char *)mapping)[fileInfo.st_size - 1] != '\n'))
+		{
+			munmap(mapping, fileInfo.st_size);
+			mapping = MAP_FAILED;
+		}
+
+		if (mapping != MAP_FAILED)
+		{
+			reader->buffer = mapping;
+			reader->length = fileInfo.st_size;
+			reader->capacity = fileInfo.st_size;
+			reader->isMapped = 1;
+			reader->atEnd = 1;
+
+			// The whole script has been consumed as far as the commands
+			//  we start are concerned, just like after a block read.
+			if (fd == 0)
+			{
+				lseek(fd, 0, SEEK_END);
+			}
+			else
+			{
+				close(fd);
+			}
+			return 0;
+		}
+	}
+
+	reader->capacity = INPUT_BLOCK_SIZE;
+	reader->buffer = malloc(reader->capacity);
+	if (reader->buffer == NULL)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - a reader set up on a file
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Lets go of a reader's buffer and file once its input is done.
+ * *
+ * ***************************************************************/
+void CloseInputReader(struct InputReader *reader)
+{
+	if (reader->isMapped)
+	{
+		munmap(reader->buffer, reader->capacity);
+	}
+	else
+	{
+		free(reader->buffer);
+		close(reader->fd);
+	}
+	reader->buffer = NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - the reader to set up
+ * *  commands - the command lines to run
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Sets up a reader over a string given with "-c".
+ * *
+ * ***************************************************************/
+void OpenStringReader(struct InputReader *reader, const char *commands)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = -1;
+	reader->length = strlen(commands);
+	reader->capacity = reader->length + 1;
+	reader->buffer = malloc(reader->capacity);
+	memcpy(reader->buffer, commands, reader->capacity);
+	reader->atEnd = 1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - where the command lines come from
+ * *
+ * * Exit:
+ * *  Returns the next command line, without its new line.
+ * *  Returns NULL, at the end of the input.
+ * *
+ * * Purpose:
+ * *	Gets the next command line, of any length. The line lives in
+ * *	the reader's buffer and stays valid until the next call.
+ * *
+ * ***************************************************************/
+char *ReadCommandLine(struct InputReader *reader)
+{
+	if (reader->isInteractive)
+	{
+		// Clear stdin
+		tcflush(0, TCIFLUSH);
+
+		fflush(stdout);
+
+		// Get user input
+		printf(": ");
+		fflush(stdout);
+		atPrompt = PROMPT_COMMAND;
+		WaitForInput();
+		ssize_t lineLength = getline(&reader->buffer, &reader->capacity, stdin);
+		atPrompt = 0;
+		if (lineLength < 0)
+		{
+			// A signal only interrupted the read, so prompt again
+			if ((ferror(stdin)) && (errno == EINTR))
+			{
+				clearerr(stdin);
+				return "";
+			}
+			return NULL;
+		}
+		RemoveNewLineAndAddNullTerm(reader->buffer);
+		return reader->buffer;
+	}
+
+	return ReadBufferedLine(reader);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - where the command lines come from
+ * *
+ * * Exit:
+ * *  Returns the next line of a here-doc, without its new line.
+ * *  Returns NULL, at the end of the input.
+ * *
+ * * Purpose:
+ * *	Gets a here-doc line. At a terminal it prompts with "> " and
+ * *	keeps what was typed ahead, unlike a command prompt.
+ * *
+ * ***************************************************************/
+char *ReadHereDocLine(struct InputReader *reader)
+{
+	if (!reader->isInteractive)
+	{
+		return ReadBufferedLine(reader);
+	}
+
+	printf("> ");
+	fflush(stdout);
+	atPrompt = PROMPT_HEREDOC;
+	WaitForInput();
+	while (getline(&reader->buffer, &reader->capacity, stdin) < 0)
+	{
+		if ((!ferror(stdin)) || (errno != EINTR))
+		{
+			atPrompt = 0;
+			return NULL;
+		}
+		clearerr(stdin);
+	}
+	atPrompt = 0;
+	RemoveNewLineAndAddNullTerm(reader->buffer);
+	return reader->buffer;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Waits at the prompt until a line can be read from the
+ * *	terminal. Background jobs that finish or stop meanwhile are
+ * *	reported right away, with the prompt shown again after, and
+ * *	the output of jobs run with "--log" is still copied. Without
+ * *	the event loop it returns at once and the read waits. A
+ * *	terminal hands over one line for each read, so stdio holds
+ * *	nothing between lines for the wait to miss.
+ * *
+ * ***************************************************************/
+void WaitForInput()
+{
+	sigset_t childMask;
+	sigset_t oldMask;
+	sigset_t waitMask;
+
+	if (shellEvents.fd < 0)
+	{
+		return;
+	}
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+	waitMask = oldMask;
+	sigdelset(&waitMask, SIGCHLD);
+
+	// stdin is only watched here, while no job has the terminal
+	WatchEvent(&shellEvents, 0, EPOLL_CTL_ADD, EPOLLIN, (unsigned long long)SHELL_TAG_INPUT << 32);
+	while ((WaitShellEvents(&waitMask) == 0) && (shellEvents.fd >= 0))
+	{
+		ReportCompletions();
+	}
+	if (shellEvents.fd >= 0)
+	{
+		WatchEvent(&shellEvents, 0, EPOLL_CTL_DEL, 0, 0);
+	}
+
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - a mapped, block or string reader
+ * *
+ * * Exit:
+ * *  Returns the next line, without its new line.
+ * *  Returns NULL, at the end of the input.
+ * *
+ * * Purpose:
+ * *	Cuts the next line out of the reader's buffer in place, reading
+ * *	more input when the buffer holds no whole line.
+ * *
+ * ***************************************************************/
+char *ReadBufferedLine(struct InputReader *reader)
+{
+	while (1)
+	{
+		char *lineStart = reader->buffer + reader->position;
+		size_t remaining = reader->length - reader->position;
+		char *lineEnd = memchr(lineStart, '\n', remaining);
+
+		// A whole line is in the buffer, so cut it out in place
+		if ((lineEnd == NULL) && (reader->atEnd) && (remaining > 0))
+		{
+			// The last line does not end in a new line
+			lineEnd = lineStart + remaining;
+		}
+
+		if (lineEnd != NULL)
+		{
+			size_t lineLength = lineEnd - lineStart;
+			*lineEnd = '\0';
+			reader->position += lineLength + ((lineLength < remaining) ? 1 : 0);
+			return lineStart;
+		}
+
+		if (reader->atEnd)
+		{
+			return NULL;
+		}
+
+		if (FillInputBuffer(reader) < 0)
+		{
+			return NULL;
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - where the command lines come from
+ * *  pipeline - the parsed command line with its here-docs
+ * *
+ * * Exit:
+ * *  Returns 0, if every body was read.
+ * *  Returns -1, if there was no memory for one.
+ * *
+ * * Purpose:
+ * *	Reads the body of each here-doc on the line from the lines
+ * *	after it, up to a line holding only its delimiter. Quotes in
+ * *	the delimiter are removed, and they keep the body from being
+ * *	expanded. Each body replaces the delimiter as the redirect's
+ * *	target and is copied into the line's arena.
+ * *
+ * ***************************************************************/
+int ReadHereDocs(struct InputReader *reader, struct Pipeline *pipeline)
+{
+	int stage = 0;
+	int i = -1;
+
+	// The redirects are found through the stages, as an alias gives
+	//  the stage it is used in copies of them
+	while (stage < pipeline->count)
+	{
+		if (++i >= pipeline->commands[stage].redirectCount)
+		{
+			stage++;
+			i = -1;
+			continue;
+		}
+
+		struct Redirect *redirect = &pipeline->commands[stage].redirects[i];
+		size_t length = 0;
+		size_t capacity = 256;
+		char *delimiter;
+		char *body;
+		char *line = NULL;
+
+		if (redirect->kind != REDIRECT_HEREDOC)
+		{
+			continue;
+		}
+
+		redirect->isQuoted = (strpbrk(redirect->target, "'\"\\") != NULL);
+		delimiter = ArenaAlloc(pipeline->arena, ExpandText(redirect->target, EXPAND_QUOTES, NULL) + 1);
+		if (delimiter == NULL)
+		{
+			printf("smallsh: out of memory for here-document\n");
+			return -1;
+		}
+		delimiter[ExpandText(redirect->target, EXPAND_QUOTES, delimiter)] = '\0';
+
+		body = malloc(capacity);
+		while ((body != NULL) && ((line = ReadHereDocLine(reader)) != NULL))
+		{
+			if (strcmp(line, delimiter) == 0)
+			{
+				break;
+			}
+
+			size_t lineLength = strlen(line);
+			if (length + lineLength + 2 > capacity)
+			{
+				while (length + lineLength + 2 > capacity)
+				{
+					capacity *= 2;
+				}
+				char *bigger = realloc(body, capacity);
+				if (bigger == NULL)
+				{
+					free(body);
+					body = NULL;
+					break;
+				}
+				body = bigger;
+			}
+			memcpy(body + length, line, lineLength);
+			body[length + lineLength] = '\n';
+			length += lineLength + 1;
+		}
+
+		if ((body != NULL) && (line == NULL))
+		{
+			printf("smallsh: warning: here-document delimited by end-of-file (wanted `%s')\n",
+				delimiter);
+		}
+
+		redirect->target = (body != NULL) ? ArenaAlloc(pipeline->arena, length + 1) : NULL;
+		if (redirect->target == NULL)
+		{
+			free(body);
+			printf("smallsh: out of memory for here-document\n");
+			return -1;
+		}
+		memcpy(redirect->target, body, length);
+		redirect->target[length] = '\0';
+		free(body);
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Opens the history file, $HISTFILE or ~/.smallsh_history. Only
+ * *	the descriptor is opened here; nothing is read until history is
+ * *	used, so startup costs the same for any size of file.
+ * *
+ * ***************************************************************/
+void OpenHistory()
+{
+	char defaultPath[PATH_MAX];
+	const char *path = getenv("HISTFILE");
+
+	if ((path == NULL) || (path[0] == '\0'))
+	{
+		const char *home = getenv("HOME");
+		if (home == NULL)
+		{
+			return;
+		}
+		snprintf(defaultPath, sizeof(defaultPath), "%s/%s", home, HISTORY_FILE_NAME);
+		path = defaultPath;
+	}
+
+	history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - the command line to record
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Appends a command line to the history file. O_APPEND puts
+ * *	each line at the end even when other sessions are writing to
+ * *	the same file. Lines starting with a space are not kept.
+ * *
+ * ***************************************************************/
+void AddHistory(const char *line)
+{
+	struct iovec parts[2];
+
+	if ((history.fd < 0) || (line[0] == '\0') || (line[0] == ' '))
+	{
+		return;
+	}
+
+	parts[0].iov_base = (void *)line;
+	parts[0].iov_len = strlen(line);
+	parts[1].iov_base = "\n";
+	parts[1].iov_len = 1;
+	writev(history.fd, parts, 2);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns 0, if the mapping covers the whole file.
+ * *  Returns -1, if there is no history.
+ * *
+ * * Purpose:
+ * *	Maps the history file, again if it grew since it was last
+ * *	mapped. The file is only appended to, so offsets into the old
+ * *	mapping are still good in the new one. A file that shrank was
+ * *	rewritten, and its index is thrown away.
+ * *
+ * ***************************************************************/
+int MapHistory()
+{
+	struct stat fileInfo;
+
+	if ((history.fd < 0) || (fstat(history.fd, &fileInfo) < 0))
+	{
+		return -1;
+	}
+	if ((size_t)fileInfo.st_size == history.mapLength)
+	{
+		return (history.mapLength > 0) ? 0 : -1;
+	}
+
+	if ((size_t)fileInfo.st_size < history.mapLength)
+	{
+		free(history.index);
+		history.index = NULL;
+		history.indexCount = 0;
+		history.indexedLength = 0;
+		history.countedLength = 0;
+		history.entryCount = 0;
+	}
+
+	if (history.map != NULL)
+	{
+		munmap(history.map, history.mapLength);
+		history.map = NULL;
+		history.mapLength = 0;
+	}
+	if (fileInfo.st_size == 0)
+	{
+		return -1;
+	}
+
+	void *mapping = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		return -1;
+	}
+	history.map = mapping;
+	history.mapLength = fileInfo.st_size;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  left, right - two history sort keys
+ * *
+ * * Exit:
+ * *  Returns <0, 0 or >0 for qsort.
+ * *
+ * * Purpose:
+ * *	Orders history entries by their text, and the same text by
+ * *	where it is in the file. The rest of the text is only compared
+ * *	when the first eight bytes are the same.
+ * *
+ * ***************************************************************/
+int CompareHistoryKeys(const void *left, const void *right)
+{
+	const struct HistoryKey *a = left;
+	const struct HistoryKey *b = right;
+
+	if (a->key != b->key)
+	{
+		return (a->key > b->key) ? 1 : -1;
+	}
+
+	// The new line ends an entry, so it sorts before any text
+	const unsigned char *aText = (const unsigned char *)history.map + a->offset;
+	const unsigned char *bText = (const unsigned char *)history.map + b->offset;
+	while ((*aText == *bText) && (*aText != '\n'))
+	{
+		aText++;
+		bText++;
+	}
+	if (*aText != *bText)
+	{
+		return ((*aText == '\n') ? -1 : (*bText == '\n') ? 1 : (int)*aText - (int)*bText);
+	}
+
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Builds the prefix index: the offset of the latest copy of each
+ * *	distinct entry, sorted by text. Entries with a prefix are then
+ * *	one contiguous run found by binary search. It is built the
+ * *	first time a prefix is looked up and rebuilt when enough new
+ * *	lines have been added after it.
+ * *
+ * ***************************************************************/
+void BuildHistoryIndex()
+{
+	size_t count = 0;
+	size_t offset;
+	size_t i;
+
+	// Only whole lines are indexed
+	size_t length = history.mapLength;
+	while ((length > 0) && (history.map[length - 1] != '\n'))
+	{
+		length--;
+	}
+
+	count = CountHistoryLines(0, length);
+
+	size_t *index = malloc((count + 1) * sizeof(size_t));
+	struct HistoryKey *keys = malloc((count + 1) * sizeof(struct HistoryKey));
+	if ((index == NULL) || (keys == NULL))
+	{
+		free(index);
+		free(keys);
+		return;
+	}
+
+	// Sort on the first eight bytes of each entry, so most compares
+	//  do not have to touch the file
+	count = 0;
+	offset = 0;
+	while (offset < length)
+	{
+		const char *lineEnd = memchr(history.map + offset, '\n', length - offset);
+		unsigned long long key = 0;
+		size_t entryLength = lineEnd - (history.map + offset);
+		for (i = 0; i < 8; i++)
+		{
+			key = (key << 8) | ((i < entryLength) ? (unsigned char)history.map[offset + i] : 0);
+		}
+		keys[count].key = key;
+		keys[count].offset = offset;
+		count++;
+		offset = (lineEnd - history.map) + 1;
+	}
+
+	qsort(keys, count, sizeof(struct HistoryKey), CompareHistoryKeys);
+	for (i = 0; i < count; i++)
+	{
+		index[i] = keys[i].offset;
+	}
+	free(keys);
+
+	// Keep only the latest copy of each entry, the last of its run
+	size_t kept = 0;
+	for (i = 0; i < count; i++)
+	{
+		if ((kept > 0) && (HistoryEntriesMatch(index[kept - 1], index[i])))
+		{
+			index[kept - 1] = index[i];
+		}
+		else
+		{
+			index[kept] = index[i];
+			kept++;
+		}
+	}
+
+	free(history.index);
+	history.index = index;
+	history.indexCount = kept;
+	history.indexedLength = length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  left, right - offsets of two history entries
+ * *
+ * * Exit:
+ * *  Returns 1, if the entries have the same text.
+ * *  Returns 0, if they do not.
+ * *
+ * * Purpose:
+ * *	Compares two entries up to their new lines.
+ * *
+ * ***************************************************************/
+int HistoryEntriesMatch(size_t left, size_t right)
+{
+	const char *a = history.map + left;
+	const char *b = history.map + right;
+
+	while ((*a == *b) && (*a != '\n'))
+	{
+		a++;
+		b++;
+	}
+
+	return (*a == *b) ? 1 : 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  start, end - the part of the history file to count
+ * *
+ * * Exit:
+ * *  Returns the number of new lines in it.
+ * *
+ * * Purpose:
+ * *	Counts history entries a line at a time with memchr.
+ * *
+ * ***************************************************************/
+size_t CountHistoryLines(size_t start, size_t end)
+{
+	size_t count = 0;
+
+	while (start < end)
+	{
+		const char *lineEnd = memchr(history.map + start, '\n', end - start);
+		if (lineEnd == NULL)
+		{
+			break;
+		}
+		count++;
+		start = (lineEnd - history.map) + 1;
+	}
+
+	return count;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  offset - the offset of a history entry
+ * *  prefix - the text to look for
+ * *  prefixLength - the length of prefix
+ * *
+ * * Exit:
+ * *  Returns <0, 0 or >0 as the entry's start sorts before, matches
+ * *  or sorts after the prefix.
+ * *
+ * * Purpose:
+ * *	Compares the start of a history entry with a prefix.
+ * *
+ * ***************************************************************/
+int CompareHistoryPrefix(size_t offset, const char *prefix, size_t prefixLength)
+{
+	const unsigned char *entry = (const unsigned char *)history.map + offset;
+	size_t i;
+
+	for (i = 0; i < prefixLength; i++)
+	{
+		if (entry[i] == '\n')
+		{
+			return -1;
+		}
+		if (entry[i] != (unsigned char)prefix[i])
+		{
+			return (int)entry[i] - (int)(unsigned char)prefix[i];
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  prefix - the text the entry starts with. An empty prefix
+ * *           matches the latest entry.
+ * *  prefixLength - the length of prefix
+ * *  first, last - the return variables for the run of the index
+ * *                that matches, or NULL if not wanted
+ * *
+ * * Exit:
+ * *  Returns the offset of the latest entry starting with prefix.
+ * *  Returns -1, if there is none.
+ * *
+ * * Purpose:
+ * *	Finds the entry "!prefix" stands for. Lines added after the
+ * *	index was built are newer than anything in it, so they are
+ * *	searched first, backwards from the end of the file. The index
+ * *	is then binary searched for the run of entries with the prefix.
+ * *
+ * ***************************************************************/
+long FindHistoryEntry(const char *prefix, size_t prefixLength, size_t *first, size_t *last)
+{
+	size_t lineEnd;
+
+	if (MapHistory() < 0)
+	{
+		return -1;
+	}
+
+	// Scan the lines after the index, latest first. Before there is
+	//  an index the recent lines are scanned, since most references
+	//  are to something run a moment ago.
+	if ((first == NULL) && (last == NULL))
+	{
+		size_t floor = history.indexedLength;
+		if ((history.index == NULL) && (history.mapLength > HISTORY_TAIL_LIMIT))
+		{
+			floor = history.mapLength - HISTORY_TAIL_LIMIT;
+		}
+
+		lineEnd = history.mapLength;
+		while ((lineEnd > 0) && (history.map[lineEnd - 1] != '\n'))
+		{
+			lineEnd--;
+		}
+		while (lineEnd > floor)
+		{
+			size_t lineStart = lineEnd - 1;
+			while ((lineStart > floor) && (history.map[lineStart - 1] != '\n'))
+			{
+				lineStart--;
+			}
+			if ((lineStart > 0) && (history.map[lineStart - 1] != '\n'))
+			{
+				// The floor cut this line in two
+				break;
+			}
+			if (CompareHistoryPrefix(lineStart, prefix, prefixLength) == 0)
+			{
+				return (long)lineStart;
+			}
+			lineEnd = lineStart;
+		}
+	}
+
+	// A listing needs every line in the index, not just the older ones,
+	//  even with an empty prefix, which lists them all
+	size_t tailLength = history.mapLength - history.indexedLength;
+	if (((prefixLength > 0) || (first != NULL)) && ((history.index == NULL) ||
+		(tailLength > HISTORY_TAIL_LIMIT) || ((first != NULL) && (tailLength > 0))))
+	{
+		BuildHistoryIndex();
+	}
+
+	if (history.index == NULL)
+	{
+		return -1;
+	}
+
+	// Find the first indexed entry not before the prefix
+	size_t low = 0;
+	size_t high = history.indexCount;
+	while (low < high)
+	{
+		size_t middle = low + ((high - low) / 2);
+		if (CompareHistoryPrefix(history.index[middle], prefix, prefixLength) < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	// The run with the prefix starts there; take its latest entry
+	long latest = -1;
+	size_t end = low;
+	while ((end < history.indexCount) &&
+		(CompareHistoryPrefix(history.index[end], prefix, prefixLength) == 0))
+	{
+		if ((long)history.index[end] > latest)
+		{
+			latest = (long)history.index[end];
+		}
+		end++;
+	}
+
+	if (first != NULL)
+	{
+		*first = low;
+	}
+	if (last != NULL)
+	{
+		*last = end;
+	}
+
+	return latest;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - the command line as it was typed
+ * *  arena - where the expanded line is built
+ * *
+ * * Exit:
+ * *  Returns the line with its history references replaced, or the
+ * *  line itself if it has none.
+ * *  Returns NULL, if a reference matches nothing.
+ * *
+ * * Purpose:
+ * *	Expands "!!" to the last command line and "!prefix" to the
+ * *	latest one starting with prefix. A "!" before a space, "=", a
+ * *	double quote or the end of the line is left alone, so
+ * *	"[ ! -f x ]" and echo "hi!" still work, and so is one in single
+ * *	quotes. The expanded line is echoed, as bash does.
+ * *
+ * ***************************************************************/
+char *ExpandHistory(char *line, struct Arena *arena)
+{
+	size_t lineLength = strlen(line);
+	size_t expandedLength = 0;
+	size_t capacity;
+	char *expanded;
+	char *current;
+	int replaced = 0;
+
+	if ((history.fd < 0) || (strchr(line, '!') == NULL))
+	{
+		return line;
+	}
+
+	// Work out the size of the new line before building it
+	for (capacity = lineLength + 1, current = line; *current != '\0'; current++)
+	{
+		if ((current[0] == '\'') && (strchr(current + 1, '\'') != NULL))
+		{
+			current = strchr(current + 1, '\'');
+		}
+		else if ((current[0] == '!') && (strchr(" \t=\n\"", current[1]) == NULL))
+		{
+			size_t referenceLength = (current[1] == '!') ? 2 : strcspn(current + 1, " \t<>|&;\"") + 1;
+			long entry = FindHistoryEntry(current + 1, (current[1] == '!') ? 0 : referenceLength - 1,
+				NULL, NULL);
+			if (entry < 0)
+			{
+				printf("smallsh: %.*s: event not found\n", (int)referenceLength, current);
+				return NULL;
+			}
+			capacity += strcspn(history.map + entry, "\n");
+			current += referenceLength - 1;
+		}
+	}
+
+	expanded = ArenaAlloc(arena, capacity);
+	if (expanded == NULL)
+	{
+		return NULL;
+	}
+
+	for (current = line; *current != '\0'; current++)
+	{
+		if ((current[0] == '\'') && (strchr(current + 1, '\'') != NULL))
+		{
+			size_t quotedLength = strchr(current + 1, '\'') - current + 1;
+			memcpy(expanded + expandedLength, current, quotedLength);
+			expandedLength += quotedLength;
+			current += quotedLength - 1;
+		}
+		else if ((current[0] == '!') && (strchr(" \t=\n\"", current[1]) == NULL))
+		{
+			size_t referenceLength = (current[1] == '!') ? 2 : strcspn(current + 1, " \t<>|&;\"") + 1;
+			long entry = FindHistoryEntry(current + 1, (current[1] == '!') ? 0 : referenceLength - 1,
+				NULL, NULL);
+			size_t entryLength = strcspn(history.map + entry, "\n");
+			memcpy(expanded + expandedLength, history.map + entry, entryLength);
+			expandedLength += entryLength;
+			current += referenceLength - 1;
+			replaced = 1;
+		}
+		else
+		{
+			expanded[expandedLength] = *current;
+			expandedLength++;
+		}
+	}
+	expanded[expandedLength] = '\0';
+
+	if (replaced)
+	{
+		printf("%s\n", expanded);
+	}
+
+	return expanded;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  reader - a block reading reader
+ * *
+ * * Exit:
+ * *  Returns 0, if more input was read or the end was reached.
+ * *  Returns -1, on a read error.
+ * *
+ * * Purpose:
+ * *	Moves the unfinished line to the front of the buffer and reads
+ * *	the next block after it. The buffer grows if one line fills it.
+ * *
+ * ***************************************************************/
+int FillInputBuffer(struct InputReader *reader)
+{
+	size_t remaining = reader->length - reader->position;
+	ssize_t bytesRead;
+
+	memmove(reader->buffer, reader->buffer + reader->position, remaining);
+	reader->length = remaining;
+	reader->position = 0;
+
+	// Keep room for the terminator of a last line without a new line
+	if (reader->length + 1 >= reader->capacity)
+	{
+		char *bigger = realloc(reader->buffer, reader->capacity * 2);
+		if (bigger == NULL)
+		{
+			return -1;
+		}
+		reader->buffer = bigger;
+		reader->capacity *= 2;
+	}
+
+	do
+	{
+		bytesRead = read(reader->fd, reader->buffer + reader->length,
+			reader->capacity - reader->length - 1);
+	} while ((bytesRead < 0) && (errno == EINTR));
+
+	if (bytesRead < 0)
+	{
+		return -1;
+	}
+	if (bytesRead == 0)
+	{
+		reader->atEnd = 1;
+	}
+	reader->length += bytesRead;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  socketPath - where to listen
+ * *
+ * * Exit:
+ * *  Returns 1, if the server could not be started. Otherwise it
+ * *  does not return.
+ * *
+ * * Purpose:
+ * *	Runs the shell as a command server on a UNIX domain socket.
+ * *	Clients send run frames, one command line each. Every line is
+ * *	started as a quiet job with its stdout and stderr on pipes, so
+ * *	any number run at once. The output is streamed back as it comes
+ * *	and the exit status follows once the job is done and its output
+ * *	has all been sent. One event loop waits on the socket, the
+ * *	clients, the output pipes and the children.
+ * *
+ * ***************************************************************/
+int RunServer(const char *socketPath)
+{
+	struct sockaddr_un address;
+	struct EventRecord events[SERVER_EPOLL_EVENTS];
+	struct stat info;
+	int i;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "smallsh: %s: socket path is too long\n", socketPath);
+		return 1;
+	}
+	strcpy(address.sun_path, socketPath);
+
+	// A socket left by an earlier server is replaced; anything else is not
+	if ((lstat(socketPath, &info) == 0) && (S_ISSOCK(info.st_mode)))
+	{
+		unlink(socketPath);
+	}
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ((listenFd < 0) || (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+		(listen(listenFd, SOMAXCONN) < 0))
+	{
+		fprintf(stderr, "smallsh: %s: %s\n", socketPath, strerror(errno));
+		return 1;
+	}
+
+	if (InitEventLoop(&serverEvents, eventBackend) < 0)
+	{
+		fprintf(stderr, "smallsh: epoll: %s\n", strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		serverCapture[i] = memfd_create("smallsh-capture", MFD_CLOEXEC);
+		if (serverCapture[i] < 0)
+		{
+			serverCapture[i] = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		}
+		if (serverCapture[i] < 0)
+		{
+			fprintf(stderr, "smallsh: cannot make a capture file: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	if ((captureLogFd >= 0) && (pipe2(serverLogTee, O_CLOEXEC | O_NONBLOCK) == 0))
+	{
+		fcntl(serverLogTee[1], F_SETPIPE_SZ, CAPTURE_CHUNK);
+	}
+	else if (captureLogFd >= 0)
+	{
+		fprintf(stderr, "smallsh: cannot log: %s\n", strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++)
+	{
+		serverClients[i].fd = -1;
+	}
+
+	// A splice to a client that has gone fails with EPIPE instead.
+	//  Children start with an empty signal mask.
+	sigset_t pipeMask;
+	sigemptyset(&pipeMask);
+	sigaddset(&pipeMask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipeMask, NULL);
+
+	WatchServerFd(listenFd, EPOLL_CTL_ADD, EPOLLIN, SERVER_TAG_LISTEN, 0);
+	WatchChildren(&serverEvents, (unsigned long long)SERVER_TAG_REAPER << 32, 1);
+
+	while (1)
+	{
+		int eventCount = WaitEvents(&serverEvents, events, SERVER_EPOLL_EVENTS);
+		if (eventCount < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "smallsh: %s: %s\n", (serverEvents.backend == EVENTS_URING) ? "io_uring" : "epoll",
+				strerror(errno));
+			return 1;
+		}
+
+		for (i = 0; i < eventCount; i++)
+		{
+			int tag = (int)(events[i].data >> 32);
+			int index = (int)(events[i].data & 0xffffffff);
+
+			switch (tag)
+			{
+				case SERVER_TAG_LISTEN:
+					AcceptClients(listenFd);
+					break;
+				case SERVER_TAG_REAPER:
+					CollectRequests();
+					break;
+				case SERVER_TAG_CLIENT:
+					// A client that hung up cannot read any more output
+					if (events[i].events & (EPOLLHUP | EPOLLERR))
+					{
+						CloseClient(index);
+						break;
+					}
+					if (events[i].events & EPOLLOUT)
+					{
+						FlushClient(index);
+					}
+					if ((events[i].events & EPOLLIN) && (serverClients[index].fd >= 0))
+					{
+						ReadClient(index);
+					}
+					break;
+				case SERVER_TAG_OUTPUT:
+					ForwardOutput(index / 2, index % 2);
+					break;
+			}
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fd - the descriptor to watch
+ * *  operation - EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * *  events - the events to wait for
+ * *  tag - what kind of descriptor it is
+ * *  index - its client, or its request and stream
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Changes what the server's event loop watches. The tag and index
+ * *	are packed into the event data, so no lookup is needed when it
+ * *	fires.
+ * *
+ * ***************************************************************/
+void WatchServerFd(int fd, int operation, unsigned int events, int tag, int index)
+{
+	WatchEvent(&serverEvents, fd, operation, events, ((unsigned long long)tag << 32) | (unsigned int)index);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - the event loop to set up
+ * *  backend - EVENTS_URING to try an io_uring first, or EVENTS_EPOLL
+ * *
+ * * Exit:
+ * *  Returns 0, if it is ready.
+ * *  Returns -1, if not even an epoll set could be made.
+ * *
+ * * Purpose:
+ * *	Makes the event loop. An io_uring that cannot be set up, as
+ * *	under a seccomp filter or with io_uring_disabled set, falls back
+ * *	to epoll without a word.
+ * *
+ * ***************************************************************/
+int InitEventLoop(struct EventLoop *loop, int backend)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->fd = -1;
+
+	if ((backend == EVENTS_URING) && (SetupEventRing(loop) == 0))
+	{
+		loop->backend = EVENTS_URING;
+		return 0;
+	}
+
+	loop->backend = EVENTS_EPOLL;
+	loop->fd = epoll_create1(EPOLL_CLOEXEC);
+	return (loop->fd < 0) ? -1 : 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - the event loop being set up
+ * *
+ * * Exit:
+ * *  Returns 0, if the ring is mapped.
+ * *  Returns -1, if the kernel has no io_uring for us.
+ * *
+ * * Purpose:
+ * *	Sets up an io_uring with the plain system calls and maps its
+ * *	submission and completion rings, and asks the kernel whether it
+ * *	can wait for children.
+ * *
+ * ***************************************************************/
+int SetupEventRing(struct EventLoop *loop)
+{
+	struct io_uring_params params;
+	size_t probeSize = sizeof(struct io_uring_probe) + (256 * sizeof(struct io_uring_probe_op));
+
+	memset(&params, 0, sizeof(params));
+	int ringFd = syscall(__NR_io_uring_setup, EVENT_RING_ENTRIES, &params);
+	if (ringFd < 0)
+	{
+		return -1;
+	}
+	fcntl(ringFd, F_SETFD, FD_CLOEXEC);
+
+	size_t sqSize = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+	size_t cqSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	int isSingleMap = ((params.features & IORING_FEAT_SINGLE_MMAP) != 0);
+	if ((isSingleMap) && (cqSize > sqSize))
+	{
+		sqSize = cqSize;
+	}
+	char *sqRing = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	char *cqRing = (isSingleMap) ? sqRing :
+		mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if ((sqRing == MAP_FAILED) || (cqRing == MAP_FAILED) || (sqes == MAP_FAILED))
+	{
+		close(ringFd);
+		return -1;
+	}
+
+	loop->fd = ringFd;
+	loop->sqHead = (unsigned int *)(sqRing + params.sq_off.head);
+	loop->sqTail = (unsigned int *)(sqRing + params.sq_off.tail);
+	loop->sqArray = (unsigned int *)(sqRing + params.sq_off.array);
+	loop->sqMask = *(unsigned int *)(sqRing + params.sq_off.ring_mask);
+	loop->sqEntries = params.sq_entries;
+	loop->cqHead = (unsigned int *)(cqRing + params.cq_off.head);
+	loop->cqTail = (unsigned int *)(cqRing + params.cq_off.tail);
+	loop->cqMask = *(unsigned int *)(cqRing + params.cq_off.ring_mask);
+	loop->cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+	loop->sqes = sqes;
+
+	struct io_uring_probe *probe = calloc(1, probeSize);
+	if ((probe != NULL) && (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) == 0))
+	{
+		loop->hasChildWait = (probe->last_op >= IORING_OP_WAITID) &&
+			((probe->ops[IORING_OP_WAITID].flags & IO_URING_OP_SUPPORTED) != 0);
+	}
+	free(probe);
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - the event loop
+ * *  fd - the descriptor
+ * *  operation - EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * *  events - EPOLLIN and EPOLLOUT, which are POLLIN and POLLOUT
+ * *  data - what the events for it come back with
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Starts, changes or stops watching a descriptor, as epoll_ctl
+ * *	does. With an io_uring nothing is sent yet: the polls that
+ * *	change are queued and go in with the next wait, and a poll that
+ * *	is replaced or dropped is cancelled there too. A descriptor can
+ * *	be closed right after it is dropped.
+ * *
+ * ***************************************************************/
+void WatchEvent(struct EventLoop *loop, int fd, int operation, unsigned int events, unsigned long long data)
+{
+	if (loop->backend == EVENTS_EPOLL)
+	{
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.u64 = data;
+		epoll_ctl(loop->fd, operation, fd, &event);
+		return;
+	}
+
+	if (fd >= loop->watchCapacity)
+	{
+		int capacity = (loop->watchCapacity == 0) ? 256 : loop->watchCapacity;
+		while (capacity <= fd)
+		{
+			capacity *= 2;
+		}
+		struct EventWatch *watches = realloc(loop->watches, capacity * sizeof(struct EventWatch));
+		int *armQueue = realloc(loop->armQueue, capacity * sizeof(int));
+		if (watches != NULL)
+		{
+			loop->watches = watches;
+		}
+		if (armQueue != NULL)
+		{
+			loop->armQueue = armQueue;
+		}
+		if ((watches == NULL) || (armQueue == NULL))
+		{
+			return;
+		}
+		memset(watches + loop->watchCapacity, 0, (capacity - loop->watchCapacity) * sizeof(struct EventWatch));
+		loop->watchCapacity = capacity;
+	}
+
+	struct EventWatch *watch = &loop->watches[fd];
+	if (watch->isArmed)
+	{
+		struct io_uring_sqe *sqe = NextEventSqe(loop);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ((unsigned long long)watch->generation << 32) | (unsigned int)fd;
+		sqe->user_data = EVENT_DATA_IGNORE;
+		watch->isArmed = 0;
+	}
+	watch->generation++;
+	watch->inUse = (operation != EPOLL_CTL_DEL);
+	watch->events = events;
+	watch->data = data;
+	if ((watch->inUse) && (!watch->isQueued))
+	{
+		watch->isQueued = 1;
+		loop->armQueue[loop->armCount] = fd;
+		loop->armCount++;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - the event loop
+ * *  data - what a child event comes back with
+ * *  holdSignal - 1 to hold SIGCHLD from now on, or 0 if the caller
+ * *               holds it whenever it waits on the loop
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Has the loop report children that exit, stop or continue,
+ * *	after they have been reaped into the reap ring. An io_uring
+ * *	that can wait for children does it with one IORING_OP_WAITID
+ * *	left waiting and SIGCHLD held, so no signal or self-pipe write
+ * *	is needed for each one. Otherwise the SIGCHLD handler reaps and
+ * *	wakes the loop through the self-pipe.
+ * *
+ * ***************************************************************/
+void WatchChildren(struct EventLoop *loop, unsigned long long data, int holdSignal)
+{
+	sigset_t childMask;
+
+	loop->childData = data;
+	if ((loop->backend == EVENTS_URING) && (loop->hasChildWait))
+	{
+		if (holdSignal)
+		{
+			sigemptyset(&childMask);
+			sigaddset(&childMask, SIGCHLD);
+			sigprocmask(SIG_BLOCK, &childMask, NULL);
+		}
+		loop->isWatchingChildren = 1;
+		return;
+	}
+	WatchEvent(loop, selfPipe[0], EPOLL_CTL_ADD, EPOLLIN, data);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - an io_uring event loop
+ * *
+ * * Exit:
+ * *  Returns a cleared submission entry.
+ * *
+ * * Purpose:
+ * *	Takes the next free entry in the submission ring, sending the
+ * *	ones already filled in to the kernel first if it is full.
+ * *
+ * ***************************************************************/
+struct io_uring_sqe *NextEventSqe(struct EventLoop *loop)
+{
+	unsigned int tail = *loop->sqTail;
+
+	while (tail - __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE) >= loop->sqEntries)
+	{
+		if ((syscall(__NR_io_uring_enter, loop->fd, loop->toSubmit, 0, 0, NULL, 0) < 0) && (errno != EINTR))
+		{
+			break;
+		}
+		loop->toSubmit = 0;
+	}
+
+	unsigned int index = tail & loop->sqMask;
+	struct io_uring_sqe *sqe = &loop->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	loop->sqArray[index] = index;
+	__atomic_store_n(loop->sqTail, tail + 1, __ATOMIC_RELEASE);
+	loop->toSubmit++;
+
+	return sqe;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  loop - the event loop
+ * *  records - the return array for the events
+ * *  max - how many fit in it
+ * *
+ * * Exit:
+ * *  Returns how many events there are, at least one.
+ * *  Returns -1, on an error other than EINTR, which returns 0.
+ * *
+ * * Purpose:
+ * *	Waits for the next events. With an io_uring, the polls that
+ * *	fired or changed are armed again and the child wait is put back,
+ * *	all in the same io_uring_enter that waits, so a quiet loop costs
+ * *	one system call for each time it wakes.
+ * *
+ * ***************************************************************/
+int WaitEvents(struct EventLoop *loop, struct EventRecord *records, int max)
+{
+	struct epoll_event events[SERVER_EPOLL_EVENTS];
+	int count = 0;
+	int i;
+
+	if (loop->backend == EVENTS_EPOLL)
+	{
+		count = epoll_wait(loop->fd, events, (max < SERVER_EPOLL_EVENTS) ? max : SERVER_EPOLL_EVENTS, -1);
+		for (i = 0; i < count; i++)
+		{
+			records[i].events = events[i].events;
+			records[i].data = events[i].data.u64;
+		}
+		return ((count < 0) && (errno == EINTR)) ? 0 : count;
+	}
+
+	for (i = 0; i < loop->armCount; i++)
+	{
+		int fd = loop->armQueue[i];
+		struct EventWatch *watch = &loop->watches[fd];
+		watch->isQueued = 0;
+		if ((watch->inUse) && (!watch->isArmed) && (watch->events != 0))
+		{
+			struct io_uring_sqe *sqe = NextEventSqe(loop);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = fd;
+			sqe->poll32_events = watch->events;
+			sqe->user_data = ((unsigned long long)watch->generation << 32) | (unsigned int)fd;
+			watch->isArmed = 1;
+		}
+	}
+	loop->armCount = 0;
+	if ((loop->isWatchingChildren) && (!loop->isChildArmed) && (!loop->isChildless))
+	{
+		struct io_uring_sqe *sqe = NextEventSqe(loop);
+		sqe->opcode = IORING_OP_WAITID;
+		sqe->fd = 0;
+		sqe->len = P_ALL;
+		sqe->file_index = WEXITED | WSTOPPED | WCONTINUED | WNOWAIT;
+		sqe->addr2 = (unsigned long long)(uintptr_t)&loop->childInfo;
+		sqe->user_data = EVENT_DATA_CHILD;
+		loop->isChildArmed = 1;
+	}
+
+	while (count == 0)
+	{
+		unsigned int head = *loop->cqHead;
+		unsigned int wait = (head == __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE)) ? 1 : 0;
+		if (syscall(__NR_io_uring_enter, loop->fd, loop->toSubmit, wait, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		{
+			return (errno == EINTR) ? 0 : -1;
+		}
+		loop->toSubmit = 0;
+
+		unsigned int tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+		while ((head != tail) && (count < max))
+		{
+			struct io_uring_cqe *cqe = &loop->cqes[head & loop->cqMask];
+			unsigned long long data = cqe->user_data;
+			int result = cqe->res;
+			head++;
+
+			if (data == EVENT_DATA_CHILD)
+			{
+				// The child is only looked at; reaping it gets its usage
+				loop->isChildArmed = 0;
+				if (result == -ECHILD)
+				{
+					loop->isChildless = 1;
+					continue;
+				}
+				if (result < 0)
+				{
+					// No waitid after all, so go back to the signal
+					sigset_t childMask;
+					loop->isWatchingChildren = 0;
+					sigemptyset(&childMask);
+					sigaddset(&childMask, SIGCHLD);
+					WatchEvent(loop, selfPipe[0], EPOLL_CTL_ADD, EPOLLIN, loop->childData);
+					sigprocmask(SIG_UNBLOCK, &childMask, NULL);
+				}
+				ReapChildren();
+				records[count].events = EPOLLIN;
+				records[count].data = loop->childData;
+				count++;
+				continue;
+			}
+			if (data == EVENT_DATA_IGNORE)
+			{
+				continue;
+			}
+
+			int fd = (int)(data & 0xffffffff);
+			struct EventWatch *watch = (fd < loop->watchCapacity) ? &loop->watches[fd] : NULL;
+			if ((watch == NULL) || (!watch->inUse) || (watch->generation != (unsigned int)(data >> 32)))
+			{
+				continue;
+			}
+			watch->isArmed = 0;
+			if (!watch->isQueued)
+			{
+				watch->isQueued = 1;
+				loop->armQueue[loop->armCount] = fd;
+				loop->armCount++;
+			}
+			records[count].events = (result < 0) ? EPOLLERR : (unsigned int)result;
+			records[count].data = watch->data;
+			count++;
+		}
+		__atomic_store_n(loop->cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  waitMask - the signal mask to wait with, which lets SIGCHLD in
+ * *
+ * * Exit:
+ * *  Returns 1, if stdin has a line to read.
+ * *  Returns 0, otherwise.
+ * *
+ * * Purpose:
+ * *	Waits once on the interactive shell's event loop, for a caller
+ * *	that holds SIGCHLD and calls ReportCompletions after. Output
+ * *	that came in from a job run with "--log" is copied on here.
+ * *	The child wait needs SIGCHLD held while it waits; the epoll
+ * *	fallback lets it in, so the reaper can wake it through the
+ * *	self-pipe.
+ * *
+ * ***************************************************************/
+int WaitShellEvents(const sigset_t *waitMask)
+{
+	struct EventRecord events[SHELL_EVENTS];
+	sigset_t heldMask;
+	int isInputReady = 0;
+	int i;
+
+	// The reaper may have run before SIGCHLD was held, and the child
+	//  wait will not wake for what it already took
+	if (__atomic_load_n(&reapHead, __ATOMIC_ACQUIRE) != reapTail)
+	{
+		return 0;
+	}
+
+	sigprocmask(SIG_SETMASK, (shellEvents.isWatchingChildren) ? NULL : waitMask, &heldMask);
+	int eventCount = WaitEvents(&shellEvents, events, SHELL_EVENTS);
+	sigprocmask(SIG_SETMASK, &heldMask, NULL);
+
+	// Without a working loop the shell goes back to waiting on its own
+	if (eventCount < 0)
+	{
+		fprintf(stderr, "smallsh: %s: %s\n", (shellEvents.backend == EVENTS_URING) ? "io_uring" : "epoll",
+			strerror(errno));
+		close(shellEvents.fd);
+		shellEvents.fd = -1;
+		return 0;
+	}
+
+	for (i = 0; i < eventCount; i++)
+	{
+		int tag = (int)(events[i].data >> 32);
+		int fd = (int)(events[i].data & 0xffffffff);
+
+		if (tag == SHELL_TAG_INPUT)
+		{
+			isInputReady = 1;
+		}
+		else if (tag == SHELL_TAG_CAPTURE)
+		{
+			CopyCapture(fd);
+		}
+	}
+
+	return isInputReady;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  listenFd - the listening socket
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Accepts every waiting connection. A connection past the client
+ * *	limit is closed at once.
+ * *
+ * ***************************************************************/
+void AcceptClients(int listenFd)
+{
+	int clientFd;
+	int i;
+
+	while ((clientFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		for (i = 0; (i < SERVER_MAX_CLIENTS) && (serverClients[i].fd >= 0); i++)
+		{
+		}
+		if (i == SERVER_MAX_CLIENTS)
+		{
+			close(clientFd);
+			continue;
+		}
+
+		memset(&serverClients[i], 0, sizeof(serverClients[i]));
+		serverClients[i].fd = clientFd;
+		WatchServerFd(clientFd, EPOLL_CTL_ADD, EPOLLIN, SERVER_TAG_CLIENT, i);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - a connected client
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Reads what the client sent and starts a request for each whole
+ * *	run frame. A bad frame closes the connection. At the end of the
+ * *	client's input, the connection is closed once every request
+ * *	has been answered, so a client can shut down its side after
+ * *	sending.
+ * *
+ * ***************************************************************/
+void ReadClient(int clientIndex)
+{
+	struct ServerClient *client = &serverClients[clientIndex];
+	size_t used = 0;
+
+	while (1)
+	{
+		if (client->inputLength == client->inputCapacity)
+		{
+			size_t capacity = (client->inputCapacity == 0) ? 4096 : client->inputCapacity * 2;
+			char *bigger = (capacity <= SERVER_MAX_LINE + FRAME_HEADER_SIZE) ?
+				realloc(client->input, capacity) : NULL;
+			if (bigger == NULL)
+			{
+				CloseClient(clientIndex);
+				return;
+			}
+			client->input = bigger;
+			client->inputCapacity = capacity;
+		}
+
+		ssize_t bytesRead = read(client->fd, client->input + client->inputLength,
+			client->inputCapacity - client->inputLength);
+		if (bytesRead == 0)
+		{
+			client->isInputDone = 1;
+			UpdateClientEvents(clientIndex);
+			CloseIdleClient(clientIndex);
+			return;
+		}
+		if (bytesRead < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN)
+			{
+				CloseClient(clientIndex);
+				return;
+			}
+			break;
+		}
+		client->inputLength += bytesRead;
+
+		// Start every whole frame in the buffer
+		while (client->inputLength - used >= FRAME_HEADER_SIZE)
+		{
+			const unsigned char *header = (const unsigned char *)client->input + used;
+			unsigned int id = ReadFrameNumber(header + 1);
+			unsigned int length = ReadFrameNumber(header + 5);
+			if ((header[0] != FRAME_RUN) || (length > SERVER_MAX_LINE))
+			{
+				CloseClient(clientIndex);
+				return;
+			}
+			if (client->inputLength - used < FRAME_HEADER_SIZE + length)
+			{
+				break;
+			}
+			StartRequest(clientIndex, id, client->input + used + FRAME_HEADER_SIZE, length);
+			used += FRAME_HEADER_SIZE + length;
+		}
+		memmove(client->input, client->input + used, client->inputLength - used);
+		client->inputLength -= used;
+		used = 0;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client that sent the request
+ * *  id - the client's id for it
+ * *  line - the command line, not null terminated
+ * *  length - its length
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Parses, expands and starts one command line. Builtins that only
+ * *	read their arguments, like echo and test, run in the server
+ * *	itself, which makes them a round trip with no process at all.
+ * *	Anything else starts as a quiet job, the same way a background
+ * *	command does, with its stdout and stderr on pipes the server
+ * *	watches. Other builtins run in a child there, so a request
+ * *	cannot hold up the server or change it for the other clients.
+ * *	A line with ";", "&&" or "||" in it runs in a copy of the
+ * *	shell, which is the request's job. What the shell itself
+ * *	prints while parsing and starting the line is caught in the
+ * *	capture files and sent first.
+ * *
+ * ***************************************************************/
+void StartRequest(int clientIndex, unsigned int id, const char *line, size_t length)
+{
+	struct ServerRequest *request = NULL;
+	struct CommandList list;
+	struct Pipeline pipeline;
+	int outputPipe[2] = { -1, -1 };
+	int errorPipe[2] = { -1, -1 };
+	int savedFds[2];
+	int requestIndex;
+	int i;
+
+	for (requestIndex = 0; requestIndex < SERVER_MAX_REQUESTS; requestIndex++)
+	{
+		if (!serverRequests[requestIndex].inUse)
+		{
+			request = &serverRequests[requestIndex];
+			break;
+		}
+	}
+	if (request == NULL)
+	{
+		QueueStatus(clientIndex, id, 126);
+		return;
+	}
+
+	memset(request, 0, sizeof(*request));
+	request->inUse = 1;
+	request->client = clientIndex;
+	request->id = id;
+	request->fds[0] = -1;
+	request->fds[1] = -1;
+	request->jobIndex = -1;
+	request->exitStatus = 1;
+	serverClients[clientIndex].requestCount++;
+
+	fflush(stdout);
+	fflush(stderr);
+	savedFds[0] = fcntl(1, F_DUPFD_CLOEXEC, 10);
+	savedFds[1] = fcntl(2, F_DUPFD_CLOEXEC, 10);
+	for (i = 0; i < 2; i++)
+	{
+		ftruncate(serverCapture[i], 0);
+		lseek(serverCapture[i], 0, SEEK_SET);
+		dup2(serverCapture[i], i + 1);
+	}
+
+	ArenaReset(&serverArena);
+	char *copy = ArenaAlloc(&serverArena, length + 1);
+	if (copy != NULL)
+	{
+		memcpy(copy, line, length);
+		copy[length] = '\0';
+		RemoveNewLineAndAddNullTerm(copy);
+	}
+
+	int isOneLine = (copy != NULL) && (strchr(copy, '\n') == NULL);
+	if ((copy == NULL) || (ParseCommandList(copy, &list, &serverArena) < 0))
+	{
+		request->exitStatus = 2;
+		list.count = 0;
+	}
+	else if (list.count == 0)
+	{
+		request->exitStatus = 0;
+	}
+	int hasDefinition = 0;
+	for (i = 0; i < list.count; i++)
+	{
+		isOneLine = (isOneLine) && (list.pipelines[i].hereDocCount == 0);
+		hasDefinition = (hasDefinition) || ((list.pipelines[i].compound != NULL) &&
+			(list.pipelines[i].compound->kind == COMPOUND_FUNCTION));
+	}
+	if (list.count > 0)
+	{
+		pipeline = list.pipelines[0];
+	}
+
+	if ((list.count > 0) && (!isOneLine))
+	{
+		printf("smallsh: a request is one command line, without here-docs\n");
+		request->exitStatus = 2;
+	}
+	else if (hasDefinition)
+	{
+		printf("smallsh: definitions are not supported in server mode\n");
+		request->exitStatus = 2;
+	}
+	else if ((list.count > 1) || ((list.count == 1) && (pipeline.compound != NULL)))
+	{
+		if ((pipe2(outputPipe, O_CLOEXEC) == 0) && (pipe2(errorPipe, O_CLOEXEC) == 0))
+		{
+			fflush(stdout);
+			fflush(stderr);
+			dup2(outputPipe[1], 1);
+			dup2(errorPipe[1], 2);
+
+			RefreshEnvironment();
+			pid_t listPid = ForkCommandList(&list, -1);
+			if (listPid > 0)
+			{
+				request->jobIndex = AddJob(&listPid, 1, -1, copy);
+				if (request->jobIndex >= 0)
+				{
+					jobs[request->jobIndex].isQuiet = 1;
+				}
+			}
+		}
+		else
+		{
+			printf("smallsh: cannot make the output pipes: %s\n", strerror(errno));
+			request->exitStatus = 126;
+		}
+	}
+	else if ((list.count == 1) && (ExpandPipeline(&pipeline) == 0))
+	{
+		struct Command *first = &pipeline.commands[0];
+		struct Builtin *builtin = (first->argc > 0) ? FindBuiltin(first->argv[0]) : NULL;
+
+		if (first->argc == 0)
+		{
+			request->exitStatus = 0;
+		}
+		else if (AssignmentNameLength(first->argv[0]) > 0)
+		{
+			printf("smallsh: assignments are not supported in server mode\n");
+			request->exitStatus = 2;
+		}
+		else if ((pipeline.count == 1) && (IsInlineBuiltin(builtin)))
+		{
+			request->exitStatus = RunBuiltinInShell(builtin, first);
+		}
+		else if ((pipe2(outputPipe, O_CLOEXEC) == 0) && (pipe2(errorPipe, O_CLOEXEC) == 0))
+		{
+			fflush(stdout);
+			fflush(stderr);
+			dup2(outputPipe[1], 1);
+			dup2(errorPipe[1], 2);
+
+			RefreshEnvironment();
+			LaunchPipeline(&pipeline, 0, pipeline.pids);
+
+			char description[MAX_JOB_COMMAND];
+			DescribePipeline(&pipeline, description, sizeof(description));
+			for (i = 0; i < pipeline.count; i++)
+			{
+				if (pipeline.pids[i] > 0)
+				{
+					break;
+				}
+			}
+			if (i < pipeline.count)
+			{
+				request->jobIndex = AddJob(pipeline.pids, pipeline.count, -1, description);
+				if (request->jobIndex >= 0)
+				{
+					jobs[request->jobIndex].isQuiet = 1;
+				}
+			}
+		}
+		else
+		{
+			printf("smallsh: cannot make the output pipes: %s\n", strerror(errno));
+			request->exitStatus = 126;
+		}
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(savedFds[0], 1);
+	dup2(savedFds[1], 2);
+	close(savedFds[0]);
+	close(savedFds[1]);
+
+	// Anything the shell printed goes out before the command's output
+	for (i = 0; i < 2; i++)
+	{
+		char buffer[SERVER_READ_SIZE];
+		ssize_t bytesRead;
+		lseek(serverCapture[i], 0, SEEK_SET);
+		while ((bytesRead = read(serverCapture[i], buffer, sizeof(buffer))) > 0)
+		{
+			if ((i == 0) && (captureLogFd >= 0))
+			{
+				WriteAll(captureLogFd, buffer, bytesRead);
+			}
+			QueueFrame(clientIndex, (i == 0) ? FRAME_STDOUT : FRAME_STDERR, id, buffer, bytesRead);
+		}
+	}
+
+	if (outputPipe[0] >= 0)
+	{
+		close(outputPipe[1]);
+		request->fds[0] = outputPipe[0];
+		WatchServerFd(request->fds[0], EPOLL_CTL_ADD, EPOLLIN, SERVER_TAG_OUTPUT, requestIndex * 2);
+	}
+	if (errorPipe[0] >= 0)
+	{
+		close(errorPipe[1]);
+		request->fds[1] = errorPipe[0];
+		WatchServerFd(request->fds[1], EPOLL_CTL_ADD, EPOLLIN, SERVER_TAG_OUTPUT, (requestIndex * 2) + 1);
+	}
+	FinishRequest(requestIndex);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  builtin - a builtin, or NULL
+ * *
+ * * Exit:
+ * *  Returns 1, if the server can run it itself.
+ * *  Returns 0, otherwise.
+ * *
+ * * Purpose:
+ * *	Picks the builtins that neither wait nor change the shell, so
+ * *	running them in the shell is safe for every server client and
+ * *	inside a "$(...)".
+ * *
+ * ***************************************************************/
+int IsInlineBuiltin(struct Builtin *builtin)
+{
+	static const BuiltinFunc inlineFuncs[] =
+	{
+		BuiltinEcho, BuiltinPrintf, BuiltinTrue, BuiltinFalse, BuiltinTest, BuiltinPwd,
+		BuiltinStatus
+	};
+	size_t i;
+
+	if (builtin == NULL)
+	{
+		return 0;
+	}
+	for (i = 0; i < sizeof(inlineFuncs) / sizeof(inlineFuncs[0]); i++)
+	{
+		if (builtin->func == inlineFuncs[i])
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  requestIndex - a running request
+ * *  stream - 0 for its stdout, 1 for its stderr
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Passes what the command wrote on to the client, and its stdout
+ * *	to the log too with "--log". What is in the pipe is teed into
+ * *	the log and then sent as one frame. Once the client has too
+ * *	much unsent output, the request's pipes are no longer read, so
+ * *	a slow client slows its own commands instead of growing the
+ * *	server.
+ * *
+ * ***************************************************************/
+void ForwardOutput(int requestIndex, int stream)
+{
+	struct ServerRequest *request = &serverRequests[requestIndex];
+	char buffer[SERVER_READ_SIZE];
+	int fd = request->fds[stream];
+	int pending = 0;
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	if ((ioctl(fd, FIONREAD, &pending) == 0) && (pending > 0))
+	{
+		size_t length = (pending > CAPTURE_CHUNK) ? CAPTURE_CHUNK : pending;
+		if ((stream == 0) && (captureLogFd >= 0))
+		{
+			ssize_t copied = TeeToLog(fd, serverLogTee, length, SPLICE_F_NONBLOCK);
+			if (copied > 0)
+			{
+				length = copied;
+			}
+		}
+		SendOutput(requestIndex, stream, length);
+		return;
+	}
+
+	// Nothing is waiting, so this is the end of the output, or some
+	//  came in since the check and is read the plain way
+	ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
+	if ((bytesRead < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+	{
+		return;
+	}
+	if (bytesRead <= 0)
+	{
+		WatchEvent(&serverEvents, fd, EPOLL_CTL_DEL, 0, 0);
+		close(fd);
+		request->fds[stream] = -1;
+		FinishRequest(requestIndex);
+		return;
+	}
+
+	if ((stream == 0) && (captureLogFd >= 0))
+	{
+		WriteAll(captureLogFd, buffer, bytesRead);
+	}
+	if (request->client < 0)
+	{
+		return;
+	}
+	QueueFrame(request->client, (stream == 0) ? FRAME_STDOUT : FRAME_STDERR, request->id, buffer, bytesRead);
+
+	struct ServerClient *client = &serverClients[request->client];
+	if ((client->fd >= 0) && (client->outputLength - client->outputSent > SERVER_OUTPUT_LIMIT))
+	{
+		PauseRequests(request->client, 1);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  requestIndex - a running request
+ * *  stream - 0 for its stdout, 1 for its stderr
+ * *  length - how much is in the pipe to send
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Sends one frame of a request's output. When nothing else is
+ * *	queued for the client, the header is sent and the payload is
+ * *	spliced from the pipe to the socket, so it is never copied
+ * *	into the server. Whatever the socket does not take is read
+ * *	into the client's queue to be sent when it is writable.
+ * *
+ * ***************************************************************/
+void SendOutput(int requestIndex, int stream, size_t length)
+{
+	struct ServerRequest *request = &serverRequests[requestIndex];
+	struct ServerClient *client = (request->client >= 0) ? &serverClients[request->client] : NULL;
+	unsigned char header[FRAME_HEADER_SIZE];
+	int fd = request->fds[stream];
+	size_t sent = 0;
+
+	if ((client == NULL) || (client->fd < 0))
+	{
+		// Nobody to send it to, but the pipe still has to be emptied
+		char buffer[SERVER_READ_SIZE];
+		while (length > 0)
+		{
+			ssize_t bytesRead = read(fd, buffer, (length < sizeof(buffer)) ? length : sizeof(buffer));
+			if (bytesRead <= 0)
+			{
+				break;
+			}
+			length -= bytesRead;
+		}
+		return;
+	}
+
+	header[0] = (stream == 0) ? FRAME_STDOUT : FRAME_STDERR;
+	WriteFrameNumber(header + 1, request->id);
+	WriteFrameNumber(header + 5, (unsigned int)length);
+
+	if (client->outputSent == client->outputLength)
+	{
+		ssize_t headerSent = send(client->fd, header, sizeof(header),
+			MSG_NOSIGNAL | MSG_DONTWAIT | MSG_MORE);
+		if (headerSent > 0)
+		{
+			sent = headerSent;
+		}
+		while ((sent >= FRAME_HEADER_SIZE) && (sent < FRAME_HEADER_SIZE + length))
+		{
+			ssize_t moved = splice(fd, NULL, client->fd, NULL, FRAME_HEADER_SIZE + length - sent,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if ((moved < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+			if (moved <= 0)
+			{
+				break;
+			}
+			sent += moved;
+		}
+	}
+
+	if (sent == FRAME_HEADER_SIZE + length)
+	{
+		return;
+	}
+
+	// Queue the rest of the frame, and let FlushClient find out if
+	//  the socket failed
+	size_t headerLeft = (sent < FRAME_HEADER_SIZE) ? FRAME_HEADER_SIZE - sent : 0;
+	size_t payloadLeft = (sent > FRAME_HEADER_SIZE) ? FRAME_HEADER_SIZE + length - sent : length;
+	char *queued = ReserveOutput(request->client, headerLeft + payloadLeft);
+	if (queued == NULL)
+	{
+		return;
+	}
+	if (headerLeft > 0)
+	{
+		memcpy(queued, header + sent, headerLeft);
+	}
+	if (ReadAll(fd, queued + headerLeft, payloadLeft) < 0)
+	{
+		CloseClient(request->client);
+		return;
+	}
+	FlushClient(request->client);
+
+	if ((client->fd >= 0) && (client->outputLength - client->outputSent > SERVER_OUTPUT_LIMIT))
+	{
+		PauseRequests(request->client, 1);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Runs when the reaper wakes the server. It collects the reaped
+ * *	children and finishes each request whose job is done.
+ * *
+ * ***************************************************************/
+void CollectRequests()
+{
+	int i;
+
+	ReportCompletions();
+
+	for (i = 0; i < SERVER_MAX_REQUESTS; i++)
+	{
+		struct ServerRequest *request = &serverRequests[i];
+		if ((request->inUse) && (request->jobIndex >= 0) && (jobs[request->jobIndex].isDone))
+		{
+			int status = jobs[request->jobIndex].status;
+			request->exitStatus = (WIFSIGNALED(status)) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+			RemoveJob(request->jobIndex);
+			request->jobIndex = -1;
+			FinishRequest(i);
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  requestIndex - a request
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Sends the exit status and frees the request once its job is
+ * *	done and both of its pipes are at the end, so the status is
+ * *	always the last frame for the request.
+ * *
+ * ***************************************************************/
+void FinishRequest(int requestIndex)
+{
+	struct ServerRequest *request = &serverRequests[requestIndex];
+
+	if ((request->jobIndex >= 0) || (request->fds[0] >= 0) || (request->fds[1] >= 0))
+	{
+		return;
+	}
+
+	request->inUse = 0;
+	if (request->client >= 0)
+	{
+		serverClients[request->client].requestCount--;
+		QueueStatus(request->client, request->id, request->exitStatus);
+		CloseIdleClient(request->client);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *  id - the request the status is for
+ * *  exitStatus - its exit value, or 128 plus the signal that ended it
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Queues a status frame.
+ * *
+ * ***************************************************************/
+void QueueStatus(int clientIndex, unsigned int id, int exitStatus)
+{
+	unsigned char payload[4];
+
+	WriteFrameNumber(payload, (unsigned int)exitStatus);
+	QueueFrame(clientIndex, FRAME_STATUS, id, (const char *)payload, sizeof(payload));
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *  type - the frame type
+ * *  id - the request the frame is for
+ * *  payload - what it carries
+ * *  length - how long that is
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Adds a frame to the client's output and sends what it can.
+ * *
+ * ***************************************************************/
+void QueueFrame(int clientIndex, char type, unsigned int id, const char *payload, size_t length)
+{
+	unsigned char *header = (unsigned char *)ReserveOutput(clientIndex, FRAME_HEADER_SIZE + length);
+
+	if (header == NULL)
+	{
+		return;
+	}
+
+	header[0] = type;
+	WriteFrameNumber(header + 1, id);
+	WriteFrameNumber(header + 5, (unsigned int)length);
+	memcpy(header + FRAME_HEADER_SIZE, payload, length);
+
+	FlushClient(clientIndex);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *  length - how much is to be queued
+ * *
+ * * Exit:
+ * *  Returns where to put it, at the end of the client's output.
+ * *  Returns NULL, if the client has gone or there is no memory for
+ * *  it, in which case the client is closed.
+ * *
+ * * Purpose:
+ * *	Makes room in a client's output queue and counts the space as
+ * *	queued.
+ * *
+ * ***************************************************************/
+char *ReserveOutput(int clientIndex, size_t length)
+{
+	struct ServerClient *client = &serverClients[clientIndex];
+	size_t needed = client->outputLength + length;
+
+	if (client->fd < 0)
+	{
+		return NULL;
+	}
+
+	if (needed > client->outputCapacity)
+	{
+		size_t capacity = (client->outputCapacity == 0) ? 4096 : client->outputCapacity;
+		while (capacity < needed)
+		{
+			capacity *= 2;
+		}
+		char *bigger = realloc(client->output, capacity);
+		if (bigger == NULL)
+		{
+			CloseClient(clientIndex);
+			return NULL;
+		}
+		client->output = bigger;
+		client->outputCapacity = capacity;
+	}
+
+	char *space = client->output + client->outputLength;
+	client->outputLength = needed;
+
+	return space;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Sends as much queued output as the socket takes. If some is
+ * *	left, the server waits for the socket to be writable; once it
+ * *	is all sent, paused requests are read again.
+ * *
+ * ***************************************************************/
+void FlushClient(int clientIndex)
+{
+	struct ServerClient *client = &serverClients[clientIndex];
+
+	while ((client->fd >= 0) && (client->outputSent < client->outputLength))
+	{
+		ssize_t sent = send(client->fd, client->output + client->outputSent,
+			client->outputLength - client->outputSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			CloseClient(clientIndex);
+			return;
+		}
+		client->outputSent += sent;
+	}
+	if (client->fd < 0)
+	{
+		return;
+	}
+
+	int isBehind = (client->outputSent < client->outputLength);
+	if (isBehind != client->isWaitingToWrite)
+	{
+		client->isWaitingToWrite = isBehind;
+		UpdateClientEvents(clientIndex);
+	}
+	if (!isBehind)
+	{
+		client->outputLength = 0;
+		client->outputSent = 0;
+		if (client->isPaused)
+		{
+			PauseRequests(clientIndex, 0);
+		}
+		CloseIdleClient(clientIndex);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Waits for more requests until the client's input ends, and
+ * *	for the socket to be writable while output is queued.
+ * *
+ * ***************************************************************/
+void UpdateClientEvents(int clientIndex)
+{
+	struct ServerClient *client = &serverClients[clientIndex];
+	unsigned int events = 0;
+
+	if (!client->isInputDone)
+	{
+		events |= EPOLLIN;
+	}
+	if (client->isWaitingToWrite)
+	{
+		events |= EPOLLOUT;
+	}
+	WatchServerFd(client->fd, EPOLL_CTL_MOD, events, SERVER_TAG_CLIENT, clientIndex);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Closes a client that has sent everything, once it has no
+ * *	requests running and no output left to send.
+ * *
+ * ***************************************************************/
+void CloseIdleClient(int clientIndex)
+{
+	struct ServerClient *client = &serverClients[clientIndex];
+
+	if ((client->fd >= 0) && (client->isInputDone) && (client->requestCount == 0) &&
+		(client->outputSent == client->outputLength))
+	{
+		CloseClient(clientIndex);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *  pause - 1 to stop reading its requests' output, 0 to start again
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Applies back pressure to every request of a client.
+ * *
+ * ***************************************************************/
+void PauseRequests(int clientIndex, int pause)
+{
+	int i;
+	int stream;
+
+	serverClients[clientIndex].isPaused = pause;
+	for (i = 0; i < SERVER_MAX_REQUESTS; i++)
+	{
+		if ((!serverRequests[i].inUse) || (serverRequests[i].client != clientIndex))
+		{
+			continue;
+		}
+		for (stream = 0; stream < 2; stream++)
+		{
+			if (serverRequests[i].fds[stream] >= 0)
+			{
+				WatchServerFd(serverRequests[i].fds[stream], EPOLL_CTL_MOD, (pause) ? 0 : EPOLLIN,
+					SERVER_TAG_OUTPUT, (i * 2) + stream);
+			}
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  clientIndex - the client
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Closes a client. Its requests keep running, but their output
+ * *	is thrown away.
+ * *
+ * ***************************************************************/
+void CloseClient(int clientIndex)
+{
+	struct ServerClient *client = &serverClients[clientIndex];
+	int i;
+
+	if (client->fd < 0)
+	{
+		return;
+	}
+
+	if (client->isPaused)
+	{
+		PauseRequests(clientIndex, 0);
+	}
+	for (i = 0; i < SERVER_MAX_REQUESTS; i++)
+	{
+		if ((serverRequests[i].inUse) && (serverRequests[i].client == clientIndex))
+		{
+			serverRequests[i].client = -1;
+		}
+	}
+
+	WatchEvent(&serverEvents, client->fd, EPOLL_CTL_DEL, 0, 0);
+	close(client->fd);
+	free(client->input);
+	free(client->output);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  socketPath - the server's socket
+ * *  argc, argv - the words of the command line to run
+ * *
+ * * Exit:
+ * *  Returns the command's exit status.
+ * *  Returns 126, if the server cannot be reached.
+ * *
+ * * Purpose:
+ * *	Sends one command line to a server and copies its output to
+ * *	this process's stdout and stderr as it arrives. The words are
+ * *	quoted, so the server runs the same words it was given.
+ * *
+ * ***************************************************************/
+int RunClient(const char *socketPath, int argc, char **argv)
+{
+	struct sockaddr_un address;
+	unsigned char header[FRAME_HEADER_SIZE];
+	char line[SERVER_MAX_LINE];
+	char payload[SERVER_READ_SIZE];
+	ssize_t length = QuoteWords(argc, argv, line, sizeof(line));
+
+	if (length < 0)
+	{
+		fprintf(stderr, "smallsh: command line is too long\n");
+		return 126;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+	int serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((serverFd < 0) || (connect(serverFd, (struct sockaddr *)&address, sizeof(address)) < 0))
+	{
+		fprintf(stderr, "smallsh: %s: %s\n", socketPath, strerror(errno));
+		return 126;
+	}
+
+	header[0] = FRAME_RUN;
+	WriteFrameNumber(header + 1, 1);
+	WriteFrameNumber(header + 5, (unsigned int)length);
+	if ((WriteAll(serverFd, (const char *)header, sizeof(header)) < 0) || (WriteAll(serverFd, line, length) < 0))
+	{
+		fprintf(stderr, "smallsh: %s: %s\n", socketPath, strerror(errno));
+		return 126;
+	}
+
+	while (ReadAll(serverFd, (char *)header, sizeof(header)) == 0)
+	{
+		unsigned int frameLength = ReadFrameNumber(header + 5);
+		while (frameLength > 0)
+		{
+			size_t chunk = (frameLength < sizeof(payload)) ? frameLength : sizeof(payload);
+			if (ReadAll(serverFd, payload, chunk) < 0)
+			{
+				return 126;
+			}
+			frameLength -= chunk;
+			if (header[0] == FRAME_STATUS)
+			{
+				close(serverFd);
+				return (int)ReadFrameNumber((const unsigned char *)payload);
+			}
+			WriteAll((header[0] == FRAME_STDERR) ? 2 : 1, payload, chunk);
+		}
+	}
+
+	fprintf(stderr, "smallsh: %s: the server closed the connection\n", socketPath);
+	return 126;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the words to join
+ * *  line - the return variable for the command line
+ * *  size - the size of line
+ * *
+ * * Exit:
+ * *  Returns the length of the command line, without its NUL.
+ * *  Returns -1, if it does not fit.
+ * *
+ * * Purpose:
+ * *	Joins words into a command line a shell splits back into the
+ * *	same words. Each is put in single quotes, with a quote in it
+ * *	written as '\''.
+ * *
+ * ***************************************************************/
+ssize_t QuoteWords(int argc, char **argv, char *line, size_t size)
+{
+	size_t length = 0;
+	const char *current;
+	int i;
+
+	for (i = 0; i < argc; i++)
+	{
+		// The worst case is every character a quote, plus the space
+		//  and the outer quotes
+		if (length + (strlen(argv[i]) * 4) + 4 > size)
+		{
+			return -1;
+		}
+		if (i > 0)
+		{
+			line[length++] = ' ';
+		}
+		line[length++] = '\'';
+		for (current = argv[i]; *current != '\0'; current++)
+		{
+			if (*current == '\'')
+			{
+				memcpy(line + length, "'\\''", 4);
+				length += 4;
+			}
+			else
+			{
+				line[length++] = *current;
+			}
+		}
+		line[length++] = '\'';
+	}
+	line[length] = '\0';
+
+	return length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  bytes - four bytes in network byte order
+ * *
+ * * Exit:
+ * *  Returns the number they hold.
+ * *
+ * * Purpose:
+ * *	Reads a request id, length or status from a frame.
+ * *
+ * ***************************************************************/
+unsigned int ReadFrameNumber(const unsigned char *bytes)
+{
+	return ((unsigned int)bytes[0] << 24) | ((unsigned int)bytes[1] << 16) |
+		((unsigned int)bytes[2] << 8) | bytes[3];
+}
+
+/**************************************************************
+ * * Entry:
+ * *  bytes - where to write four bytes
+ * *  value - the number to write
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes a number into a frame in network byte order.
+ * *
+ * ***************************************************************/
+void WriteFrameNumber(unsigned char *bytes, unsigned int value)
+{
+	bytes[0] = (value >> 24) & 0xff;
+	bytes[1] = (value >> 16) & 0xff;
+	bytes[2] = (value >> 8) & 0xff;
+	bytes[3] = value & 0xff;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fd - where to write
+ * *  data - what to write
+ * *  length - how much
+ * *
+ * * Exit:
+ * *  Returns 0, if it was all written.
+ * *  Returns -1, on an error.
+ * *
+ * * Purpose:
+ * *	Writes all of a buffer to a blocking descriptor.
+ * *
+ * ***************************************************************/
+int WriteAll(int fd, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fd - where to read from
+ * *  data - where to put it
+ * *  length - how much to read
+ * *
+ * * Exit:
+ * *  Returns 0, if it was all read.
+ * *  Returns -1, at the end of the input or on an error.
+ * *
+ * * Purpose:
+ * *	Reads an exact amount from a blocking descriptor.
+ * *
+ * ***************************************************************/
+int ReadAll(int fd, char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t bytesRead = read(fd, data, length);
+		if (bytesRead < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (bytesRead == 0)
+		{
+			return -1;
+		}
+		data += bytesRead;
+		length -= bytesRead;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed command line
+ * *
+ * * Exit:
+ * *  Returns 0, if command executed without errors.
+ * *  Returns any other number, if command executed with errors.
+ * *
+ * * Purpose:
+ * *	Runs the specified background command or pipeline and adds it
+ * *	to the job table.
+ * *
+ * ***************************************************************/
+int RunBackGroundCommand(struct Pipeline *pipeline)
+{	
+	int returnStatus = 0;
+	pid_t *pids = pipeline->pids;
+	char pidNumberStr[12];
+	pid_t pgid;
+	int i;
+
+	// With limits set, the job gets a cgroup of its own and its
+	//  children set the rlimits before they exec
+	char *cgroup = NULL;
+	if (jobLimitCount > 0)
+	{
+		cgroup = MakeJobCgroup();
+		isLaunchLimited = 1;
+		launchCgroup = cgroup;
+	}
+	pgid = LaunchPipeline(pipeline, 0, pids);
+	isLaunchLimited = 0;
+	launchCgroup = NULL;
+
+	// The job is reported by its last stage, like a single command.
+	//  The reaper only reports it between lines, after it is added.
+	pid_t spawnPid = -1;
+	for (i = 0; i < pipeline->count; i++)
+	{
+		if (pids[i] > 0)
+		{
+			spawnPid = pids[i];
+		}
+	}
+	if (spawnPid < 0)
+	{
+		if (cgroup != NULL)
+		{
+			rmdir(cgroup);
+			free(cgroup);
+		}
+		return 1;
+	}
+
+	char description[MAX_JOB_COMMAND];
+	DescribePipeline(pipeline, description, sizeof(description));
+	int jobIndex = AddJob(pids, pipeline->pidCount, pgid, description);
+	if (jobIndex < 0)
+	{
+		printf("smallsh: job table is full, pid %d is not tracked\n", spawnPid);
+		free(cgroup);
+	}
+	else
+	{
+		// Not the capture, which is added after the stages
+		jobs[jobIndex].pid = spawnPid;
+		jobs[jobIndex].captureFd = pipeline->captureFd;
+		jobs[jobIndex].cgroup = cgroup;
+		jobs[jobIndex].number = NextJobNumber();
+		currentJob = jobIndex;
+	}
+
+	// Output the process ID message for background processes
+	snprintf(pidNumberStr, sizeof(pidNumberStr), "%d", spawnPid);
+	printf("background pid is %s\n", pidNumberStr);
+	lastBackgroundPid = spawnPid;
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  sig - the signal number
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Is the signal hander for any child signals. It only reaps the
+ * *	children into the reap ring and wakes the shell; everything it
+ * *	calls is async-signal-safe. The shell loop reports them.
+ * *
+ * ***************************************************************/
+static void sigchld_handler (int sig)
+{
+	int savedErrno = errno;
+
+	ReapChildren();
+	write(selfPipe[1], "c", 1);
+
+	errno = savedErrno;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  sig - the signal number
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Is the signal handler for SIGTSTP. It toggles foreground-only
+ * *	mode, where "&" is ignored, and says so right away with
+ * *	write(), which is async-signal-safe.
+ * *
+ * ***************************************************************/
+static void sigtstp_handler (int sig)
+{
+	static const char enterMsg[] = "\nEntering foreground-only mode (& is now ignored)\n";
+	static const char exitMsg[] = "\nExiting foreground-only mode\n";
+	int savedErrno = errno;
+
+	if (foreGroundOnly)
+	{
+		foreGroundOnly = 0;
+		write(1, exitMsg, sizeof(exitMsg) - 1);
+	}
+	else
+	{
+		foreGroundOnly = 1;
+		write(1, enterMsg, sizeof(enterMsg) - 1);
+	}
+	if (atPrompt != 0)
+	{
+		write(1, (atPrompt == PROMPT_HEREDOC) ? "> " : ": ", 2);
+	}
+
+	errno = savedErrno;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Sets up the free job list and the handler's self-pipe.
+ * *
+ * ***************************************************************/
+void InitJobTable()
+{
+	int lowPipe[2];
+	int i;
+
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		freeJobs[i] = MAX_JOBS - 1 - i;
+	}
+	freeJobCount = MAX_JOBS;
+
+	// Kept out of the low descriptors, which "3>file" and the like use
+	if (pipe(lowPipe) == 0)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			selfPipe[i] = fcntl(lowPipe[i], F_DUPFD_CLOEXEC, SELF_PIPE_MIN_FD);
+			close(lowPipe[i]);
+			fcntl(selfPipe[i], F_SETFL, fcntl(selfPipe[i], F_GETFL) | O_NONBLOCK);
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Closes all zombie child processes by waiting for them, and
+ * *	records each one and its resource usage in the reap ring. Stops
+ * *	and continues are recorded too. Runs in the SIGCHLD handler,
+ * *	or in the shell loop with SIGCHLD blocked. A child that does
+ * *	not fit in the ring is left for the next call.
+ * *
+ * ***************************************************************/
+void ReapChildren()
+{
+	int status;
+	pid_t childPid;
+	unsigned int head = reapHead;
+
+	while ((head - __atomic_load_n(&reapTail, __ATOMIC_ACQUIRE)) < REAP_RING_SIZE)
+	{
+		// wait4 is a plain system call, so it is as safe here as waitpid
+		struct ReapRecord *record = &reapRing[head & (REAP_RING_SIZE - 1)];
+		childPid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &record->usage);
+		if (childPid <= 0)
+		{
+			break;
+		}
+
+		record->pid = childPid;
+		record->status = status;
+		head++;
+		TRACE(TRACE_EXIT, 0, childPid, status, "");
+
+		// Publish the record only after it is written
+		__atomic_store_n(&reapHead, head, __ATOMIC_RELEASE);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Drains the reap ring and prints a message for each background
+ * *	job whose last process has finished, or that stopped.
+ * *	Example: "background pid 4923 is done: exit value 0"
+ * *	Messages printed at the prompt go on lines of their own, and
+ * *	the prompt is shown again after them.
+ * *
+ * ***************************************************************/
+void ReportCompletions()
+{
+	char drain[64];
+	sigset_t childMask;
+	sigset_t oldMask;
+	int caughtUp = 0;
+	int reported = 0;
+
+	// Empty the self-pipe; the ring says what actually happened
+	while (read(selfPipe[0], drain, sizeof(drain)) > 0)
+	{
+	}
+
+	while (1)
+	{
+		unsigned int head = __atomic_load_n(&reapHead, __ATOMIC_ACQUIRE);
+
+		while (reapTail != head)
+		{
+			struct ReapRecord record = reapRing[reapTail & (REAP_RING_SIZE - 1)];
+			__atomic_store_n(&reapTail, reapTail + 1, __ATOMIC_RELEASE);
+			TRACE(TRACE_REAP, 0, record.pid, record.status, "");
+
+			struct PidSlot *slot = FindPidSlot(record.pid, 0);
+			int jobIndex = -1;
+
+			// A job that stops or continues is still running
+			if ((WIFSTOPPED(record.status)) || (WIFCONTINUED(record.status)))
+			{
+				if (slot != NULL)
+				{
+					struct Job *job = &jobs[slot->job];
+					if ((WIFSTOPPED(record.status)) && (!job->isStopped) && (!job->isQuiet))
+					{
+						job->isStopped = 1;
+						currentJob = slot->job;
+						if ((reported++ == 0) && (atPrompt != 0))
+						{
+							printf("\n");
+						}
+						PrintJob(slot->job, "Stopped");
+					}
+					job->isStopped = WIFSTOPPED(record.status);
+				}
+				continue;
+			}
+
+			if (slot != NULL)
+			{
+				jobIndex = slot->job;
+				RemovePidSlot(slot);
+				jobs[jobIndex].liveCount--;
+				AddUsage(&jobs[jobIndex].usage, &record.usage);
+				if (record.pid == jobs[jobIndex].pid)
+				{
+					jobs[jobIndex].status = record.status;
+				}
+
+				// Wait for the rest of the job
+				if (jobs[jobIndex].liveCount > 0)
+				{
+					continue;
+				}
+				record.status = jobs[jobIndex].status;
+				record.pid = jobs[jobIndex].pid;
+				ElapsedSince(&jobs[jobIndex].startTime, &jobs[jobIndex].endTime);
+
+				// All the job wrote is in its capture pipe by now, so
+				//  copy it on before the job is reported
+				while ((jobs[jobIndex].captureFd >= 0) && (CopyCapture(jobs[jobIndex].captureFd) > 0))
+				{
+				}
+				jobs[jobIndex].captureFd = -1;
+
+				// Whoever started a quiet job collects it
+				if (jobs[jobIndex].isQuiet)
+				{
+					jobs[jobIndex].isDone = 1;
+					continue;
+				}
+			}
+
+			if ((reported++ == 0) && (atPrompt != 0))
+			{
+				printf("\n");
+			}
+
+			// If child was terminated by a signal, then display the correct message	
+			if (WIFSIGNALED(record.status))
+			{
+				printf("background pid %d is done: terminated by signal %d", record.pid,
+					WTERMSIG(record.status));
+			}
+			else
+			{
+				printf("background pid %d is done: exit value %d", record.pid,
+					WEXITSTATUS(record.status));
+			}
+
+			if (jobIndex >= 0)
+			{
+				PrintJobUsage(jobIndex);
+				RemoveJob(jobIndex);
+			}
+			printf("\n");
+		}
+
+		// Children the handler could not fit in the ring are reaped
+		//  here once, now that there is room again.
+		if (caughtUp)
+		{
+			break;
+		}
+		sigemptyset(&childMask);
+		sigaddset(&childMask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+		ReapChildren();
+		sigprocmask(SIG_SETMASK, &oldMask, NULL);
+		caughtUp = 1;
+	}
+
+	if ((reported > 0) && (atPrompt != 0))
+	{
+		printf((atPrompt == PROMPT_HEREDOC) ? "> " : ": ");
+	}
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pids - the pid of each process, -1 for any that did not start
+ * *  count - the number of pids
+ * *  pgid - the job's process group, or -1
+ * *  command - the text of the command line, for the job table
+ * *
+ * * Exit:
+ * *  Returns the index of the new job.
+ * *  Returns -1, if the job table is full.
+ * *
+ * * Purpose:
+ * *	Adds a background job to the job table.
+ * *
+ * ***************************************************************/
+int AddJob(pid_t *pids, int count, pid_t pgid, const char *command)
+{
+	int i;
+
+	// There is a child to wait for again
+	serverEvents.isChildless = 0;
+	shellEvents.isChildless = 0;
+
+	if (freeJobCount == 0)
+	{
+		return -1;
+	}
+
+	int jobIndex = freeJobs[--freeJobCount];
+	struct Job *job = &jobs[jobIndex];
+
+	memset(job, 0, sizeof(*job));
+	job->inUse = 1;
+	job->pgid = pgid;
+	job->captureFd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &job->startTime);
+	strncpy(job->command, command, MAX_JOB_COMMAND - 1);
+
+	for (i = 0; i < count; i++)
+	{
+		if (pids[i] <= 0)
+		{
+			continue;
+		}
+
+		struct PidSlot *slot = FindPidSlot(pids[i], 1);
+		if (slot == NULL)
+		{
+			continue;
+		}
+		slot->pid = pids[i];
+		slot->job = jobIndex;
+		job->pid = pids[i];
+		job->liveCount++;
+	}
+
+	return jobIndex;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Gives a forked copy of the shell an empty job table, reap ring
+ * *	and self-pipe of its own. The parent's jobs are not its children,
+ * *	and its event loop and the output it copies are not the copy's.
+ * *
+ * ***************************************************************/
+void ResetJobTableInChild()
+{
+	if (shellEvents.fd >= 0)
+	{
+		close(shellEvents.fd);
+		shellEvents.fd = -1;
+	}
+	memset(jobs, 0, sizeof(jobs));
+	memset(pidSlots, 0, sizeof(pidSlots));
+	reapHead = 0;
+	reapTail = 0;
+	close(selfPipe[0]);
+	close(selfPipe[1]);
+	InitJobTable();
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fd - a descriptor a redirect is about to replace
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Moves the self-pipe end that is on fd, if one is, to a free
+ * *	descriptor, so the redirect does not take it from the handler.
+ * *
+ * ***************************************************************/
+void MoveSelfPipe(int fd)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if ((fd >= 0) && (selfPipe[i] == fd))
+		{
+			selfPipe[i] = fcntl(fd, F_DUPFD_CLOEXEC, SELF_PIPE_MIN_FD);
+			close(fd);
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  jobIndex - the job to remove
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Puts a finished job's slot back on the free list and removes
+ * *	its cgroup.
+ * *
+ * ***************************************************************/
+void RemoveJob(int jobIndex)
+{
+	// A cgroup is empty once its processes have all been reaped
+	if (jobs[jobIndex].cgroup != NULL)
+	{
+		rmdir(jobs[jobIndex].cgroup);
+		free(jobs[jobIndex].cgroup);
+		jobs[jobIndex].cgroup = NULL;
+	}
+	jobs[jobIndex].inUse = 0;
+	freeJobs[freeJobCount++] = jobIndex;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pid - the process to look for
+ * *  forInsert - 1 to return a free slot when the pid is not found
+ * *
+ * * Exit:
+ * *  Returns the slot for the pid, or a free slot if forInsert is set.
+ * *  Returns NULL, if there is no such slot.
+ * *
+ * * Purpose:
+ * *	Looks a pid up in the pid to job map.
+ * *
+ * ***************************************************************/
+struct PidSlot *FindPidSlot(pid_t pid, int forInsert)
+{
+	unsigned int index = PidSlotHome(pid);
+	int probes;
+
+	if (pid <= 0)
+	{
+		return NULL;
+	}
+
+	for (probes = 0; probes < PID_SLOT_COUNT; probes++)
+	{
+		struct PidSlot *slot = &pidSlots[index];
+
+		if (slot->pid == pid)
+		{
+			return slot;
+		}
+		if (slot->pid == 0)
+		{
+			// The end of the probe chain
+			return forInsert ? slot : NULL;
+		}
+
+		index = (index + 1) & (PID_SLOT_COUNT - 1);
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pid - a process id
+ * *
+ * * Exit:
+ * *  Returns the slot its probe chain starts at.
+ * *
+ * * Purpose:
+ * *	Is the pid to job map's hash.
+ * *
+ * ***************************************************************/
+unsigned int PidSlotHome(pid_t pid)
+{
+	return ((unsigned int)pid * 2654435761u) & (PID_SLOT_COUNT - 1);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  slot - a slot FindPidSlot found
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Takes an entry out of the pid to job map. Each later entry in
+ * *	the chain that may live in the hole moves back into it, so the
+ * *	chain stays unbroken without a tombstone and lookups stay short
+ * *	however many jobs come and go.
+ * *
+ * ***************************************************************/
+void RemovePidSlot(struct PidSlot *slot)
+{
+	unsigned int mask = PID_SLOT_COUNT - 1;
+	unsigned int hole = slot - pidSlots;
+	unsigned int index = hole;
+
+	while (1)
+	{
+		index = (index + 1) & mask;
+		if (pidSlots[index].pid == 0)
+		{
+			break;
+		}
+
+		// An entry can move back when the hole is at or after its home
+		unsigned int home = PidSlotHome(pidSlots[index].pid);
+		if (((index - home) & mask) >= ((index - hole) & mask))
+		{
+			pidSlots[hole] = pidSlots[index];
+			hole = index;
+		}
+	}
+	pidSlots[hole].pid = 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed command line
+ * *  description - the return variable for the text
+ * *  size - the size of description
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Rebuilds a short text form of a command line, for the job
+ * *	table. Long command lines are cut off.
+ * *
+ * ***************************************************************/
+void DescribePipeline(struct Pipeline *pipeline, char *description, size_t size)
+{
+	size_t used = 0;
+	int i;
+	int j;
+
+	description[0] = '\0';
+	for (i = 0; i < pipeline->count; i++)
+	{
+		struct Command *command = &pipeline->commands[i];
+
+		for (j = 0; j < command->argc; j++)
+		{
+			used += snprintf(description + used, size - used, "%s%s",
+				((i > 0) || (j > 0)) ? " " : "", command->argv[j]);
+			if (used >= size)
+			{
+				return;
+			}
+		}
+
+		if ((i < pipeline->count - 1) && (pipeline->commands[i + 1].fanOut > 0))
+		{
+			used += snprintf(description + used, size - used, " |& %d%s", pipeline->commands[i + 1].fanOut,
+				(pipeline->commands[i + 1].isUnordered) ? "u" : "");
+		}
+		else if (i < pipeline->count - 1)
+		{
+			used += snprintf(description + used, size - used, " |");
+		}
+		if (used >= size)
+		{
+			return;
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  jobIndex - a job in the table
+ * *
+ * * Exit:
+ * *  Returns 1, if the job stopped.
+ * *  Returns 0, once every process in it has finished.
+ * *
+ * * Purpose:
+ * *	Waits for a job the way parallel does, by sleeping until the
+ * *	reaper has something. The job is quiet while it is waited on,
+ * *	so the reporter leaves it for the caller to remove.
+ * *
+ * ***************************************************************/
+int WaitForJob(int jobIndex)
+{
+	struct Job *job = &jobs[jobIndex];
+	int wasQuiet = job->isQuiet;
+	sigset_t childMask;
+	sigset_t oldMask;
+	sigset_t waitMask;
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+	waitMask = oldMask;
+	sigdelset(&waitMask, SIGCHLD);
+
+	job->isQuiet = 1;
+	ReportCompletions();
+	while ((!job->isDone) && (!job->isStopped))
+	{
+		WaitForChild(&waitMask);
+		ReportCompletions();
+	}
+	job->isQuiet = wasQuiet;
+
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	return job->isStopped;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  waitMask - the signal mask to sleep with, which lets SIGCHLD in
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Sleeps until a child may have changed, for a caller that holds
+ * *	SIGCHLD and calls ReportCompletions after. The interactive
+ * *	shell sleeps on its event loop, which copies the output of
+ * *	jobs run with "--log" meanwhile; otherwise it waits for the
+ * *	signal.
+ * *
+ * ***************************************************************/
+void WaitForChild(const sigset_t *waitMask)
+{
+	if (shellEvents.fd < 0)
+	{
+		sigsuspend(waitMask);
+		return;
+	}
+
+	WaitShellEvents(waitMask);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  job - a stopped job
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Sends SIGCONT to every process in a job, through its process
+ * *	group when it has one.
+ * *
+ * ***************************************************************/
+void ContinueJob(struct Job *job)
+{
+	int i;
+
+	if (job->pgid > 0)
+	{
+		kill(-job->pgid, SIGCONT);
+	}
+	else
+	{
+		for (i = 0; i < PID_SLOT_COUNT; i++)
+		{
+			if ((pidSlots[i].pid > 0) && (&jobs[pidSlots[i].job] == job))
+			{
+				kill(pidSlots[i].pid, SIGCONT);
+			}
+		}
+	}
+	job->isStopped = 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  spec - "%n", "%%", "%+" or a pid, or NULL for the current job
+ * *  builtinName - the builtin asking, for the error message
+ * *
+ * * Exit:
+ * *  Returns the index of the job.
+ * *  Returns -1, if there is no such job.
+ * *
+ * * Purpose:
+ * *	Finds the job a job control builtin was given.
+ * *
+ * ***************************************************************/
+int FindJob(const char *spec, const char *builtinName)
+{
+	int jobIndex = -1;
+
+	if ((spec == NULL) || (strcmp(spec, "%") == 0) || (strcmp(spec, "%%") == 0) ||
+		(strcmp(spec, "%+") == 0))
+	{
+		jobIndex = FindCurrentJob();
+		if (jobIndex < 0)
+		{
+			printf("smallsh: %s: no current job\n", builtinName);
+		}
+		return jobIndex;
+	}
+
+	if ((spec[0] == '%') && (IsNumber(spec + 1)))
+	{
+		int number = atoi(spec + 1);
+		for (jobIndex = MAX_JOBS - 1; jobIndex >= 0; jobIndex--)
+		{
+			if ((jobs[jobIndex].inUse) && (jobs[jobIndex].number == number))
+			{
+				break;
+			}
+		}
+	}
+	else if (IsNumber(spec))
+	{
+		struct PidSlot *slot = FindPidSlot(atoi(spec), 0);
+		if (slot != NULL)
+		{
+			jobIndex = slot->job;
+		}
+	}
+
+	if ((jobIndex < 0) || (jobIndex >= MAX_JOBS) || (!jobs[jobIndex].inUse) || (jobs[jobIndex].isQuiet))
+	{
+		printf("smallsh: %s: %s: no such job\n", builtinName, spec);
+		return -1;
+	}
+
+	return jobIndex;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the index of the current job.
+ * *  Returns -1, if there are no jobs.
+ * *
+ * * Purpose:
+ * *	Picks the job "fg" and "bg" use by default: the one that last
+ * *	stopped or went into the background, or else the newest.
+ * *
+ * ***************************************************************/
+int FindCurrentJob()
+{
+	int newest = -1;
+	int i;
+
+	if ((currentJob >= 0) && (jobs[currentJob].inUse) && (!jobs[currentJob].isQuiet))
+	{
+		return currentJob;
+	}
+
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		if ((!jobs[i].inUse) || (jobs[i].isQuiet))
+		{
+			continue;
+		}
+		if ((newest < 0) || (jobs[i].startTime.tv_sec > jobs[newest].startTime.tv_sec) ||
+			((jobs[i].startTime.tv_sec == jobs[newest].startTime.tv_sec) &&
+			(jobs[i].startTime.tv_nsec > jobs[newest].startTime.tv_nsec)))
+		{
+			newest = i;
+		}
+	}
+	currentJob = newest;
+
+	return newest;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the number for a new job.
+ * *
+ * * Purpose:
+ * *	Numbers jobs as sh does: one past the highest number in use,
+ * *	so the numbers start from 1 again once the jobs are gone.
+ * *	Quiet jobs have no number.
+ * *
+ * ***************************************************************/
+int NextJobNumber()
+{
+	int highest = 0;
+	int i;
+
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		if ((jobs[i].inUse) && (!jobs[i].isQuiet) && (jobs[i].number > highest))
+		{
+			highest = jobs[i].number;
+		}
+	}
+
+	return highest + 1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  jobIndex - a job in the table
+ * *  state - what to call its state, such as "Running"
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Prints one line about a job, with a "+" on the current job.
+ * *	Example: "[1]+ Stopped    4923  sleep 100". A job with a
+ * *	cgroup also shows what it has used.
+ * *
+ * ***************************************************************/
+void PrintJob(int jobIndex, const char *state)
+{
+	printf("[%d]%c %-10s %d  %s", jobs[jobIndex].number, (jobIndex == FindCurrentJob()) ? '+' : ' ', state,
+		(int)jobs[jobIndex].pid, jobs[jobIndex].command);
+	PrintJobUsage(jobIndex);
+	printf("\n");
+	fflush(stdout);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  status - a wait status
+ * *  errMsg - the return variable for the message status shows
+ * *
+ * * Exit:
+ * *  Returns the exit value, or 128 plus the signal that ended it.
+ * *
+ * * Purpose:
+ * *	Turns the wait status of a foreground command into the status
+ * *	the shell keeps, and says so when a signal ended it. A killed
+ * *	command is a failure, so "&&" stops after it as it does in sh;
+ * *	status still shows "terminated by signal N".
+ * *
+ * ***************************************************************/
+int ForeGroundStatus(int status, char *errMsg)
+{
+	// Save the appropriate signal error message
+	foregroundSignal = (WIFSIGNALED(status)) ? WTERMSIG(status) : 0;
+	if (WIFSIGNALED(status))
+	{
+		snprintf(errMsg, MAX_ERR_MSG_LENGTH, "terminated by signal %d", WTERMSIG(status));
+		printf("%s\n", errMsg);
+		return 128 + WTERMSIG(status);
+	}
+
+	return WEXITSTATUS(status);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  job - a job that was in the foreground
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Gives the terminal back to the shell. If the job stopped, its
+ * *	terminal modes are kept for when it comes back, and the shell's
+ * *	own modes are put back.
+ * *
+ * ***************************************************************/
+void TakeTerminalBack(struct Job *job)
+{
+	if (!shellIsInteractive)
+	{
+		return;
+	}
+
+	if ((job != NULL) && (job->isStopped))
+	{
+		job->hasModes = (tcgetattr(0, &job->modes) == 0);
+		GiveTerminalTo(getpgrp());
+		tcsetattr(0, TCSADRAIN, &shellModes);
+	}
+	else
+	{
+		// Keep what the job did, such as stty, as the shell's modes
+		GiveTerminalTo(getpgrp());
+		tcgetattr(0, &shellModes);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - the text to check
+ * *
+ * * Exit:
+ * *  Returns 1, if it is all digits.
+ * *  Returns 0, otherwise.
+ * *
+ * * Purpose:
+ * *	Tells a pid or job number from other words.
+ * *
+ * ***************************************************************/
+int IsNumber(const char *text)
+{
+	if (*text == '\0')
+	{
+		return 0;
+	}
+
+	return (text[strspn(text, "0123456789")] == '\0');
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed command line
+ * *  errMsg - the return variable to hold the error message
+ * *  usage - the return variable for the resources all the stages
+ * *          used together
+ * *
+ * * Exit:
+ * *  Returns 0, if command executed without errors.
+ * *  Returns any other number, if command executed with errors.
+ * *
+ * * Purpose:
+ * *	Runs the specified foreground command or pipeline. All the
+ * *	stages run at the same time and the status comes from the
+ * *	last one. If it is stopped, it is moved to the job table. The
+ * *	interactive shell waits for it through the job table from the
+ * *	start, so its event loop goes on copying output meanwhile.
+ * *
+ * ***************************************************************/
+int RunForeGroundCommand(struct Pipeline *pipeline, char *errMsg, struct rusage *usage)
+{	
+	int status = 0;
+	int lastStatus = 0;
+	int returnStatus = 0;
+	pid_t *pids = pipeline->pids;
+	pid_t pgid;
+	sigset_t childMask;
+	sigset_t oldMask;
+	struct rusage stageUsage;
+	char description[MAX_JOB_COMMAND];
+	int jobIndex = -1;
+	int stopSignal = 0;
+	int i;
+
+	memset(usage, 0, sizeof(*usage));
+
+	// Keep the SIGCHLD handler from reaping our foreground children
+	//  before we get to wait on them.
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	// Start the child processes for command execution	
+	pgid = LaunchPipeline(pipeline, 1, pids);
+	GiveTerminalTo(pgid);
+
+	if (shellEvents.fd >= 0)
+	{
+		DescribePipeline(pipeline, description, sizeof(description));
+		jobIndex = AddJob(pids, pipeline->pidCount, pgid, description);
+	}
+
+	if (jobIndex >= 0)
+	{
+		// The reaper collects the stages, and the capture is copied
+		//  out before the job counts as done. A stop reads as a ^Z,
+		//  as it does for fg.
+		struct Job *job = &jobs[jobIndex];
+		job->captureFd = pipeline->captureFd;
+		long long traceStart = TRACE_START();
+		if ((job->liveCount > 0) && (WaitForJob(jobIndex)))
+		{
+			stopSignal = SIGTSTP;
+		}
+		TRACE(TRACE_WAIT, traceStart, job->pid, job->status, "");
+		if (stopSignal == 0)
+		{
+			lastStatus = job->status;
+			*usage = job->usage;
+			RemoveJob(jobIndex);
+		}
+	}
+	else
+	{
+		// Wait for every stage of the job to finish, and the capture
+		//  after them, so the output is all written before the prompt
+		for (i = 0; i < pipeline->pidCount; i++)
+		{
+			if (pids[i] > 0)
+			{
+				long long traceStart = TRACE_START();
+				while ((wait4(pids[i], &status, WUNTRACED, &stageUsage) < 0) && (errno == EINTR))
+				{
+				}
+				TRACE(TRACE_WAIT, traceStart, pids[i], status, "");
+				if (WIFSTOPPED(status))
+				{
+					break;
+				}
+				AddUsage(usage, &stageUsage);
+				if (i == pipeline->count - 1)
+				{
+					lastStatus = status;
+				}
+			}
+		}
+
+		// A ^Z stopped the job. The stages not waited for yet become a
+		//  stopped job that fg or bg can pick up.
+		if (i < pipeline->pidCount)
+		{
+			DescribePipeline(pipeline, description, sizeof(description));
+			jobIndex = AddJob(pids + i, pipeline->pidCount - i, pgid, description);
+			if ((jobIndex >= 0) && (i < pipeline->count) && (pids[pipeline->count - 1] > 0))
+			{
+				jobs[jobIndex].pid = pids[pipeline->count - 1];
+			}
+			stopSignal = WSTOPSIG(status);
+		}
+	}
+
+	if (stopSignal != 0)
+	{
+		struct Job *job = (jobIndex >= 0) ? &jobs[jobIndex] : NULL;
+		if (job != NULL)
+		{
+			job->isStopped = 1;
+			job->number = NextJobNumber();
+			currentJob = jobIndex;
+		}
+		TakeTerminalBack(job);
+		sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+		snprintf(errMsg, MAX_ERR_MSG_LENGTH, "stopped by signal %d", stopSignal);
+		printf("\n");
+		if (job != NULL)
+		{
+			PrintJob(jobIndex, "Stopped");
+		}
+		return 128 + stopSignal;
+	}
+
+	TakeTerminalBack(NULL);
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	// The last stage could not be started
+	if (pids[pipeline->count - 1] < 0)
+	{
+		return 1;
+	}
+
+	returnStatus = ForeGroundStatus(lastStatus, errMsg);
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  total - the usage to add to
+ * *  add - the usage of one more process
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Adds up the resources of the processes in a job. CPU time and
+ * *	context switches are summed; max RSS is the largest of them.
+ * *
+ * ***************************************************************/
+void AddUsage(struct rusage *total, const struct rusage *add)
+{
+	timeradd(&total->ru_utime, &add->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &add->ru_stime, &total->ru_stime);
+	if (add->ru_maxrss > total->ru_maxrss)
+	{
+		total->ru_maxrss = add->ru_maxrss;
+	}
+	total->ru_nvcsw += add->ru_nvcsw;
+	total->ru_nivcsw += add->ru_nivcsw;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  total - the usage at the end of a builtin
+ * *  before - the usage at its start
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Turns the shell's own usage into the part a builtin used. The
+ * *	max RSS stays the shell's high water mark.
+ * *
+ * ***************************************************************/
+void SubtractUsage(struct rusage *total, const struct rusage *before)
+{
+	timersub(&total->ru_utime, &before->ru_utime, &total->ru_utime);
+	timersub(&total->ru_stime, &before->ru_stime, &total->ru_stime);
+	total->ru_nvcsw -= before->ru_nvcsw;
+	total->ru_nivcsw -= before->ru_nivcsw;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  start - a CLOCK_MONOTONIC time
+ * *  elapsed - the return variable for the time since then
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Measures the wall time since start.
+ * *
+ * ***************************************************************/
+void ElapsedSince(const struct timespec *start, struct timespec *elapsed)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed->tv_sec = now.tv_sec - start->tv_sec;
+	elapsed->tv_nsec = now.tv_nsec - start->tv_nsec;
+	if (elapsed->tv_nsec < 0)
+	{
+		elapsed->tv_sec--;
+		elapsed->tv_nsec += 1000000000L;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  out - where to write the report
+ * *  timing - the resources a command used
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes the wall time, CPU time, max RSS and context switches
+ * *	of a command.
+ * *
+ * ***************************************************************/
+void PrintTiming(FILE *out, const struct CommandTiming *timing)
+{
+	fflush(stdout);
+	fprintf(out, "real\t%ld.%06lds\n", (long)timing->wallTime.tv_sec,
+		timing->wallTime.tv_nsec / 1000);
+	fprintf(out, "user\t%ld.%06lds\n", (long)timing->usage.ru_utime.tv_sec,
+		(long)timing->usage.ru_utime.tv_usec);
+	fprintf(out, "sys\t%ld.%06lds\n", (long)timing->usage.ru_stime.tv_sec,
+		(long)timing->usage.ru_stime.tv_usec);
+	fprintf(out, "maxrss\t%ld KB\n", timing->usage.ru_maxrss);
+	fprintf(out, "ctxsw\t%ld voluntary, %ld involuntary\n", timing->usage.ru_nvcsw,
+		timing->usage.ru_nivcsw);
+	fflush(out);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the parsed command line
+ * *  isForeGround - 1 if this is a foreground job
+ * *  pids - the return array for the pid of each stage. A stage
+ * *         that could not be started gets -1.
+ * *
+ * * Exit:
+ * *  Returns the process group of the job, or -1 if the job shares
+ * *  the shell's process group.
+ * *
+ * * Purpose:
+ * *	Starts every stage of a pipeline, connecting each stage's
+ * *	output to the next stage's input. When the shell is
+ * *	interactive the stages share a new process group. With
+ * *	"--log", the last stage's output goes through a capture
+ * *	process, which is started after the stages and counted in
+ * *	pidCount. The interactive shell copies it on itself from its
+ * *	event loop instead, if the job will fit in the job table, and
+ * *	leaves the pipe in captureFd.
+ * *
+ * ***************************************************************/
+pid_t LaunchPipeline(struct Pipeline *pipeline, int isForeGround, pid_t *pids)
+{
+	pid_t pgid = ((shellIsInteractive) && (!pipeline->isSubstitution)) ? 0 : -1;
+	int prevRead = -1;
+	int captureRead = -1;
+	int pipeFds[2];
+	struct FdPlan plan;
+	int i;
+
+	for (i = 0; i < pipeline->count; i++)
+	{
+		struct Command *command = &pipeline->commands[i];
+		int inFd = prevRead;
+		int outFd = -1;
+
+		pids[i] = -1;
+		prevRead = -1;
+		plan.actionCount = 0;
+		plan.openedCount = 0;
+
+		// Connect this stage to the next one. The shell's copies are
+		//  close-on-exec so the other stages do not inherit them.
+		if ((i < pipeline->count - 1) && (pipe2(pipeFds, O_CLOEXEC) == 0))
+		{
+			outFd = pipeFds[1];
+			prevRead = pipeFds[0];
+		}
+
+		// The server logs a request's output itself as it forwards it,
+		//  and the output of a "$(...)" is not the command line's
+		if ((i == pipeline->count - 1) && (captureLogFd >= 0) && (serverEvents.fd < 0) &&
+			(!pipeline->isSubstitution) && (!HasRedirect(command, 1)) &&
+			(pipe2(pipeFds, O_CLOEXEC) == 0))
+		{
+			outFd = pipeFds[1];
+			captureRead = pipeFds[0];
+		}
+
+		// Redirect stdin to dev/null if the user did not 
+		//  specify input redirection for a background job
+		if ((i == 0) && (!isForeGround) && (!HasRedirect(command, 0)))
+		{
+			inFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		}
+
+		// The pipe comes first, so the command's own redirects can
+		//  replace or copy it
+		if (inFd >= 0)
+		{
+			AddFdAction(&plan, inFd, 0);
+		}
+		if (outFd >= 0)
+		{
+			AddFdAction(&plan, outFd, 1);
+		}
+
+		if (OpenRedirects(command, &plan) == 0)
+		{
+			struct Builtin *builtin = FindBuiltin(command->argv[0]);
+
+			if (command->fanOut > 0)
+			{
+				pids[i] = ForkFanOut(command, &plan, isForeGround, pgid);
+			}
+			else if (builtin != NULL)
+			{
+				pids[i] = ForkBuiltin(builtin, command, &plan, isForeGround, pgid);
+			}
+			else
+			{
+				pids[i] = SpawnCommand(command->argv, &plan, isForeGround, pgid);
+			}
+
+			if ((pids[i] < 0) && (builtin == NULL) && (command->fanOut == 0))
+			{
+				printf("%s: no such file or directory\n", command->argv[0]);
+			}
+			else if (pgid == 0)
+			{
+				// The first stage started leads the job's process group
+				pgid = pids[i];
+			}
+		}
+
+		CloseFdPlan(&plan);
+		if (inFd >= 0)
+		{
+			close(inFd);
+		}
+		if (outFd >= 0)
+		{
+			close(outFd);
+		}
+	}
+
+	pipeline->pidCount = pipeline->count;
+	pipeline->captureFd = -1;
+	if ((captureRead >= 0) && (shellEvents.fd >= 0) && (shellLogTee[0] >= 0) && (freeJobCount > 0))
+	{
+		fcntl(captureRead, F_SETFL, O_NONBLOCK);
+		fcntl(captureRead, F_SETPIPE_SZ, CAPTURE_CHUNK);
+		WatchEvent(&shellEvents, captureRead, EPOLL_CTL_ADD, EPOLLIN,
+			((unsigned long long)SHELL_TAG_CAPTURE << 32) | (unsigned int)captureRead);
+		pipeline->captureFd = captureRead;
+	}
+	else if (captureRead >= 0)
+	{
+		pids[pipeline->pidCount] = ForkCapture(captureRead, pgid);
+		if (pids[pipeline->pidCount] > 0)
+		{
+			if (pgid == 0)
+			{
+				pgid = pids[pipeline->pidCount];
+			}
+			pipeline->pidCount++;
+		}
+		close(captureRead);
+	}
+
+	return (pgid > 0) ? pgid : -1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the log file
+ * *
+ * * Exit:
+ * *  Returns 0, if the log is open.
+ * *  Returns -1, if it could not be opened.
+ * *
+ * * Purpose:
+ * *	Opens the log that "--log" copies command output into. New
+ * *	output goes after what the file already holds. It is not
+ * *	opened with O_APPEND, because splice will not write to such a
+ * *	file; the shell and its capture processes share the one file
+ * *	offset instead, so their writes still follow each other.
+ * *
+ * ***************************************************************/
+int OpenCaptureLog(const char *path)
+{
+	captureLogFd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if ((captureLogFd < 0) || (lseek(captureLogFd, 0, SEEK_END) < 0))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the file to trace into
+ * *
+ * * Exit:
+ * *  Returns 0, if tracing is on.
+ * *  Returns -1, if the file could not be made.
+ * *
+ * * Purpose:
+ * *	Makes the trace file as an empty ring and maps it. The mapping
+ * *	is shared, so what the shell and its forked copies write is in
+ * *	the file without a write call and survives the shell dying.
+ * *
+ * ***************************************************************/
+int OpenTrace(const char *path)
+{
+	size_t size = sizeof(struct TraceHeader) + (TRACE_RING_EVENTS * sizeof(struct TraceRecord));
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	traceHeader = map;
+	memcpy(traceHeader->magic, TRACE_MAGIC, sizeof(traceHeader->magic));
+	traceHeader->version = TRACE_VERSION;
+	traceHeader->capacity = TRACE_RING_EVENTS;
+	traceRecords = (struct TraceRecord *)(traceHeader + 1);
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the monotonic clock in nanoseconds.
+ * *
+ * * Purpose:
+ * *	Is the clock trace events are timed with.
+ * *
+ * ***************************************************************/
+long long TraceNow()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * 1000000000LL) + now.tv_nsec;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  kind - what happened, a TRACE_ kind
+ * *  start - when a span began, from TRACE_START(), or 0 for an
+ * *          instant
+ * *  value, detail - numbers that go with it, like a pid and status
+ * *  text - a name that goes with it, cut to fit
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes one event into the trace ring, over the oldest one when
+ * *	it is full. Taking a record is one atomic add and nothing else
+ * *	is shared, so it is safe from the SIGCHLD handler and from a
+ * *	forked copy at the same time. Called through TRACE().
+ * *
+ * ***************************************************************/
+void TraceEvent(int kind, long long start, long long value, int detail, const char *text)
+{
+	unsigned long long index = __atomic_fetch_add(&traceHeader->head, 1, __ATOMIC_RELAXED);
+	struct TraceRecord *record = &traceRecords[index & (TRACE_RING_EVENTS - 1)];
+	long long now = TraceNow();
+	size_t i;
+
+	__atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	record->start = (start > 0) ? start : now;
+	record->duration = (start > 0) ? now - start : 0;
+	record->value = value;
+	record->pid = getpid();
+	record->kind = kind;
+	record->detail = detail;
+	for (i = 0; (i < sizeof(record->text) - 1) && (text[i] != '\0'); i++)
+	{
+		record->text[i] = text[i];
+	}
+	record->text[i] = '\0';
+
+	__atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  source - the read end of the last stage's output pipe
+ * *  pgid - the process group to join, 0 to lead a new one, or
+ * *         -1 to stay in the shell's group
+ * *
+ * * Exit:
+ * *  Returns the pid of the capture process.
+ * *  Returns -1, if it could not be started.
+ * *
+ * * Purpose:
+ * *	Starts the process that copies a job's output to the log and
+ * *	the shell's stdout. It is part of the job, so ^Z stops it with
+ * *	the rest, but it keeps ignoring SIGINT like the shell so what
+ * *	the job wrote before a ^C still reaches the log.
+ * *
+ * ***************************************************************/
+pid_t ForkCapture(int source, pid_t pgid)
+{
+	pid_t capturePid;
+	struct sigaction act;
+	sigset_t emptyMask;
+
+	fflush(stdout);
+	capturePid = fork();
+
+	if (capturePid == 0)
+	{
+		if (pgid >= 0)
+		{
+			setpgid(0, pgid);
+		}
+
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGTTOU, &act, NULL);
+		sigaction(SIGTSTP, &act, NULL);
+		sigemptyset(&emptyMask);
+		sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+		ApplyJobLimits();
+
+		RunCapture(source, 1);
+		_exit(0);
+	}
+
+	if ((capturePid > 0) && (pgid >= 0))
+	{
+		setpgid(capturePid, (pgid == 0) ? capturePid : pgid);
+	}
+
+	return capturePid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  source - the pipe the job writes to
+ * *  destination - where the output goes besides the log
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Copies a job's output until the job closes the pipe. Each
+ * *	chunk is teed into a second pipe and spliced from there to
+ * *	the log, then spliced from the first pipe to the destination,
+ * *	so the data never passes through this process's memory. It
+ * *	stops if the destination fails; the job then gets SIGPIPE as
+ * *	it would from a closed reader.
+ * *
+ * ***************************************************************/
+void RunCapture(int source, int destination)
+{
+	int teeFds[2];
+
+	fcntl(source, F_SETPIPE_SZ, CAPTURE_CHUNK);
+	if (pipe2(teeFds, O_CLOEXEC) < 0)
+	{
+		close(captureLogFd);
+		captureLogFd = -1;
+	}
+	else
+	{
+		fcntl(teeFds[1], F_SETPIPE_SZ, CAPTURE_CHUNK);
+	}
+
+	while (1)
+	{
+		ssize_t length;
+
+		if (captureLogFd >= 0)
+		{
+			length = TeeToLog(source, teeFds, CAPTURE_CHUNK, 0);
+			if ((length > 0) && (SpliceAll(source, destination, length) < 0))
+			{
+				return;
+			}
+		}
+		else
+		{
+			length = MoveChunk(source, destination, CAPTURE_CHUNK);
+		}
+
+		if (length <= 0)
+		{
+			return;
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fd - a capture pipe the shell's event loop watches
+ * *
+ * * Exit:
+ * *  Returns 1, if some output was copied.
+ * *  Returns 0, if there is none yet.
+ * *  Returns -1, at the end of the output. The pipe is closed.
+ * *
+ * * Purpose:
+ * *	Copies what a job wrote on to the log and the shell's stdout,
+ * *	as a capture process would, without waiting for more. What is
+ * *	in the pipe is teed into the log and spliced on. If stdout
+ * *	fails the pipe is closed, and the job gets SIGPIPE as it would
+ * *	from a closed reader.
+ * *
+ * ***************************************************************/
+int CopyCapture(int fd)
+{
+	char buffer[SERVER_READ_SIZE];
+	int pending = 0;
+	int isCopied = 0;
+	int i;
+
+	// What the shell printed itself goes first
+	fflush(stdout);
+
+	if ((ioctl(fd, FIONREAD, &pending) == 0) && (pending > 0))
+	{
+		size_t length = (pending > CAPTURE_CHUNK) ? CAPTURE_CHUNK : pending;
+		if (captureLogFd >= 0)
+		{
+			ssize_t copied = TeeToLog(fd, shellLogTee, length, SPLICE_F_NONBLOCK);
+			if (copied > 0)
+			{
+				length = copied;
+			}
+		}
+		isCopied = (SpliceAll(fd, 1, length) == 0);
+	}
+	else
+	{
+		// Nothing is waiting, so this is the end of the output, or some
+		//  came in since the check and is read the plain way
+		ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
+		if ((bytesRead < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+		{
+			return 0;
+		}
+		if ((bytesRead > 0) && (captureLogFd >= 0))
+		{
+			WriteAll(captureLogFd, buffer, bytesRead);
+		}
+		isCopied = (bytesRead > 0) && (WriteAll(1, buffer, bytesRead) == 0);
+	}
+	if (isCopied)
+	{
+		return 1;
+	}
+
+	WatchEvent(&shellEvents, fd, EPOLL_CTL_DEL, 0, 0);
+	close(fd);
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		if ((jobs[i].inUse) && (jobs[i].captureFd == fd))
+		{
+			jobs[i].captureFd = -1;
+		}
+	}
+
+	return -1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  source - a pipe with output in it
+ * *  teeFds - an empty pipe to tee through
+ * *  length - the most to copy
+ * *  flags - SPLICE_F_NONBLOCK to not wait for output
+ * *
+ * * Exit:
+ * *  Returns how much was copied to the log. That much is still in
+ * *  the source, for the caller to move on.
+ * *  Returns 0, at the end of the output.
+ * *  Returns -1, on an error.
+ * *
+ * * Purpose:
+ * *	Copies the start of a pipe's contents to the log without
+ * *	taking it out of the pipe. If the log cannot be written, it is
+ * *	closed and the output is no longer logged.
+ * *
+ * ***************************************************************/
+ssize_t TeeToLog(int source, int *teeFds, size_t length, unsigned int flags)
+{
+	ssize_t copied;
+
+	while (((copied = tee(source, teeFds[1], length, flags)) < 0) && (errno == EINTR))
+	{
+	}
+
+	if ((copied > 0) && (SpliceAll(teeFds[0], captureLogFd, copied) < 0))
+	{
+		close(captureLogFd);
+		captureLogFd = -1;
+	}
+
+	return copied;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  source - a pipe holding at least length bytes
+ * *  destination - where they go
+ * *  length - how much to move
+ * *
+ * * Exit:
+ * *  Returns 0, if it was all moved.
+ * *  Returns -1, on an error.
+ * *
+ * * Purpose:
+ * *	Moves an exact amount out of a pipe into a blocking
+ * *	descriptor.
+ * *
+ * ***************************************************************/
+int SpliceAll(int source, int destination, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t moved = MoveChunk(source, destination, length);
+		if (moved <= 0)
+		{
+			return -1;
+		}
+		length -= moved;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  source - a pipe
+ * *  destination - where its contents go
+ * *  length - the most to move
+ * *
+ * * Exit:
+ * *  Returns how much was moved.
+ * *  Returns 0, at the end of the input.
+ * *  Returns -1, on an error.
+ * *
+ * * Purpose:
+ * *	Moves some of a pipe's contents with splice. A destination
+ * *	splice cannot write to gets a plain read and write instead.
+ * *
+ * ***************************************************************/
+ssize_t MoveChunk(int source, int destination, size_t length)
+{
+	char buffer[SERVER_READ_SIZE];
+	ssize_t moved;
+
+	while (((moved = splice(source, NULL, destination, NULL, length, SPLICE_F_MOVE)) < 0) &&
+		(errno == EINTR))
+	{
+	}
+	if ((moved >= 0) || (errno != EINVAL))
+	{
+		return moved;
+	}
+
+	if (length > sizeof(buffer))
+	{
+		length = sizeof(buffer);
+	}
+	while (((moved = read(source, buffer, length)) < 0) && (errno == EINTR))
+	{
+	}
+	if ((moved > 0) && (WriteAll(destination, buffer, moved) < 0))
+	{
+		return -1;
+	}
+
+	return moved;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  command - the command with the redirects to open
+ * *  plan - the descriptor plan to add the redirects to
+ * *
+ * * Exit:
+ * *  Returns 0, if every redirect was opened.
+ * *  Returns -1, if a redirect could not be opened. What was opened
+ * *  is still in the plan for CloseFdPlan.
+ * *
+ * * Purpose:
+ * *	Opens the files and here-docs for one command's redirects and
+ * *	adds a descriptor action for each, in the order they were
+ * *	written. ">>" opens with O_APPEND, so a log only gets the new
+ * *	data, and "N>&M" copies a descriptor instead of opening
+ * *	anything. Each opened descriptor is kept above every
+ * *	descriptor the command's redirects set, so applying one action
+ * *	never replaces the source of a later one.
+ * *
+ * ***************************************************************/
+int OpenRedirects(struct Command *command, struct FdPlan *plan)
+{
+	int highestTarget = 2;
+	int i;
+
+	for (i = 0; i < command->redirectCount; i++)
+	{
+		if (command->redirects[i].fd > highestTarget)
+		{
+			highestTarget = command->redirects[i].fd;
+		}
+	}
+
+	for (i = 0; i < command->redirectCount; i++)
+	{
+		struct Redirect *redirect = &command->redirects[i];
+		long long traceStart = TRACE_START();
+		int fd = -1;
+
+		switch (redirect->kind)
+		{
+			case REDIRECT_INPUT:
+				fd = open(redirect->target, O_RDONLY | O_CLOEXEC);
+				if (fd < 0)
+				{
+					printf("smallsh: cannot open %s for input\n", redirect->target);
+					return -1;
+				}
+				break;
+			case REDIRECT_OUTPUT:
+				fd = open(redirect->target, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+				if (fd < 0)
+				{
+					printf("smallsh: cannot open %s for output\n", redirect->target);
+					return -1;
+				}
+				break;
+			case REDIRECT_APPEND:
+				fd = open(redirect->target, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+				if (fd < 0)
+				{
+					printf("smallsh: cannot open %s for output\n", redirect->target);
+					return -1;
+				}
+				break;
+			case REDIRECT_HERESTRING:
+				fd = OpenHereDoc(redirect->target, "\n");
+				if (fd < 0)
+				{
+					return -1;
+				}
+				break;
+			case REDIRECT_HEREDOC:
+				fd = OpenHereDoc(redirect->target, "");
+				if (fd < 0)
+				{
+					return -1;
+				}
+				break;
+			case REDIRECT_DUP:
+			{
+				if (strcmp(redirect->target, "-") == 0)
+				{
+					AddFdAction(plan, -1, redirect->fd);
+					continue;
+				}
+
+				// The source is either set up by an earlier action or has
+				//  to be open in the shell already
+				int source = atoi(redirect->target);
+				int j;
+				for (j = 0; j < plan->actionCount; j++)
+				{
+					if ((plan->actions[j].target == source) && (plan->actions[j].source >= 0))
+					{
+						break;
+					}
+				}
+				if ((j == plan->actionCount) && (fcntl(source, F_GETFD) < 0))
+				{
+					printf("smallsh: %d: bad file descriptor\n", source);
+					return -1;
+				}
+				AddFdAction(plan, source, redirect->fd);
+				continue;
+			}
+		}
+
+		if (fd <= highestTarget)
+		{
+			int moved = fcntl(fd, F_DUPFD_CLOEXEC, highestTarget + 1);
+			close(fd);
+			fd = moved;
+			if (fd < 0)
+			{
+				printf("smallsh: cannot open %s\n", redirect->target);
+				return -1;
+			}
+		}
+		plan->opened[plan->openedCount] = fd;
+		plan->openedCount++;
+		AddFdAction(plan, fd, redirect->fd);
+		TRACE(TRACE_REDIRECT, traceStart, redirect->fd, 0,
+			(redirect->kind >= REDIRECT_HERESTRING) ? "<<" : redirect->target);
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  body - the text the command reads
+ * *  tail - text to add after the body
+ * *
+ * * Exit:
+ * *  Returns a close-on-exec descriptor positioned at the start of
+ * *  the text.
+ * *  Returns -1, if it could not be made.
+ * *
+ * * Purpose:
+ * *	Feeds a here-string or here-doc to a command through an
+ * *	in-memory file, so nothing is written to disk and a body of any
+ * *	size cannot fill a pipe the shell is still writing to. Kernels
+ * *	without memfd_create get a pipe, which holds a body up to the
+ * *	pipe's size.
+ * *
+ * ***************************************************************/
+int OpenHereDoc(const char *body, const char *tail)
+{
+	size_t bodyLength = strlen(body);
+	size_t tailLength = strlen(tail);
+	int pipeFds[2];
+	int fd;
+
+	fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+	if (fd >= 0)
+	{
+		if ((write(fd, body, bodyLength) != (ssize_t)bodyLength) ||
+			(write(fd, tail, tailLength) != (ssize_t)tailLength) ||
+			(lseek(fd, 0, SEEK_SET) != 0))
+		{
+			close(fd);
+			printf("smallsh: cannot write here-document\n");
+			return -1;
+		}
+		return fd;
+	}
+
+	if ((bodyLength + tailLength > PIPE_BUF * 16) || (pipe2(pipeFds, O_CLOEXEC) < 0))
+	{
+		printf("smallsh: cannot make here-document\n");
+		return -1;
+	}
+	write(pipeFds[1], body, bodyLength);
+	write(pipeFds[1], tail, tailLength);
+	close(pipeFds[1]);
+
+	return pipeFds[0];
+}
+
+/**************************************************************
+ * * Entry:
+ * *  command - the parsed command
+ * *  fd - the descriptor to look for
+ * *
+ * * Exit:
+ * *  Returns 1, if one of the command's redirects sets fd.
+ * *  Returns 0, if none does.
+ * *
+ * * Purpose:
+ * *	Tells if a command redirects a descriptor itself.
+ * *
+ * ***************************************************************/
+int HasRedirect(struct Command *command, int fd)
+{
+	int i;
+
+	for (i = 0; i < command->redirectCount; i++)
+	{
+		if (command->redirects[i].fd == fd)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  plan - the descriptor plan
+ * *  source - the descriptor to copy, or -1 to close target
+ * *  target - the descriptor the child sees
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Adds one action to the end of a descriptor plan.
+ * *
+ * ***************************************************************/
+void AddFdAction(struct FdPlan *plan, int source, int target)
+{
+	plan->actions[plan->actionCount].source = source;
+	plan->actions[plan->actionCount].target = target;
+	plan->actionCount++;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  plan - the descriptor plan
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Closes the descriptors the shell opened for a plan's redirects.
+ * *
+ * ***************************************************************/
+void CloseFdPlan(struct FdPlan *plan)
+{
+	int i;
+
+	for (i = 0; i < plan->openedCount; i++)
+	{
+		close(plan->opened[i]);
+	}
+	plan->openedCount = 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  plan - the descriptor plan, or NULL
+ * *
+ * * Exit:
+ * *  Returns 0, if every action was applied.
+ * *  Returns -1, if one failed.
+ * *
+ * * Purpose:
+ * *	Sets up a forked child's descriptors the way posix_spawn file
+ * *	actions would, then closes the sources that are not in use as
+ * *	a target, for children that do not exec.
+ * *
+ * ***************************************************************/
+int ApplyFdPlan(const struct FdPlan *plan)
+{
+	int i;
+	int j;
+
+	if (plan == NULL)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < plan->actionCount; i++)
+	{
+		const struct FdAction *action = &plan->actions[i];
+
+		MoveSelfPipe(action->target);
+		if (action->source < 0)
+		{
+			close(action->target);
+		}
+		else if (action->source == action->target)
+		{
+			// dup2 does nothing here, so keep it open across exec
+			fcntl(action->target, F_SETFD, 0);
+		}
+		else if (dup2(action->source, action->target) < 0)
+		{
+			return -1;
+		}
+	}
+
+	for (i = 0; i < plan->actionCount; i++)
+	{
+		int source = plan->actions[i].source;
+		for (j = 0; j < plan->actionCount; j++)
+		{
+			if (plan->actions[j].target == source)
+			{
+				break;
+			}
+		}
+		if ((source > 2) && (j == plan->actionCount))
+		{
+			close(source);
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pgid - the process group that should own the terminal
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Moves the terminal to a job's process group, or back to the
+ * *	shell. Does nothing when the shell is not interactive.
+ * *
+ * ***************************************************************/
+void GiveTerminalTo(pid_t pgid)
+{
+	if ((shellIsInteractive) && (pgid > 0))
+	{
+		tcsetpgrp(0, pgid);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Picks the launch engine. posix_spawn is the default because
+ * *	it does not copy the shell's page tables the way fork does.
+ * *	Setting SMALLSH_SPAWN=fork in the environment falls back to
+ * *	fork()+execv().
+ * *
+ * ***************************************************************/
+void InitSpawnEngine()
+{
+	char *engineName = getenv("SMALLSH_SPAWN");
+
+	if ((engineName != NULL) && (strcmp(engineName, "fork") == 0))
+	{
+		spawnEngine = SPAWN_ENGINE_FORK;
+	}
+	else
+	{
+		spawnEngine = SPAWN_ENGINE_POSIX;
+	}
+
+	// The foreground attributes put SIGINT back to its default action
+	//  and clear the SIGCHLD block the parent holds while spawning.
+	//  Both put back SIGTTOU, which an interactive shell ignores.
+	sigset_t emptyMask;
+	sigset_t defaultSignals;
+	sigemptyset(&emptyMask);
+	sigemptyset(&defaultSignals);
+	sigaddset(&defaultSignals, SIGTTOU);
+
+	// Background children keep the shell's ignored SIGINT
+	posix_spawnattr_init(&backGroundAttr);
+	posix_spawnattr_setsigmask(&backGroundAttr, &emptyMask);
+	posix_spawnattr_setsigdefault(&backGroundAttr, &defaultSignals);
+
+	sigaddset(&defaultSignals, SIGINT);
+	posix_spawnattr_init(&foreGroundAttr);
+	posix_spawnattr_setsigmask(&foreGroundAttr, &emptyMask);
+	posix_spawnattr_setsigdefault(&foreGroundAttr, &defaultSignals);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argv - the null terminated command and arguments
+ * *  plan - the descriptors the child gets, or NULL to inherit
+ * *  isForeGround - 1 if the child should get default SIGINT
+ * *  pgid - the process group to join, 0 to lead a new one, or
+ * *         -1 to stay in the shell's group
+ * *
+ * * Exit:
+ * *  Returns the pid of the child process.
+ * *  Returns -1, if the command could not be started.
+ * *
+ * * Purpose:
+ * *	Starts a command with the selected launch engine. The command
+ * *	is found through the PATH cache, so the child execs it directly
+ * *	instead of trying each PATH directory in turn.
+ * *
+ * ***************************************************************/
+pid_t SpawnCommand(char **argv, const struct FdPlan *plan, int isForeGround, pid_t pgid)
+{
+	pid_t spawnPid = -1;
+	posix_spawnattr_t *attr = isForeGround ? &foreGroundAttr : &backGroundAttr;
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	sigset_t childMask;
+	sigset_t oldMask;
+	int fromCache = 0;
+	int spawnResult;
+	int i;
+
+	long long traceStart = TRACE_START();
+	const char *path = LookupCommandPath(argv[0], &fromCache);
+	TRACE(TRACE_PATH, traceStart, fromCache, 0, argv[0]);
+	if (path == NULL)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	// posix_spawn cannot set rlimits or a cgroup for the child
+	if ((spawnEngine == SPAWN_ENGINE_FORK) || (isLaunchLimited))
+	{
+		return ForkCommand(path, argv, plan, isForeGround, pgid);
+	}
+
+	if (pgid >= 0)
+	{
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(attr, pgid);
+	}
+	posix_spawnattr_setflags(attr, flags);
+
+	posix_spawn_file_actions_t fileActions;
+	posix_spawn_file_actions_init(&fileActions);
+
+	// Establish the redirects. The sources are all close-on-exec, so
+	//  they do not need closing in the child.
+	for (i = 0; (plan != NULL) && (i < plan->actionCount); i++)
+	{
+		if (plan->actions[i].source < 0)
+		{
+			posix_spawn_file_actions_addclose(&fileActions, plan->actions[i].target);
+		}
+		else
+		{
+			posix_spawn_file_actions_adddup2(&fileActions, plan->actions[i].source,
+				plan->actions[i].target);
+		}
+	}
+
+	// Flush anything we printed so the child's output comes after it
+	fflush(stdout);
+
+	// posix_spawn waits for a child whose exec failed itself, so the
+	//  handler must not reap it first and report it as a job
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	traceStart = TRACE_START();
+	spawnResult = posix_spawn(&spawnPid, path, &fileActions, attr, argv, environ);
+
+	// The command moved since it was cached, so look for it again
+	if ((spawnResult == ENOENT) && (fromCache))
+	{
+		ForgetCommandPath(argv[0]);
+		path = LookupCommandPath(argv[0], &fromCache);
+		if (path != NULL)
+		{
+			spawnResult = posix_spawn(&spawnPid, path, &fileActions, attr, argv, environ);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	if (spawnResult != 0)
+	{
+		errno = spawnResult;
+		spawnPid = -1;
+	}
+	TRACE(TRACE_SPAWN, traceStart, spawnPid, spawnResult, path);
+
+	posix_spawn_file_actions_destroy(&fileActions);
+
+	return spawnPid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the file to execute
+ * *  argv - the null terminated command and arguments
+ * *  plan - the descriptors the child gets, or NULL to inherit
+ * *  isForeGround - 1 if the child should get default SIGINT
+ * *  pgid - the process group to join, 0 to lead a new one, or
+ * *         -1 to stay in the shell's group
+ * *
+ * * Exit:
+ * *  Returns the pid of the child process.
+ * *  Returns -1, if the command could not be started.
+ * *
+ * * Purpose:
+ * *	The fork()+execv() fallback for SpawnCommand. Exec errors
+ * *	come back through a close-on-exec pipe so both engines report
+ * *	them the same way. SIGCHLD is held until a child whose exec
+ * *	failed has been waited for here, so the handler cannot reap it
+ * *	first and report it as a job.
+ * *
+ * ***************************************************************/
+pid_t ForkCommand(const char *path, char **argv, const struct FdPlan *plan, int isForeGround,
+	pid_t pgid)
+{
+	pid_t spawnPid = -5;
+	int errPipe[2];
+	int childErr = 0;
+	struct sigaction act;
+	sigset_t emptyMask;
+	sigset_t childMask;
+	sigset_t oldMask;
+
+	if (pipe(errPipe) < 0)
+	{
+		return -1;
+	}
+	fcntl(errPipe[1], F_SETFD, FD_CLOEXEC);
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	long long traceStart = TRACE_START();
+	fflush(stdout);
+	spawnPid = fork();
+	if (spawnPid != 0)
+	{
+		TRACE(TRACE_FORK, traceStart, spawnPid, 0, path);
+	}
+
+	switch (spawnPid)
+	{
+		case -1:
+			// Fork failed
+			close(errPipe[0]);
+			close(errPipe[1]);
+			sigprocmask(SIG_SETMASK, &oldMask, NULL);
+			return -1;
+		case 0:
+			// This code will run in the child process
+			close(errPipe[0]);
+
+			// Establish the redirects, exit if error is found.
+			if (ApplyFdPlan(plan) < 0)
+			{ 
+				_exit(1);
+			}
+
+			if (pgid >= 0)
+			{
+				setpgid(0, pgid);
+			}
+
+			// Set up the signal handler for the child process to not ignore termination signals
+			memset(&act, 0, sizeof(act));
+			act.sa_handler = SIG_DFL;
+			sigaction(SIGTTOU, &act, NULL);
+			if (isForeGround)
+			{
+				sigaction(SIGINT, &act, NULL);
+			}
+			sigemptyset(&emptyMask);
+			sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+			ApplyJobLimits();
+
+			// Try to execute the user command
+			TRACE(TRACE_EXEC, 0, 0, 0, path);
+			execv(path, argv);
+			childErr = errno;
+			write(errPipe[1], &childErr, sizeof(childErr));
+			_exit(1);
+		default:
+			// This code will run in the parent process
+			close(errPipe[1]);
+
+			// Set the group here too so it is in place before we use it
+			if (pgid >= 0)
+			{
+				setpgid(spawnPid, (pgid == 0) ? spawnPid : pgid);
+			}
+
+			// A successful exec closes the pipe without writing anything
+			if (read(errPipe[0], &childErr, sizeof(childErr)) == sizeof(childErr))
+			{
+				close(errPipe[0]);
+				waitpid(spawnPid, NULL, 0);
+				sigprocmask(SIG_SETMASK, &oldMask, NULL);
+				errno = childErr;
+				return -1;
+			}
+			close(errPipe[0]);
+			sigprocmask(SIG_SETMASK, &oldMask, NULL);
+			break;
+	}
+
+	return spawnPid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the command name
+ * *  fromCache - the return variable, set to 1 if the path came
+ * *              from the cache
+ * *
+ * * Exit:
+ * *  Returns the file to execute for the command.
+ * *  Returns NULL, if it is not on PATH.
+ * *
+ * * Purpose:
+ * *	Finds a command the way execvp would, remembering the answer.
+ * *	Names with a slash are used as they are. The cache is emptied
+ * *	whenever PATH is not the value it was filled from.
+ * *
+ * ***************************************************************/
+const char *LookupCommandPath(const char *name, int *fromCache)
+{
+	unsigned int bucket;
+	char *currentPath = getenv("PATH");
+
+	*fromCache = 0;
+	if (strchr(name, '/') != NULL)
+	{
+		return name;
+	}
+	if (name[0] == '\0')
+	{
+		return NULL;
+	}
+
+	if (currentPath == NULL)
+	{
+		currentPath = DEFAULT_PATH;
+	}
+	if ((hashedPath == NULL) || (strcmp(hashedPath, currentPath) != 0))
+	{
+		ClearPathCache();
+		hashedPath = strdup(currentPath);
+	}
+
+	struct PathEntry *entry = FindPathEntry(name, &bucket);
+	if (entry != NULL)
+	{
+		entry->hits++;
+		*fromCache = 1;
+		return entry->path;
+	}
+
+	char *foundPath = SearchPath(name);
+	if (foundPath == NULL)
+	{
+		return NULL;
+	}
+
+	// Paths from "." or an empty PATH entry depend on the current
+	//  directory, so they are not kept.
+	if (foundPath[0] != '/')
+	{
+		static char *uncachedPath = NULL;
+		free(uncachedPath);
+		uncachedPath = foundPath;
+		return uncachedPath;
+	}
+
+	entry = malloc(sizeof(struct PathEntry));
+	if (entry == NULL)
+	{
+		free(foundPath);
+		return NULL;
+	}
+	entry->name = strdup(name);
+	entry->path = foundPath;
+	entry->hits = 1;
+	entry->next = pathBuckets[bucket];
+	pathBuckets[bucket] = entry;
+
+	return entry->path;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the command name
+ * *  bucket - the return variable for the name's bucket
+ * *
+ * * Exit:
+ * *  Returns the cache entry for the name, or NULL.
+ * *
+ * * Purpose:
+ * *	Looks a command up in the PATH cache.
+ * *
+ * ***************************************************************/
+struct PathEntry *FindPathEntry(const char *name, unsigned int *bucket)
+{
+	struct PathEntry *entry;
+
+	*bucket = HashString(name) & (PATH_HASH_BUCKETS - 1);
+	for (entry = pathBuckets[*bucket]; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->name, name) == 0)
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the command name
+ * *
+ * * Exit:
+ * *  Returns the first executable file for the name on PATH, which
+ * *  the caller frees.
+ * *  Returns NULL, if there is none.
+ * *
+ * * Purpose:
+ * *	Walks the PATH directories the cache was filled from.
+ * *
+ * ***************************************************************/
+char *SearchPath(const char *name)
+{
+	const char *dirStart = hashedPath;
+	size_t nameLength = strlen(name);
+	struct stat fileInfo;
+
+	while (1)
+	{
+		const char *dirEnd = strchr(dirStart, ':');
+		size_t dirLength = (dirEnd != NULL) ? (size_t)(dirEnd - dirStart) : strlen(dirStart);
+
+		// An empty entry means the current directory
+		char *candidate = malloc(dirLength + nameLength + 3);
+		if (candidate == NULL)
+		{
+			return NULL;
+		}
+		if (dirLength == 0)
+		{
+			strcpy(candidate, "./");
+		}
+		else
+		{
+			memcpy(candidate, dirStart, dirLength);
+			candidate[dirLength] = '/';
+			candidate[dirLength + 1] = '\0';
+		}
+		strcat(candidate, name);
+
+		if ((stat(candidate, &fileInfo) == 0) && (S_ISREG(fileInfo.st_mode)) &&
+			(access(candidate, X_OK) == 0))
+		{
+			return candidate;
+		}
+		free(candidate);
+
+		if (dirEnd == NULL)
+		{
+			return NULL;
+		}
+		dirStart = dirEnd + 1;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the command name
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Drops one command from the PATH cache.
+ * *
+ * ***************************************************************/
+void ForgetCommandPath(const char *name)
+{
+	unsigned int bucket = HashString(name) & (PATH_HASH_BUCKETS - 1);
+	struct PathEntry **link = &pathBuckets[bucket];
+
+	while (*link != NULL)
+	{
+		struct PathEntry *entry = *link;
+		if (strcmp(entry->name, name) == 0)
+		{
+			*link = entry->next;
+			FreeShellString(entry->name);
+			FreeShellString(entry->path);
+			free(entry);
+			return;
+		}
+		link = &entry->next;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Empties the PATH cache.
+ * *
+ * ***************************************************************/
+void ClearPathCache()
+{
+	int i;
+
+	for (i = 0; i < PATH_HASH_BUCKETS; i++)
+	{
+		while (pathBuckets[i] != NULL)
+		{
+			struct PathEntry *entry = pathBuckets[i];
+			pathBuckets[i] = entry->next;
+			FreeShellString(entry->name);
+			FreeShellString(entry->path);
+			free(entry);
+		}
+	}
+
+	FreeShellString(hashedPath);
+	hashedPath = NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  value - the string to hash
+ * *
+ * * Exit:
+ * *  Returns the FNV-1a hash of the string.
+ * *
+ * * Purpose:
+ * *	Hashes a key for the command path cache.
+ * *
+ * ***************************************************************/
+unsigned int HashString(const char *value)
+{
+	return HashBytes(value, strlen(value));
+}
+
+/**************************************************************
+ * * Entry:
+ * *  value - the bytes to hash
+ * *  length - how many there are
+ * *
+ * * Exit:
+ * *  Returns the FNV-1a hash of the bytes.
+ * *
+ * * Purpose:
+ * *	Hashes a key that is not null terminated, like a variable name
+ * *	in the middle of a word.
+ * *
+ * ***************************************************************/
+unsigned int HashBytes(const char *value, size_t length)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)value[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  value - the bytes to hash
+ * *  length - how many there are
+ * *
+ * * Exit:
+ * *  Returns the 64-bit FNV-1a hash of the bytes.
+ * *
+ * * Purpose:
+ * *	Hashes keys that name files, where 32 bits would collide.
+ * *
+ * ***************************************************************/
+unsigned long long HashBytes64(const char *value, size_t length)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)value[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  N/a
+ * *
+ * * Purpose:
+ * *	Chains the built in commands by their first character.
+ * *
+ * ***************************************************************/
+void InitBuiltins()
+{
+	int i;
+	int count = sizeof(builtins) / sizeof(builtins[0]);
+
+	for (i = 0; i < 256; i++)
+	{
+		builtinIndex[i] = -1;
+	}
+
+	// Push each builtin onto the front of its character's chain
+	for (i = count - 1; i >= 0; i--)
+	{
+		unsigned char first = (unsigned char)builtins[i].name[0];
+		builtins[i].next = builtinIndex[first];
+		builtinIndex[first] = i;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the command name to look up
+ * *
+ * * Exit:
+ * *  Returns the built in command, or NULL if there is none.
+ * *
+ * * Purpose:
+ * *	Finds a built in command by name. A function comes first, as in
+ * *	sh, and is run by the one builtin that calls functions.
+ * *
+ * ***************************************************************/
+struct Builtin *FindBuiltin(const char *name)
+{
+	int i = builtinIndex[(unsigned char)name[0]];
+
+	if (FindDefinition(&functionTable, name) != NULL)
+	{
+		return &functionBuiltin;
+	}
+
+	while (i >= 0)
+	{
+		if (strcmp(builtins[i].name, name) == 0)
+		{
+			return &builtins[i];
+		}
+		i = builtins[i].next;
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  builtin - the built in command to run
+ * *  command - the parsed command with its args and redirects
+ * *
+ * * Exit:
+ * *  Returns the exit status of the built in command.
+ * *
+ * * Purpose:
+ * *	Runs a built in command in the shell process. Redirects are
+ * *	applied to the shell's own descriptors for the length of the
+ * *	command and then put back.
+ * *
+ * ***************************************************************/
+int RunBuiltinInShell(struct Builtin *builtin, struct Command *command)
+{
+	struct FdPlan plan;
+	int saved[MAX_REDIRECTS];
+	int returnStatus;
+	int i;
+	int j;
+
+	plan.actionCount = 0;
+	plan.openedCount = 0;
+	if (OpenRedirects(command, &plan) < 0)
+	{
+		CloseFdPlan(&plan);
+		return 1;
+	}
+
+	if (HasRedirect(command, 1))
+	{
+		fflush(stdout);
+	}
+
+	// Keep a copy of each descriptor the first time it changes. -1
+	//  means it was closed and -2 that there is nothing to put back.
+	for (i = 0; i < plan.actionCount; i++)
+	{
+		struct FdAction *action = &plan.actions[i];
+
+		MoveSelfPipe(action->target);
+		saved[i] = (action->source == action->target) ? -2 : -1;
+		for (j = 0; j < i; j++)
+		{
+			if (plan.actions[j].target == action->target)
+			{
+				saved[i] = -2;
+				break;
+			}
+		}
+		if (saved[i] == -1)
+		{
+			saved[i] = fcntl(action->target, F_DUPFD_CLOEXEC, 10);
+		}
+
+		if (action->source < 0)
+		{
+			close(action->target);
+		}
+		else if (action->source != action->target)
+		{
+			dup2(action->source, action->target);
+		}
+	}
+	CloseFdPlan(&plan);
+
+	long long traceStart = TRACE_START();
+	returnStatus = builtin->func(command->argc, command->argv);
+	TRACE(TRACE_BUILTIN, traceStart, returnStatus, 0, command->argv[0]);
+
+	// Put the shell's own descriptors back, latest first. Output that
+	//  stays on stdout is flushed before the next child is started or
+	//  the next prompt, so it does not need a write of its own here.
+	if (HasRedirect(command, 1))
+	{
+		fflush(stdout);
+	}
+	for (i = plan.actionCount - 1; i >= 0; i--)
+	{
+		if (saved[i] >= 0)
+		{
+			dup2(saved[i], plan.actions[i].target);
+			close(saved[i]);
+		}
+		else if (saved[i] == -1)
+		{
+			close(plan.actions[i].target);
+		}
+	}
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  builtin - the built in command to run
+ * *  command - the parsed command with its args
+ * *  plan - the descriptors the child gets, or NULL to inherit
+ * *  isForeGround - 1 if the child should get default SIGINT
+ * *  pgid - the process group to join, 0 to lead a new one, or
+ * *         -1 to stay in the shell's group
+ * *
+ * * Exit:
+ * *  Returns the pid of the child process.
+ * *  Returns -1, if the child could not be started.
+ * *
+ * * Purpose:
+ * *	Runs a built in command in a child process so it can take
+ * *	part in a pipeline or run in the background.
+ * *
+ * ***************************************************************/
+pid_t ForkBuiltin(struct Builtin *builtin, struct Command *command, const struct FdPlan *plan,
+	int isForeGround, pid_t pgid)
+{
+	pid_t spawnPid;
+	struct sigaction act;
+	sigset_t emptyMask;
+
+	long long traceStart = TRACE_START();
+	fflush(stdout);
+	spawnPid = fork();
+	if (spawnPid != 0)
+	{
+		TRACE(TRACE_FORK, traceStart, spawnPid, 0, command->argv[0]);
+	}
+
+	if (spawnPid == 0)
+	{
+		// This code will run in the child process
+		if (pgid >= 0)
+		{
+			setpgid(0, pgid);
+		}
+
+		// Builtins like parallel start children of their own, and a
+		//  function runs whole command lines with no terminal to hand
+		//  out. The new self-pipe comes first, so the plan can move it
+		//  off any descriptor it hands the builtin.
+		ResetJobTableInChild();
+		if (ApplyFdPlan(plan) < 0)
+		{
+			_exit(1);
+		}
+		ApplyJobLimits();
+		shellIsInteractive = 0;
+		serverEvents.fd = -1;
+
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGTTOU, &act, NULL);
+		sigaction(SIGTSTP, &act, NULL);
+		if (isForeGround)
+		{
+			sigaction(SIGINT, &act, NULL);
+		}
+		sigemptyset(&emptyMask);
+		sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+		int returnStatus = builtin->func(command->argc, command->argv);
+		fflush(stdout);
+		_exit(returnStatus);
+	}
+
+	if ((spawnPid > 0) && (pgid >= 0))
+	{
+		// Set the group here too so it is in place before we use it
+		setpgid(spawnPid, (pgid == 0) ? spawnPid : pgid);
+	}
+
+	return spawnPid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  command - a "|& N" stage, after its redirects
+ * *  plan - the descriptors the stage gets
+ * *  isForeGround - 1 if the workers should get default SIGINT
+ * *  pgid - the process group to join, 0 to lead a new one, or
+ * *         -1 to stay in the shell's group
+ * *
+ * * Exit:
+ * *  Returns the pid of the process that runs the workers.
+ * *  Returns -1, if it could not be started.
+ * *
+ * * Purpose:
+ * *	Starts a copy of the shell in the stage's place. It splits
+ * *	what comes down the pipeline among the workers and merges what
+ * *	they write. The workers join its process group, so ^C and job
+ * *	control reach them as they do any other stage.
+ * *
+ * ***************************************************************/
+pid_t ForkFanOut(struct Command *command, const struct FdPlan *plan, int isForeGround, pid_t pgid)
+{
+	pid_t fanOutPid;
+	struct sigaction act;
+	sigset_t pipeMask;
+
+	long long traceStart = TRACE_START();
+	fflush(stdout);
+	fanOutPid = fork();
+	if (fanOutPid != 0)
+	{
+		TRACE(TRACE_FORK, traceStart, fanOutPid, command->fanOut, "|&");
+	}
+
+	if (fanOutPid == 0)
+	{
+		if (pgid >= 0)
+		{
+			setpgid(0, pgid);
+		}
+		if (ApplyFdPlan(plan) < 0)
+		{
+			_exit(1);
+		}
+
+		// Nothing else the shell has open is the stage's, and a pipe
+		//  end held here would keep the next stage from seeing the end
+		close_range(3, ~0U, 0);
+		captureLogFd = -1;
+		ResetJobTableInChild();
+		ApplyJobLimits();
+		shellIsInteractive = 0;
+		serverEvents.fd = -1;
+
+		// Its workers are waited for by pid, so nothing reaps them
+		//  first. A worker that stops reading gives EPIPE, not a signal.
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGCHLD, &act, NULL);
+		sigaction(SIGTTOU, &act, NULL);
+		sigaction(SIGTSTP, &act, NULL);
+		if (isForeGround)
+		{
+			sigaction(SIGINT, &act, NULL);
+		}
+		sigemptyset(&pipeMask);
+		sigaddset(&pipeMask, SIGPIPE);
+		sigprocmask(SIG_SETMASK, &pipeMask, NULL);
+
+		int returnStatus = RunFanOut(command, isForeGround, (pgid >= 0) ? getpgrp() : -1);
+		fflush(stdout);
+		_exit(returnStatus);
+	}
+
+	if ((fanOutPid > 0) && (pgid >= 0))
+	{
+		// Set the group here too so it is in place before we use it
+		setpgid(fanOutPid, (pgid == 0) ? fanOutPid : pgid);
+	}
+
+	return fanOutPid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  command - the "|& N" stage
+ * *  isForeGround - 1 if the workers should get default SIGINT
+ * *  pgid - the process group the workers join, or -1
+ * *
+ * * Exit:
+ * *  Returns the highest exit status of the workers, 128 plus the
+ * *  signal for one that was killed.
+ * *
+ * * Purpose:
+ * *	Runs a filter as N workers. Stdin is cut into blocks of whole
+ * *	lines, up to FAN_OUT_BLOCK, and a block goes out as soon as a
+ * *	worker is free, so a slow stream is not held back to fill one.
+ * *
+ * *	Unordered, a worker is started for each block until there
+ * *	are N, and they run for the whole stream. Each line they
+ * *	write is passed on whole, in the order it comes.
+ * *	Ordered, every block gets a worker of its own, up to N at
+ * *	once, and its output is held until the blocks before it have
+ * *	been written. That keeps the output in input order, and a
+ * *	filter like gzip writes one member per block.
+ * *
+ * ***************************************************************/
+int RunFanOut(struct Command *command, int isForeGround, pid_t pgid)
+{
+	int workerCount = command->fanOut;
+	struct FanOutWorker *workers = calloc(workerCount, sizeof(struct FanOutWorker));
+	struct pollfd *polls = calloc((2 * workerCount) + 1, sizeof(struct pollfd));
+	struct FanOutWorker **polled = calloc((2 * workerCount) + 1, sizeof(struct FanOutWorker *));
+	size_t inputSize = FAN_OUT_BLOCK + FAN_OUT_READ;
+	char *input = malloc(inputSize);
+	size_t inputLength = 0;
+	int isInputDone = 0;
+	unsigned long nextBlock = 0;
+	unsigned long nextOutput = 0;
+	int exitStatus = 0;
+	int i;
+	int j;
+
+	if ((workers == NULL) || (polls == NULL) || (polled == NULL) || (input == NULL))
+	{
+		fprintf(stderr, "smallsh: |&: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < workerCount; i++)
+	{
+		workers[i].pid = -1;
+		workers[i].inFd = -1;
+		workers[i].outFd = -1;
+	}
+
+	while (1)
+	{
+		// Hand out the lines read so far to the workers that are free.
+		//  A short block only goes when no worker has one to work on.
+		while (1)
+		{
+			struct FanOutWorker *idle = NULL;
+			struct FanOutWorker *unstarted = NULL;
+			int isBusy = 0;
+			for (i = 0; i < workerCount; i++)
+			{
+				struct FanOutWorker *worker = &workers[i];
+				if ((command->isUnordered) ? (worker->block != NULL) : (worker->pid >= 0))
+				{
+					isBusy = 1;
+				}
+				else if ((command->isUnordered) && (worker->inFd >= 0) && (idle == NULL))
+				{
+					idle = worker;
+				}
+				else if ((worker->pid < 0) && (unstarted == NULL))
+				{
+					unstarted = worker;
+				}
+			}
+			if (idle == NULL)
+			{
+				idle = unstarted;
+			}
+			if (idle == NULL)
+			{
+				break;
+			}
+
+			char *lastNewLine = memrchr(input, '\n', inputLength);
+			size_t length = 0;
+			if (isInputDone)
+			{
+				length = inputLength;
+			}
+			else if ((lastNewLine != NULL) && ((inputLength >= FAN_OUT_BLOCK) || (!isBusy)))
+			{
+				length = (lastNewLine - input) + 1;
+			}
+			if (length == 0)
+			{
+				break;
+			}
+
+			// The block keeps the buffer and the rest moves to a new one
+			size_t restSize = (inputLength - length > FAN_OUT_BLOCK) ? inputSize : FAN_OUT_BLOCK + FAN_OUT_READ;
+			char *rest = malloc(restSize);
+			if (rest == NULL)
+			{
+				fprintf(stderr, "smallsh: |&: out of memory\n");
+				return 1;
+			}
+			memcpy(rest, input + length, inputLength - length);
+			idle->block = input;
+			idle->blockLength = length;
+			idle->blockSent = 0;
+			input = rest;
+			inputSize = restSize;
+			inputLength -= length;
+
+			idle->sequence = nextBlock;
+			nextBlock++;
+			if ((idle->pid < 0) && (StartFanOutWorker(command, idle, isForeGround, pgid) < 0))
+			{
+				fprintf(stderr, "smallsh: %s: %s\n", command->argv[0], strerror(errno));
+				return 127;
+			}
+		}
+
+		// Unordered workers get end of file once the input runs out
+		if ((isInputDone) && (inputLength == 0))
+		{
+			for (i = 0; i < workerCount; i++)
+			{
+				if ((workers[i].inFd >= 0) && (workers[i].block == NULL))
+				{
+					close(workers[i].inFd);
+					workers[i].inFd = -1;
+				}
+			}
+		}
+
+		// Wait on the input while there is room for it, on the workers
+		//  that have lines to take and on everything they write
+		int pollCount = 0;
+		if ((!isInputDone) && ((inputLength < FAN_OUT_BLOCK) || (memchr(input, '\n', inputLength) == NULL)))
+		{
+			polls[pollCount].fd = 0;
+			polls[pollCount].events = POLLIN;
+			polled[pollCount] = NULL;
+			pollCount++;
+		}
+		for (i = 0; i < workerCount; i++)
+		{
+			if ((workers[i].inFd >= 0) && (workers[i].block != NULL))
+			{
+				polls[pollCount].fd = workers[i].inFd;
+				polls[pollCount].events = POLLOUT;
+				polled[pollCount] = &workers[i];
+				pollCount++;
+			}
+			if (workers[i].outFd >= 0)
+			{
+				polls[pollCount].fd = workers[i].outFd;
+				polls[pollCount].events = POLLIN;
+				polled[pollCount] = &workers[i];
+				pollCount++;
+			}
+		}
+		if (pollCount == 0)
+		{
+			break;
+		}
+		if (poll(polls, pollCount, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "smallsh: |&: %s\n", strerror(errno));
+			return 1;
+		}
+
+		for (i = 0; i < pollCount; i++)
+		{
+			struct FanOutWorker *worker = polled[i];
+			if (polls[i].revents == 0)
+			{
+				continue;
+			}
+
+			if (worker == NULL)
+			{
+				// More of the stream. A line longer than a block grows it.
+				if (inputSize - inputLength < FAN_OUT_READ)
+				{
+					char *grown = realloc(input, inputSize * 2);
+					if (grown == NULL)
+					{
+						fprintf(stderr, "smallsh: |&: out of memory\n");
+						return 1;
+					}
+					input = grown;
+					inputSize *= 2;
+				}
+				ssize_t readCount = read(0, input + inputLength, inputSize - inputLength);
+				if ((readCount < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+				{
+					continue;
+				}
+				if (readCount <= 0)
+				{
+					isInputDone = 1;
+				}
+				else
+				{
+					inputLength += readCount;
+				}
+			}
+			else if (polls[i].fd == worker->inFd)
+			{
+				ssize_t written = write(worker->inFd, worker->block + worker->blockSent,
+					worker->blockLength - worker->blockSent);
+				if (written > 0)
+				{
+					worker->blockSent += written;
+				}
+				else if ((errno != EAGAIN) && (errno != EINTR))
+				{
+					// The worker stopped reading. What it did not take is
+					//  lost and it gets no more.
+					worker->blockSent = worker->blockLength;
+					worker->isClosed = 1;
+				}
+				if (worker->blockSent == worker->blockLength)
+				{
+					free(worker->block);
+					worker->block = NULL;
+					if ((!command->isUnordered) || (worker->isClosed))
+					{
+						close(worker->inFd);
+						worker->inFd = -1;
+					}
+				}
+			}
+			else
+			{
+				if (worker->outputSize - worker->outputLength < FAN_OUT_READ)
+				{
+					size_t grownSize = (worker->outputSize == 0) ? FAN_OUT_READ * 2 : worker->outputSize * 2;
+					char *grown = realloc(worker->output, grownSize);
+					if (grown == NULL)
+					{
+						fprintf(stderr, "smallsh: |&: out of memory\n");
+						return 1;
+					}
+					worker->output = grown;
+					worker->outputSize = grownSize;
+				}
+				ssize_t readCount = read(worker->outFd, worker->output + worker->outputLength,
+					worker->outputSize - worker->outputLength);
+				if ((readCount < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+				{
+					continue;
+				}
+				if (readCount > 0)
+				{
+					worker->outputLength += readCount;
+				}
+				else
+				{
+					// It is done; its status is the stage's if it is the worst
+					int status = 0;
+					close(worker->outFd);
+					worker->outFd = -1;
+					while ((waitpid(worker->pid, &status, 0) < 0) && (errno == EINTR))
+					{
+					}
+					int workerStatus = (WIFSIGNALED(status)) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+					if (workerStatus > exitStatus)
+					{
+						exitStatus = workerStatus;
+					}
+					worker->pid = 0;
+				}
+
+				// Write on what can go now. Ordered, that is all of the
+				//  oldest block's output and then each finished block
+				//  after it.
+				if (command->isUnordered)
+				{
+					if (EmitFanOutOutput(worker, (worker->pid == 0)) < 0)
+					{
+						return 1;
+					}
+				}
+				else
+				{
+					struct FanOutWorker *oldest = worker;
+					while ((oldest != NULL) && (oldest->sequence == nextOutput))
+					{
+						if (EmitFanOutOutput(oldest, 1) < 0)
+						{
+							return 1;
+						}
+						if (oldest->pid != 0)
+						{
+							break;
+						}
+						oldest->pid = -1;
+						nextOutput++;
+						oldest = NULL;
+						for (j = 0; j < workerCount; j++)
+						{
+							if ((workers[j].pid >= 0) && (workers[j].sequence == nextOutput))
+							{
+								oldest = &workers[j];
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return exitStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  command - the "|& N" stage
+ * *  worker - a free worker slot
+ * *  isForeGround - 1 if the worker should get default SIGINT
+ * *  pgid - the process group it joins, or -1
+ * *
+ * * Exit:
+ * *  Returns 0, if the worker is running.
+ * *  Returns -1, if it could not be started.
+ * *
+ * * Purpose:
+ * *	Starts one copy of the filter with a pipe on each side, the
+ * *	way a pipeline stage is started. The shell's ends do not block,
+ * *	so a worker that is slow to read holds up no other.
+ * *
+ * ***************************************************************/
+int StartFanOutWorker(struct Command *command, struct FanOutWorker *worker, int isForeGround, pid_t pgid)
+{
+	struct FdPlan plan;
+	int inPipe[2];
+	int outPipe[2];
+
+	if (pipe2(inPipe, O_CLOEXEC) < 0)
+	{
+		return -1;
+	}
+	if (pipe2(outPipe, O_CLOEXEC) < 0)
+	{
+		close(inPipe[0]);
+		close(inPipe[1]);
+		return -1;
+	}
+	fcntl(inPipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(outPipe[0], F_SETFL, O_NONBLOCK);
+
+	plan.actionCount = 0;
+	plan.openedCount = 0;
+	AddFdAction(&plan, inPipe[0], 0);
+	AddFdAction(&plan, outPipe[1], 1);
+
+	// A builtin or function does not exec, so close-on-exec does not
+	//  take the shell's ends of its own pipes away from it
+	struct Builtin *builtin = FindBuiltin(command->argv[0]);
+	if (builtin != NULL)
+	{
+		AddFdAction(&plan, -1, inPipe[1]);
+		AddFdAction(&plan, -1, outPipe[0]);
+		worker->pid = ForkBuiltin(builtin, command, &plan, isForeGround, pgid);
+	}
+	else
+	{
+		worker->pid = SpawnCommand(command->argv, &plan, isForeGround, pgid);
+	}
+	int spawnErr = errno;
+	close(inPipe[0]);
+	close(outPipe[1]);
+	if (worker->pid < 0)
+	{
+		close(inPipe[1]);
+		close(outPipe[0]);
+		errno = spawnErr;
+		return -1;
+	}
+
+	worker->inFd = inPipe[1];
+	worker->outFd = outPipe[0];
+	worker->outputLength = 0;
+	worker->isClosed = 0;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  worker - a worker with output waiting
+ * *  isAll - 1 to write all of it, 0 to stop after the last whole
+ * *          line
+ * *
+ * * Exit:
+ * *  Returns 0, if it was written.
+ * *  Returns -1, if stdout is gone.
+ * *
+ * * Purpose:
+ * *	Writes a worker's output on down the pipeline. Lines are only
+ * *	written whole, so two workers' lines never mix. When the
+ * *	reader is gone, the SIGPIPE held until now ends the process,
+ * *	as it would any filter.
+ * *
+ * ***************************************************************/
+int EmitFanOutOutput(struct FanOutWorker *worker, int isAll)
+{
+	size_t length = worker->outputLength;
+	sigset_t pipeMask;
+
+	if (!isAll)
+	{
+		char *lastNewLine = memrchr(worker->output, '\n', worker->outputLength);
+		length = (lastNewLine == NULL) ? 0 : (size_t)(lastNewLine - worker->output) + 1;
+	}
+	if (length == 0)
+	{
+		return 0;
+	}
+
+	if (WriteAll(1, worker->output, length) < 0)
+	{
+		sigemptyset(&pipeMask);
+		sigaddset(&pipeMask, SIGPIPE);
+		sigprocmask(SIG_UNBLOCK, &pipeMask, NULL);
+		return -1;
+	}
+	memmove(worker->output, worker->output + length, worker->outputLength - length);
+	worker->outputLength -= length;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Does not return.
+ * *
+ * * Purpose:
+ * *	Exits the shell, with the given exit value or 0.
+ * *
+ * ***************************************************************/
+int BuiltinExit(int argc, char **argv)
+{
+	fflush(stdout);
+	exit((argc > 1) ? atoi(argv[1]) : 0);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if the directory was changed.
+ * *  Returns 1, if it could not be changed.
+ * *
+ * * Purpose:
+ * *	Changes the current shell's directory to HOME if no directory
+ * *	was given, otherwise to the user specified directory.
+ * *
+ * ***************************************************************/
+int BuiltinCd(int argc, char **argv)
+{
+	char *targetDir = (argc > 1) ? argv[1] : getenv("HOME");
+
+	if (targetDir == NULL)
+	{
+		printf("smallsh: cd: HOME not set\n");
+		return 1;
+	}
+
+	if (chdir(targetDir) < 0)
+	{
+		printf("smallsh: cd: %s: %s\n", targetDir, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Shows the status of the last foreground command and then
+ * *	clears it. "status -v" also shows the resources it used.
+ * *
+ * ***************************************************************/
+int BuiltinStatus(int argc, char **argv)
+{
+	if (strncmp(errMsg, "", MAX_ERR_MSG_LENGTH) == 0)
+	{
+		// Display the regular status output
+		printf("exit value %d\n", statusNumber);
+	}
+	else
+	{
+		// If there was an error message, then show that instead of the 
+		//  regular status message
+		printf("%s\n", errMsg);
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-v") == 0) && (hasLastTiming))
+	{
+		PrintTiming(stdout, &lastTiming);
+	}
+
+	// Clear the status
+	strncpy(errMsg, "", MAX_ERR_MSG_LENGTH);
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Writes the arguments separated by spaces. "-n" leaves off the
+ * *	trailing new line.
+ * *
+ * ***************************************************************/
+int BuiltinEcho(int argc, char **argv)
+{
+	int i = 1;
+	int addNewLine = 1;
+
+	if ((argc > 1) && (strcmp(argv[1], "-n") == 0))
+	{
+		addNewLine = 0;
+		i++;
+	}
+
+	for (; i < argc; i++)
+	{
+		fputs(argv[i], stdout);
+		if (i < argc - 1)
+		{
+			putchar(' ');
+		}
+	}
+
+	if (addNewLine)
+	{
+		putchar('\n');
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if the directory was written.
+ * *  Returns 1, if it could not be found.
+ * *
+ * * Purpose:
+ * *	Writes the current working directory.
+ * *
+ * ***************************************************************/
+int BuiltinPwd(int argc, char **argv)
+{
+	char currentDir[PATH_MAX];
+
+	if (getcwd(currentDir, sizeof(currentDir)) == NULL)
+	{
+		printf("smallsh: pwd: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("%s\n", currentDir);
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Does nothing, successfully.
+ * *
+ * ***************************************************************/
+int BuiltinTrue(int argc, char **argv)
+{
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 1.
+ * *
+ * * Purpose:
+ * *	Does nothing, unsuccessfully.
+ * *
+ * ***************************************************************/
+int BuiltinFalse(int argc, char **argv)
+{
+	return 1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if the expression is true.
+ * *  Returns 1, if the expression is false.
+ * *  Returns 2, if the expression is not valid.
+ * *
+ * * Purpose:
+ * *	Evaluates a test expression. When called as "[" the last
+ * *	argument must be "]".
+ * *
+ * ***************************************************************/
+int BuiltinTest(int argc, char **argv)
+{
+	if (strcmp(argv[0], "[") == 0)
+	{
+		if (strcmp(argv[argc - 1], "]") != 0)
+		{
+			printf("smallsh: [: missing `]'\n");
+			return 2;
+		}
+		argc--;
+	}
+
+	return EvaluateTest(argc - 1, argv + 1);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the expression, without the command name
+ * *
+ * * Exit:
+ * *  Returns 0, if the expression is true.
+ * *  Returns 1, if the expression is false.
+ * *  Returns 2, if the expression is not valid.
+ * *
+ * * Purpose:
+ * *	Evaluates a test expression, with "-o" binding looser than
+ * *	"-a" and "!" negating the expression after it.
+ * *
+ * ***************************************************************/
+int EvaluateTest(int argc, char **argv)
+{
+	int i;
+
+	// Split on the loosest operator first. An operator in the first
+	//  or last position is an operand, so skip those.
+	for (i = 1; i < argc - 1; i++)
+	{
+		if (strcmp(argv[i], "-o") == 0)
+		{
+			int left = EvaluateTest(i, argv);
+			int right = EvaluateTest(argc - i - 1, argv + i + 1);
+			if ((left == 2) || (right == 2))
+			{
+				return 2;
+			}
+			return ((left == 0) || (right == 0)) ? 0 : 1;
+		}
+	}
+	for (i = 1; i < argc - 1; i++)
+	{
+		if (strcmp(argv[i], "-a") == 0)
+		{
+			int left = EvaluateTest(i, argv);
+			int right = EvaluateTest(argc - i - 1, argv + i + 1);
+			if ((left == 2) || (right == 2))
+			{
+				return 2;
+			}
+			return ((left == 0) && (right == 0)) ? 0 : 1;
+		}
+	}
+
+	if ((argc > 1) && (strcmp(argv[0], "!") == 0))
+	{
+		int result = EvaluateTest(argc - 1, argv + 1);
+		return (result == 2) ? 2 : !result;
+	}
+
+	return EvaluateTestPrimary(argc, argv);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - a single test primary
+ * *
+ * * Exit:
+ * *  Returns 0, if the primary is true.
+ * *  Returns 1, if the primary is false.
+ * *  Returns 2, if the primary is not valid.
+ * *
+ * * Purpose:
+ * *	Evaluates a string, file or integer test.
+ * *
+ * ***************************************************************/
+int EvaluateTestPrimary(int argc, char **argv)
+{
+	struct stat fileInfo;
+
+	// No arguments is false and one argument is true if it is not empty
+	if (argc == 0)
+	{
+		return 1;
+	}
+	if (argc == 1)
+	{
+		return (argv[0][0] != '\0') ? 0 : 1;
+	}
+
+	if ((argc == 2) && (argv[0][0] == '-') && (argv[0][1] != '\0') && (argv[0][2] == '\0'))
+	{
+		char *operand = argv[1];
+
+		switch (argv[0][1])
+		{
+			case 'z':
+				return (operand[0] == '\0') ? 0 : 1;
+			case 'n':
+				return (operand[0] != '\0') ? 0 : 1;
+			case 'e':
+				return (stat(operand, &fileInfo) == 0) ? 0 : 1;
+			case 'f':
+				return ((stat(operand, &fileInfo) == 0) && (S_ISREG(fileInfo.st_mode))) ? 0 : 1;
+			case 'd':
+				return ((stat(operand, &fileInfo) == 0) && (S_ISDIR(fileInfo.st_mode))) ? 0 : 1;
+			case 's':
+				return ((stat(operand, &fileInfo) == 0) && (fileInfo.st_size > 0)) ? 0 : 1;
+			case 'h':
+			case 'L':
+				return ((lstat(operand, &fileInfo) == 0) && (S_ISLNK(fileInfo.st_mode))) ? 0 : 1;
+			case 'r':
+				return (access(operand, R_OK) == 0) ? 0 : 1;
+			case 'w':
+				return (access(operand, W_OK) == 0) ? 0 : 1;
+			case 'x':
+				return (access(operand, X_OK) == 0) ? 0 : 1;
+		}
+	}
+
+	if (argc == 3)
+	{
+		char *op = argv[1];
+
+		if (strcmp(op, "=") == 0)
+		{
+			return (strcmp(argv[0], argv[2]) == 0) ? 0 : 1;
+		}
+		if (strcmp(op, "!=") == 0)
+		{
+			return (strcmp(argv[0], argv[2]) != 0) ? 0 : 1;
+		}
+
+		if ((op[0] == '-') && (strlen(op) == 3))
+		{
+			char *leftEnd;
+			char *rightEnd;
+			long left = strtol(argv[0], &leftEnd, 10);
+			long right = strtol(argv[2], &rightEnd, 10);
+
+			if ((*leftEnd != '\0') || (*rightEnd != '\0') || (argv[0][0] == '\0') ||
+				(argv[2][0] == '\0'))
+			{
+				printf("smallsh: test: integer expression expected\n");
+				return 2;
+			}
+
+			if (strcmp(op, "-eq") == 0) return (left == right) ? 0 : 1;
+			if (strcmp(op, "-ne") == 0) return (left != right) ? 0 : 1;
+			if (strcmp(op, "-lt") == 0) return (left < right) ? 0 : 1;
+			if (strcmp(op, "-le") == 0) return (left <= right) ? 0 : 1;
+			if (strcmp(op, "-gt") == 0) return (left > right) ? 0 : 1;
+			if (strcmp(op, "-ge") == 0) return (left >= right) ? 0 : 1;
+		}
+	}
+
+	printf("smallsh: test: unknown expression\n");
+	return 2;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command, the format and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if everything was written.
+ * *  Returns 1, if the format is missing or not valid.
+ * *
+ * * Purpose:
+ * *	Writes the arguments under control of the format. The format
+ * *	is reused until all the arguments are used up. Supports the
+ * *	%s, %b, %c, %d, %i, %u, %o, %x, %X and %% conversions with
+ * *	flags, width and precision, and the usual backslash escapes.
+ * *
+ * ***************************************************************/
+int BuiltinPrintf(int argc, char **argv)
+{
+	int nextArg = 2;
+
+	if (argc < 2)
+	{
+		printf("smallsh: printf: usage: printf format [arguments]\n");
+		return 1;
+	}
+
+	do
+	{
+		int usedArg = 0;
+		char *format = argv[1];
+
+		while (*format != '\0')
+		{
+			if (*format == '\\')
+			{
+				PrintEscapedChar(&format);
+				continue;
+			}
+
+			if (*format != '%')
+			{
+				putchar(*format);
+				format++;
+				continue;
+			}
+
+			if (format[1] == '%')
+			{
+				putchar('%');
+				format += 2;
+				continue;
+			}
+
+			// Copy the whole conversion so printf can handle the flags,
+			//  width and precision.
+			char spec[32];
+			int specLength = 0;
+			spec[specLength++] = *format++;
+			while ((*format != '\0') && (strchr("-+ #0123456789.", *format) != NULL) &&
+				(specLength < (int)sizeof(spec) - 3))
+			{
+				spec[specLength++] = *format++;
+			}
+
+			char conversion = *format;
+			if (conversion == '\0')
+			{
+				printf("smallsh: printf: missing conversion\n");
+				return 1;
+			}
+			format++;
+
+			char *arg = (nextArg < argc) ? argv[nextArg] : NULL;
+			if (arg != NULL)
+			{
+				nextArg++;
+				usedArg = 1;
+			}
+
+			switch (conversion)
+			{
+				case 's':
+				case 'b':
+					spec[specLength++] = 's';
+					spec[specLength] = '\0';
+					printf(spec, (arg != NULL) ? arg : "");
+					break;
+				case 'c':
+					spec[specLength++] = 'c';
+					spec[specLength] = '\0';
+					printf(spec, ((arg != NULL) && (arg[0] != '\0')) ? arg[0] : '\0');
+					break;
+				case 'd':
+				case 'i':
+				case 'u':
+				case 'o':
+				case 'x':
+				case 'X':
+					spec[specLength++] = 'l';
+					spec[specLength++] = conversion;
+					spec[specLength] = '\0';
+					printf(spec, (arg != NULL) ? strtol(arg, NULL, 0) : 0L);
+					break;
+				default:
+					printf("smallsh: printf: %%%c: invalid conversion\n", conversion);
+					return 1;
+			}
+		}
+
+		// Stop if this pass of the format did not use any arguments
+		if (!usedArg)
+		{
+			break;
+		}
+	} while (nextArg < argc);
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  format - points at a backslash in a printf format. It is
+ * *           moved past the escape sequence.
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes the character for one backslash escape sequence.
+ * *
+ * ***************************************************************/
+void PrintEscapedChar(char **format)
+{
+	char *current = *format + 1;
+	char value;
+
+	switch (*current)
+	{
+		case 'n': value = '\n'; break;
+		case 't': value = '\t'; break;
+		case 'r': value = '\r'; break;
+		case 'a': value = '\a'; break;
+		case 'b': value = '\b'; break;
+		case 'f': value = '\f'; break;
+		case 'v': value = '\v'; break;
+		case '\\': value = '\\'; break;
+		case '\0':
+			// A trailing backslash is written as is
+			putchar('\\');
+			*format = current;
+			return;
+		default:
+			if ((*current >= '0') && (*current <= '7'))
+			{
+				// Up to three octal digits
+				int digits = 0;
+				value = 0;
+				while ((digits < 3) && (*current >= '0') && (*current <= '7'))
+				{
+					value = (value * 8) + (*current - '0');
+					current++;
+					digits++;
+				}
+				putchar(value);
+				*format = current;
+				return;
+			}
+
+			// Not an escape, write both characters
+			putchar('\\');
+			value = *current;
+			break;
+	}
+
+	putchar(value);
+	*format = current + 1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the builtin, for the error message
+ * *  argc, argv - the builtin's arguments
+ * *  next - the argument that may be "-j", moved past the option
+ * *  maxJobs - the return variable for N, left alone without "-j"
+ * *
+ * * Exit:
+ * *  Returns 0, if there was no "-j" or N is a count of 1 or more.
+ * *  Returns -1, if N is missing, is not a number or is below 1.
+ * *
+ * * Purpose:
+ * *	Reads the "-j N" or "-jN" option of parallel and on. A count
+ * *	above the job table's size is cut down to it, as no more jobs
+ * *	than that can run at once.
+ * *
+ * ***************************************************************/
+int ParseJobCount(const char *name, int argc, char **argv, int *next, long *maxJobs)
+{
+	char *count;
+	char *end;
+
+	if ((*next >= argc) || (strncmp(argv[*next], "-j", 2) != 0))
+	{
+		return 0;
+	}
+
+	count = argv[*next] + 2;
+	(*next)++;
+	if ((*count == '\0') && (*next < argc))
+	{
+		count = argv[(*next)++];
+	}
+
+	errno = 0;
+	long value = strtol(count, &end, 10);
+	if ((*count == '\0') || (*end != '\0') || (errno != 0) || (value < 1))
+	{
+		printf("smallsh: %s: -j %s: not a count of 1 or more\n", name, count);
+		return -1;
+	}
+	*maxJobs = (value > MAX_JOBS) ? MAX_JOBS : value;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments:
+ * *               parallel [-j N] command... [::: arg...]
+ * *
+ * * Exit:
+ * *  Returns 0, if every command succeeded.
+ * *  Returns 2, if N is not a count of 1 or more.
+ * *  Returns the number of failed commands otherwise, up to 101.
+ * *
+ * * Purpose:
+ * *	Runs the command template once per argument, with at most N
+ * *	commands running at a time. N defaults to the number of online
+ * *	CPUs. Each "{}" in the template is replaced by the argument, or
+ * *	the argument is added to the end if there is no "{}". The
+ * *	arguments follow ":::", or are read a line at a time from stdin.
+ * *	A slot is refilled as soon as the reaper reports its command.
+ * *
+ * ***************************************************************/
+int BuiltinParallel(int argc, char **argv)
+{
+	long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int templateStart = 1;
+	int templateCount;
+	int nextArg = -1;
+	char *line = NULL;
+	size_t lineCapacity = 0;
+	int failures = 0;
+	int inFlight = 0;
+	int moreArgs = 1;
+	sigset_t childMask;
+	sigset_t oldMask;
+	int i;
+
+	// Get the number of jobs to run at once
+	if (maxJobs < 1)
+	{
+		maxJobs = 1;
+	}
+	if (ParseJobCount("parallel", argc, argv, &templateStart, &maxJobs) < 0)
+	{
+		printf("smallsh: parallel: usage: parallel [-j N] command... [::: arg...]\n");
+		return 2;
+	}
+
+	// The template runs up to ":::" or the end of the line
+	for (templateCount = 0; templateStart + templateCount < argc; templateCount++)
+	{
+		if (strcmp(argv[templateStart + templateCount], ":::") == 0)
+		{
+			nextArg = templateStart + templateCount + 1;
+			break;
+		}
+	}
+	if (templateCount == 0)
+	{
+		printf("smallsh: parallel: usage: parallel [-j N] command... [::: arg...]\n");
+		return 1;
+	}
+
+	int *slots = malloc(maxJobs * sizeof(int));
+	if (slots == NULL)
+	{
+		return 1;
+	}
+	for (i = 0; i < maxJobs; i++)
+	{
+		slots[i] = -1;
+	}
+
+	// Hold SIGCHLD except while waiting, so no completion is missed
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	while ((moreArgs) || (inFlight > 0))
+	{
+		// Fill the free slots
+		for (i = 0; (i < maxJobs) && (moreArgs); i++)
+		{
+			if (slots[i] >= 0)
+			{
+				continue;
+			}
+
+			// Get the next argument
+			char *arg = NULL;
+			if (nextArg >= 0)
+			{
+				if (nextArg < argc)
+				{
+					arg = argv[nextArg++];
+				}
+			}
+			else
+			{
+				ssize_t length = getline(&line, &lineCapacity, stdin);
+				if (length >= 0)
+				{
+					if ((length > 0) && (line[length - 1] == '\n'))
+					{
+						line[length - 1] = '\0';
+					}
+					arg = line;
+				}
+			}
+			if (arg == NULL)
+			{
+				moreArgs = 0;
+				break;
+			}
+
+			char **commandArgs = BuildParallelArgs(argv + templateStart, templateCount, arg);
+			if (commandArgs == NULL)
+			{
+				moreArgs = 0;
+				break;
+			}
+
+			pid_t spawnPid = SpawnCommand(commandArgs, NULL, 1, -1);
+			if (spawnPid < 0)
+			{
+				printf("%s: no such file or directory\n", commandArgs[0]);
+				failures++;
+				i--;
+			}
+			else
+			{
+				slots[i] = AddJob(&spawnPid, 1, -1, commandArgs[0]);
+				if (slots[i] < 0)
+				{
+					// No room to track it, so wait for it right here
+					int status;
+					waitpid(spawnPid, &status, 0);
+					if ((!WIFEXITED(status)) || (WEXITSTATUS(status) != 0))
+					{
+						failures++;
+					}
+					i--;
+				}
+				else
+				{
+					jobs[slots[i]].isQuiet = 1;
+					inFlight++;
+				}
+			}
+			FreeParallelArgs(commandArgs);
+		}
+
+		if (inFlight == 0)
+		{
+			continue;
+		}
+
+		// Sleep until the reaper has something, then collect it
+		WaitForChild(&oldMask);
+		ReportCompletions();
+
+		for (i = 0; i < maxJobs; i++)
+		{
+			if ((slots[i] >= 0) && (jobs[slots[i]].isDone))
+			{
+				int status = jobs[slots[i]].status;
+				if ((!WIFEXITED(status)) || (WEXITSTATUS(status) != 0))
+				{
+					failures++;
+				}
+				RemoveJob(slots[i]);
+				slots[i] = -1;
+				inFlight--;
+			}
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	free(slots);
+	free(line);
+
+	return (failures > 101) ? 101 : failures;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  templateArgs - the command template
+ * *  templateCount - the number of words in the template
+ * *  arg - the argument for this run
+ * *
+ * * Exit:
+ * *  Returns the null terminated argv for one run.
+ * *  Returns NULL, if memory ran out.
+ * *
+ * * Purpose:
+ * *	Fills in a parallel command template. Free the result with
+ * *	FreeParallelArgs.
+ * *
+ * ***************************************************************/
+char **BuildParallelArgs(char **templateArgs, int templateCount, const char *arg)
+{
+	char **commandArgs = calloc(templateCount + 2, sizeof(char *));
+	size_t argLength = strlen(arg);
+	int usedArg = 0;
+	int i;
+
+	if (commandArgs == NULL)
+	{
+		return NULL;
+	}
+
+	for (i = 0; i < templateCount; i++)
+	{
+		char *word = templateArgs[i];
+		size_t size = strlen(word) + 1;
+		char *marker;
+
+		// Make room for every replacement
+		for (marker = strstr(word, "{}"); marker != NULL; marker = strstr(marker + 2, "{}"))
+		{
+			size += argLength;
+		}
+
+		char *filled = malloc(size);
+		if (filled == NULL)
+		{
+			FreeParallelArgs(commandArgs);
+			return NULL;
+		}
+
+		char *out = filled;
+		while (*word != '\0')
+		{
+			if ((word[0] == '{') && (word[1] == '}'))
+			{
+				memcpy(out, arg, argLength);
+				out += argLength;
+				word += 2;
+				usedArg = 1;
+			}
+			else
+			{
+				*out++ = *word++;
+			}
+		}
+		*out = '\0';
+		commandArgs[i] = filled;
+	}
+
+	if (!usedArg)
+	{
+		commandArgs[templateCount] = strdup(arg);
+	}
+
+	return commandArgs;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argv - an argv built by BuildParallelArgs
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees a filled in parallel command.
+ * *
+ * ***************************************************************/
+void FreeParallelArgs(char **argv)
+{
+	int i;
+
+	for (i = 0; argv[i] != NULL; i++)
+	{
+		free(argv[i]);
+	}
+	free(argv);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments:
+ * *               on [-j N] host[,host...] command...
+ * *
+ * * Exit:
+ * *  Returns 0, if the command succeeded on every host.
+ * *  Returns 2, if N is not a count of 1 or more.
+ * *  Returns the number of hosts it failed on otherwise, up to 101.
+ * *
+ * * Purpose:
+ * *	Runs a command on many hosts at once, at most N at a time, 64
+ * *	by default. A host with a "/" in it is the socket of a smallsh
+ * *	command server; any other is reached with ssh, through a
+ * *	master connection kept open under the cache directory, so only
+ * *	the first command to a host pays for the connection. Each host
+ * *	is a quiet job in the job table while it runs, and each line it
+ * *	writes is prefixed with its name. Hosts that fail are listed at
+ * *	the end.
+ * *	Example: "on -j 16 web1,web2,web3 uptime"
+ * *
+ * ***************************************************************/
+int BuiltinOn(int argc, char **argv)
+{
+	long maxJobs = ON_DEFAULT_JOBS;
+	int hostsIndex = 1;
+	int failures = 0;
+	int inFlight = 0;
+	int hostCount = 0;
+	sigset_t childMask;
+	sigset_t oldMask;
+	char *save = NULL;
+	int i;
+
+	// Get the number of hosts to run on at once
+	if (ParseJobCount("on", argc, argv, &hostsIndex, &maxJobs) < 0)
+	{
+		printf("smallsh: on: usage: on [-j N] host[,host...] command...\n");
+		return 2;
+	}
+	if (hostsIndex + 1 >= argc)
+	{
+		printf("smallsh: on: usage: on [-j N] host[,host...] command...\n");
+		return 1;
+	}
+
+	char *hostList = strdup(argv[hostsIndex]);
+	char **hosts = malloc((strlen(argv[hostsIndex]) / 2 + 1) * sizeof(char *));
+	int *slots = malloc(maxJobs * sizeof(int));
+	if ((hostList == NULL) || (hosts == NULL) || (slots == NULL))
+	{
+		free(hostList);
+		free(hosts);
+		free(slots);
+		return 1;
+	}
+	for (char *host = strtok_r(hostList, ",", &save); host != NULL; host = strtok_r(NULL, ",", &save))
+	{
+		hosts[hostCount++] = host;
+	}
+	for (i = 0; i < maxJobs; i++)
+	{
+		slots[i] = -1;
+	}
+	int *hostOfSlot = malloc(maxJobs * sizeof(int));
+	int *hostStatus = malloc((hostCount + 1) * sizeof(int));
+	if ((hostOfSlot == NULL) || (hostStatus == NULL))
+	{
+		free(hostOfSlot);
+		free(hostStatus);
+		free(hosts);
+		free(hostList);
+		free(slots);
+		return 1;
+	}
+
+	// Hold SIGCHLD except while waiting, so no completion is missed
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+	int nextHost = 0;
+	while ((nextHost < hostCount) || (inFlight > 0))
+	{
+		// Fill the free slots
+		for (i = 0; (i < maxJobs) && (nextHost < hostCount); i++)
+		{
+			if (slots[i] >= 0)
+			{
+				continue;
+			}
+
+			int hostIndex = nextHost++;
+			pid_t hostPid = ForkOnHost(hosts[hostIndex], argc - hostsIndex - 1, argv + hostsIndex + 1, &oldMask);
+			hostStatus[hostIndex] = 0;
+			if (hostPid < 0)
+			{
+				hostStatus[hostIndex] = 126 << 8;
+				i--;
+				continue;
+			}
+
+			char description[MAX_JOB_COMMAND];
+			snprintf(description, sizeof(description), "on %s", hosts[hostIndex]);
+			slots[i] = AddJob(&hostPid, 1, -1, description);
+			if (slots[i] < 0)
+			{
+				// No room to track it, so wait for it right here
+				waitpid(hostPid, &hostStatus[hostIndex], 0);
+				i--;
+			}
+			else
+			{
+				jobs[slots[i]].isQuiet = 1;
+				hostOfSlot[i] = hostIndex;
+				inFlight++;
+			}
+		}
+
+		if (inFlight == 0)
+		{
+			continue;
+		}
+
+		// Sleep until the reaper has something, then collect it
+		WaitForChild(&oldMask);
+		ReportCompletions();
+
+		for (i = 0; i < maxJobs; i++)
+		{
+			if ((slots[i] >= 0) && (jobs[slots[i]].isDone))
+			{
+				hostStatus[hostOfSlot[i]] = jobs[slots[i]].status;
+				RemoveJob(slots[i]);
+				slots[i] = -1;
+				inFlight--;
+			}
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+	for (i = 0; i < hostCount; i++)
+	{
+		int status = hostStatus[i];
+		if (WIFSIGNALED(status))
+		{
+			printf("on: %s: terminated by signal %d\n", hosts[i], WTERMSIG(status));
+			failures++;
+		}
+		else if (WEXITSTATUS(status) != 0)
+		{
+			printf("on: %s: exit value %d\n", hosts[i], WEXITSTATUS(status));
+			failures++;
+		}
+	}
+
+	free(hostOfSlot);
+	free(hostStatus);
+	free(hosts);
+	free(hostList);
+	free(slots);
+
+	return (failures > 101) ? 101 : failures;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  host - the host, or the socket of a command server
+ * *  argc, argv - the words of the command to run there
+ * *  mask - the signal mask the shell had before SIGCHLD was held
+ * *
+ * * Exit:
+ * *  Returns the pid of the process that runs it.
+ * *  Returns -1, if it could not be started.
+ * *
+ * * Purpose:
+ * *	Starts a copy of the shell that runs the command on the host,
+ * *	prefixes what comes back with the host's name and exits with
+ * *	the command's status.
+ * *
+ * ***************************************************************/
+pid_t ForkOnHost(const char *host, int argc, char **argv, const sigset_t *mask)
+{
+	struct sigaction act;
+
+	long long traceStart = TRACE_START();
+	fflush(stdout);
+	pid_t hostPid = fork();
+	if (hostPid > 0)
+	{
+		TRACE(TRACE_FORK, traceStart, hostPid, 0, host);
+	}
+
+	if (hostPid == 0)
+	{
+		captureLogFd = -1;
+		ResetJobTableInChild();
+		shellIsInteractive = 0;
+		serverEvents.fd = -1;
+
+		// Its one child is waited for by pid, and ^C ends it
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGCHLD, &act, NULL);
+		sigaction(SIGINT, &act, NULL);
+		sigaction(SIGTSTP, &act, NULL);
+		sigprocmask(SIG_SETMASK, mask, NULL);
+
+		int returnStatus = RunOnHost(host, argc, argv);
+		fflush(stdout);
+		_exit(returnStatus);
+	}
+
+	return hostPid;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  host - the host, or the socket of a command server
+ * *  argc, argv - the words of the command to run there
+ * *
+ * * Exit:
+ * *  Returns the command's exit status, 128 plus the signal if ssh
+ * *  was killed, or 126 if it could not be started.
+ * *
+ * * Purpose:
+ * *	Runs the command on the host with its stdout and stderr on
+ * *	pipes, and copies each line from them to this process's stdout
+ * *	and stderr after the host's name. The remote command's stdin is
+ * *	/dev/null, since every host cannot share the shell's.
+ * *
+ * ***************************************************************/
+int RunOnHost(const char *host, int argc, char **argv)
+{
+	struct OnHostStream streams[2];
+	struct pollfd fds[2];
+	char controlPath[PATH_MAX + 16];
+	int outPipe[2];
+	int errPipe[2];
+	int status;
+	int i;
+
+	if ((pipe2(outPipe, O_CLOEXEC) < 0) || (pipe2(errPipe, O_CLOEXEC) < 0))
+	{
+		return 126;
+	}
+
+	pid_t remotePid = fork();
+	if (remotePid == 0)
+	{
+		int nullFd = open("/dev/null", O_RDONLY);
+		dup2(nullFd, 0);
+		dup2(outPipe[1], 1);
+		dup2(errPipe[1], 2);
+
+		// A server socket is talked to here
+		if (strchr(host, '/') != NULL)
+		{
+			_exit(RunClient(host, argc, argv));
+		}
+
+		// ssh joins its words with spaces for the remote shell, so they
+		//  go as one quoted command line. The master connection stays
+		//  up for later commands to the same host.
+		const char *ssh = getenv("SMALLSH_SSH");
+		char **sshArgs = malloc((argc + 16) * sizeof(char *));
+		int count = 0;
+		if (sshArgs == NULL)
+		{
+			_exit(126);
+		}
+		sshArgs[count++] = (char *)(((ssh != NULL) && (ssh[0] != '\0')) ? ssh : "ssh");
+		if (FindCacheDirectory(controlPath, sizeof(controlPath) - 16) == 0)
+		{
+			strcat(controlPath, "/ssh-%C");
+			sshArgs[count++] = "-o";
+			sshArgs[count++] = "ControlMaster=auto";
+			sshArgs[count++] = "-o";
+			sshArgs[count++] = "ControlPersist=" ON_CONTROL_PERSIST;
+			sshArgs[count++] = "-o";
+			char *option = malloc(strlen(controlPath) + sizeof("ControlPath="));
+			sprintf(option, "ControlPath=%s", controlPath);
+			sshArgs[count++] = option;
+		}
+		sshArgs[count++] = "-o";
+		sshArgs[count++] = "BatchMode=yes";
+		sshArgs[count++] = "-T";
+		sshArgs[count++] = (char *)host;
+		sshArgs[count++] = "--";
+		sshArgs[count] = malloc(SERVER_MAX_LINE);
+		if ((sshArgs[count] == NULL) || (QuoteWords(argc, argv, sshArgs[count], SERVER_MAX_LINE) < 0))
+		{
+			fprintf(stderr, "smallsh: command line is too long\n");
+			_exit(126);
+		}
+		count++;
+		sshArgs[count] = NULL;
+		execvp(sshArgs[0], sshArgs);
+		fprintf(stderr, "%s: %s\n", sshArgs[0], strerror(errno));
+		_exit(126);
+	}
+	close(outPipe[1]);
+	close(errPipe[1]);
+	if (remotePid < 0)
+	{
+		close(outPipe[0]);
+		close(errPipe[0]);
+		return 126;
+	}
+
+	memset(streams, 0, sizeof(streams));
+	fds[0].fd = outPipe[0];
+	fds[1].fd = errPipe[0];
+	for (i = 0; i < 2; i++)
+	{
+		fds[i].events = POLLIN;
+		streams[i].host = host;
+		streams[i].outFd = i + 1;
+	}
+
+	// Read both until both are at their end
+	while ((fds[0].fd >= 0) || (fds[1].fd >= 0))
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		for (i = 0; i < 2; i++)
+		{
+			if ((fds[i].fd >= 0) && (fds[i].revents != 0) && (CopyHostLines(&streams[i], fds[i].fd) <= 0))
+			{
+				close(fds[i].fd);
+				fds[i].fd = -1;
+			}
+		}
+	}
+
+	while ((waitpid(remotePid, &status, 0) < 0) && (errno == EINTR))
+	{
+	}
+
+	return (WIFSIGNALED(status)) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  stream - a host's stdout or stderr
+ * *  fd - the pipe it comes down
+ * *
+ * * Exit:
+ * *  Returns the number of bytes read.
+ * *  Returns 0, at the end of the stream.
+ * *  Returns -1, on an error.
+ * *
+ * * Purpose:
+ * *	Reads what the host wrote and writes each whole line after the
+ * *	host's name, all of a read in one write so lines from hosts do
+ * *	not mix. What is left of a line waits for the next read; at the
+ * *	end, or when a line fills the buffer, it is written as a line.
+ * *
+ * ***************************************************************/
+ssize_t CopyHostLines(struct OnHostStream *stream, int fd)
+{
+	size_t prefixLength = strlen(stream->host) + 2;
+	char output[ON_LINE_SIZE * 2];
+	size_t outputLength = 0;
+	size_t start = 0;
+	size_t i;
+
+	ssize_t bytesRead = read(fd, stream->pending + stream->length, sizeof(stream->pending) - stream->length);
+	if ((bytesRead < 0) && (errno == EINTR))
+	{
+		return 1;
+	}
+	if (bytesRead > 0)
+	{
+		stream->length += bytesRead;
+	}
+
+	for (i = 0; i < stream->length; i++)
+	{
+		int isLast = (i + 1 == stream->length);
+		if ((stream->pending[i] != '\n') && ((!isLast) || ((bytesRead > 0) && (stream->length < sizeof(stream->pending)))))
+		{
+			continue;
+		}
+
+		// A line and its prefix, with a newline if it had none
+		size_t lineLength = i + 1 - start;
+		if (outputLength + prefixLength + lineLength + 1 > sizeof(output))
+		{
+			WriteAll(stream->outFd, output, outputLength);
+			outputLength = 0;
+		}
+		if (prefixLength + lineLength + 1 > sizeof(output))
+		{
+			WriteAll(stream->outFd, stream->host, prefixLength - 2);
+			WriteAll(stream->outFd, ": ", 2);
+			WriteAll(stream->outFd, stream->pending + start, lineLength);
+		}
+		else
+		{
+			outputLength += sprintf(output + outputLength, "%s: ", stream->host);
+			memcpy(output + outputLength, stream->pending + start, lineLength);
+			outputLength += lineLength;
+		}
+		if (stream->pending[i] != '\n')
+		{
+			output[outputLength++] = '\n';
+		}
+		start = i + 1;
+	}
+	WriteAll(stream->outFd, output, outputLength);
+
+	memmove(stream->pending, stream->pending + start, stream->length - start);
+	stream->length -= start;
+
+	return bytesRead;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments:
+ * *               hash [-r] [name...]
+ * *
+ * * Exit:
+ * *  Returns 0, if every name was found.
+ * *  Returns 1, if a name is not on PATH.
+ * *
+ * * Purpose:
+ * *	With no arguments, lists the cached command paths and how often
+ * *	each was used. "-r" empties the cache. Names are looked up and
+ * *	added to the cache.
+ * *
+ * ***************************************************************/
+int BuiltinHash(int argc, char **argv)
+{
+	int returnStatus = 0;
+	int fromCache;
+	int i = 1;
+
+	if ((argc > 1) && (strcmp(argv[1], "-r") == 0))
+	{
+		ClearPathCache();
+		i++;
+	}
+
+	if (argc == 1)
+	{
+		int bucket;
+		struct PathEntry *entry;
+		int any = 0;
+
+		for (bucket = 0; bucket < PATH_HASH_BUCKETS; bucket++)
+		{
+			for (entry = pathBuckets[bucket]; entry != NULL; entry = entry->next)
+			{
+				if (!any)
+				{
+					printf("hits\tcommand\n");
+					any = 1;
+				}
+				printf("%4d\t%s\n", entry->hits, entry->path);
+			}
+		}
+		if (!any)
+		{
+			printf("smallsh: hash table empty\n");
+		}
+		return 0;
+	}
+
+	for (; i < argc; i++)
+	{
+		if (LookupCommandPath(argv[i], &fromCache) == NULL)
+		{
+			printf("smallsh: hash: %s: not found\n", argv[i]);
+			returnStatus = 1;
+		}
+		else
+		{
+			// Looking a name up is not a use of it
+			unsigned int bucket;
+			struct PathEntry *entry = FindPathEntry(argv[i], &bucket);
+			if (entry != NULL)
+			{
+				entry->hits--;
+			}
+		}
+	}
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if the entries were listed.
+ * *  Returns 1, if there is no history or nothing matched.
+ * *
+ * * Purpose:
+ * *	"history" lists every entry, "history N" the last N entries and
+ * *	"history -s prefix" each distinct entry starting with prefix,
+ * *	latest first. Entries are numbered from the start of the file.
+ * *
+ * ***************************************************************/
+int BuiltinHistory(int argc, char **argv)
+{
+	size_t offset;
+
+	if ((argc > 2) && (strcmp(argv[1], "-s") == 0))
+	{
+		size_t first = 0;
+		size_t last = 0;
+		if (FindHistoryEntry(argv[2], strlen(argv[2]), &first, &last) < 0)
+		{
+			return 1;
+		}
+
+		// The run is in text order; show the latest first
+		size_t count = last - first;
+		size_t *matches = malloc(count * sizeof(size_t));
+		if (matches == NULL)
+		{
+			return 1;
+		}
+		memcpy(matches, history.index + first, count * sizeof(size_t));
+		qsort(matches, count, sizeof(size_t), CompareOffsetsDescending);
+		for (offset = 0; offset < count; offset++)
+		{
+			printf("%.*s\n", (int)strcspn(history.map + matches[offset], "\n"),
+				history.map + matches[offset]);
+		}
+		free(matches);
+		return 0;
+	}
+
+	if (MapHistory() < 0)
+	{
+		return 1;
+	}
+
+	// Count the entries once; later calls only count what was added
+	size_t length = history.mapLength;
+	while ((length > 0) && (history.map[length - 1] != '\n'))
+	{
+		length--;
+	}
+	history.entryCount += CountHistoryLines(history.countedLength, length);
+	history.countedLength = length;
+
+	// Step back over the entries to show
+	size_t wanted = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : history.entryCount;
+	size_t shown = 0;
+	size_t start = length;
+	while ((start > 0) && (shown < wanted))
+	{
+		start--;
+		while ((start > 0) && (history.map[start - 1] != '\n'))
+		{
+			start--;
+		}
+		shown++;
+	}
+
+	size_t number = history.entryCount - shown + 1;
+	for (offset = start; offset < length; number++)
+	{
+		size_t entryLength = strcspn(history.map + offset, "\n");
+		printf("%5zu  %.*s\n", number, (int)entryLength, history.map + offset);
+		offset += entryLength + 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the rc file's path, $SMALLSHRC or ~/.smallshrc.
+ * *  Returns NULL, if there is no home directory.
+ * *
+ * * Purpose:
+ * *	Finds the file of commands the shell runs before anything
+ * *	else. It does not have to exist.
+ * *
+ * ***************************************************************/
+const char *FindRcFile()
+{
+	static char defaultPath[PATH_MAX];
+	const char *path = getenv("SMALLSHRC");
+
+	if ((path != NULL) && (path[0] != '\0'))
+	{
+		return path;
+	}
+
+	const char *home = getenv("HOME");
+	if (home == NULL)
+	{
+		return NULL;
+	}
+	snprintf(defaultPath, sizeof(defaultPath), "%s/%s", home, RC_FILE_NAME);
+
+	return defaultPath;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the variable name, not null terminated
+ * *  nameLength - the length of name
+ * *  isRead - 1 if its value was looked at, 0 if it was only set
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Remembers a variable the rc file uses. Those it reads are the
+ * *	snapshot's key, and all of them are what the snapshot holds.
+ * *
+ * ***************************************************************/
+void NoteRcVariable(const char *name, size_t nameLength, int isRead)
+{
+	unsigned int bucket = HashBytes(name, nameLength) % VARIABLE_HASH_BUCKETS;
+	int i;
+
+	if (rcVariableCount == 0)
+	{
+		memset(rcVariableBuckets, -1, sizeof(rcVariableBuckets));
+	}
+	for (i = rcVariableBuckets[bucket]; i >= 0; i = rcVariables[i].next)
+	{
+		if ((strncmp(rcVariables[i].name, name, nameLength) == 0) && (rcVariables[i].name[nameLength] == '\0'))
+		{
+			rcVariables[i].isRead |= isRead;
+			return;
+		}
+	}
+
+	if (rcVariableCount == rcVariableCapacity)
+	{
+		size_t capacity = (rcVariableCapacity == 0) ? 16 : rcVariableCapacity * 2;
+		struct RcVariable *bigger = realloc(rcVariables, capacity * sizeof(struct RcVariable));
+		if (bigger == NULL)
+		{
+			isRcCacheable = 0;
+			return;
+		}
+		rcVariables = bigger;
+		rcVariableCapacity = capacity;
+	}
+	rcVariables[rcVariableCount].name = strndup(name, nameLength);
+	if (rcVariables[rcVariableCount].name == NULL)
+	{
+		isRcCacheable = 0;
+		return;
+	}
+	rcVariables[rcVariableCount].isRead = isRead;
+	rcVariables[rcVariableCount].next = rcVariableBuckets[bucket];
+	rcVariableBuckets[bucket] = rcVariableCount;
+	rcVariableCount++;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the variable name, not null terminated
+ * *  nameLength - the length of name
+ * *
+ * * Exit:
+ * *  Returns its "NAME=value" in the environment the shell started
+ * *  with.
+ * *  Returns NULL, if it was not set there.
+ * *
+ * * Purpose:
+ * *	Looks a variable up as it was before the table took over.
+ * *
+ * ***************************************************************/
+const char *FindStartupEntry(const char *name, size_t nameLength)
+{
+	char **entry;
+
+	for (entry = startupEnvironment; (entry != NULL) && (*entry != NULL); entry++)
+	{
+		if ((strncmp(*entry, name, nameLength) == 0) && ((*entry)[nameLength] == '='))
+		{
+			return *entry;
+		}
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the rc file
+ * *
+ * * Exit:
+ * *  Returns 0, if the tables were loaded from the snapshot.
+ * *  Returns -1, if there is no snapshot that matches.
+ * *
+ * * Purpose:
+ * *	Maps the rc file's snapshot, puts the rc file's variables
+ * *	into the table and builds the PATH cache and the definitions
+ * *	straight from it. Those strings stay in the mapping, so this
+ * *	costs a walk over the file and no parsing. The snapshot is
+ * *	only used if the rc file has the same inode, size and
+ * *	modification time it was made from, and every variable it
+ * *	read is byte for byte what it was then. Others may differ,
+ * *	as the rc file never saw them.
+ * *
+ * ***************************************************************/
+int LoadRcSnapshot(const char *path)
+{
+	char snapshotPath[PATH_MAX];
+	struct stat rcInfo;
+	struct stat info;
+	unsigned int i;
+	int t;
+
+	if ((stat(path, &rcInfo) < 0) ||
+		(snprintf(snapshotPath, sizeof(snapshotPath), "%s%s", path, RC_SNAPSHOT_SUFFIX) >= (int)sizeof(snapshotPath)))
+	{
+		return -1;
+	}
+	int fd = open(snapshotPath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	if ((fstat(fd, &info) < 0) || ((size_t)info.st_size <= sizeof(struct RcSnapshotHeader)))
+	{
+		close(fd);
+		return -1;
+	}
+	char *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	const struct RcSnapshotHeader *header = (const struct RcSnapshotHeader *)mapping;
+	char *text = mapping + sizeof(*header);
+	char *end = mapping + info.st_size;
+	int isMatch = (memcmp(header->magic, RC_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0) &&
+		(header->version == RC_SNAPSHOT_VERSION) &&
+		(header->rcDevice == (unsigned long long)rcInfo.st_dev) &&
+		(header->rcInode == (unsigned long long)rcInfo.st_ino) &&
+		(header->rcSize == (long long)rcInfo.st_size) &&
+		(header->rcSeconds == (long long)rcInfo.st_mtim.tv_sec) &&
+		(header->rcNanoseconds == (long long)rcInfo.st_mtim.tv_nsec) &&
+		(header->length == (unsigned long long)info.st_size);
+
+	// Every string has to be there before any of them is used, and
+	//  each variable the rc file read has to be as it was. The table
+	//  holds just the environment until the snapshot is loaded.
+	size_t variablesStart = header->hasHashedPath;
+	size_t effectsStart = variablesStart + header->dependencyCount;
+	size_t effectsEnd = effectsStart + header->variableCount;
+	size_t strings = effectsEnd + (2 * ((size_t)header->pathCount + header->aliasCount + header->functionCount));
+	char *next = text;
+	for (i = 0; (isMatch) && (i < strings); i++)
+	{
+		char *stringEnd = memchr(next, '\0', end - next);
+		if (stringEnd == NULL)
+		{
+			isMatch = 0;
+			break;
+		}
+		if ((i >= variablesStart) && (i < effectsStart))
+		{
+			size_t nameLength = VariableNameLength(next);
+			struct Variable *variable = FindVariableEntry(next, nameLength);
+			isMatch = (nameLength > 0) && ((next[nameLength] == '=') ?
+				((variable != NULL) && (strcmp(variable->entry, next) == 0)) :
+				((next[nameLength] == '\0') && (variable == NULL)));
+		}
+		else if ((i >= effectsStart) && (i < effectsEnd))
+		{
+			size_t nameLength = VariableNameLength(next + 1);
+			isMatch = (nameLength > 0) && (strchr("01-", next[0]) != NULL) &&
+				(next[1 + nameLength] == ((next[0] == '-') ? '\0' : '='));
+		}
+		next = stringEnd + 1;
+	}
+	char **effects = malloc((header->variableCount + 1) * sizeof(char *));
+	unsigned char *isApplied = calloc(header->variableCount + 1, 1);
+	if ((!isMatch) || (next != end) || (effects == NULL) || (isApplied == NULL))
+	{
+		free(effects);
+		free(isApplied);
+		munmap(mapping, info.st_size);
+		return -1;
+	}
+
+	snapshotMap = mapping;
+	snapshotLength = info.st_size;
+	if (header->hasHashedPath)
+	{
+		hashedPath = text;
+		text += strlen(text) + 1;
+	}
+
+	for (i = 0; i < header->dependencyCount; i++)
+	{
+		text += strlen(text) + 1;
+	}
+
+	// Each name is in the snapshot once, so only the environment's
+	//  variables need looking for. Those are changed first, while
+	//  the chains are short, and the rest are added after.
+	for (i = 0; i < header->variableCount; i++)
+	{
+		char *entry = text + 1;
+		size_t nameLength = (text[0] == '-') ? strlen(entry) : (size_t)(strchr(entry, '=') - entry);
+		struct Variable *variable = FindVariableEntry(entry, nameLength);
+		effects[i] = text;
+		if (text[0] == '-')
+		{
+			UnsetVariable(entry);
+			isApplied[i] = 1;
+		}
+		else if (variable != NULL)
+		{
+			// The envp still points at the old string
+			FreeLater(variable->entry);
+			variable->entry = entry;
+			variable->isExported = (text[0] == '1');
+			isApplied[i] = 1;
+		}
+		text = entry + strlen(entry) + 1;
+	}
+	for (i = 0; i < header->variableCount; i++)
+	{
+		char *entry = effects[i] + 1;
+		struct Variable *variable;
+		if ((!isApplied[i]) && ((variable = malloc(sizeof(struct Variable))) != NULL))
+		{
+			variable->entry = entry;
+			variable->nameLength = strchr(entry, '=') - entry;
+			variable->isExported = (effects[i][0] == '1');
+			unsigned int bucket = HashBytes(entry, variable->nameLength) % VARIABLE_HASH_BUCKETS;
+			variable->next = variableBuckets[bucket];
+			variableBuckets[bucket] = variable;
+		}
+	}
+	free(effects);
+	free(isApplied);
+
+	for (i = 0; i < header->pathCount; i++)
+	{
+		struct PathEntry *entry = malloc(sizeof(struct PathEntry));
+		char *name = text;
+		text += strlen(text) + 1;
+		if (entry != NULL)
+		{
+			unsigned int bucket = HashString(name) & (PATH_HASH_BUCKETS - 1);
+			entry->name = name;
+			entry->path = text;
+			entry->hits = 0;
+			entry->next = pathBuckets[bucket];
+			pathBuckets[bucket] = entry;
+		}
+		text += strlen(text) + 1;
+	}
+
+	for (t = 0; t < 2; t++)
+	{
+		struct DefinitionTable *table = (t == 0) ? &aliasTable : &functionTable;
+		unsigned int count = (t == 0) ? header->aliasCount : header->functionCount;
+		for (i = 0; i < count; i++)
+		{
+			struct Definition *definition = calloc(1, sizeof(struct Definition));
+			char *name = text;
+			text += strlen(text) + 1;
+			if (definition != NULL)
+			{
+				definition->name = name;
+				definition->text = text;
+				AddDefinition(table, definition);
+			}
+			text += strlen(text) + 1;
+		}
+	}
+
+	environmentDirty = 1;
+	RefreshEnvironment();
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the rc file
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Runs the rc file's commands in the shell, like a script. If
+ * *	they only set variables and fill the PATH cache, what they did
+ * *	is then written to a snapshot, so the next shell can load it
+ * *	without running the file. Otherwise any old snapshot is
+ * *	removed.
+ * *
+ * ***************************************************************/
+void RunRcFile(const char *path)
+{
+	struct InputReader reader;
+	struct stat rcInfo;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+		{
+			fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+		}
+		return;
+	}
+
+	// The file is keyed as it was before any of it ran
+	if ((fstat(fd, &rcInfo) < 0) || (OpenInputReader(&reader, fd) < 0))
+	{
+		fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	isLoadingRc = 1;
+	isRcCacheable = 1;
+	RunShellLoop(&reader);
+	isLoadingRc = 0;
+	CloseInputReader(&reader);
+
+	if (isRcCacheable)
+	{
+		SaveRcSnapshot(path, &rcInfo);
+	}
+	else
+	{
+		// A stale snapshot would only be mapped and turned down again
+		char snapshotPath[PATH_MAX];
+		if (snprintf(snapshotPath, sizeof(snapshotPath), "%s%s", path, RC_SNAPSHOT_SUFFIX) < (int)sizeof(snapshotPath))
+		{
+			unlink(snapshotPath);
+		}
+	}
+
+	size_t i;
+	for (i = 0; i < rcVariableCount; i++)
+	{
+		free(rcVariables[i].name);
+	}
+	free(rcVariables);
+	rcVariables = NULL;
+	rcVariableCount = 0;
+	rcVariableCapacity = 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - an expanded line of the rc file
+ * *  assignments - how many NAME=value words start it
+ * *
+ * * Exit:
+ * *  Returns 1, if a snapshot can hold what it does.
+ * *  Returns 0, if it has to run every time.
+ * *
+ * * Purpose:
+ * *	Tells the lines that only change the variable table, the PATH
+ * *	cache or the definitions from the ones that do something else:
+ * *	run a command, print or open a file. Those keep the rc file from
+ * *	being cached.
+ * *
+ * ***************************************************************/
+int IsSnapshotCommand(struct Pipeline *pipeline, int assignments)
+{
+	struct Command *first = &pipeline->commands[0];
+
+	if ((pipeline->count > 1) || (pipeline->isBackground) || (first->redirectCount > 0))
+	{
+		return 0;
+	}
+	if (assignments == first->argc)
+	{
+		return 1;
+	}
+
+	// Listing the tables prints something, so it needs an argument
+	struct Builtin *builtin = FindBuiltin(first->argv[0]);
+	return (assignments == 0) && (builtin != NULL) && (first->argc > 1) &&
+		((builtin->func == BuiltinExport) || (builtin->func == BuiltinUnset) ||
+		(builtin->func == BuiltinHash) || (builtin->func == BuiltinAlias) ||
+		(builtin->func == BuiltinUnalias));
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the rc file
+ * *  rcInfo - the rc file as it was when it was run
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes the variables the rc file read and changed, the PATH
+ * *	cache and the definitions to the rc file's snapshot. It is
+ * *	written to a temporary file and renamed into place, so a
+ * *	shell starting at the same time sees the old one or the new
+ * *	one, never half of one. If it cannot be written the rc file
+ * *	is just run again next time.
+ * *
+ * ***************************************************************/
+void SaveRcSnapshot(const char *path, const struct stat *rcInfo)
+{
+	char snapshotPath[PATH_MAX];
+	char temporaryPath[PATH_MAX + 16];
+	struct RcSnapshotHeader header;
+	struct Variable *variable;
+	struct PathEntry *entry;
+	struct Definition *definition;
+	size_t length;
+	size_t used;
+	size_t v;
+	int i;
+	int t;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RC_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = RC_SNAPSHOT_VERSION;
+	header.rcDevice = rcInfo->st_dev;
+	header.rcInode = rcInfo->st_ino;
+	header.rcSize = rcInfo->st_size;
+	header.rcSeconds = rcInfo->st_mtim.tv_sec;
+	header.rcNanoseconds = rcInfo->st_mtim.tv_nsec;
+	header.hasHashedPath = (hashedPath != NULL);
+
+	// Measure, then fill
+	length = sizeof(header) + ((hashedPath != NULL) ? strlen(hashedPath) + 1 : 0);
+	for (v = 0; v < rcVariableCount; v++)
+	{
+		const char *name = rcVariables[v].name;
+		const char *startEntry = FindStartupEntry(name, strlen(name));
+		if (rcVariables[v].isRead)
+		{
+			length += strlen((startEntry != NULL) ? startEntry : name) + 1;
+			header.dependencyCount++;
+		}
+		variable = FindVariableEntry(name, strlen(name));
+		length += strlen((variable != NULL) ? variable->entry : name) + 2;
+		header.variableCount++;
+	}
+	for (i = 0; i < PATH_HASH_BUCKETS; i++)
+	{
+		for (entry = pathBuckets[i]; entry != NULL; entry = entry->next)
+		{
+			length += strlen(entry->name) + strlen(entry->path) + 2;
+			header.pathCount++;
+		}
+	}
+	for (t = 0; t < 2; t++)
+	{
+		struct DefinitionTable *table = (t == 0) ? &aliasTable : &functionTable;
+		for (i = 0; i < DEFINITION_HASH_BUCKETS; i++)
+		{
+			for (definition = table->buckets[i]; definition != NULL; definition = definition->next)
+			{
+				length += strlen(definition->name) + strlen(definition->text) + 2;
+			}
+		}
+	}
+	header.aliasCount = aliasTable.count;
+	header.functionCount = functionTable.count;
+	header.length = length;
+
+	char *image = malloc(length);
+	if (image == NULL)
+	{
+		return;
+	}
+	memcpy(image, &header, sizeof(header));
+	used = sizeof(header);
+	if (hashedPath != NULL)
+	{
+		used += sprintf(image + used, "%s", hashedPath) + 1;
+	}
+	for (v = 0; v < rcVariableCount; v++)
+	{
+		const char *name = rcVariables[v].name;
+		const char *startEntry = FindStartupEntry(name, strlen(name));
+		if (rcVariables[v].isRead)
+		{
+			used += sprintf(image + used, "%s", (startEntry != NULL) ? startEntry : name) + 1;
+		}
+	}
+	for (v = 0; v < rcVariableCount; v++)
+	{
+		variable = FindVariableEntry(rcVariables[v].name, strlen(rcVariables[v].name));
+		if (variable == NULL)
+		{
+			used += sprintf(image + used, "-%s", rcVariables[v].name) + 1;
+		}
+		else
+		{
+			used += sprintf(image + used, "%c%s", variable->isExported ? '1' : '0', variable->entry) + 1;
+		}
+	}
+	for (i = 0; i < PATH_HASH_BUCKETS; i++)
+	{
+		for (entry = pathBuckets[i]; entry != NULL; entry = entry->next)
+		{
+			used += sprintf(image + used, "%s", entry->name) + 1;
+			used += sprintf(image + used, "%s", entry->path) + 1;
+		}
+	}
+	for (t = 0; t < 2; t++)
+	{
+		struct DefinitionTable *table = (t == 0) ? &aliasTable : &functionTable;
+		for (i = 0; i < DEFINITION_HASH_BUCKETS; i++)
+		{
+			for (definition = table->buckets[i]; definition != NULL; definition = definition->next)
+			{
+				used += sprintf(image + used, "%s", definition->name) + 1;
+				used += sprintf(image + used, "%s", definition->text) + 1;
+			}
+		}
+	}
+
+	snprintf(snapshotPath, sizeof(snapshotPath), "%s%s", path, RC_SNAPSHOT_SUFFIX);
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d", snapshotPath, (int)shellPid);
+	int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0)
+	{
+		int result = WriteAll(fd, image, length);
+		if ((close(fd) < 0) || (result < 0) || (rename(temporaryPath, snapshotPath) < 0))
+		{
+			unlink(temporaryPath);
+		}
+	}
+	free(image);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - a string from the variable table or the PATH cache
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees a string the tables are done with, unless it is in the
+ * *	mapped rc snapshot.
+ * *
+ * ***************************************************************/
+void FreeShellString(char *text)
+{
+	if (((uintptr_t)text < (uintptr_t)snapshotMap) ||
+		((uintptr_t)text >= (uintptr_t)snapshotMap + snapshotLength))
+	{
+		free(text);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Loads the environment the shell started with into the variable
+ * *	table, every entry exported, and builds the first envp.
+ * *
+ * ***************************************************************/
+void InitVariables()
+{
+	char **entry;
+
+	for (entry = environ; *entry != NULL; entry++)
+	{
+		char *equals = strchr(*entry, '=');
+		if ((equals != NULL) && (equals != *entry))
+		{
+			SetVariable(*entry, equals - *entry, equals + 1, 1);
+		}
+	}
+
+	RefreshEnvironment();
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the variable name, not null terminated
+ * *  nameLength - the length of name
+ * *
+ * * Exit:
+ * *  Returns the variable.
+ * *  Returns NULL, if it is not set.
+ * *
+ * * Purpose:
+ * *	Looks a variable up in the table, for something that uses its
+ * *	value. While the rc file runs, that makes it part of the key of
+ * *	the rc file's snapshot.
+ * *
+ * ***************************************************************/
+struct Variable *FindVariable(const char *name, size_t nameLength)
+{
+	if (isLoadingRc)
+	{
+		NoteRcVariable(name, nameLength, 1);
+	}
+
+	return FindVariableEntry(name, nameLength);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the variable name, not null terminated
+ * *  nameLength - the length of name
+ * *
+ * * Exit:
+ * *  Returns the variable.
+ * *  Returns NULL, if it is not set.
+ * *
+ * * Purpose:
+ * *	Looks a variable up in the table without noting it, for the
+ * *	table's own use.
+ * *
+ * ***************************************************************/
+struct Variable *FindVariableEntry(const char *name, size_t nameLength)
+{
+	struct Variable *variable = variableBuckets[HashBytes(name, nameLength) % VARIABLE_HASH_BUCKETS];
+
+	while (variable != NULL)
+	{
+		if ((variable->nameLength == nameLength) &&
+			(memcmp(variable->entry, name, nameLength) == 0))
+		{
+			return variable;
+		}
+		variable = variable->next;
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the variable name, not null terminated
+ * *  nameLength - the length of name
+ * *  value - the new value
+ * *  export - 1 to export it, 0 to leave the export flag as it is
+ * *
+ * * Exit:
+ * *  Returns 0, if the variable was set.
+ * *  Returns -1, if there was no memory.
+ * *
+ * * Purpose:
+ * *	Sets a variable. The name and value are kept as one
+ * *	"NAME=value" string, so the envp can point straight at it.
+ * *	Changing an exported variable marks the envp as out of date.
+ * *
+ * ***************************************************************/
+int SetVariable(const char *name, size_t nameLength, const char *value, int export)
+{
+	size_t valueLength = strlen(value);
+	char *entry = malloc(nameLength + valueLength + 2);
+
+	if (entry == NULL)
+	{
+		return -1;
+	}
+	memcpy(entry, name, nameLength);
+	entry[nameLength] = '=';
+	memcpy(entry + nameLength + 1, value, valueLength + 1);
+
+	if (isLoadingRc)
+	{
+		NoteRcVariable(name, nameLength, 0);
+	}
+	struct Variable *variable = FindVariableEntry(name, nameLength);
+	if (variable == NULL)
+	{
+		unsigned int bucket = HashBytes(name, nameLength) % VARIABLE_HASH_BUCKETS;
+		variable = malloc(sizeof(struct Variable));
+		if (variable == NULL)
+		{
+			free(entry);
+			return -1;
+		}
+		variable->entry = NULL;
+		variable->nameLength = nameLength;
+		variable->isExported = 0;
+		variable->next = variableBuckets[bucket];
+		variableBuckets[bucket] = variable;
+	}
+
+	// The old string stays in the envp until it is rebuilt
+	if (variable->isExported)
+	{
+		FreeLater(variable->entry);
+	}
+	else
+	{
+		FreeShellString(variable->entry);
+	}
+
+	variable->entry = entry;
+	variable->isExported |= export;
+	if (variable->isExported)
+	{
+		environmentDirty = 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - the variable to remove
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Removes a variable from the table.
+ * *
+ * ***************************************************************/
+void UnsetVariable(const char *name)
+{
+	size_t nameLength = strlen(name);
+	struct Variable **link = &variableBuckets[HashBytes(name, nameLength) % VARIABLE_HASH_BUCKETS];
+
+	if (isLoadingRc)
+	{
+		NoteRcVariable(name, nameLength, 0);
+	}
+	while (*link != NULL)
+	{
+		struct Variable *variable = *link;
+		if ((variable->nameLength == nameLength) &&
+			(memcmp(variable->entry, name, nameLength) == 0))
+		{
+			*link = variable->next;
+			if (variable->isExported)
+			{
+				environmentDirty = 1;
+				FreeLater(variable->entry);
+			}
+			else
+			{
+				FreeShellString(variable->entry);
+			}
+			free(variable);
+			return;
+		}
+		link = &variable->next;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  entry - an envp string that has been replaced
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Holds on to a string the current envp may still point to, until
+ * *	the envp is rebuilt without it.
+ * *
+ * ***************************************************************/
+void FreeLater(char *entry)
+{
+	char **bigger;
+
+	if (retiredCount == retiredCapacity)
+	{
+		size_t capacity = (retiredCapacity == 0) ? 16 : retiredCapacity * 2;
+		bigger = realloc(retiredEntries, capacity * sizeof(char *));
+		if (bigger == NULL)
+		{
+			// Leaking one string is better than a dangling envp
+			return;
+		}
+		retiredEntries = bigger;
+		retiredCapacity = capacity;
+	}
+
+	retiredEntries[retiredCount] = entry;
+	retiredCount++;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Rebuilds the envp from the exported variables if any of them
+ * *	changed since it was last built. It becomes environ, so getenv
+ * *	and every child see the table. When nothing changed this is
+ * *	one test of a flag.
+ * *
+ * ***************************************************************/
+void RefreshEnvironment()
+{
+	size_t count = 0;
+	size_t i;
+	struct Variable *variable;
+
+	if (!environmentDirty)
+	{
+		return;
+	}
+
+	for (i = 0; i < VARIABLE_HASH_BUCKETS; i++)
+	{
+		for (variable = variableBuckets[i]; variable != NULL; variable = variable->next)
+		{
+			count += variable->isExported;
+		}
+	}
+
+	char **envp = malloc((count + 1) * sizeof(char *));
+	if (envp == NULL)
+	{
+		return;
+	}
+
+	count = 0;
+	for (i = 0; i < VARIABLE_HASH_BUCKETS; i++)
+	{
+		for (variable = variableBuckets[i]; variable != NULL; variable = variable->next)
+		{
+			if (variable->isExported)
+			{
+				envp[count] = variable->entry;
+				count++;
+			}
+		}
+	}
+	envp[count] = NULL;
+
+	environ = envp;
+	free(shellEnvironment);
+	shellEnvironment = envp;
+
+	for (i = 0; i < retiredCount; i++)
+	{
+		FreeShellString(retiredEntries[i]);
+	}
+	retiredCount = 0;
+	environmentDirty = 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  word - the word to check
+ * *
+ * * Exit:
+ * *  Returns the length of the name, if the word is NAME=value.
+ * *  Returns 0, if it is not an assignment.
+ * *
+ * * Purpose:
+ * *	Tells a variable assignment from a command word.
+ * *
+ * ***************************************************************/
+size_t AssignmentNameLength(const char *word)
+{
+	size_t length = VariableNameLength(word);
+
+	return ((length > 0) && (word[length] == '=')) ? length : 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - text that may start with a variable name
+ * *
+ * * Exit:
+ * *  Returns the length of the name at the start of text, or 0.
+ * *
+ * * Purpose:
+ * *	Measures a name: a letter or "_", then letters, digits and "_".
+ * *
+ * ***************************************************************/
+size_t VariableNameLength(const char *text)
+{
+	size_t length = 0;
+
+	if ((text[0] != '_') && (!isalpha((unsigned char)text[0])))
+	{
+		return 0;
+	}
+	while ((text[length] == '_') || (isalnum((unsigned char)text[length])))
+	{
+		length++;
+	}
+
+	return length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if every name was valid.
+ * *  Returns 1, if one was not.
+ * *
+ * * Purpose:
+ * *	"export NAME=value" sets and exports a variable and
+ * *	"export NAME" exports one that is already set. With no
+ * *	arguments it lists the exported variables.
+ * *
+ * ***************************************************************/
+int BuiltinExport(int argc, char **argv)
+{
+	int returnStatus = 0;
+	int i;
+
+	if (argc == 1)
+	{
+		for (i = 0; shellEnvironment[i] != NULL; i++)
+		{
+			printf("export %s\n", shellEnvironment[i]);
+		}
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		size_t nameLength = VariableNameLength(argv[i]);
+
+		if ((nameLength == 0) || ((argv[i][nameLength] != '=') && (argv[i][nameLength] != '\0')))
+		{
+			printf("smallsh: export: `%s': not a valid identifier\n", argv[i]);
+			returnStatus = 1;
+		}
+		else if (argv[i][nameLength] == '=')
+		{
+			SetVariable(argv[i], nameLength, argv[i] + nameLength + 1, 1);
+		}
+		else
+		{
+			struct Variable *variable = FindVariable(argv[i], nameLength);
+			if (variable != NULL)
+			{
+				environmentDirty |= !variable->isExported;
+				variable->isExported = 1;
+			}
+			else
+			{
+				SetVariable(argv[i], nameLength, "", 1);
+			}
+		}
+	}
+
+	RefreshEnvironment();
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Removes each named variable, or with "-f" each named function.
+ * *
+ * ***************************************************************/
+int BuiltinUnset(int argc, char **argv)
+{
+	int isFunction = (argc > 1) && (strcmp(argv[1], "-f") == 0);
+	int i;
+
+	for (i = 1 + isFunction; i < argc; i++)
+	{
+		if (isFunction)
+		{
+			RemoveDefinition(&functionTable, argv[i]);
+		}
+		else
+		{
+			UnsetVariable(argv[i]);
+		}
+	}
+
+	RefreshEnvironment();
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments:
+ * *               alias [name[=value]...]
+ * *
+ * * Exit:
+ * *  Returns 0, if every alias was set or found.
+ * *  Returns 1, if one was not.
+ * *
+ * * Purpose:
+ * *	"alias name=value" defines an alias, which is parsed now and
+ * *	replaces the first word of a command in the lines read after
+ * *	it. "alias name" shows one and "alias" shows them all.
+ * *
+ * ***************************************************************/
+int BuiltinAlias(int argc, char **argv)
+{
+	int returnStatus = 0;
+	struct Definition *alias;
+	int i;
+
+	if (argc == 1)
+	{
+		for (i = 0; i < DEFINITION_HASH_BUCKETS; i++)
+		{
+			for (alias = aliasTable.buckets[i]; alias != NULL; alias = alias->next)
+			{
+				PrintAlias(alias);
+			}
+		}
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		char *equals = strchr(argv[i], '=');
+		if (equals == NULL)
+		{
+			alias = FindDefinition(&aliasTable, argv[i]);
+			if (alias == NULL)
+			{
+				printf("smallsh: alias: %s: not found\n", argv[i]);
+				returnStatus = 1;
+			}
+			else
+			{
+				PrintAlias(alias);
+			}
+			continue;
+		}
+
+		size_t nameLength = equals - argv[i];
+		if ((nameLength == 0) || (strcspn(argv[i], " \t\n/<>|&;()$'\"\\*?[") < nameLength))
+		{
+			printf("smallsh: alias: `%.*s': invalid alias name\n", (int)nameLength, argv[i]);
+			returnStatus = 1;
+			continue;
+		}
+		alias = NewDefinition(argv[i], nameLength, equals + 1);
+		if (alias == NULL)
+		{
+			printf("smallsh: out of memory\n");
+			returnStatus = 1;
+		}
+		else if (ParseDefinition(alias, 1) < 0)
+		{
+			FreeDefinition(alias);
+			returnStatus = 1;
+		}
+		else
+		{
+			AddDefinition(&aliasTable, alias);
+		}
+	}
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  alias - the alias to show
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Prints an alias the way it could be defined again, with its
+ * *	value in single quotes.
+ * *
+ * ***************************************************************/
+void PrintAlias(const struct Definition *alias)
+{
+	const char *current;
+
+	printf("alias %s='", alias->name);
+	for (current = alias->text; *current != '\0'; current++)
+	{
+		if (*current == '\'')
+		{
+			printf("'\\''");
+		}
+		else
+		{
+			putchar(*current);
+		}
+	}
+	printf("'\n");
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments:
+ * *               unalias -a | name...
+ * *
+ * * Exit:
+ * *  Returns 0, if every alias was removed.
+ * *  Returns 1, if one was not defined.
+ * *
+ * * Purpose:
+ * *	Removes aliases, or all of them with "-a".
+ * *
+ * ***************************************************************/
+int BuiltinUnalias(int argc, char **argv)
+{
+	int returnStatus = 0;
+	int i;
+
+	if ((argc > 1) && (strcmp(argv[1], "-a") == 0))
+	{
+		for (i = 0; i < DEFINITION_HASH_BUCKETS; i++)
+		{
+			while (aliasTable.buckets[i] != NULL)
+			{
+				RemoveDefinition(&aliasTable, aliasTable.buckets[i]->name);
+			}
+		}
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		if (RemoveDefinition(&aliasTable, argv[i]) < 0)
+		{
+			printf("smallsh: unalias: %s: not found\n", argv[i]);
+			returnStatus = 1;
+		}
+	}
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments: return [n]
+ * *
+ * * Exit:
+ * *  Returns n, or the status of the last command.
+ * *  Returns 1, if no function is running.
+ * *
+ * * Purpose:
+ * *	Ends the function that is running, skipping the rest of its
+ * *	body.
+ * *
+ * ***************************************************************/
+int BuiltinReturn(int argc, char **argv)
+{
+	if (functionDepth == 0)
+	{
+		printf("smallsh: return: can only `return' from a function\n");
+		return 1;
+	}
+
+	isReturning = 1;
+	return (argc > 1) ? (atoi(argv[1]) & 255) : statusNumber;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments: break [n]
+ * *
+ * * Exit:
+ * *  Returns 0, or 1 if n is not a positive number.
+ * *
+ * * Purpose:
+ * *	Ends the loop that is running, or the n innermost ones.
+ * *
+ * ***************************************************************/
+int BuiltinBreak(int argc, char **argv)
+{
+	return LeaveLoops("break", argc, argv, 0);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments: continue [n]
+ * *
+ * * Exit:
+ * *  Returns 0, or 1 if n is not a positive number.
+ * *
+ * * Purpose:
+ * *	Skips the rest of the loop's body and goes around again, in
+ * *	the nth loop out when n is given.
+ * *
+ * ***************************************************************/
+int BuiltinContinue(int argc, char **argv)
+{
+	return LeaveLoops("continue", argc, argv, 1);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  name - "break" or "continue", for the messages
+ * *  argc, argv - the builtin's arguments
+ * *  isContinue - 1 to go around the last loop left again
+ * *
+ * * Exit:
+ * *  Returns 0, or 1 if the count is not a positive number.
+ * *
+ * * Purpose:
+ * *	Marks how many loops to leave. The command lists stop as they
+ * *	see it and RunLoop counts the loops off. Outside a loop it
+ * *	only says so, as sh does. A count past the loops running ends
+ * *	them all.
+ * *
+ * ***************************************************************/
+int LeaveLoops(const char *name, int argc, char **argv, int isContinue)
+{
+	int count = 1;
+
+	if (argc > 1)
+	{
+		char *end;
+		long value = strtol(argv[1], &end, 10);
+		if ((*end != '\0') || (end == argv[1]) || (value < 1))
+		{
+			printf("smallsh: %s: %s: loop count out of range\n", name, argv[1]);
+			return 1;
+		}
+		count = (value > loopDepth) ? loopDepth : (int)value;
+	}
+	if (loopDepth == 0)
+	{
+		printf("smallsh: %s: only meaningful in a `for', `while', or `until' loop\n", name);
+		return 0;
+	}
+
+	loopJumps = count;
+	isContinuing = isContinue;
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Lists the background and stopped jobs.
+ * *
+ * ***************************************************************/
+int BuiltinJobs(int argc, char **argv)
+{
+	int i;
+
+	// Jobs that finished are reported first, not listed
+	ReportCompletions();
+
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		if ((jobs[i].inUse) && (!jobs[i].isQuiet))
+		{
+			PrintJob(i, (jobs[i].isStopped) ? "Stopped" : "Running");
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns the status of the job, as for a foreground command.
+ * *  Returns 1, if there is no such job.
+ * *
+ * * Purpose:
+ * *	Moves a job to the foreground, continuing it if it was
+ * *	stopped, and waits for it.
+ * *
+ * ***************************************************************/
+int BuiltinFg(int argc, char **argv)
+{
+	int jobIndex = FindJob((argc > 1) ? argv[1] : NULL, "fg");
+	if (jobIndex < 0)
+	{
+		return 1;
+	}
+	struct Job *job = &jobs[jobIndex];
+
+	printf("%s\n", job->command);
+	fflush(stdout);
+
+	// Collect any stop the reaper has not reported, before continuing
+	ReportCompletions();
+	GiveTerminalTo(job->pgid);
+	if ((shellIsInteractive) && (job->hasModes))
+	{
+		tcsetattr(0, TCSADRAIN, &job->modes);
+	}
+	ContinueJob(job);
+
+	int stopped = WaitForJob(jobIndex);
+	TakeTerminalBack(job);
+
+	if (stopped)
+	{
+		currentJob = jobIndex;
+		printf("\n");
+		PrintJob(jobIndex, "Stopped");
+		return 128 + SIGTSTP;
+	}
+
+	int status = ForeGroundStatus(job->status, errMsg);
+	RemoveJob(jobIndex);
+
+	return status;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its arguments
+ * *
+ * * Exit:
+ * *  Returns 0, if the job is running in the background.
+ * *  Returns 1, if there is no such job.
+ * *
+ * * Purpose:
+ * *	Continues a stopped job in the background.
+ * *
+ * ***************************************************************/
+int BuiltinBg(int argc, char **argv)
+{
+	int jobIndex = FindJob((argc > 1) ? argv[1] : NULL, "bg");
+	if (jobIndex < 0)
+	{
+		return 1;
+	}
+
+	if (!jobs[jobIndex].isStopped)
+	{
+		printf("smallsh: bg: job %d already in background\n", jobs[jobIndex].number);
+		return 0;
+	}
+
+	ContinueJob(&jobs[jobIndex]);
+	currentJob = jobIndex;
+	PrintJob(jobIndex, "Running");
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and the jobs or pids to wait for
+ * *
+ * * Exit:
+ * *  Returns the exit value of the last job waited for, 127 if it
+ * *  is not a job of this shell or 0 with no arguments.
+ * *
+ * * Purpose:
+ * *	Waits for background jobs to finish, so a script can start
+ * *	work with "&" and join it. With no arguments it waits for every
+ * *	running job. A job that was waited for is not reported as done.
+ * *
+ * ***************************************************************/
+int BuiltinWait(int argc, char **argv)
+{
+	int returnStatus = 0;
+	int jobIndex;
+	int i;
+
+	if (argc == 1)
+	{
+		for (jobIndex = 0; jobIndex < MAX_JOBS; jobIndex++)
+		{
+			if ((jobs[jobIndex].inUse) && (!jobs[jobIndex].isQuiet) && (!jobs[jobIndex].isStopped) &&
+				(WaitForJob(jobIndex) == 0))
+			{
+				RemoveJob(jobIndex);
+			}
+		}
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		jobIndex = -1;
+		if ((argv[i][0] == '%') || (FindPidSlot(atoi(argv[i]), 0) != NULL))
+		{
+			jobIndex = FindJob(argv[i], "wait");
+		}
+		else
+		{
+			printf("smallsh: wait: pid %s is not a child of this shell\n", argv[i]);
+		}
+		if (jobIndex < 0)
+		{
+			returnStatus = 127;
+			continue;
+		}
+
+		if (WaitForJob(jobIndex))
+		{
+			returnStatus = 128 + SIGTSTP;
+			continue;
+		}
+		int status = jobs[jobIndex].status;
+		returnStatus = (WIFSIGNALED(status)) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+		RemoveJob(jobIndex);
+	}
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command and its name=value limits
+ * *
+ * * Exit:
+ * *  Returns 0, if the limits were set.
+ * *  Returns 1, if one is not a limit or has a bad value.
+ * *
+ * * Purpose:
+ * *	Sets the limits for background jobs started after it. With no
+ * *	arguments it lists them, "name=" clears one and "-r" clears
+ * *	them all. cpu, memory and io go into a cgroup v2 directory for
+ * *	each job, which also counts the CPU time and memory the job
+ * *	uses for the job table. time, as, nofile, nproc, core and fsize
+ * *	are rlimits, set in each of the job's processes before it
+ * *	execs.
+ * *	Example: "limit cpu=50 memory=512M nofile=256"
+ * *
+ * ***************************************************************/
+int BuiltinLimit(int argc, char **argv)
+{
+	int count = sizeof(jobLimits) / sizeof(jobLimits[0]);
+	int i;
+	int j;
+
+	if (argc == 1)
+	{
+		for (j = 0; j < count; j++)
+		{
+			if (jobLimits[j].value >= 0)
+			{
+				printf("%s=%lld\n", jobLimits[j].name, jobLimits[j].value);
+			}
+		}
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-r") == 0)
+		{
+			for (j = 0; j < count; j++)
+			{
+				jobLimits[j].value = -1;
+			}
+			continue;
+		}
+
+		char *equals = strchr(argv[i], '=');
+		for (j = 0; (equals != NULL) && (j < count); j++)
+		{
+			if ((strncmp(argv[i], jobLimits[j].name, equals - argv[i]) == 0) &&
+				(jobLimits[j].name[equals - argv[i]] == '\0'))
+			{
+				break;
+			}
+		}
+		if ((equals == NULL) || (j == count))
+		{
+			printf("smallsh: limit: %s: not a limit\n", argv[i]);
+			return 1;
+		}
+
+		long long value = (equals[1] == '\0') ? -1 : ParseLimitValue(equals + 1, jobLimits[j].isSize);
+		if ((equals[1] != '\0') && ((value < 0) ||
+			((strcmp(jobLimits[j].name, "cpu") == 0) && (value == 0)) ||
+			((strcmp(jobLimits[j].name, "io") == 0) && ((value < 1) || (value > 10000)))))
+		{
+			printf("smallsh: limit: %s: bad value\n", argv[i]);
+			return 1;
+		}
+		jobLimits[j].value = value;
+	}
+
+	jobLimitCount = 0;
+	for (j = 0; j < count; j++)
+	{
+		jobLimitCount += (jobLimits[j].value >= 0);
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - a number, in bytes if isSize is set
+ * *  isSize - 1 to take a K, M or G at the end
+ * *
+ * * Exit:
+ * *  Returns the value.
+ * *  Returns -1, if it is not a number or is too big.
+ * *
+ * * Purpose:
+ * *	Reads the value of a limit.
+ * *
+ * ***************************************************************/
+long long ParseLimitValue(const char *text, int isSize)
+{
+	char *end;
+	long long value;
+
+	if (!isdigit((unsigned char)text[0]))
+	{
+		return -1;
+	}
+	errno = 0;
+	value = strtoll(text, &end, 10);
+	if (errno != 0)
+	{
+		return -1;
+	}
+
+	if ((isSize) && (*end != '\0') && (end[1] == '\0'))
+	{
+		const char *suffix = strchr("KMG", toupper((unsigned char)*end));
+		if (suffix == NULL)
+		{
+			return -1;
+		}
+		// One too big to shift is as bad as one strtoll cannot read
+		int shift = 10 * (suffix - "KMG" + 1);
+		if (value > (LLONG_MAX >> shift))
+		{
+			return -1;
+		}
+		value <<= shift;
+		end++;
+	}
+
+	return (*end == '\0') ? value : -1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the new cgroup directory, which the caller frees.
+ * *  Returns NULL, if cgroups cannot be used.
+ * *
+ * * Purpose:
+ * *	Makes the cgroup for a background job and writes the cgroup
+ * *	limits that are set into it. A limit whose controller is not
+ * *	enabled there is reported and left out.
+ * *
+ * ***************************************************************/
+char *MakeJobCgroup()
+{
+	static unsigned int jobCgroupCount = 0;
+	char text[64];
+	size_t i;
+
+	if (OpenJobCgroupRoot() < 0)
+	{
+		return NULL;
+	}
+
+	char *path = malloc(strlen(jobCgroupRoot) + 32);
+	if (path == NULL)
+	{
+		return NULL;
+	}
+	sprintf(path, "%s/job-%u", jobCgroupRoot, ++jobCgroupCount);
+	if (mkdir(path, 0755) < 0)
+	{
+		printf("smallsh: limit: %s: %s\n", path, strerror(errno));
+		free(path);
+		return NULL;
+	}
+
+	for (i = 0; i < sizeof(jobLimits) / sizeof(jobLimits[0]); i++)
+	{
+		struct JobLimit *limit = &jobLimits[i];
+		if ((limit->file == NULL) || (limit->value < 0))
+		{
+			continue;
+		}
+
+		// cpu.max is a quota out of each 100ms period
+		if (strcmp(limit->name, "cpu") == 0)
+		{
+			snprintf(text, sizeof(text), "%lld 100000", limit->value * 1000);
+		}
+		else if (strcmp(limit->name, "io") == 0)
+		{
+			snprintf(text, sizeof(text), "default %lld", limit->value);
+		}
+		else
+		{
+			snprintf(text, sizeof(text), "%lld", limit->value);
+		}
+		if (WriteCgroupFile(path, limit->file, text) < 0)
+		{
+			printf("smallsh: limit: cannot set %s: %s\n", limit->name,
+				(errno == ENOENT) ? "its controller is not enabled" : strerror(errno));
+		}
+	}
+
+	return path;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns 0, if the job cgroups have somewhere to go.
+ * *  Returns -1, if there is no cgroup v2 tree the shell can use.
+ * *
+ * * Purpose:
+ * *	The first time limits are used, makes a "smallsh-PID" cgroup
+ * *	under the shell's own cgroup v2 and gives it the cpu, memory
+ * *	and io controllers, so each job cgroup in it is a leaf with
+ * *	its own limits. Without cgroups only the rlimits apply.
+ * *
+ * ***************************************************************/
+int OpenJobCgroupRoot()
+{
+	char mountPoint[PATH_MAX] = "";
+	char ownPath[PATH_MAX] = "";
+	char line[PATH_MAX + 64];
+	char directory[2 * PATH_MAX];
+	FILE *file;
+
+	if (jobCgroupState != 0)
+	{
+		return (jobCgroupState > 0) ? 0 : -1;
+	}
+	jobCgroupState = -1;
+
+	// Where cgroup v2 is mounted, then where the shell is in it
+	file = fopen("/proc/self/mounts", "r");
+	while ((file != NULL) && (fgets(line, sizeof(line), file) != NULL))
+	{
+		char type[32];
+		if ((sscanf(line, "%*s %4095s %31s", directory, type) == 2) && (strcmp(type, "cgroup2") == 0))
+		{
+			strcpy(mountPoint, directory);
+			break;
+		}
+	}
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+	file = fopen("/proc/self/cgroup", "r");
+	while ((file != NULL) && (fgets(line, sizeof(line), file) != NULL))
+	{
+		if (strncmp(line, "0::", 3) == 0)
+		{
+			RemoveNewLineAndAddNullTerm(line);
+			strcpy(ownPath, (strcmp(line + 3, "/") == 0) ? "" : line + 3);
+			break;
+		}
+	}
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+	if (mountPoint[0] == '\0')
+	{
+		printf("smallsh: limit: there is no cgroup v2 mount, so only rlimits apply\n");
+		return -1;
+	}
+
+	snprintf(directory, sizeof(directory), "%s%s", mountPoint, ownPath);
+	jobCgroupRoot = malloc(strlen(directory) + 32);
+	if (jobCgroupRoot == NULL)
+	{
+		return -1;
+	}
+	sprintf(jobCgroupRoot, "%s/smallsh-%d", directory, (int)shellPid);
+	if ((mkdir(jobCgroupRoot, 0755) < 0) && (errno != EEXIST))
+	{
+		printf("smallsh: limit: %s: %s, so only rlimits apply\n", jobCgroupRoot, strerror(errno));
+		free(jobCgroupRoot);
+		jobCgroupRoot = NULL;
+		return -1;
+	}
+
+	// The shell's own cgroup refuses controllers for its children if
+	//  it has processes of its own and is not the root; the limits
+	//  that need them are reported when a job is made
+	WriteCgroupFile(directory, "cgroup.subtree_control", "+cpu +memory +io");
+	WriteCgroupFile(jobCgroupRoot, "cgroup.subtree_control", "+cpu +memory +io");
+	atexit(RemoveJobCgroupRoot);
+	jobCgroupState = 1;
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Removes the shell's cgroup for its jobs when it exits. It is
+ * *	left if a job is still running in it.
+ * *
+ * ***************************************************************/
+void RemoveJobCgroupRoot()
+{
+	if (jobCgroupRoot != NULL)
+	{
+		rmdir(jobCgroupRoot);
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  directory - a cgroup directory
+ * *  file - one of its files
+ * *  text - what to write
+ * *
+ * * Exit:
+ * *  Returns 0, if it was written.
+ * *  Returns -1, with errno set, if it was not.
+ * *
+ * * Purpose:
+ * *	Writes a cgroup control file in a single write, as the kernel
+ * *	wants.
+ * *
+ * ***************************************************************/
+int WriteCgroupFile(const char *directory, const char *file, const char *text)
+{
+	char path[PATH_MAX];
+	int result = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", directory, file);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		result = (write(fd, text, strlen(text)) == (ssize_t)strlen(text)) ? 0 : -1;
+		int savedErrno = errno;
+		close(fd);
+		errno = savedErrno;
+	}
+
+	return result;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Runs in a child of a limited background job before it execs.
+ * *	It moves itself into the job's cgroup, so the cgroup counts the
+ * *	whole of its run, and sets the rlimits.
+ * *
+ * ***************************************************************/
+void ApplyJobLimits()
+{
+	size_t i;
+
+	if (!isLaunchLimited)
+	{
+		return;
+	}
+
+	if ((launchCgroup != NULL) && (WriteCgroupFile(launchCgroup, "cgroup.procs", "0") < 0))
+	{
+		fprintf(stderr, "smallsh: limit: cannot join %s: %s\n", launchCgroup, strerror(errno));
+	}
+
+	for (i = 0; i < sizeof(jobLimits) / sizeof(jobLimits[0]); i++)
+	{
+		struct JobLimit *limit = &jobLimits[i];
+		struct rlimit value;
+
+		if ((limit->file != NULL) || (limit->value < 0))
+		{
+			continue;
+		}
+
+		// The hard limit goes down too, so the job cannot raise it
+		getrlimit(limit->resource, &value);
+		if ((value.rlim_max == RLIM_INFINITY) || ((rlim_t)limit->value < value.rlim_max))
+		{
+			value.rlim_max = limit->value;
+		}
+		value.rlim_cur = value.rlim_max;
+		if (setrlimit(limit->resource, &value) < 0)
+		{
+			fprintf(stderr, "smallsh: limit: cannot set %s: %s\n", limit->name, strerror(errno));
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  jobIndex - a job in the table
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Adds what a job with a cgroup has used to the line being
+ * *	printed about it: the CPU time from cpu.stat, and the most
+ * *	memory it has held from memory.peak, or memory.current on
+ * *	kernels without it. Nothing is added for other jobs.
+ * *
+ * ***************************************************************/
+void PrintJobUsage(int jobIndex)
+{
+	const char *cgroup = jobs[jobIndex].cgroup;
+	char path[PATH_MAX];
+	char line[128];
+	long long cpuUsec = -1;
+	long long memoryBytes = -1;
+	FILE *file;
+
+	if (cgroup == NULL)
+	{
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/cpu.stat", cgroup);
+	file = fopen(path, "r");
+	while ((file != NULL) && (fgets(line, sizeof(line), file) != NULL))
+	{
+		if (sscanf(line, "usage_usec %lld", &cpuUsec) == 1)
+		{
+			break;
+		}
+	}
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+
+	snprintf(path, sizeof(path), "%s/memory.peak", cgroup);
+	file = fopen(path, "r");
+	if (file == NULL)
+	{
+		snprintf(path, sizeof(path), "%s/memory.current", cgroup);
+		file = fopen(path, "r");
+	}
+	if (file != NULL)
+	{
+		if (fscanf(file, "%lld", &memoryBytes) != 1)
+		{
+			memoryBytes = -1;
+		}
+		fclose(file);
+	}
+
+	if (cpuUsec >= 0)
+	{
+		printf(" (cpu %lld.%02llds", cpuUsec / 1000000, (cpuUsec % 1000000) / 10000);
+		if (memoryBytes >= 0)
+		{
+			printf(", memory %lld KB", memoryBytes / 1024);
+		}
+		printf(")");
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  left, right - the offsets to compare
+ * *
+ * * Exit:
+ * *  Returns <0, 0 or >0 for qsort.
+ * *
+ * * Purpose:
+ * *	Orders history offsets latest first.
+ * *
+ * ***************************************************************/
+int CompareOffsetsDescending(const void *left, const void *right)
+{
+	size_t a = *(const size_t *)left;
+	size_t b = *(const size_t *)right;
+
+	return (a < b) - (a > b);
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - "cache" and the command to run
+ * *
+ * * Exit:
+ * *  Returns the command's exit status, from this run or the one
+ * *  that was cached.
+ * *
+ * * Purpose:
+ * *	Is the builtin "cache". A command that was run before with the
+ * *	same words, in the same directory and on the same files gets
+ * *	its output and status back from the cache, with no process
+ * *	started. A file is the same if its stat says so: the files
+ * *	named by its words and the file on stdin, with where stdin is
+ * *	read from. A command reading a pipe always runs. Only stdout is
+ * *	kept; a command killed or stopped by a signal is not cached.
+ * *	Example: "cache sha256sum big.iso"
+ * *
+ * ***************************************************************/
+int BuiltinCache(int argc, char **argv)
+{
+	char directory[PATH_MAX];
+	char entryPath[PATH_MAX + 32];
+	char tempPath[PATH_MAX + 32];
+	struct CacheHeader header;
+	size_t keyLength;
+	int isComplete = 0;
+	int returnStatus;
+
+	if (argc < 2)
+	{
+		printf("cache: usage: cache command [arg ...]\n");
+		return 2;
+	}
+
+	// What the command reads cannot be named, so it just runs
+	char *key = MakeCacheKey(argc - 1, argv + 1, &keyLength);
+	if ((key == NULL) || (FindCacheDirectory(directory, sizeof(directory)) < 0))
+	{
+		free(key);
+		return RunCachedCommand(argc - 1, argv + 1, -1, &isComplete);
+	}
+	snprintf(entryPath, sizeof(entryPath), "%s/%016llx", directory, HashBytes64(key, keyLength));
+
+	int entryFd = open(entryPath, O_RDONLY | O_CLOEXEC);
+	if (entryFd >= 0)
+	{
+		returnStatus = ReplayCacheEntry(entryFd, key, keyLength);
+		close(entryFd);
+		if (returnStatus >= 0)
+		{
+			free(key);
+			return returnStatus;
+		}
+	}
+
+	// The output goes into a new entry, which takes the entry's name
+	//  only once it is whole
+	snprintf(tempPath, sizeof(tempPath), "%s/.new.XXXXXX", directory);
+	int tempFd = mkostemp(tempPath, O_CLOEXEC);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.keyLength = keyLength;
+	off_t outputStart = sizeof(header) + keyLength;
+	if ((tempFd < 0) || (WriteAll(tempFd, (char *)&header, sizeof(header)) < 0) ||
+		(WriteAll(tempFd, key, keyLength) < 0))
+	{
+		if (tempFd >= 0)
+		{
+			close(tempFd);
+			unlink(tempPath);
+		}
+		free(key);
+		return RunCachedCommand(argc - 1, argv + 1, -1, &isComplete);
+	}
+	free(key);
+
+	returnStatus = RunCachedCommand(argc - 1, argv + 1, tempFd, &isComplete);
+
+	off_t end = lseek(tempFd, 0, SEEK_END);
+	header.status = returnStatus;
+	header.outputLength = (end > outputStart) ? end - outputStart : 0;
+	SendCacheOutput(tempFd, outputStart, header.outputLength);
+	if ((isComplete) && (end >= outputStart) &&
+		(pwrite(tempFd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)) &&
+		(rename(tempPath, entryPath) == 0))
+	{
+		tempPath[0] = '\0';
+	}
+	if (tempPath[0] != '\0')
+	{
+		unlink(tempPath);
+	}
+	close(tempFd);
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command to run
+ * *  outFd - where its stdout goes, or -1 to leave it alone
+ * *  isComplete - the return variable, set to 1 if it ran to its
+ * *               end and was not killed or stopped
+ * *
+ * * Exit:
+ * *  Returns its status.
+ * *
+ * * Purpose:
+ * *	Runs the command as a foreground job of one stage, the way a
+ * *	command line would, with its stdout moved to outFd.
+ * *
+ * ***************************************************************/
+int RunCachedCommand(int argc, char **argv, int outFd, int *isComplete)
+{
+	struct Pipeline pipeline;
+	struct Command command;
+	struct Redirect redirect;
+	struct rusage usage;
+	char outName[16];
+	pid_t pids[2];
+
+	memset(&pipeline, 0, sizeof(pipeline));
+	memset(&command, 0, sizeof(command));
+	command.argv = argv;
+	command.argc = argc;
+	if (outFd >= 0)
+	{
+		snprintf(outName, sizeof(outName), "%d", outFd);
+		redirect.kind = REDIRECT_DUP;
+		redirect.fd = 1;
+		redirect.target = outName;
+		redirect.isQuoted = 0;
+		command.redirects = &redirect;
+		command.redirectCount = 1;
+	}
+	pipeline.commands = &command;
+	pipeline.count = 1;
+	pipeline.stageLimit = 1;
+	pipeline.pids = pids;
+	pipeline.isExpanded = 1;
+
+	fflush(stdout);
+	strncpy(errMsg, "", MAX_ERR_MSG_LENGTH);
+	int returnStatus = RunForeGroundCommand(&pipeline, errMsg, &usage);
+	*isComplete = (errMsg[0] == '\0') && (pids[0] > 0);
+
+	return returnStatus;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command
+ * *  length - the return variable for the key's length
+ * *
+ * * Exit:
+ * *  Returns the key, which the caller frees.
+ * *  Returns NULL, if the command's input cannot be named.
+ * *
+ * * Purpose:
+ * *	Writes down what a command's output depends on: the working
+ * *	directory, each word and, for each word that is a file and for
+ * *	a file on stdin, the file's identity and times. A file that is
+ * *	written to gets a new mtime and ctime, so its entries are no
+ * *	longer found.
+ * *
+ * ***************************************************************/
+char *MakeCacheKey(int argc, char **argv, size_t *length)
+{
+	char directory[PATH_MAX];
+	struct stat info;
+	size_t size = sizeof(directory) + 256;
+	size_t used = 0;
+	int i;
+
+	if ((fstat(0, &info) == 0) && ((S_ISFIFO(info.st_mode)) || (S_ISSOCK(info.st_mode))))
+	{
+		return NULL;
+	}
+	if (getcwd(directory, sizeof(directory)) == NULL)
+	{
+		return NULL;
+	}
+	for (i = 0; i < argc; i++)
+	{
+		size += strlen(argv[i]) + 256;
+	}
+	char *key = malloc(size);
+	if (key == NULL)
+	{
+		return NULL;
+	}
+
+	// Each part has a letter saying what it is and ends in a NUL
+	used += snprintf(key + used, size - used, "d%s", directory) + 1;
+	if ((fstat(0, &info) == 0) && (S_ISREG(info.st_mode)))
+	{
+		used += snprintf(key + used, size - used, "i%llu:%llu:%lld:%lld.%09ld:%lld.%09ld@%lld",
+			(unsigned long long)info.st_dev, (unsigned long long)info.st_ino, (long long)info.st_size,
+			(long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec, (long long)info.st_ctim.tv_sec,
+			info.st_ctim.tv_nsec, (long long)lseek(0, 0, SEEK_CUR)) + 1;
+	}
+	for (i = 0; i < argc; i++)
+	{
+		used += snprintf(key + used, size - used, "a%s", argv[i]) + 1;
+		if ((stat(argv[i], &info) == 0) && (S_ISREG(info.st_mode)))
+		{
+			used += snprintf(key + used, size - used, "f%llu:%llu:%lld:%lld.%09ld:%lld.%09ld",
+				(unsigned long long)info.st_dev, (unsigned long long)info.st_ino, (long long)info.st_size,
+				(long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec, (long long)info.st_ctim.tv_sec,
+				info.st_ctim.tv_nsec) + 1;
+		}
+	}
+
+	*length = used;
+	return key;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - the return array for the directory
+ * *  size - its size
+ * *
+ * * Exit:
+ * *  Returns 0, if the directory is there.
+ * *  Returns -1, if there is nowhere to keep a cache.
+ * *
+ * * Purpose:
+ * *	Finds the cache directory, making it if need be. It is
+ * *	$SMALLSH_CACHE, or smallsh under $XDG_CACHE_HOME or ~/.cache.
+ * *
+ * ***************************************************************/
+int FindCacheDirectory(char *path, size_t size)
+{
+	const char *directory = getenv("SMALLSH_CACHE");
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	if ((directory != NULL) && (directory[0] != '\0'))
+	{
+		snprintf(path, size, "%s", directory);
+	}
+	else if ((base != NULL) && (base[0] != '\0'))
+	{
+		mkdir(base, 0700);
+		snprintf(path, size, "%s/%s", base, CACHE_DIRECTORY_NAME);
+	}
+	else if (home != NULL)
+	{
+		snprintf(path, size, "%s/.cache", home);
+		mkdir(path, 0700);
+		snprintf(path, size, "%s/.cache/%s", home, CACHE_DIRECTORY_NAME);
+	}
+	else
+	{
+		return -1;
+	}
+
+	if ((mkdir(path, 0700) < 0) && (errno != EEXIST))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  entryFd - a cache entry
+ * *  key - the key it should have
+ * *  keyLength - the key's length
+ * *
+ * * Exit:
+ * *  Returns the status that was cached.
+ * *  Returns -1, if the entry is not whole or not for this key.
+ * *
+ * * Purpose:
+ * *	Checks a cache hit and writes its output to stdout. The key is
+ * *	compared in full, so two commands whose keys hash the same do
+ * *	not get each other's output.
+ * *
+ * ***************************************************************/
+int ReplayCacheEntry(int entryFd, const char *key, size_t keyLength)
+{
+	struct CacheHeader header;
+	struct stat info;
+
+	if ((pread(entryFd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) ||
+		(memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0) ||
+		(header.version != CACHE_VERSION) || (header.keyLength != keyLength) ||
+		(fstat(entryFd, &info) < 0) ||
+		((unsigned long long)info.st_size != sizeof(header) + header.keyLength + header.outputLength))
+	{
+		return -1;
+	}
+
+	char *cachedKey = malloc(keyLength);
+	if ((cachedKey == NULL) || (pread(entryFd, cachedKey, keyLength, sizeof(header)) != (ssize_t)keyLength) ||
+		(memcmp(cachedKey, key, keyLength) != 0))
+	{
+		free(cachedKey);
+		return -1;
+	}
+	free(cachedKey);
+
+	SendCacheOutput(entryFd, sizeof(header) + keyLength, header.outputLength);
+
+	return header.status;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  fd - a cache entry
+ * *  offset - where the output starts in it
+ * *  length - how long the output is
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Copies cached output to stdout with sendfile, so it does not
+ * *	pass through the shell. Where stdout cannot take sendfile it is
+ * *	copied through a buffer.
+ * *
+ * ***************************************************************/
+void SendCacheOutput(int fd, off_t offset, size_t length)
+{
+	char buffer[65536];
+
+	fflush(stdout);
+	while (length > 0)
+	{
+		ssize_t sent = sendfile(1, fd, &offset, length);
+		if ((sent < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+		if (sent <= 0)
+		{
+			break;
+		}
+		length -= sent;
+	}
+
+	while (length > 0)
+	{
+		ssize_t readCount = pread(fd, buffer, (length < sizeof(buffer)) ? length : sizeof(buffer), offset);
+		if ((readCount <= 0) || (WriteAll(1, buffer, readCount) < 0))
+		{
+			return;
+		}
+		offset += readCount;
+		length -= readCount;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  arena - the arena to allocate from
+ * *  size - the number of bytes needed
+ * *
+ * * Exit:
+ * *  Returns the memory, aligned for any type.
+ * *  Returns NULL, if no memory is left.
+ * *
+ * * Purpose:
+ * *	Bumps the arena's current block. When it is full the next
+ * *	block is used, reusing blocks an earlier line needed before
+ * *	adding a bigger one, so a long line only mallocs once.
+ * *
+ * ***************************************************************/
+void *ArenaAlloc(struct Arena *arena, size_t size)
+{
+	struct ArenaBlock *block = arena->current;
+
+	size = (size + 15) & ~(size_t)15;
+
+	while ((block != NULL) && (block->used + size > block->size))
+	{
+		block = block->next;
+		if (block != NULL)
+		{
+			block->used = 0;
+		}
+	}
+
+	if (block == NULL)
+	{
+		size_t blockSize = ARENA_BLOCK_SIZE;
+		if ((arena->last != NULL) && (arena->last->size * 2 > blockSize))
+		{
+			blockSize = arena->last->size * 2;
+		}
+		if (size > blockSize)
+		{
+			blockSize = size;
+		}
+
+		block = malloc(sizeof(struct ArenaBlock) + blockSize);
+		if (block == NULL)
+		{
+			return NULL;
+		}
+		block->next = NULL;
+		block->size = blockSize;
+		block->used = 0;
+
+		if (arena->last != NULL)
+		{
+			arena->last->next = block;
+		}
+		else
+		{
+			arena->first = block;
+		}
+		arena->last = block;
+	}
+
+	arena->current = block;
+	void *memory = block->data + block->used;
+	block->used += size;
+
+	return memory;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  arena - the arena to reset
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees everything in the arena at once. The blocks are kept for
+ * *	the next line, and each one is emptied when it is reached.
+ * *
+ * ***************************************************************/
+void ArenaReset(struct Arena *arena)
+{
+	arena->current = arena->first;
+	if (arena->first != NULL)
+	{
+		arena->first->used = 0;
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  arena - the arena to free
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Frees every block of an arena, for one that is not used again
+ * *	until it is set up afresh.
+ * *
+ * ***************************************************************/
+void ArenaFree(struct Arena *arena)
+{
+	while (arena->first != NULL)
+	{
+		struct ArenaBlock *block = arena->first;
+		arena->first = block->next;
+		free(block);
+	}
+	memset(arena, 0, sizeof(*arena));
+}
+
+/**************************************************************
+ * * Entry:
+ * *  arena - where to allocate the copy
+ * *  text - the string to copy
+ * *
+ * * Exit:
+ * *  Returns the copy.
+ * *  Returns NULL, if there was no memory.
+ * *
+ * * Purpose:
+ * *	Copies a string into an arena.
+ * *
+ * ***************************************************************/
+char *ArenaCopy(struct Arena *arena, const char *text)
+{
+	size_t size = strlen(text) + 1;
+	char *copy = ArenaAlloc(arena, size);
+
+	if (copy != NULL)
+	{
+		memcpy(copy, text, size);
+	}
+
+	return copy;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - the command line, which is cut up in place
+ * *  list - the return variable for its pipelines
+ * *  arena - where the pipelines are allocated
+ * *
+ * * Exit:
+ * *  Returns 0, if the line was parsed. A line with nothing on it
+ * *  has no pipelines.
+ * *  Returns -1, on a syntax error.
+ * *
+ * * Purpose:
+ * *  Splits a command line at ";", "&", "&&" and "||" outside quotes
+ * *  and substitutions, and parses each part as a pipeline. A line
+ * *  may end with ";" or "&", but not with "&&" or "||". The lines
+ * *  of a compound command read over several lines are split at
+ * *  their new lines too, and blank ones are skipped. Aliases are
+ * *  replaced once each pipeline is parsed.
+ * *
+ * ***************************************************************/
+int ParseCommandList(char *line, struct CommandList *list, struct Arena *arena)
+{
+	char *current = line;
+	int kind;
+	int length;
+	int operators = 0;
+
+	while ((current = NextListOperator(current, &kind, &length)) != NULL)
+	{
+		current += length;
+		operators++;
+	}
+
+	list->count = 0;
+	list->pipelines = ArenaAlloc(arena, (operators + 1) * sizeof(struct Pipeline));
+	list->operators = ArenaAlloc(arena, operators + 1);
+	if ((list->pipelines == NULL) || (list->operators == NULL))
+	{
+		printf("smallsh: out of memory\n");
+		return -1;
+	}
+
+	char *segment = line;
+	while (segment != NULL)
+	{
+		struct Pipeline *pipeline = &list->pipelines[list->count];
+		char token[3] = "";
+		char *end = segment;
+
+		// A compound command runs to its end word, over the operators
+		//  in its body
+		int isCompound = ParseCompound(segment, pipeline, arena, &end);
+		if (isCompound < 0)
+		{
+			return -1;
+		}
+
+		kind = LIST_SEQUENCE;
+		current = NextListOperator(end, &kind, &length);
+		if (current != NULL)
+		{
+			memcpy(token, current, length);
+			token[length] = '\0';
+			*current = '\0';
+			current += length;
+		}
+
+		if (isCompound)
+		{
+			end += strspn(end, " \t");
+			if (*end != '\0')
+			{
+				printf("smallsh: syntax error near unexpected token `%.*s'\n", (int)strcspn(end, " \t"), end);
+				return -1;
+			}
+		}
+		else if (ParseCommandLine(segment, pipeline, arena) < 0)
+		{
+			return -1;
+		}
+		if (pipeline->count == 0)
+		{
+			// Only the end of the line can be empty, after ";" or "&",
+			//  and the lines of a compound command
+			int previous = (list->count > 0) ? list->operators[list->count - 1] : LIST_SEQUENCE;
+			if ((current != NULL) && (token[0] == '\n'))
+			{
+				segment = current;
+				continue;
+			}
+			if ((current != NULL) || (previous == LIST_AND) || (previous == LIST_OR))
+			{
+				printf("smallsh: syntax error near unexpected token `%s'\n",
+					(current != NULL) ? token : "newline");
+				return -1;
+			}
+			break;
+		}
+		if ((!isCompound) && (ExpandAliases(pipeline) < 0))
+		{
+			return -1;
+		}
+
+		if (kind == LIST_BACKGROUND)
+		{
+			pipeline->isBackground = 1;
+		}
+		list->operators[list->count] = kind;
+		list->count++;
+		segment = current;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - where to start looking
+ * *  kind - the return variable for the kind of operator
+ * *  length - the return variable for how long it is
+ * *
+ * * Exit:
+ * *  Returns the next list operator.
+ * *  Returns NULL, if there are no more, or a quote is not closed,
+ * *  which ParseCommandLine reports.
+ * *
+ * * Purpose:
+ * *  Finds the next ";", "&", "&&" or "||" outside quotes and
+ * *  substitutions. The "&" in a ">&" redirect is not one. A new
+ * *  line, which only a compound command read over several lines
+ * *  has, is the same as ";".
+ * *
+ * ***************************************************************/
+char *NextListOperator(char *line, int *kind, int *length)
+{
+	char *current = line;
+
+	while (*current != '\0')
+	{
+		if ((*current == '\'') || (*current == '"'))
+		{
+			current = FindClosingQuote(current);
+		}
+		else if ((*current == '$') && (current[1] == '('))
+		{
+			current = FindClosingParen(current);
+		}
+		else if ((*current == '\\') && (current[1] != '\0'))
+		{
+			current++;
+		}
+		else if ((*current == ';') || (*current == '\n'))
+		{
+			*kind = LIST_SEQUENCE;
+			*length = 1;
+			return current;
+		}
+		else if ((current[0] == '&') && (current[1] == '&'))
+		{
+			*kind = LIST_AND;
+			*length = 2;
+			return current;
+		}
+		else if ((current[0] == '|') && (current[1] == '|'))
+		{
+			*kind = LIST_OR;
+			*length = 2;
+			return current;
+		}
+		else if ((*current == '&') && ((current == line) || (strchr("<>|", current[-1]) == NULL)))
+		{
+			*kind = LIST_BACKGROUND;
+			*length = 1;
+			return current;
+		}
+		if (current == NULL)
+		{
+			return NULL;
+		}
+		current++;
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  segment - the start of a part of a command list
+ * *  pipeline - the return variable for the compound command
+ * *  arena - where it is allocated
+ * *  end - the return variable for the text after it
+ * *
+ * * Exit:
+ * *  Returns 1, if the part is a compound command.
+ * *  Returns 0, if it is not one.
+ * *  Returns -1, on a syntax error.
+ * *
+ * * Purpose:
+ * *  Reads a function definition, "name() { body; }" or "function
+ * *  name { body; }". The body is cut out of the line as it is; it
+ * *  is parsed when the definition runs. A loop is handed to
+ * *  ParseLoop.
+ * *
+ * ***************************************************************/
+int ParseCompound(char *segment, struct Pipeline *pipeline, struct Arena *arena, char **end)
+{
+	char *current = segment + strspn(segment, " \t\n");
+	int isKeyword = ((strncmp(current, "function", 8) == 0) && ((current[8] == ' ') || (current[8] == '\t')));
+	size_t nameLength;
+	int depth = 1;
+
+	if ((IsKeyword(current, "for")) || (IsKeyword(current, "while")) || (IsKeyword(current, "until")))
+	{
+		return ParseLoop(current, pipeline, arena, end);
+	}
+	if (isKeyword)
+	{
+		current += 8;
+		current += strspn(current, " \t");
+	}
+	char *name = current;
+	nameLength = strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-");
+	current += nameLength;
+	current += strspn(current, " \t");
+	if ((current[0] == '(') && (current[1] == ')'))
+	{
+		current += 2;
+		current += strspn(current, " \t\n");
+	}
+	else if (!isKeyword)
+	{
+		return 0;
+	}
+	if ((nameLength == 0) || (isdigit((unsigned char)name[0])))
+	{
+		printf("smallsh: `%.*s': not a valid function name\n", (int)(current - name), name);
+		return -1;
+	}
+	if (*current != '{')
+	{
+		printf("smallsh: syntax error: `{' expected after `%.*s'\n", (int)nameLength, name);
+		return -1;
+	}
+
+	char *body = current + 1;
+	char *close = FindCompoundEnd(body, &depth);
+	if (close == NULL)
+	{
+		printf("smallsh: syntax error: unexpected end of file looking for `}'\n");
+		return -1;
+	}
+	if (*close != '}')
+	{
+		printf("smallsh: syntax error near unexpected token `%.*s'\n", (int)strcspn(close, " \t\n;&|<>"), close);
+		return -1;
+	}
+
+	struct Compound *compound = NewCompound(pipeline, arena, COMPOUND_FUNCTION);
+	if (compound == NULL)
+	{
+		return -1;
+	}
+	name[nameLength] = '\0';
+	*close = '\0';
+	compound->name = name;
+	compound->body = body;
+	*end = close + 1;
+
+	return 1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the return variable for the compound command
+ * *  arena - where it is allocated
+ * *  kind - what kind of compound command it is
+ * *
+ * * Exit:
+ * *  Returns the compound command, with its lists empty.
+ * *  Returns NULL, if there was no memory.
+ * *
+ * * Purpose:
+ * *  Sets a pipeline up to run a compound command. Its one stage is
+ * *  empty, so whatever looks at a pipeline finds nothing to run in
+ * *  it.
+ * *
+ * ***************************************************************/
+struct Compound *NewCompound(struct Pipeline *pipeline, struct Arena *arena, int kind)
+{
+	char empty[] = "";
+
+	if (ParseCommandLine(empty, pipeline, arena) < 0)
+	{
+		return NULL;
+	}
+	struct Compound *compound = ArenaAlloc(arena, sizeof(struct Compound));
+	if (compound == NULL)
+	{
+		printf("smallsh: out of memory\n");
+		return NULL;
+	}
+	memset(compound, 0, sizeof(*compound));
+	compound->kind = kind;
+	pipeline->compound = compound;
+	pipeline->argPool[0] = NULL;
+	pipeline->count = 1;
+
+	return compound;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - where a word starts
+ * *  keyword - the word to look for
+ * *
+ * * Exit:
+ * *  Returns 1, if the word is keyword.
+ * *  Returns 0, if not.
+ * *
+ * * Purpose:
+ * *  Tells a reserved word from a longer word that starts the same,
+ * *  so "done" is not "do" and "format" is not "for".
+ * *
+ * ***************************************************************/
+int IsKeyword(const char *text, const char *keyword)
+{
+	size_t length = strlen(keyword);
+
+	return (strncmp(text, keyword, length) == 0) &&
+		((text[length] == '\0') || (strchr(" \t\n;", text[length]) != NULL));
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - where the loop's first word starts
+ * *  pipeline - the return variable for the loop
+ * *  arena - where it is allocated
+ * *  end - the return variable for the text after it
+ * *
+ * * Exit:
+ * *  Returns 1, if the loop was parsed.
+ * *  Returns -1, on a syntax error.
+ * *
+ * * Purpose:
+ * *  Reads "for name [in words]; do list; done", "while list; do
+ * *  list; done" or "until list; do list; done". Each part is parsed
+ * *  now, with the line, so running the loop only copies and
+ * *  expands it. A for loop without "in" goes over "$@". The
+ * *  separators can be new lines.
+ * *
+ * ***************************************************************/
+int ParseLoop(char *text, struct Pipeline *pipeline, struct Arena *arena, char **end)
+{
+	int kind = (text[0] == 'f') ? COMPOUND_FOR : (text[0] == 'w') ? COMPOUND_WHILE : COMPOUND_UNTIL;
+	char *current = text + ((kind == COMPOUND_FOR) ? 3 : 5);
+	char *words = NULL;
+	char *name = NULL;
+	size_t nameLength = 0;
+	char *doWord;
+	int depth = 1;
+	int operator;
+	int length;
+	int i;
+
+	if (kind == COMPOUND_FOR)
+	{
+		current += strspn(current, " \t");
+		name = current;
+		nameLength = VariableNameLength(name);
+		if ((nameLength == 0) || ((name[nameLength] != '\0') && (strchr(" \t\n;", name[nameLength]) == NULL)))
+		{
+			printf("smallsh: `%.*s': not a valid identifier\n", (int)strcspn(name, " \t\n;"), name);
+			return -1;
+		}
+		current += nameLength;
+		current += strspn(current, " \t");
+
+		if (IsKeyword(current, "in"))
+		{
+			words = current + 2;
+			current = NextListOperator(words, &operator, &length);
+			if ((current == NULL) || (operator != LIST_SEQUENCE))
+			{
+				printf("smallsh: syntax error near unexpected token `%.*s'\n",
+					(current == NULL) ? 7 : length, (current == NULL) ? "newline" : current);
+				return -1;
+			}
+		}
+		else if ((*current == ';') || (*current == '\n'))
+		{
+			words = ArenaCopy(arena, "\"$@\"");
+			if (words == NULL)
+			{
+				printf("smallsh: out of memory\n");
+				return -1;
+			}
+		}
+		else
+		{
+			printf("smallsh: syntax error near unexpected token `%.*s'\n", (int)strcspn(current, " \t\n;"), current);
+			return -1;
+		}
+		*current = '\0';
+		current++;
+		current += strspn(current, " \t\n");
+		doWord = (IsKeyword(current, "do")) ? current : NULL;
+	}
+	else
+	{
+		doWord = FindCompoundEnd(current, &depth);
+	}
+
+	if ((doWord == NULL) || (!IsKeyword(doWord, "do")))
+	{
+		printf("smallsh: syntax error: `do' expected in the loop\n");
+		return -1;
+	}
+	char *condition = current;
+	char *body = doWord + 2;
+	char *close = FindCompoundEnd(body, &depth);
+	if (close == NULL)
+	{
+		printf("smallsh: syntax error: unexpected end of file looking for `done'\n");
+		return -1;
+	}
+	if (!IsKeyword(close, "done"))
+	{
+		printf("smallsh: syntax error near unexpected token `%.*s'\n", (int)strcspn(close, " \t\n;&|<>"), close);
+		return -1;
+	}
+
+	struct Compound *loop = NewCompound(pipeline, arena, kind);
+	if (loop == NULL)
+	{
+		return -1;
+	}
+	*doWord = '\0';
+	*close = '\0';
+	*end = close + 4;
+
+	// A word list is one pipeline, however many words are in it
+	if (kind == COMPOUND_FOR)
+	{
+		name[nameLength] = '\0';
+		loop->name = name;
+		loop->words.pipelines = ArenaAlloc(arena, sizeof(struct Pipeline));
+		loop->words.operators = ArenaCopy(arena, "");
+		if ((loop->words.pipelines == NULL) || (loop->words.operators == NULL))
+		{
+			printf("smallsh: out of memory\n");
+			return -1;
+		}
+		if (ParseCommandLine(words, loop->words.pipelines, arena) < 0)
+		{
+			return -1;
+		}
+		loop->words.count = loop->words.pipelines->count;
+		if ((loop->words.count > 1) || ((loop->words.count == 1) && (loop->words.pipelines->redirectsUsed > 0)))
+		{
+			printf("smallsh: syntax error: a for loop's words cannot have pipes or redirects\n");
+			return -1;
+		}
+	}
+	else if (ParseCommandList(condition, &loop->condition, arena) < 0)
+	{
+		return -1;
+	}
+	if (ParseCommandList(body, &loop->list, arena) < 0)
+	{
+		return -1;
+	}
+	if (((kind != COMPOUND_FOR) && (loop->condition.count == 0)) || (loop->list.count == 0))
+	{
+		printf("smallsh: syntax error near unexpected token `%s'\n", (loop->list.count == 0) ? "done" : "do");
+		return -1;
+	}
+
+	// Their bodies would have to be read after the whole loop
+	for (i = 0; i < loop->condition.count + loop->list.count; i++)
+	{
+		struct Pipeline *part = (i < loop->condition.count) ?
+			&loop->condition.pipelines[i] : &loop->list.pipelines[i - loop->condition.count];
+		if (part->hereDocCount > 0)
+		{
+			printf("smallsh: here-documents are not supported in loops\n");
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - the text after a "{"
+ * *  depth - how many braces are open, updated as they are read
+ * *
+ * * Exit:
+ * *  Returns the "}" or "done" that closes the first one, or its "do".
+ * *  Returns NULL, if the text ends first.
+ * *
+ * * Purpose:
+ * *  Finds the end of a function body or a loop. A brace or a
+ * *  reserved word only counts where a command could start, as in
+ * *  sh, so "echo }" does not end the body. "for", "while" and
+ * *  "until" open a loop and "done" closes one. A "do" that belongs
+ * *  to the first one open is returned as well, which is where a
+ * *  while loop's test ends. Quotes and substitutions are skipped.
+ * *
+ * ***************************************************************/
+char *FindCompoundEnd(char *text, int *depth)
+{
+	char *current = text;
+	int atCommand = 1;
+	int isName = 0; // the word after "function"
+
+	while (*current != '\0')
+	{
+		if ((*current == ' ') || (*current == '\t'))
+		{
+			current++;
+			continue;
+		}
+		if (strchr(";\n&|", *current) != NULL)
+		{
+			atCommand = 1;
+			current++;
+			continue;
+		}
+		if (strchr("<>", *current) != NULL)
+		{
+			atCommand = 0;
+			current++;
+			continue;
+		}
+
+		char *word = current;
+		while ((*current != '\0') && (strchr(" \t;\n&|<>", *current) == NULL))
+		{
+			if ((*current == '\'') || (*current == '"'))
+			{
+				current = FindClosingQuote(current);
+			}
+			else if ((*current == '$') && (current[1] == '('))
+			{
+				current = FindClosingParen(current);
+			}
+			else if ((*current == '\\') && (current[1] != '\0'))
+			{
+				current++;
+			}
+			if (current == NULL)
+			{
+				return NULL;
+			}
+			current++;
+		}
+		size_t length = current - word;
+
+		if (isName)
+		{
+			isName = 0;
+			atCommand = 1;
+		}
+		else if (!atCommand)
+		{
+			atCommand = ((length == 2) && (strncmp(word, "()", 2) == 0)) ||
+				((length > 2) && (strncmp(current - 2, "()", 2) == 0));
+		}
+		else if (((length == 1) && (*word == '{')) || (IsKeyword(word, "while")) || (IsKeyword(word, "until")))
+		{
+			(*depth)++;
+		}
+		else if (IsKeyword(word, "for"))
+		{
+			// The name and the words after it are not commands
+			(*depth)++;
+			atCommand = 0;
+		}
+		else if (IsKeyword(word, "do"))
+		{
+			if (*depth == 1)
+			{
+				return word;
+			}
+		}
+		else if (((length == 1) && (*word == '}')) || (IsKeyword(word, "done")))
+		{
+			(*depth)--;
+			if (*depth == 0)
+			{
+				return word;
+			}
+			atCommand = 0;
+		}
+		else
+		{
+			isName = ((length == 8) && (strncmp(word, "function", 8) == 0));
+			atCommand = ((length > 2) && (strncmp(current - 2, "()", 2) == 0));
+		}
+	}
+
+	return NULL;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - a command line
+ * *
+ * * Exit:
+ * *  Returns how many compound commands are still open at the end
+ * *  of the line.
+ * *
+ * * Purpose:
+ * *  Tells the shell loop to read more lines before it parses a
+ * *  function or a loop that is not closed yet.
+ * *
+ * ***************************************************************/
+int CompoundDepth(char *line)
+{
+	int depth = 0;
+	char *close;
+
+	if ((strchr(line, '{') == NULL) && (strstr(line, "for") == NULL) &&
+		(strstr(line, "while") == NULL) && (strstr(line, "until") == NULL))
+	{
+		return 0;
+	}
+	while ((close = FindCompoundEnd(line, &depth)) != NULL)
+	{
+		line = close + strcspn(close, " \t\n;&|<>");
+	}
+
+	return (depth > 0) ? depth : 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - a parsed pipeline
+ * *
+ * * Exit:
+ * *  Returns 0, if its aliases were replaced.
+ * *  Returns -1, if there was no memory.
+ * *
+ * * Purpose:
+ * *  Replaces an alias in the first word of each stage with its
+ * *  parsed value. The words after it follow the value's last word.
+ * *  A value starting with another alias is expanded in turn, but
+ * *  never one already expanded for that stage, so "alias ls='ls
+ * *  -F'" works. Quoted words are not aliases.
+ * *
+ * ***************************************************************/
+int ExpandAliases(struct Pipeline *pipeline)
+{
+	const char *expanded[MAX_ALIAS_DEPTH];
+	int i;
+	int j;
+
+	if ((aliasTable.count == 0) || (isAliasExpansionOff))
+	{
+		return 0;
+	}
+
+	for (i = 0; i < pipeline->count; i++)
+	{
+		int depth = 0;
+		while ((depth < MAX_ALIAS_DEPTH) && (pipeline->commands[i].argc > 0))
+		{
+			const char *word = pipeline->commands[i].argv[0];
+			struct Definition *alias = NULL;
+			if (strpbrk(word, EXPAND_SPECIAL) == NULL)
+			{
+				alias = FindDefinition(&aliasTable, word);
+			}
+			for (j = 0; (alias != NULL) && (j < depth); j++)
+			{
+				if (strcmp(expanded[j], alias->name) == 0)
+				{
+					alias = NULL;
+				}
+			}
+			if ((alias == NULL) || ((!alias->isParsed) && (ParseDefinition(alias, 1) < 0)))
+			{
+				break;
+			}
+			expanded[depth] = alias->name;
+			depth++;
+
+			// The stages of a value with pipes are not looked at again
+			struct Pipeline *body = &alias->list.pipelines[0];
+			if (SpliceAlias(pipeline, i, body) < 0)
+			{
+				printf("smallsh: out of memory\n");
+				return -1;
+			}
+			i += body->count - 1;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  pipeline - the pipeline being parsed
+ * *  stage - the stage whose first word is the alias
+ * *  body - the alias value's pipeline
+ * *
+ * * Exit:
+ * *  Returns 0, if the value was spliced in.
+ * *  Returns -1, if there was no memory.
+ * *
+ * * Purpose:
+ * *  Puts the stages of an alias value in place of a stage's first
+ * *  word. The last one takes the stage's other words and redirects.
+ * *  The value's words are copied into the line's arena, so a
+ * *  function body that used the alias keeps them if it changes.
+ * *
+ * ***************************************************************/
+int SpliceAlias(struct Pipeline *pipeline, int stage, struct Pipeline *body)
+{
+	struct Arena *arena = pipeline->arena;
+	int count = pipeline->count + body->count - 1;
+	struct Command *commands = ArenaAlloc(arena, count * sizeof(struct Command));
+	pid_t *pids = ArenaAlloc(arena, (count + 1) * sizeof(pid_t));
+	int i;
+	int j;
+
+	if ((commands == NULL) || (pids == NULL))
+	{
+		return -1;
+	}
+	memcpy(commands, pipeline->commands, stage * sizeof(struct Command));
+	memcpy(commands + stage + body->count, pipeline->commands + stage + 1,
+		(pipeline->count - stage - 1) * sizeof(struct Command));
+
+	for (i = 0; i < body->count; i++)
+	{
+		struct Command *from = &body->commands[i];
+		struct Command *to = &commands[stage + i];
+		int isLast = (i == body->count - 1);
+		struct Command *rest = &pipeline->commands[stage];
+		int argc = from->argc + ((isLast) ? rest->argc - 1 : 0);
+		int redirectCount = from->redirectCount + ((isLast) ? rest->redirectCount : 0);
+
+		to->argv = ArenaAlloc(arena, (argc + 1) * sizeof(char *));
+		to->redirects = ArenaAlloc(arena, (redirectCount + 1) * sizeof(struct Redirect));
+		if ((to->argv == NULL) || (to->redirects == NULL))
+		{
+			return -1;
+		}
+		for (j = 0; j < from->argc; j++)
+		{
+			to->argv[j] = ArenaCopy(arena, from->argv[j]);
+			if (to->argv[j] == NULL)
+			{
+				return -1;
+			}
+		}
+		for (j = 0; j < from->redirectCount; j++)
+		{
+			to->redirects[j] = from->redirects[j];
+			to->redirects[j].target = ArenaCopy(arena, from->redirects[j].target);
+			if (to->redirects[j].target == NULL)
+			{
+				return -1;
+			}
+		}
+		if (isLast)
+		{
+			memcpy(to->argv + from->argc, rest->argv + 1, (rest->argc - 1) * sizeof(char *));
+			memcpy(to->redirects + from->redirectCount, rest->redirects, rest->redirectCount * sizeof(struct Redirect));
+		}
+		to->argv[argc] = NULL;
+		to->argc = argc;
+		to->redirectCount = redirectCount;
 
-/**************************************************************
- * * Entry:
- * *  N/a
- * *
- * * Exit:
- * *  N/a
- * *
- * * Purpose:
- * *	This is the entry point into the program.
- * *
- * ***************************************************************/
-int main()
-{
-	// Set up a signal handler to deal with signals from child processes
-	struct sigaction act;
-	act.sa_handler = sigchld_handler;
-	sigaction(SIGCHLD, &act, NULL);
+		// "|& N alias" fans out the alias's first stage
+		to->fanOut = (i == 0) ? rest->fanOut : from->fanOut;
+		to->isUnordered = (i == 0) ? rest->isUnordered : from->isUnordered;
+	}
 
-	// Run the small shell loop
-	RunShellLoop();
+	pipeline->commands = commands;
+	pipeline->pids = pids;
+	pipeline->count = count;
+	pipeline->stageLimit = count;
 
 	return 0;
 }
 
 /**************************************************************
  * * Entry:
- * *  N/a
+ * *  userCommand - the user entered command string. It is cut up
+ * *								in place.
+ * *  pipeline - the command descriptor to fill in
+ * *  arena - where the pools for the line are allocated
  * *
  * * Exit:
- * *  N/a
+ * *  Returns 0, if the line was parsed.
+ * *  Returns -1, if the line has a syntax error.
  * *
  * * Purpose:
- * *	Runs the shell loop
+ * *  Breaks the user entered command string into words in a single
+ * *  pass. Each stage's argv, the redirect targets and the background
+ * *  flag all point into the user command string, so nothing is
+ * *  copied. A quick count of the separators first sizes the pools,
+ * *  so a line can have any number of words and stages. The redirect
+ * *  symbols and their targets are not put in argv, and nothing after
+ * *  the background symbol ("&") is read. The redirect, pipe and
+ * *  background symbols do not need spaces around them. A number
+ * *  right before a redirect symbol is the descriptor it applies to,
+ * *  as in "2>err". Quotes and backslashes keep the symbols and
+ * *  spaces in them part of the word.
  * *
  * ***************************************************************/
-void RunShellLoop()
+int ParseCommandLine(char *userCommand, struct Pipeline *pipeline, struct Arena *arena)
 {
-	int exitShell = 0;
-	int statusNumber = 0;
-	char userInput[MAX_COMMAND_LENGTH] = "";
+	char *current = userCommand;
+	struct Redirect *pendingRedirect = NULL;
+	int redirectFd = -1;
+	char symbol;
+	int separators = 0;
+	int pipes = 0;
+	int redirects = 0;
 
-	char errMsg[MAX_ERR_MSG_LENGTH] = "";
-
-	while (exitShell == 0)
+	// Every word after the first follows a separator, every stage after
+	//  the first follows a pipe and every redirect starts with < or >
+	for (current = userCommand; *current != '\0'; current++)
 	{
-		// Clear stdin
-		tcflush(0, TCIFLUSH);
-
-		// Clear the user input variable before each run
-		strncpy(userInput, "", MAX_COMMAND_LENGTH - 1);
-
-		fflush(stdout);
-    	
-    // Get user input
-		printf(": ");
-		fgets(userInput, 79, stdin);
-		fflush(stdout);
-		RemoveNewLineAndAddNullTerm(userInput);
-
-		// If you at the end of an input file, then exit.
-		if (feof(stdin))
+		switch (*current)
 		{
-			exit(0);
+			case '|':
+				pipes++;
+				separators++;
+				break;
+			case '<':
+			case '>':
+				redirects++;
+				separators++;
+				break;
+			case ' ':
+			case '\t':
+			case '&':
+				separators++;
+				break;
 		}
+	}
+	current = userCommand;
 
-		// Restart loop if user entered nothing
-		if (strcmp(userInput, "") == 0)
+	pipeline->stageLimit = pipes + 1;
+	pipeline->poolSize = separators + 1 + pipeline->stageLimit;
+	pipeline->argPool = ArenaAlloc(arena, pipeline->poolSize * sizeof(char *));
+	pipeline->redirectPool = ArenaAlloc(arena, (redirects + 1) * sizeof(struct Redirect));
+	pipeline->commands = ArenaAlloc(arena, pipeline->stageLimit * sizeof(struct Command));
+	pipeline->pids = ArenaAlloc(arena, (pipeline->stageLimit + 1) * sizeof(pid_t)); // and the capture
+	if ((pipeline->argPool == NULL) || (pipeline->redirectPool == NULL) ||
+		(pipeline->commands == NULL) || (pipeline->pids == NULL))
+	{
+		printf("smallsh: out of memory\n");
+		return -1;
+	}
+
+	pipeline->arena = arena;
+	pipeline->isExpanded = 0;
+	pipeline->isSubstitution = 0;
+	pipeline->compound = NULL;
+	pipeline->poolUsed = 0;
+	pipeline->redirectsUsed = 0;
+	pipeline->hereDocCount = 0;
+	pipeline->count = 0;
+	pipeline->isBackground = 0;
+	memset(&pipeline->commands[0], 0, sizeof(struct Command));
+	pipeline->commands[0].argv = pipeline->argPool;
+	pipeline->commands[0].redirects = pipeline->redirectPool;
+
+	while (*current != '\0')
+	{
+		// Skip the whitespace between words
+		if ((*current == ' ') || (*current == '\t'))
 		{
+			current++;
 			continue;
 		}
 
-		// Restart the loop if the user entered a comment
-		if (userInput[0] == '#')
+		if (strchr("<>|&", *current) == NULL)
 		{
-			continue;
-		}
+			// Find the end of the word. Quoted and escaped characters
+			//  do not end it; the quotes are removed when it is expanded.
+			char *wordStart = current;
+			while ((*current != '\0') && (strchr(" \t<>|&", *current) == NULL))
+			{
+				if ((*current == '\'') || (*current == '"'))
+				{
+					char *close = FindClosingQuote(current);
+					if (close == NULL)
+					{
+						printf("smallsh: unexpected EOF while looking for matching `%c'\n", *current);
+						return -1;
+					}
+					current = close;
+				}
+				else if ((*current == '$') && (current[1] == '('))
+				{
+					char *close = FindClosingParen(current);
+					if (close == NULL)
+					{
+						printf("smallsh: unexpected EOF while looking for matching `)'\n");
+						return -1;
+					}
+					current = close;
+				}
+				else if ((*current == '\\') && (current[1] != '\0'))
+				{
+					current++;
+				}
+				current++;
+			}
 
-		// Exit the shell if user wants us to
-		if (strcmp(userInput, "exit") == 0)
+			// Remember what ended the word so the word can be terminated
+			//  in its place.
+			symbol = *current;
+			*current = '\0';
+			if (((symbol == '<') || (symbol == '>')) && (pendingRedirect == NULL) &&
+				(IsDescriptorWord(wordStart)))
+			{
+				redirectFd = atoi(wordStart);
+			}
+			else if (SaveWord(pipeline, &pendingRedirect, wordStart) < 0)
+			{
+				return -1;
+			}
+			if (symbol == '\0')
+			{
+				break;
+			}
+			current++;
+			if ((symbol == ' ') || (symbol == '\t'))
+			{
+				continue;
+			}
+		}
+		else
 		{
-			exitShell = 1;
-			exit(0);
+			symbol = *current;
+			*current = '\0';
+			current++;
 		}
 
-		// Change the current shell's directory to HOME if the 
-		// user types "cd"
-		if (strcmp(userInput, "cd") == 0)
+		// Handle the redirect, pipe and background symbols
+		if (pendingRedirect != NULL)
 		{
-			// Get the HOME path
-			char* homePath;
-  		homePath = getenv("HOME");
-
-  		// Change the current directory
-			chdir(homePath);
-			continue;
+			printf("smallsh: syntax error near unexpected token `%c'\n", symbol);
+			return -1;
 		}
 
-		// Change current directory to user specified directory
-		if ((userInput[0] == 'c') && (userInput[1] == 'd') && (userInput[2] == ' '))
+		if ((symbol == '<') || (symbol == '>'))
 		{
-			char *argArr[MAX_ARGS];
-			InitializeArgsArray(argArr);
-
-			// Get the directory name from the user entered command
-			ParseUserInputToArgs(userInput, argArr);
+			// The longer symbols share a first character with < and >
+			int kind = (symbol == '<') ? REDIRECT_INPUT : REDIRECT_OUTPUT;
+			if ((symbol == '>') && (*current == '>'))
+			{
+				kind = REDIRECT_APPEND;
+				current++;
+			}
+			else if ((symbol == '<') && (*current == '<'))
+			{
+				kind = REDIRECT_HEREDOC;
+				current++;
+				if (*current == '<')
+				{
+					kind = REDIRECT_HERESTRING;
+					current++;
+				}
+			}
+			else if (*current == '&')
+			{
+				kind = REDIRECT_DUP;
+				current++;
+			}
 
-			// Change the current directory
-			chdir(argArr[1]);
-			continue;
+			if (redirectFd < 0)
+			{
+				redirectFd = ((kind == REDIRECT_OUTPUT) || (kind == REDIRECT_APPEND) ||
+					((kind == REDIRECT_DUP) && (symbol == '>'))) ? 1 : 0;
+			}
+			pendingRedirect = AddRedirect(pipeline, kind, redirectFd);
+			if (pendingRedirect == NULL)
+			{
+				return -1;
+			}
+			redirectFd = -1;
 		}
-
-		// Get the status of the previous command
-		if (strcmp(userInput, "status") == 0)
+		else if (symbol == '|')
 		{
-			if (strncmp(errMsg, "", MAX_ERR_MSG_LENGTH) == 0)
+			struct Command *stage = &pipeline->commands[pipeline->count];
+			if (stage->argc == 0)
 			{
-				// Display the regular status output
-				printf("exit value %d\n", statusNumber);
+				printf("smallsh: syntax error near unexpected token `|'\n");
+				return -1;
 			}
-			else
+			if (EndStage(pipeline) < 0)
 			{
-				// If there was an error message, then show that instead of the 
-				//  regular status message
-				printf("%s\n", errMsg);
+				return -1;
+			}
+			if ((*current == '&') && (ParseFanOut(&current, &pipeline->commands[pipeline->count]) < 0))
+			{
+				return -1;
 			}
-
-			// Clear the status
-			strncpy(errMsg, "", MAX_ERR_MSG_LENGTH);
-			statusNumber = 0;
-			continue;
 		}
 		else
 		{
-			// Clean up the status if we didn't want to display it
-			strncpy(errMsg, "", MAX_ERR_MSG_LENGTH);
-			statusNumber = 0;
+			pipeline->isBackground = 1;
+			break;
 		}
+	}
 
-		// Check if we are doing a background process
-		if (ContainsString(userInput, "&"))
-		{
-			RunBackGroundCommand(userInput);
-			continue;
-		}
-		
-		// Run the foreground command	
-		statusNumber = RunForeGroundCommand(userInput, errMsg);
+	// A redirect symbol needs a file name after it
+	if (pendingRedirect != NULL)
+	{
+		printf("smallsh: syntax error near unexpected token `newline'\n");
+		return -1;
+	}
+
+	// A line with nothing on it is not a command
+	struct Command *last = &pipeline->commands[pipeline->count];
+	if ((last->argc == 0) && (pipeline->count == 0) && (last->redirectCount == 0))
+	{
+		return 0;
+	}
+	if (last->argc == 0)
+	{
+		printf("smallsh: syntax error near unexpected token `newline'\n");
+		return -1;
 	}
+
+	return EndStage(pipeline);
 }
 
 /**************************************************************
  * * Entry:
- * *  userCommand - the user entered command string
+ * *  pipeline - the command descriptor being filled in
  * *
  * * Exit:
- * *  Returns 0, if command executed without errors.
- * *  Returns any other number, if command executed with errors.
+ * *  Returns 0.
  * *
  * * Purpose:
- * *	Runs the specified foreground command.
+ * *  Null terminates the current stage's argv and starts the next
+ * *  stage right after it in the argument and redirect pools.
+ * *  SaveWord always leaves a slot free for the terminator.
  * *
  * ***************************************************************/
-int RunBackGroundCommand(char *userCommand)
-{	
-	int returnStatus = 0;
-	pid_t spawnPid = -5;
-	char pidNumberStr[10];
-	int fd = -1;
-	char fileName[MAX_COMMAND_LENGTH] = "";
-
-	// Check if we have any redirects
-	int hasOutputRedirect = ContainsString(userCommand, ">");
-	int hasInputRedirect = ContainsString(userCommand, "<");
-
-	char *argv[MAX_ARGS];
-	InitializeArgsArray(argv);
+int EndStage(struct Pipeline *pipeline)
+{
+	// Add the null terminator to the end of the array
+	pipeline->argPool[pipeline->poolUsed] = 0;
+	pipeline->poolUsed++;
+	pipeline->count++;
 
-	// Get the file descriptor if we have to redirect output
-	if (hasOutputRedirect == 1)
+	if (pipeline->count < pipeline->stageLimit)
 	{
-		GetFileName(userCommand, fileName);
-		fd = open(fileName, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+		struct Command *next = &pipeline->commands[pipeline->count];
+		memset(next, 0, sizeof(struct Command));
+		next->argv = &pipeline->argPool[pipeline->poolUsed];
+		next->redirects = &pipeline->redirectPool[pipeline->redirectsUsed];
 	}
 
-	// Get the file descriptor if we have to redirect input 
-	if (hasInputRedirect == 1)
+	return 0;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  current - the text after a "|", which starts with "&"
+ * *  stage - the stage that comes after the pipe
+ * *
+ * * Exit:
+ * *  Returns 0, with current moved past the count.
+ * *  Returns -1, on a syntax error.
+ * *
+ * * Purpose:
+ * *	Reads the worker count of "|& N" or "|& Nu" for a stage.
+ * *
+ * ***************************************************************/
+int ParseFanOut(char **current, struct Command *stage)
+{
+	char *text = *current + 1;
+	char *end;
+
+	while ((*text == ' ') || (*text == '\t'))
 	{
-		GetFileName(userCommand, fileName);
-		fd = open(fileName, O_RDONLY, 0644);
+		text++;
 	}
-	else
+	long count = (isdigit((unsigned char)*text)) ? strtol(text, &end, 10) : 0;
+	if (count > 0)
 	{
-		// Redirect stdin to dev/null if the user did not 
-		//  specify input redirection
-		fd = open("/dev/null", O_RDONLY);
+		stage->isUnordered = (*end == 'u');
+		end += stage->isUnordered;
 	}
-
-	// Get the args from the user entered string
-	ParseUserInputToArgs(userCommand, argv);
-
-	// Start the child process for command execution	
-	spawnPid = fork();
-
-	switch (spawnPid)
+	if ((count < 1) || (count > MAX_FAN_OUT) || ((*end != ' ') && (*end != '\t')))
 	{
-		case -1:
-			// Error in forking, exit.
-			exit(1);
-			break;
-		case 0:
-			// This code will be executed by the child process.
-
-			if ((hasOutputRedirect) && (dup2(fd, 1) < 0))
-			{ 
-				// Establish the std output redirect, exit if error is found.
-				exit(1);
-			}
-			else if ((dup2(fd, 0) < 0))
-			{ 
-				// Establish the std input redirect, exit if error is found.
-				printf("smallsh: cannot open %s for input\n", fileName);
-				exit(1);
-			}
-
-   	 		close(fd);
-
-   	 		// Execute the user's command
-	  		execvp(argv[0], argv);
-	  		printf("%s: no such file or directory\n", argv[0]);
-	  		exit(1);
-			break;
-		default:
-			// This code will be run by the parent process.
-
-			close(fd);
-
-			// Output the process ID message for background processes
-			snprintf(pidNumberStr, sizeof(pidNumberStr), "%d", spawnPid);
-			printf("background pid is %s\n", pidNumberStr);
-
-			break;
+		printf("smallsh: |&: expected a count of workers from 1 to %d\n", MAX_FAN_OUT);
+		return -1;
 	}
 
-	return returnStatus;
+	stage->fanOut = count;
+	*current = end;
+
+	return 0;
 }
 
 /**************************************************************
  * * Entry:
- * *  sig - the signal number
+ * *  pipeline - the command descriptor being filled in
+ * *  pendingRedirect - the redirect waiting for its target, or NULL
+ * *  word - the word that was just found
  * *
  * * Exit:
- * *  n/a
+ * *  Returns 0, if the word was saved.
+ * *  Returns -1, if the word is not a descriptor a duplicating
+ * *  redirect can use.
  * *
  * * Purpose:
- * *	Is the signal hander for any child signals
+ * *  Puts a word either into the pending redirect or into the
+ * *  current stage's argv.
  * *
  * ***************************************************************/
-static void sigchld_handler (int sig)
+int SaveWord(struct Pipeline *pipeline, struct Redirect **pendingRedirect, char *word)
 {
-	int status;
-	pid_t childPid;
+	if (*pendingRedirect != NULL)
+	{
+		struct Redirect *redirect = *pendingRedirect;
 
-	// Close all zombie child processes by waiting for it.
-	while ((childPid = waitpid(-1, &status, WNOHANG)) > 0)
-	{
-		// Convert the child pid to a string
-		char pidNumberStr[10];
-		snprintf(pidNumberStr, sizeof(pidNumberStr), "%d", childPid);
-
-		// Declare the message variable
-		char childTerminateMsg[MAX_ERR_MSG_LENGTH]; 
-
-		// Construct the child terminate message
-		//  Example: "background pid 4923 is done: exit value 0"
-		strncpy(childTerminateMsg, "\nbackground pid ", MAX_ERR_MSG_LENGTH);
-		strcat(childTerminateMsg, pidNumberStr);
-		strcat(childTerminateMsg, " is done: ");
-	
-		// If child was terminated by a signal, then display the correct message	
-		if(WIFSIGNALED(status)) {
-				int signalNumber = WTERMSIG(status);
-				char signalNumberStr[10];
-   			snprintf(signalNumberStr, sizeof(signalNumberStr), "%d", signalNumber); // Convert signal number to a string
-
-   			// Output the correct error message and save it for the status command
-				strcat(childTerminateMsg, "terminated by signal ");
-				strcat(childTerminateMsg, signalNumberStr);
-				strcat(childTerminateMsg, "\n");
-				write(1, childTerminateMsg, sizeof(childTerminateMsg));
+		if ((redirect->kind == REDIRECT_DUP) && (strcmp(word, "-") != 0) &&
+			(!IsDescriptorWord(word)))
+		{
+			printf("smallsh: %s: ambiguous redirect\n", word);
+			return -1;
 		}
-		else
+		if (redirect->kind == REDIRECT_HEREDOC)
 		{
-			// Child exited normally, write out the normal child process end message
-			char statusNumberStr[5];
-			strcat(childTerminateMsg, "exit value ");
-			snprintf(statusNumberStr, sizeof(statusNumberStr), "%d", WEXITSTATUS(status)); // Convert status number to a string
-			strcat(childTerminateMsg, statusNumberStr);
-			strcat(childTerminateMsg, "\n");
-
-			// Write out the message
-			write(1, childTerminateMsg, sizeof(childTerminateMsg));
+			pipeline->hereDocCount++;
 		}
 
-		continue;
+		redirect->target = word;
+		*pendingRedirect = NULL;
+		return 0;
 	}
+
+	// The pool was sized to the line, with a slot for each stage's
+	//  null terminator
+	struct Command *stage = &pipeline->commands[pipeline->count];
+	stage->argv[stage->argc] = word;
+	stage->argc++;
+	pipeline->poolUsed++;
+
+	return 0;
 }
 
 /**************************************************************
  * * Entry:
- * *  userCommand - the user entered command string
- * *  errMsg - the return variable to hold the error message
+ * *  pipeline - the command descriptor being filled in
+ * *  kind - the kind of redirect
+ * *  fd - the descriptor it applies to
  * *
  * * Exit:
- * *  Returns 0, if command executed without errors.
- * *  Returns any other number, if command executed with errors.
+ * *  Returns the new redirect, waiting for its target.
+ * *  Returns NULL, if the command has too many redirects.
  * *
  * * Purpose:
- * *	Runs the specified foreground command.
+ * *  Adds a redirect to the current stage.
  * *
  * ***************************************************************/
-int RunForeGroundCommand(char *userCommand, char *errMsg)
-{	
-	int status = 0;
-	int returnStatus = 0;
-	pid_t spawnPid = -5;
-	int fd = -1;
-	struct sigaction act;
-	char fileName[MAX_COMMAND_LENGTH] = "";
-
-	// Determine if we have any redirects
-	int hasOutputRedirect = ContainsString(userCommand, ">");
-	int hasInputRedirect = ContainsString(userCommand, "<");
-
-	char *argv[MAX_ARGS];
-	InitializeArgsArray(argv);
-
-	// Get the file descriptor if we have to redirect output
-	if (hasOutputRedirect == 1)
-	{
-		GetFileName(userCommand, fileName);
-		fd = open(fileName, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-	}
-
-	// Get the file descriptor if we have to redirect input 
-	if (hasInputRedirect == 1)
+struct Redirect *AddRedirect(struct Pipeline *pipeline, int kind, int fd)
+{
+	struct Command *stage = &pipeline->commands[pipeline->count];
+	if (stage->redirectCount == MAX_REDIRECTS)
 	{
-		GetFileName(userCommand, fileName);
-		fd = open(fileName, O_RDONLY, 0644);
+		printf("smallsh: too many redirects (max %d)\n", MAX_REDIRECTS);
+		return NULL;
 	}
 
-	// Get all the args from the user entered command
-	ParseUserInputToArgs(userCommand, argv);
-
-	// Start the child process for command execution	
-	spawnPid = fork();
-
-	switch (spawnPid)
-	{
-		case -1:
-			// Fork failed
-			exit(1);
-			break;
-		case 0:
-			// This code will run in the child process
-
-			// Establish the std output redirect, exit if error is found.
-			if ((hasOutputRedirect) && (dup2(fd, 1) < 0))
-			{ 
-				exit(1);
-			}
-
-			// Establish the std input redirect, exit if error is found.
-			if ((hasInputRedirect) && (dup2(fd, 0) < 0))
-			{ 
-				printf("smallsh: cannot open %s for input\n", fileName);
-				exit(1);
-			}
-
-			// Set up the signal handler for the child process to not ignore termination signals
-			act.sa_handler = SIG_DFL;
-			sigaction(SIGINT, &act, NULL);
-
- 	 		close(fd);
-
-			// Try to execute the user command
-  		execvp(argv[0], argv);
-  		printf("%s: no such file or directory\n", argv[0]);
-  		exit(1);
-			break;
-		default:
-			// This code will run in the parent process
-
-			close(fd);
-			
-			// Set up the signal handler for the parent process to ignore termination messages
-			act.sa_handler = SIG_DFL;
-			act.sa_handler = SIG_IGN;
-			sigaction(SIGINT, &act, NULL);
-
-			// Wait for child process to finish	
-			waitpid(spawnPid, &status, 0);
-
-			returnStatus = WEXITSTATUS(status);
-
-			// Save the appropriate signal error message
-			if(WIFSIGNALED(status)) {
-				int signalNumber = WTERMSIG(status);
-				char terminateMsg[MAX_ERR_MSG_LENGTH]; 
-				char signalNumberStr[10];
-   				snprintf(signalNumberStr, sizeof(signalNumberStr), "%d", signalNumber);
+	struct Redirect *redirect = &pipeline->redirectPool[pipeline->redirectsUsed];
+	redirect->kind = kind;
+	redirect->fd = fd;
+	redirect->target = NULL;
+	redirect->isQuoted = 0;
+	pipeline->redirectsUsed++;
+	stage->redirectCount++;
 
-   			// Output the correct error message and save it for the status command
-				strncpy(terminateMsg, "terminated by signal ", MAX_ERR_MSG_LENGTH);
-				strcat(terminateMsg, signalNumberStr);
-				printf("%s\n", terminateMsg);
-				strncpy(errMsg, terminateMsg, MAX_ERR_MSG_LENGTH);
-			}
-
-			break;
-	}
-
-	return returnStatus;
+	return redirect;
 }
 
 /**************************************************************
  * * Entry:
- * *  userCommand - the user entered command string
- * *  returnValue - the array containing the user entered commands.
- * *								used as a return container.
+ * *  word - the word to check
  * *
  * * Exit:
- * *  n/a
+ * *  Returns 1, if the word is a descriptor number.
+ * *  Returns 0, if it is not.
  * *
  * * Purpose:
- * *  Takes a user entered command string and breaks it up per word
- * *  and puts it into an array. We will not put the redirection 
- * *	symbols into the return array. We will also not put anything
- * *	after the redirection symbols into the return array.
+ * *  Tells a descriptor number like the 2 in "2>err" from any other
+ * *  word.
  * *
  * ***************************************************************/
-void ParseUserInputToArgs(char *userCommand, char **returnArr)
+int IsDescriptorWord(const char *word)
 {
-  char *currentToken;
-  int currentTokenNumber = 0;
-
-  // Determine if we have any redirect symbols
-	int HasOutputRedirect = ContainsString(userCommand, ">");
-	int HasInputRedirect = ContainsString(userCommand, "<");
+	int length = 0;
 
-  // Increment through the user command and break each word based on the 
-  //  whitespace delimiter. Put each word into the return array.
-  currentToken = strtok(userCommand, " ");
-  while (currentToken != NULL)
-  {
-  	// Break if we find an output redirect symbol
-  	if ((HasOutputRedirect == 1) && (strcmp(currentToken, ">") == 0))
-    {
-    	break;
-    }
-
-  	// Break if we find an input redirect symbol
-    if ((HasInputRedirect == 1) && (strcmp(currentToken, "<") == 0))
-    {
-    	break;
-    }
-
-    // Break if we find the background process symbol ("&")
-		if (strcmp(currentToken, "&") == 0)
-    {
-    	break;
-    }
-
-    // Add the command arg to the array
-  	returnArr[currentTokenNumber] = currentToken;
-    currentToken = strtok (NULL, " ");
-    currentTokenNumber++;
-
-    // Break out if we are reaching the array limit.
-    if (currentTokenNumber == (MAX_ARGS - 1))
-    {
-  		returnArr[MAX_ARGS - 1] = 0;
-    	break;
-    }
-  }
+	while (word[length] != '\0')
+	{
+		if ((word[length] < '0') || (word[length] > '9') || (length == 4))
+		{
+			return 0;
+		}
+		length++;
+	}
 
-  // Add the null terminator to the end of the array
-  returnArr[currentTokenNumber] = 0;
+	return (length > 0) ? 1 : 0;
 }
 
 /**************************************************************
  * * Entry:
- * *  userCommand - the user entered command string
- * *  returnValue - the return value to hold the file name
+ * *  quote - an opening quote
  * *
  * * Exit:
- * *  n/a
+ * *  Returns the matching closing quote.
+ * *  Returns NULL, if the quote is not closed on the line.
  * *
  * * Purpose:
- * *  Gets the file name for the user entered command string. We
- * *  will only get a file name if there is a redirection symbol.
+ * *  Finds where a quoted part of a word ends. In double quotes a
+ * *  backslash escapes the next character, and a "$(...)" can hold
+ * *  quotes of its own.
  * *
  * ***************************************************************/
-void GetFileName(char *userCommand, char *returnValue)
+char *FindClosingQuote(char *quote)
 {
-	// There are no redirects, so do not get the file name
-	if ((ContainsString(userCommand, "<") == 0) && (ContainsString(userCommand, ">") == 0)) 
+	char *current = quote + 1;
+
+	if (*quote == '\'')
 	{
-		return;
+		return strchr(current, '\'');
 	}
 
-	// Break all the commands into an array and find the first element
-	//  after the redirection signs
-	char *tempArray[MAX_ARGS];
-	char *currentToken;
-  int currentTokenNumber = 0;
-  int redirSymPosition = 0;
-
-  // Increment through the user command and break each word based on the 
-  //  whitespace delimiter. Put each word into the return array.
-  InitializeArgsArray(tempArray);
-  currentToken = strtok(userCommand, " ");
-  while (currentToken != NULL)
-  {
-  	// Save the position of redirect symbol
-  	if ((strcmp(currentToken, "<") == 0) || (strcmp(currentToken, ">") == 0))
-  	{
-  		redirSymPosition = currentTokenNumber;
-  	}
-
-    // Add the command arg to the array
-  	tempArray[currentTokenNumber] = currentToken;
-    currentToken = strtok (NULL, " ");
-    currentTokenNumber++;
-
-    // Break out if we are reaching the array limit.
-    if (currentTokenNumber == (MAX_ARGS - 1))
-    {
-  		tempArray[MAX_ARGS - 1] = 0;
-    	break;
-    }
-  }
+	while ((*current != '\0') && (*current != '"'))
+	{
+		if ((*current == '$') && (current[1] == '('))
+		{
+			current = FindClosingParen(current);
+			if (current == NULL)
+			{
+				return NULL;
+			}
+		}
+		else if ((*current == '\\') && (current[1] != '\0'))
+		{
+			current++;
+		}
+		current++;
+	}
 
-  // Get the file name and save it in the return variable
-  if (tempArray[redirSymPosition + 1] != 0)
-  {
-  	strncpy(returnValue, tempArray[redirSymPosition + 1], MAX_COMMAND_LENGTH);
-  }
+	return (*current == '"') ? current : NULL;
 }
 
 /**************************************************************
  * * Entry:
- * *  argv - the array of strings
+ * *  dollar - the "$" of a "$("
  * *
  * * Exit:
- * *  n/a
+ * *  Returns the matching ")".
+ * *  Returns NULL, if it is not closed on the line.
  * *
  * * Purpose:
- * *  Will set all the elements in the specified array to 0.
+ * *  Finds where a command substitution ends. Quotes, escapes and
+ * *  nested substitutions inside it are skipped over.
  * *
  * ***************************************************************/
-void InitializeArgsArray(char **argv)
+char *FindClosingParen(char *dollar)
 {
-	int i; 
-	for(i = 0; i < MAX_ARGS; i++)
+	char *current = dollar + 2;
+	int depth = 1;
+
+	while (*current != '\0')
 	{
-		// Initialize all values in the array to NULL
-		argv[i] = 0;
+		if ((*current == '\'') || (*current == '"'))
+		{
+			current = FindClosingQuote(current);
+			if (current == NULL)
+			{
+				return NULL;
+			}
+		}
+		else if ((*current == '\\') && (current[1] != '\0'))
+		{
+			current++;
+		}
+		else if (*current == '(')
+		{
+			depth++;
+		}
+		else if ((*current == ')') && (--depth == 0))
+		{
+			return current;
+		}
+		current++;
 	}
+
+	return NULL;
 }
 
 /**************************************************************
@@ -615,38 +15367,8 @@ void InitializeArgsArray(char **argv)
 void RemoveNewLineAndAddNullTerm(char *stringValue)
 {
    size_t ln = strlen(stringValue) - 1;
-   if (stringValue[ln] == '\n')
+   if ((ln != (size_t)-1) && (stringValue[ln] == '\n'))
    {
       stringValue[ln] = '\0';
    }
 }
-
-/**************************************************************
- * * Entry:
- * *  stringToSearch - The string to perform a search on.
- * *  stringToSearchFor - The string to search for.
- * *
- * * Exit:
- * *  Returns 1, if we found the string.
- * *  Returns 0, if we didn't find the string.
- * *
- * * Purpose:
- * *  To seach a string to see if contains another string.
- * *
- * ***************************************************************/
-int ContainsString(char *stringToSearch, char *stringToSearchFor)
-{
-  char *foundStringPointer;
-
-  // Search for the specified string
-  foundStringPointer = strstr(stringToSearch, stringToSearchFor); 
-
-  if (foundStringPointer == 0)
-  {
-  	return 0; // False, did not find the string.
-  }
-  else
-  {
-  	return 1; // True, found the string.
-  }
-}
@@ -0,0 +1,291 @@
+#!/bin/bash
+#########################################################
+# File: tests/check.sh
+# # Description: The test suite "make check" runs. It fuzzes
+# # the tokenizer, checks redirects and expansion against bash
+# # and floods the job table to see that every child is reaped.
+# # Bugs that were fixed are checked again under "regress".
+# #
+# # Usage: tests/check.sh [fuzz|compare|stress|regress]...
+# #########################################################
+
+cd "$(dirname "$0")/.." || exit 1
+top=$(pwd)
+shell="$top/smallsh"
+fuzzer="$top/smallsh_fuzz"
+work=$(mktemp -d /tmp/smallsh_check.XXXXXX)
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+# Prints a result and counts it
+check()
+{
+	if [ "$2" = 0 ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		failures=$((failures + 1))
+	fi
+}
+
+# The seeds and ${FUZZ_ITERATIONS} random mutations of them, then the
+# corpus files one at a time the way AFL would run them
+run_fuzz()
+{
+	mkdir -p "$work/fuzz" && cd "$work/fuzz" || return
+	"$fuzzer" -n "${FUZZ_ITERATIONS:-200000}" -s "${FUZZ_SEED:-1}" > /dev/null 2> "$work/fuzz.log"
+	check "fuzz: ${FUZZ_ITERATIONS:-200000} mutated lines" $?
+	"$fuzzer" "$top"/tests/corpus/* > /dev/null 2>> "$work/fuzz.log"
+	check "fuzz: corpus" $?
+	cat "$work/fuzz.log" | grep -v "inputs$"
+	cd "$top" || exit 1
+}
+
+# Runs one line in a fresh directory and records what it did
+run_line()
+{
+	rm -rf "$work/dir" && mkdir "$work/dir" && cd "$work/dir" || return
+	printf 'pear\napple\npear\nfig\n' > in
+	touch a.c b.c
+	timeout 10 "$@" < /dev/null > "$work/out" 2> "$work/err"
+	echo "status $?" >> "$work/out"
+	test -s "$work/err" && echo "stderr" >> "$work/out"
+	for file in *; do
+		echo "== $file"
+		cat "$file"
+	done >> "$work/out" 2>&1
+	cd "$top" || exit 1
+}
+
+# Every line of tests/compare.txt must do what bash does
+run_compare()
+{
+	local count=0
+	local failed=0
+
+	while IFS= read -r line; do
+		case "$line" in
+			""|"#"*) continue ;;
+		esac
+		count=$((count + 1))
+		run_line bash --norc --noprofile -c "$line"
+		mv "$work/out" "$work/bash.out"
+		run_line "$shell" --norc -c "$line"
+		sed -i '/^terminated by signal [0-9]*$/d' "$work/out"
+		if ! cmp -s "$work/bash.out" "$work/out"; then
+			echo "     differs from bash: $line"
+			diff "$work/bash.out" "$work/out" | sed -n '2,7s/^/     /p'
+			failed=$((failed + 1))
+		fi
+	done < tests/compare.txt
+	check "compare: $count lines agree with bash" $failed
+}
+
+# Many children at once, more than fit in the reap ring
+run_stress()
+{
+	local script="$work/stress"
+
+	# Each job that ends is reported once
+	for ((i = 0; i < 3000; i++)); do
+		echo "true &"
+	done > "$script"
+	echo "sleep 2" >> "$script"
+	"$shell" --norc "$script" > "$work/out" 2>&1
+	test "$(grep -c ' is done: exit value 0' "$work/out")" = 3000
+	check "stress: 3000 short background jobs are each reported" $?
+
+	# Jobs that end together, as many as the table holds, leave no
+	#  zombies behind
+	for ((i = 0; i < 1000; i++)); do
+		echo "sleep 1 &"
+	done > "$script"
+	echo "sleep 2" >> "$script"
+	echo 'ps -o stat= --ppid $$ | grep -c Z' >> "$script"
+	"$shell" --norc "$script" > "$work/out" 2>&1
+	test "$(grep -c ' is done: exit value 0' "$work/out")" = 1000 && test "$(tail -1 "$work/out")" = 0
+	check "stress: 1000 jobs ending at once are all reaped" $?
+
+	# wait collects them instead, and the table is empty afterwards
+	for ((i = 0; i < 1000; i++)); do
+		echo "sleep 0.5 &"
+	done > "$script"
+	echo "wait" >> "$script"
+	echo "jobs" >> "$script"
+	echo 'ps -o stat= --ppid $$ | grep -c Z' >> "$script"
+	"$shell" --norc "$script" > "$work/out" 2>&1
+	test "$(grep -vc 'background pid' "$work/out")" = 1 && test "$(tail -1 "$work/out")" = 0
+	check "stress: wait joins 1000 jobs" $?
+
+	# Fan-out keeps the order of the lines with any number of workers
+	seq 200000 > "$work/lines"
+	local expected
+	expected=$(md5sum < "$work/lines")
+	for workers in 1 7 64; do
+		test "$("$shell" --norc -c "cat $work/lines |& $workers cat" | md5sum)" = "$expected"
+		check "stress: |& $workers keeps the line order" $?
+	done
+	test "$("$shell" --norc -c "cat $work/lines |& 16u cat" | sort -n | md5sum)" = "$expected"
+	check "stress: |& 16u keeps every line" $?
+}
+
+# Runs a line in a fresh directory and checks all it printed against
+#  a pattern, where "*" stands for the pids
+expect()
+{
+	local name="$1"
+	local line="$2"
+	local expected="$3"
+
+	rm -rf "$work/dir" && mkdir "$work/dir" && cd "$work/dir" || return
+	[[ "$(timeout 10 "$shell" --norc -c "$line" < /dev/null 2>&1)" == $expected ]]
+	check "regress: $name" $?
+	cd "$top" || exit 1
+}
+
+# Bugs that were fixed, each run the way it was found
+run_regress()
+{
+	expect "a killed command fails for && and ||" \
+		"sh -c 'kill -9 \$\$' && echo ran; echo \$?; sh -c 'kill -15 \$\$' || status" \
+		"$(printf 'terminated by signal 9\n137\nterminated by signal 15\nterminated by signal 15')"
+
+	# The SIGCHLD self-pipe stays clear of descriptors redirects name
+	expect "a job ending during a function does not write to its 4>" \
+		"sleep 0.1 & f() { sleep 0.5; echo body >&4; }; f 4>f4; wait; cat f4" \
+		"$(printf 'background pid is *\nbody')"
+	echo in > "$work/in3"
+	expect "a function's 3< is not the self-pipe" \
+		"g() { sleep 0.3 & wait; cat <&3; }; g 3<$work/in3 | cat" \
+		"$(printf 'background pid is *\nin')"
+	expect "a function in a pipeline or the background gets its 3>" \
+		"f() { echo x >&3; }; f 3>a | cat; f 3>b & wait; cat a b" \
+		"$(printf 'background pid is *\nx\nx')"
+
+	# "on" keeps each word whole on its way to the host
+	"$shell" --server "$work/sock" > /dev/null 2>&1 &
+	local server=$!
+	sleep 0.3
+	expect "on sends quoted words to a server" \
+		"on $work/sock sh -c \"echo out; echo more\"; on $work/sock printf '%s|' \"it's\" 'a b' '*'" \
+		"$(printf '%s: out\n%s: more\n%s: it'"'"'s|a b|*|' "$work/sock" "$work/sock" "$work/sock")"
+	kill $server
+	wait $server 2> /dev/null
+
+	# A job count that is not 1 or more is refused
+	for count in 0 -3 abc; do
+		expect "parallel -j $count is a usage error" "parallel -j $count echo ::: a; echo \$?" \
+			"$(printf 'smallsh: parallel: -j %s: not a count of 1 or more\n*usage*\n2' "$count")"
+	done
+	expect "on -j 0 is a usage error" "on -j 0 $work/sock true; echo \$?" \
+		"$(printf 'smallsh: on: -j 0: not a count of 1 or more\n*usage*\n2')"
+
+	# A background command whose exec fails is waited for where it
+	#  failed, and never reported as a job that finished
+	printf '\001\002' > "$work/bad" && chmod +x "$work/bad"
+	for ((i = 0; i < 300; i++)); do
+		echo "$work/bad &"
+	done > "$work/badjobs"
+	echo "sleep 0.5" >> "$work/badjobs"
+	SMALLSH_SPAWN=fork timeout 20 "$shell" --norc "$work/badjobs" > "$work/out" 2>&1
+	! grep -q 'is done' "$work/out"
+	check "regress: a background exec failure is not reported as a job" $?
+
+	# A loop in the background is a job like any other, in its own
+	#  group and under the limits
+	expect "a background loop gets the job limits" \
+		"limit nofile=20; for i in 1; do sh -c 'ulimit -n; test \$(ps -o pgid= -p \$\$) = \$PPID && echo own'; done & wait" \
+		"$(printf 'background pid is *\n20\nown')"
+
+	# A size that overflows once its suffix is applied is refused
+	expect "limit refuses a size too big to hold" \
+		"limit memory=17179869185G; echo \$?" \
+		"$(printf 'smallsh: limit: memory=17179869185G: bad value\n1')"
+
+	# A syntax error ends a script with status 2, as in sh
+	printf 'echo a |\necho ran\n' | timeout 10 "$shell" --norc > "$work/out" 2>&1
+	test $? = 2 && grep -q 'syntax error' "$work/out" && ! grep -q ran "$work/out"
+	check "regress: a syntax error ends a script with status 2" $?
+
+	# An rc snapshot is kept while only variables the rc file never
+	#  read change, and made again when one it read does
+	printf 'X=$HOME/x\nexport FOO=bar\n' > "$work/rc"
+	rm -f "$work/rc.snapshot"
+	local seen=""
+	for session in 1 2 3; do
+		SMALLSHRC="$work/rc" SESSION=$session "$shell" -c 'echo $X $FOO' > /dev/null
+		seen="$seen $(stat -c %i.%.9Z "$work/rc.snapshot")"
+	done
+	set -- $seen
+	test "$1" = "$2" && test "$2" = "$3"
+	check "regress: an rc snapshot outlives a variable it never read" $?
+	test "$(SMALLSHRC="$work/rc" HOME=/elsewhere "$shell" -c 'echo $X $FOO')" = "/elsewhere/x bar"
+	check "regress: an rc snapshot is not used when a variable it read changed" $?
+
+	# History is only expanded at a terminal, so type the lines into one
+	if command -v script > /dev/null; then
+		rm -f "$work/history"
+		(
+			sleep 0.5
+			for line in 'echo "x!"' 'echo a! "b!"' 'exit'; do
+				printf '%s\n' "$line"
+				sleep 0.3
+			done
+		) | HISTFILE="$work/history" timeout 10 script -qc "$shell --norc" /dev/null | tr -d '\r' > "$work/out"
+		grep -qx 'x!' "$work/out" && grep -qx 'a! b!' "$work/out" && ! grep -q 'event not found' "$work/out"
+		check "regress: a ! before a closing quote is not history" $?
+
+		# An empty prefix lists every entry, before there is an index
+		rm -f "$work/history"
+		(
+			sleep 0.5
+			for line in 'echo one' 'history -s ""' 'exit'; do
+				printf '%s\n' "$line"
+				sleep 0.3
+			done
+		) | HISTFILE="$work/history" timeout 10 script -qc "$shell --norc" /dev/null | tr -d '\r' > "$work/out"
+		grep -A2 -x ': history -s ""' "$work/out" | tail -1 | grep -qx 'echo one'
+		check "regress: history -s \"\" lists every entry" $?
+
+		# At a terminal the shell goes on after a syntax error, with $? 2
+		(
+			sleep 0.5
+			for line in 'echo a |' 'echo status $?' 'exit'; do
+				printf '%s\n' "$line"
+				sleep 0.3
+			done
+		) | timeout 10 script -qc "$shell --norc" /dev/null | tr -d '\r' > "$work/out"
+		grep -qx 'status 2' "$work/out"
+		check "regress: a syntax error at the prompt sets \$? to 2" $?
+
+		# At a terminal the shell waits on its event loop, which reports
+		#  a job as soon as it finishes and copies the output it logs
+		for events in uring epoll; do
+			rm -f "$work/log"
+			(
+				sleep 0.5
+				printf '%s\n' 'sleep 0.2 &'
+				sleep 1
+				printf '%s\n' 'seq 1 100000 | tail -1'
+				sleep 0.5
+				printf '%s\n' 'exit'
+			) | timeout 10 script -qc "$shell --norc --events $events --log $work/log" /dev/null | tr -d '\r' > "$work/out"
+			sed -n '/is done/,$p' "$work/out" | grep -q '^: seq' && [ "$(cat "$work/log")" = 100000 ]
+			check "regress: the prompt reports a job as it finishes ($events)" $?
+		done
+	fi
+}
+
+sections=("$@")
+if [ ${#sections[@]} = 0 ]; then
+	sections=(fuzz compare stress regress)
+fi
+for section in "${sections[@]}"; do
+	run_"$section"
+done
+
+if [ $failures != 0 ]; then
+	echo "$failures failed"
+	exit 1
+fi
+echo "all passed"
@@ -0,0 +1,304 @@
+/**************************************************************
+ * *  Filename: fuzz_parse.c
+ * *  Purpose - Fuzz harness for the smallsh tokenizer. Each input is
+ * *  one command line. It is parsed into a command list, described
+ * *  for the job table, copied the way loops and functions copy
+ * *  their bodies and, when that cannot run a command, expanded.
+ * *
+ * *  libFuzzer: clang -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER
+ * *             -D_GNU_SOURCE -I. tests/fuzz_parse.c
+ * *  AFL:       afl-gcc -D_GNU_SOURCE -I. tests/fuzz_parse.c, then
+ * *             afl-fuzz -i tests/corpus -o findings ./a.out @@
+ * *  Otherwise: smallsh_fuzz [-n iterations] [-s seed] [file...]
+ * *             runs the files given, or the built in corpus with
+ * *             random mutations.
+ * *
+ * ***************************************************************/
+
+// Build the shell's code in, without its main()
+#define SMALLSH_NO_MAIN
+#include "smallsh.c"
+
+#define FUZZ_MAX_INPUT 65536
+#define FUZZ_DEFAULT_ITERATIONS 200000
+
+// Lines the mutations start from, and pieces of syntax they put in
+static const char *fuzzSeeds[] =
+{
+	"ls -la > out 2>&1",
+	"cat < in | sort | uniq -c > out &",
+	"echo \"a $HOME b\" 'c $d' e\\ f ${x:-y}",
+	"x=1 y=2 env | grep x",
+	"true && echo yes || echo no; false",
+	"echo $(echo $(pwd)) `date`",
+	"for i in 1 2 3; do echo $i; done",
+	"while test -f x; do rm x; done",
+	"f() { echo $1 \"$@\"; }",
+	"cat <<< word 3<> rw 4>&- 5>&3",
+	"yes |& 4 wc -l | head -1",
+	"seq 10 |& 2u cat",
+	"echo *.c ?x [a-z]* {a,b}",
+	"cache sha256sum file < in",
+	"on -j 2 a,b uptime",
+	"cat << EOF",
+	"!! !$ !-2",
+};
+static const char *fuzzTokens[] =
+{
+	" ", "|", "|&", "|& 3", "&", "&&", "||", ";", "<", ">", ">>", "2>", "2>&1", ">&-", "<<<", "<<", "<>",
+	"\"", "'", "\\", "$", "${", "}", "$(", ")", "`", "{", "(", "*", "?", "[", "]", "=", "#", "\n",
+	"for", "in", "do", "done", "while", "until", "{ ", " }", "()", "!", "$@", "$?", "$$", "$1",
+};
+
+// Function declarations
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+void FuzzLine(const char *line, size_t length);
+size_t MutateLine(char *line, size_t length, size_t capacity);
+unsigned int FuzzRandom();
+
+static struct Arena fuzzArena;
+static struct Arena copyArena;
+static int isFuzzReady;
+static unsigned int fuzzState = 1;
+
+/**************************************************************
+ * * Entry:
+ * *  data - one input
+ * *  size - its length
+ * *
+ * * Exit:
+ * *  Returns 0.
+ * *
+ * * Purpose:
+ * *	Is the libFuzzer entry point. A NUL in the input ends the
+ * *	line, as it would when the shell reads it.
+ * *
+ * ***************************************************************/
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	static char line[FUZZ_MAX_INPUT + 1];
+
+	if (!isFuzzReady)
+	{
+		// Parse errors are printed; the fuzzer only cares about crashes
+		freopen("/dev/null", "w", stdout);
+		InitJobTable();
+		InitVariables();
+		isFuzzReady = 1;
+	}
+
+	if (size > FUZZ_MAX_INPUT)
+	{
+		size = FUZZ_MAX_INPUT;
+	}
+	memcpy(line, data, size);
+	line[size] = '\0';
+	FuzzLine(line, strlen(line));
+
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the command line options and input files
+ * *
+ * * Exit:
+ * *  Returns 0, if every input was run. A crash is the failure.
+ * *  Returns 1, if a file could not be read.
+ * *
+ * * Purpose:
+ * *	Runs each file given as one input, which is how AFL runs it.
+ * *	With no files it runs the seeds, then random mutations of them,
+ * *	so "make check" fuzzes without libFuzzer or AFL.
+ * *
+ * ***************************************************************/
+int main(int argc, char **argv)
+{
+	static char line[FUZZ_MAX_INPUT + 1];
+	long iterations = FUZZ_DEFAULT_ITERATIONS;
+	int seedCount = sizeof(fuzzSeeds) / sizeof(fuzzSeeds[0]);
+	int fileCount = 0;
+	long i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+		{
+			iterations = atol(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+		{
+			fuzzState = (unsigned int)atol(argv[++i]) | 1;
+		}
+		else
+		{
+			int fd = open(argv[i], O_RDONLY);
+			ssize_t length = (fd < 0) ? -1 : read(fd, line, FUZZ_MAX_INPUT);
+			if (length < 0)
+			{
+				fprintf(stderr, "smallsh_fuzz: %s: %s\n", argv[i], strerror(errno));
+				return 1;
+			}
+			close(fd);
+			LLVMFuzzerTestOneInput((unsigned char *)line, length);
+			fileCount++;
+		}
+	}
+	if (fileCount > 0)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < seedCount; i++)
+	{
+		LLVMFuzzerTestOneInput((const unsigned char *)fuzzSeeds[i], strlen(fuzzSeeds[i]));
+	}
+
+	// Each mutant starts from a seed and takes a few changes
+	for (i = 0; i < iterations; i++)
+	{
+		strcpy(line, fuzzSeeds[FuzzRandom() % seedCount]);
+		size_t length = strlen(line);
+		int changes = 1 + (FuzzRandom() % 8);
+		while (changes-- > 0)
+		{
+			length = MutateLine(line, length, 4096);
+		}
+		LLVMFuzzerTestOneInput((unsigned char *)line, length);
+	}
+
+	fprintf(stderr, "smallsh_fuzz: %ld inputs\n", iterations + seedCount);
+
+	return 0;
+}
+#endif
+
+/**************************************************************
+ * * Entry:
+ * *  line - the command line, with a NUL at its end
+ * *  length - its length
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Runs one line through the parser and everything that walks
+ * *	what it makes. A line with "$(" is not expanded, as that would
+ * *	run its command, and neither is one with a "/", so patterns
+ * *	only look at the empty directory the fuzzer runs in.
+ * *
+ * ***************************************************************/
+void FuzzLine(const char *line, size_t length)
+{
+	struct CommandList list;
+	struct CommandList copy;
+	char description[MAX_JOB_COMMAND];
+	char *work;
+	int i;
+
+	ArenaReset(&fuzzArena);
+	ArenaReset(&copyArena);
+	work = ArenaAlloc(&fuzzArena, length + 1);
+	if (work == NULL)
+	{
+		return;
+	}
+	memcpy(work, line, length + 1);
+
+	if (ParseCommandList(work, &list, &fuzzArena) < 0)
+	{
+		return;
+	}
+	if (CopyCommandList(&list, &copy, &copyArena) < 0)
+	{
+		return;
+	}
+
+	int canExpand = (strstr(line, "$(") == NULL) && (strchr(line, '/') == NULL);
+	for (i = 0; i < copy.count; i++)
+	{
+		DescribePipeline(&copy.pipelines[i], description, sizeof(description));
+		if ((canExpand) && (copy.pipelines[i].compound == NULL))
+		{
+			ExpandPipeline(&copy.pipelines[i]);
+		}
+	}
+}
+
+/**************************************************************
+ * * Entry:
+ * *  line - the text to change, with room for capacity characters
+ * *  length - its length
+ * *  capacity - the most it can grow to
+ * *
+ * * Exit:
+ * *  Returns the new length.
+ * *
+ * * Purpose:
+ * *	Makes one random change: a token put in, a character changed,
+ * *	a range cut out or a range repeated.
+ * *
+ * ***************************************************************/
+size_t MutateLine(char *line, size_t length, size_t capacity)
+{
+	int tokenCount = sizeof(fuzzTokens) / sizeof(fuzzTokens[0]);
+	size_t at = (length == 0) ? 0 : FuzzRandom() % (length + 1);
+	size_t span = (length == at) ? 0 : 1 + (FuzzRandom() % (length - at));
+
+	switch (FuzzRandom() % 4)
+	{
+		case 0:
+		{
+			const char *token = fuzzTokens[FuzzRandom() % tokenCount];
+			size_t tokenLength = strlen(token);
+			if (length + tokenLength < capacity)
+			{
+				memmove(line + at + tokenLength, line + at, length - at + 1);
+				memcpy(line + at, token, tokenLength);
+				length += tokenLength;
+			}
+			break;
+		}
+		case 1:
+			if (at < length)
+			{
+				line[at] = 1 + (FuzzRandom() % 255);
+			}
+			break;
+		case 2:
+			memmove(line + at, line + at + span, length - at - span + 1);
+			length -= span;
+			break;
+		default:
+			if (length + span < capacity)
+			{
+				memmove(line + at + span, line + at, length - at + 1);
+				length += span;
+			}
+			break;
+	}
+
+	return length;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  N/a
+ * *
+ * * Exit:
+ * *  Returns the next pseudo random number.
+ * *
+ * * Purpose:
+ * *	Is a xorshift generator, so a seed always gives the same run
+ * *	and a failure can be repeated with -s.
+ * *
+ * ***************************************************************/
+unsigned int FuzzRandom()
+{
+	fuzzState ^= fuzzState << 13;
+	fuzzState ^= fuzzState >> 17;
+	fuzzState ^= fuzzState << 5;
+
+	return fuzzState;
+}
@@ -0,0 +1,149 @@
+#!/bin/bash
+#########################################################
+# File: tests/perf.sh
+# # Description: The timing check "make perf" runs. It runs
+# # smallsh_bench PERF_RUNS times (3 unless set) and compares
+# # the best of each timing with the best in the baseline,
+# # tests/perf_baseline.jsonl. A timing more than PERF_TOLERANCE
+# # times worse than its baseline (2 unless set) fails. Tail
+# # latencies (p90, p99, max) are shown by the bench but not
+# # checked, as they are mostly noise.
+# #
+# # Usage: tests/perf.sh [--update]
+# #   --update writes the new timings as the baseline
+# #########################################################
+
+cd "$(dirname "$0")/.." || exit 1
+baseline=tests/perf_baseline.jsonl
+iterations=${PERF_ITERATIONS:-500}
+runs=${PERF_RUNS:-3}
+current=$(mktemp /tmp/smallsh_perf.XXXXXX)
+trap 'rm -f "$current"' EXIT
+
+# The cache bench needs an input that is not a pipe
+for ((run = 0; run < runs; run++)); do
+	./smallsh_bench -n "$iterations" < /dev/null >> "$current" || exit 1
+done
+
+if [ "$1" = "--update" ]; then
+	cp "$current" "$baseline"
+	echo "wrote $(wc -l < "$baseline") timings from $runs runs to $baseline"
+	exit 0
+fi
+if [ ! -f "$baseline" ]; then
+	echo "no $baseline; make one with tests/perf.sh --update"
+	exit 1
+fi
+
+# A result is named by its bench and every field that is not a
+#  timing, so only like is compared with like. Each file can hold
+#  several runs, and the best of each timing stands for the file.
+awk -v tolerance="${PERF_TOLERANCE:-2}" '
+	function isTiming(name)
+	{
+		return (!isTail(name)) && ((isFaster(name)) || (name ~ /(_us|_ms)$/) || (name ~ /^ns_per_/));
+	}
+	function isTail(name)
+	{
+		return name ~ /^(p90|p99|max)_/;
+	}
+	function isFaster(name)
+	{
+		return name ~ /_per_s(ec)?$/;
+	}
+	function isBetter(name, value, best)
+	{
+		return isFaster(name) ? value > best : value < best;
+	}
+	function splitFields(line,    pair, colon)
+	{
+		delete names;
+		delete values;
+		count = 0;
+		key = "";
+		while (match(line, /"[a-z0-9_]+":("[^"]*"|[-+.0-9eE]+)/))
+		{
+			pair = substr(line, RSTART, RLENGTH);
+			line = substr(line, RSTART + RLENGTH);
+			colon = index(pair, ":");
+			count++;
+			names[count] = substr(pair, 2, colon - 3);
+			values[count] = substr(pair, colon + 1);
+			gsub(/"/, "", values[count]);
+			if ((!isTiming(names[count])) && (!isTail(names[count])))
+			{
+				key = key " " names[count] "=" values[count];
+			}
+		}
+		sub(/^ bench=/, "", key);
+	}
+	{
+		file = (FNR == NR) ? "base" : "now";
+		splitFields($0);
+		if ((file == "now") && (key ~ / error=/))
+		{
+			printf("FAIL %s\n", key);
+			failures++;
+		}
+		for (i = 1; i <= count; i++)
+		{
+			if (!isTiming(names[i]))
+			{
+				continue;
+			}
+			id = key SUBSEP names[i];
+			if (!((file, id) in best))
+			{
+				best[file, id] = values[i];
+				if (!(id in isListed))
+				{
+					isListed[id] = 1;
+					order[++idCount] = id;
+				}
+			}
+			else if (isBetter(names[i], values[i] + 0, best[file, id] + 0))
+			{
+				best[file, id] = values[i];
+			}
+		}
+	}
+	END {
+		for (i = 1; i <= idCount; i++)
+		{
+			id = order[i];
+			split(id, parts, SUBSEP);
+			if (!(("now", id) in best))
+			{
+				printf("gone %s %s\n", parts[1], parts[2]);
+				continue;
+			}
+			now = best["now", id];
+			if (!(("base", id) in best))
+			{
+				printf("new  %s %s %s\n", parts[1], parts[2], now);
+				continue;
+			}
+			old = best["base", id];
+			if ((old <= 0) || (now <= 0))
+			{
+				ratio = 1;
+			}
+			else
+			{
+				ratio = isFaster(parts[2]) ? old / now : now / old;
+			}
+			if (ratio > tolerance)
+			{
+				failures++;
+			}
+			printf("%s %s %s %s (baseline %s, %.2fx)\n", (ratio > tolerance) ? "FAIL" : "ok  ", parts[1],
+				parts[2], now, old, ratio);
+		}
+		if (failures > 0)
+		{
+			printf("%d timings are more than %sx worse than the baseline\n", failures, tolerance);
+			exit 1;
+		}
+		printf("all timings within %sx of the baseline\n", tolerance);
+	}
+' "$baseline" "$current"
@@ -0,0 +1,203 @@
+/**************************************************************
+ * *  Filename: trace.c
+ * *  Purpose - Decoder for smallsh trace files. It reads the rings
+ * *  that "smallsh --trace file" or SMALLSH_TRACE leave behind and
+ * *  writes them as Chrome trace JSON, which chrome://tracing and
+ * *  Perfetto open. Spans become complete events and instants
+ * *  become instant events, one row per process.
+ * *
+ * *  Usage: smallsh_trace file... > trace.json
+ * *
+ * ***************************************************************/
+
+// Build the shell's code in, without its main(), for the file format
+#define SMALLSH_NO_MAIN
+#include "smallsh.c"
+
+// The trace event names and what their value and detail are
+static const char *decodeKindNames[TRACE_KIND_COUNT] =
+{
+	"", "read", "parse", "builtin", "path", "spawn", "fork", "exec", "redirect", "wait", "exit", "reap"
+};
+static const char *decodeValueNames[TRACE_KIND_COUNT] =
+{
+	"", "length", "pipelines", "status", "cached", "pid", "pid", "", "fd", "pid", "pid", "pid"
+};
+static const char *decodeDetailNames[TRACE_KIND_COUNT] =
+{
+	"", "", "", "", "", "error", "", "", "", "status", "status", "status"
+};
+
+// Function declarations
+int DecodeTrace(const char *path, int isFirst);
+void PrintJsonString(const char *text, size_t size);
+
+/**************************************************************
+ * * Entry:
+ * *  argc, argv - the trace files to decode
+ * *
+ * * Exit:
+ * *  Returns 0, if every file was decoded.
+ * *  Returns 1, if any could not be read.
+ * *
+ * * Purpose:
+ * *	Writes the events of every file given into one trace. They
+ * *	share a clock, so the files of a shell and the shells it ran
+ * *	line up.
+ * *
+ * ***************************************************************/
+int main(int argc, char **argv)
+{
+	int isFirst = 1;
+	int result = 0;
+	int i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: smallsh_trace file... > trace.json\n");
+		return 2;
+	}
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (i = 1; i < argc; i++)
+	{
+		int count = DecodeTrace(argv[i], isFirst);
+		if (count < 0)
+		{
+			result = 1;
+		}
+		else if (count > 0)
+		{
+			isFirst = 0;
+		}
+	}
+	printf("\n]}\n");
+
+	return result;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  path - a trace file
+ * *  isFirst - 1 if no event has been written yet
+ * *
+ * * Exit:
+ * *  Returns the number of events written.
+ * *  Returns -1, if the file is not a trace.
+ * *
+ * * Purpose:
+ * *	Writes the events still in a trace ring, oldest first. Records
+ * *	that were written over or were being written when the shell
+ * *	stopped are skipped.
+ * *
+ * ***************************************************************/
+int DecodeTrace(const char *path, int isFirst)
+{
+	struct stat info;
+	int count = 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if ((fd < 0) || (fstat(fd, &info) < 0))
+	{
+		fprintf(stderr, "smallsh_trace: %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+	void *map = (info.st_size >= (off_t)sizeof(struct TraceHeader)) ?
+		mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	struct TraceHeader *header = map;
+	if ((map == MAP_FAILED) || (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) ||
+		(header->version != TRACE_VERSION) ||
+		((off_t)(sizeof(struct TraceHeader) + (header->capacity * sizeof(struct TraceRecord))) > info.st_size))
+	{
+		fprintf(stderr, "smallsh_trace: %s: not a smallsh trace\n", path);
+		if (map != MAP_FAILED)
+		{
+			munmap(map, info.st_size);
+		}
+		return -1;
+	}
+
+	struct TraceRecord *records = (struct TraceRecord *)(header + 1);
+	unsigned long long head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	unsigned long long index = (head > header->capacity) ? head - header->capacity : 0;
+
+	for (; index < head; index++)
+	{
+		struct TraceRecord record = records[index % header->capacity];
+		if ((record.sequence != index + 1) || (record.kind == 0) || (record.kind >= TRACE_KIND_COUNT))
+		{
+			continue;
+		}
+
+		printf("%s\n{\"name\":\"%s\",\"cat\":\"smallsh\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+			((isFirst) && (count == 0)) ? "" : ",", decodeKindNames[record.kind], record.pid, record.pid,
+			record.start / 1e3);
+		if (record.duration > 0)
+		{
+			printf("\"ph\":\"X\",\"dur\":%.3f,", record.duration / 1e3);
+		}
+		else
+		{
+			printf("\"ph\":\"i\",\"s\":\"p\",");
+		}
+		printf("\"args\":{");
+		if (decodeValueNames[record.kind][0] != '\0')
+		{
+			printf("\"%s\":%lld,", decodeValueNames[record.kind], record.value);
+		}
+		if (decodeDetailNames[record.kind][0] != '\0')
+		{
+			printf("\"%s\":%d,", decodeDetailNames[record.kind], record.detail);
+		}
+		printf("\"text\":");
+		PrintJsonString(record.text, sizeof(record.text));
+		printf("}}");
+		count++;
+	}
+
+	munmap(map, info.st_size);
+
+	return count;
+}
+
+/**************************************************************
+ * * Entry:
+ * *  text - the characters, ending at a NUL or at size
+ * *  size - the most there can be
+ * *
+ * * Exit:
+ * *  n/a
+ * *
+ * * Purpose:
+ * *	Writes text as a quoted JSON string.
+ * *
+ * ***************************************************************/
+void PrintJsonString(const char *text, size_t size)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; (i < size) && (text[i] != '\0'); i++)
+	{
+		unsigned char c = text[i];
+		if ((c == '"') || (c == '\\'))
+		{
+			printf("\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			printf("\\u%04x", c);
+		}
+		else
+		{
+			putchar(c);
+		}
+	}
+	putchar('"');
+}